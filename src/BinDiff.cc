@@ -25,6 +25,11 @@ Options:\n\
   --color: Highlight differing bytes even if the output is not a TTY.\n\
   --no-color: Don't highlight differing bytes even if the output is a TTY.\n\
   --start-address=ADDR: Address the first byte as ADDR (hex) instead of 0.\n\
+  --aligned: Find inserted, deleted, and moved data instead of comparing the\n\
+      files offset by offset. In this mode, each difference is shown as a\n\
+      hunk with the offsets and sizes of the changed data in each file. Both\n\
+      files are loaded into memory in this mode; otherwise, they're read\n\
+      incrementally, so they may be larger than memory.\n\
 \n");
 }
 
@@ -52,10 +57,17 @@ int main(int argc, char** argv) {
   size_t context_lines = args.get<size_t>("context", 3);
   uint64_t base_offset = args.get<uint64_t>("start-address", 0, phosg::Arguments::IntFormat::HEX);
 
-  string data1 = (filename1 == "-") ? read_all(stdin) : load_file(filename1);
-  string data2 = (filename2 == "-") ? read_all(stdin) : load_file(filename2);
-
-  bool is_identical = print_binary_diff(
-      stdout, data1.data(), data1.size(), data2.data(), data2.size(), use_color, context_lines, base_offset);
+  bool is_identical;
+  if (args.get<bool>("aligned")) {
+    string data1 = (filename1 == "-") ? read_all(stdin) : load_file(filename1);
+    string data2 = (filename2 == "-") ? read_all(stdin) : load_file(filename2);
+    is_identical = print_binary_diff_aligned(
+        stdout, data1.data(), data1.size(), data2.data(), data2.size(), use_color, context_lines, base_offset);
+  } else {
+    // Read both files incrementally, so files larger than memory can be compared
+    auto f1 = fopen_shared(filename1, "rb", stdin);
+    auto f2 = fopen_shared(filename2, "rb", stdin);
+    is_identical = print_binary_diff(stdout, f1.get(), f2.get(), use_color, context_lines, base_offset);
+  }
   return is_identical ? 0 : 1;
 }
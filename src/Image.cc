@@ -0,0 +1,830 @@
+#include "Image.hh"
+
+#include <zlib.h>
+
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Encoding.hh"
+#include "Strings.hh"
+#include "Tools.hh"
+
+using namespace std;
+
+namespace phosg {
+
+////////////////////////////////////////////////////////////////////////////////
+// PNG decoding
+
+struct PNGInterlacePass {
+  size_t x_offset;
+  size_t y_offset;
+  size_t x_step;
+  size_t y_step;
+};
+
+static const array<PNGInterlacePass, 1> png_single_pass{{{0, 0, 1, 1}}};
+static const array<PNGInterlacePass, 7> png_adam7_passes{{
+    {0, 0, 8, 8},
+    {4, 0, 8, 8},
+    {0, 4, 4, 8},
+    {2, 0, 4, 4},
+    {0, 2, 2, 4},
+    {1, 0, 2, 2},
+    {0, 1, 1, 2},
+}};
+
+static inline uint8_t png_paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
+  int p = static_cast<int>(a) + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return (pb <= pc) ? b : c;
+}
+
+// Reverses the filter on one row of a PNG image. row and prev_row do not include the filter type byte; prev_row must
+// be all zeroes for the first row of each pass.
+static void png_unfilter_row(uint8_t filter_type, uint8_t* row, const uint8_t* prev_row, size_t size, size_t bpp) {
+  switch (filter_type) {
+    case 0: // None
+      break;
+    case 1: // Sub
+      for (size_t z = bpp; z < size; z++) {
+        row[z] += row[z - bpp];
+      }
+      break;
+    case 2: // Up
+      for (size_t z = 0; z < size; z++) {
+        row[z] += prev_row[z];
+      }
+      break;
+    case 3: // Average
+      for (size_t z = 0; z < bpp; z++) {
+        row[z] += prev_row[z] >> 1;
+      }
+      for (size_t z = bpp; z < size; z++) {
+        row[z] += (static_cast<uint16_t>(row[z - bpp]) + prev_row[z]) >> 1;
+      }
+      break;
+    case 4: // Paeth
+      for (size_t z = 0; z < bpp; z++) {
+        row[z] += prev_row[z];
+      }
+      for (size_t z = bpp; z < size; z++) {
+        row[z] += png_paeth_predictor(row[z - bpp], prev_row[z], prev_row[z - bpp]);
+      }
+      break;
+    default:
+      throw runtime_error(std::format("invalid PNG filter type {}", filter_type));
+  }
+}
+
+class PNGRowDecoder {
+public:
+  PNGRowDecoder(const uint8_t* ihdr_data, size_t ihdr_size) {
+    if (ihdr_size != 13) {
+      throw runtime_error("PNG IHDR chunk has incorrect size");
+    }
+    StringReader r(ihdr_data, ihdr_size);
+    this->w = r.get_u32b();
+    this->h = r.get_u32b();
+    this->bit_depth = r.get_u8();
+    this->color_type = r.get_u8();
+    uint8_t compression = r.get_u8();
+    uint8_t filter = r.get_u8();
+    uint8_t interlace = r.get_u8();
+
+    if (this->w == 0 || this->h == 0 || this->w > 0x7FFFFFFF || this->h > 0x7FFFFFFF) {
+      throw runtime_error("PNG image has invalid dimensions");
+    }
+    if (compression != 0) {
+      throw runtime_error("PNG image uses unknown compression method");
+    }
+    if (filter != 0) {
+      throw runtime_error("PNG image uses unknown filter method");
+    }
+    if (interlace > 1) {
+      throw runtime_error("PNG image uses unknown interlace method");
+    }
+    this->interlaced = (interlace == 1);
+
+    switch (this->color_type) {
+      case 0: // Grayscale
+        this->channels = 1;
+        if (this->bit_depth != 1 && this->bit_depth != 2 && this->bit_depth != 4 && this->bit_depth != 8 && this->bit_depth != 16) {
+          throw runtime_error("PNG grayscale image has invalid bit depth");
+        }
+        break;
+      case 2: // RGB
+        this->channels = 3;
+        if (this->bit_depth != 8 && this->bit_depth != 16) {
+          throw runtime_error("PNG RGB image has invalid bit depth");
+        }
+        break;
+      case 3: // Indexed
+        this->channels = 1;
+        if (this->bit_depth != 1 && this->bit_depth != 2 && this->bit_depth != 4 && this->bit_depth != 8) {
+          throw runtime_error("PNG indexed-color image has invalid bit depth");
+        }
+        break;
+      case 4: // Grayscale + alpha
+        this->channels = 2;
+        if (this->bit_depth != 8 && this->bit_depth != 16) {
+          throw runtime_error("PNG grayscale+alpha image has invalid bit depth");
+        }
+        break;
+      case 6: // RGBA
+        this->channels = 4;
+        if (this->bit_depth != 8 && this->bit_depth != 16) {
+          throw runtime_error("PNG RGBA image has invalid bit depth");
+        }
+        break;
+      default:
+        throw runtime_error("PNG image has invalid color type");
+    }
+    this->bits_per_pixel = this->channels * this->bit_depth;
+    this->filter_bpp = std::max<size_t>(this->bits_per_pixel >> 3, 1);
+
+    // The row buffers are sized for the full image width; the interlaced passes use only part of them
+    size_t max_row_size = this->row_size(this->w);
+    this->cur_row.resize(max_row_size + 1, 0);
+    this->prev_row.resize(max_row_size, 0);
+    this->colors.resize(this->w, 0);
+
+    this->z.zalloc = Z_NULL;
+    this->z.zfree = Z_NULL;
+    this->z.opaque = Z_NULL;
+    this->z.next_in = Z_NULL;
+    this->z.avail_in = 0;
+    if (inflateInit(&this->z) != Z_OK) {
+      throw runtime_error("cannot initialize zlib stream");
+    }
+
+    this->pass_index = 0;
+    this->start_pass();
+  }
+  PNGRowDecoder(const PNGRowDecoder&) = delete;
+  PNGRowDecoder(PNGRowDecoder&&) = delete;
+  PNGRowDecoder& operator=(const PNGRowDecoder&) = delete;
+  PNGRowDecoder& operator=(PNGRowDecoder&&) = delete;
+  ~PNGRowDecoder() {
+    inflateEnd(&this->z);
+  }
+
+  size_t width() const {
+    return this->w;
+  }
+  size_t height() const {
+    return this->h;
+  }
+  uint8_t get_color_type() const {
+    return this->color_type;
+  }
+
+  void set_palette(const uint8_t* data, size_t size) {
+    if ((size % 3) || (size > 0x300) || (size == 0)) {
+      throw runtime_error("PNG PLTE chunk has invalid size");
+    }
+    this->palette.resize(size / 3);
+    for (size_t z = 0; z < this->palette.size(); z++) {
+      this->palette[z] = rgba8888(data[z * 3], data[z * 3 + 1], data[z * 3 + 2], 0xFF);
+    }
+  }
+
+  void set_transparency(const uint8_t* data, size_t size) {
+    if (this->color_type == 3) {
+      if (size > this->palette.size()) {
+        throw runtime_error("PNG tRNS chunk has more entries than the palette");
+      }
+      for (size_t z = 0; z < size; z++) {
+        this->palette[z] = replace_alpha(this->palette[z], data[z]);
+      }
+    } else if (this->color_type == 0) {
+      if (size != 2) {
+        throw runtime_error("PNG tRNS chunk has incorrect size");
+      }
+      this->transparent_key[0] = (data[0] << 8) | data[1];
+      this->has_transparent_key = true;
+    } else if (this->color_type == 2) {
+      if (size != 6) {
+        throw runtime_error("PNG tRNS chunk has incorrect size");
+      }
+      for (size_t z = 0; z < 3; z++) {
+        this->transparent_key[z] = (data[z * 2] << 8) | data[z * 2 + 1];
+      }
+      this->has_transparent_key = true;
+    } else {
+      throw runtime_error("PNG tRNS chunk is not valid for images with an alpha channel");
+    }
+  }
+
+  bool is_complete() const {
+    return this->pass_index >= this->passes_count();
+  }
+
+  // Decompresses the data from one IDAT chunk, calling row_fn for each row that is completed. The compressed data is
+  // not copied, and only one row is decompressed at a time.
+  void add_data(const uint8_t* data, size_t size, const PNGRowFunction& row_fn) {
+    if (this->color_type == 3 && this->palette.empty()) {
+      throw runtime_error("PNG indexed-color image has no palette");
+    }
+
+    this->z.next_in = const_cast<Bytef*>(data);
+    this->z.avail_in = size;
+    while (!this->is_complete() && !this->stream_ended) {
+      size_t row_bytes = this->pass_row_size + 1;
+      this->z.next_out = this->cur_row.data() + this->cur_row_filled;
+      this->z.avail_out = row_bytes - this->cur_row_filled;
+      int z_ret = inflate(&this->z, Z_NO_FLUSH);
+      if (z_ret == Z_STREAM_END) {
+        this->stream_ended = true;
+      } else if (z_ret != Z_OK && z_ret != Z_BUF_ERROR) {
+        throw runtime_error(std::format("zlib error decompressing PNG data: {}", z_ret));
+      }
+      this->cur_row_filled = row_bytes - this->z.avail_out;
+
+      // If inflate didn't fill the row, then it has used all of the available input
+      if (this->cur_row_filled < row_bytes) {
+        break;
+      }
+      this->finish_row(row_fn);
+    }
+  }
+
+private:
+  size_t w;
+  size_t h;
+  uint8_t bit_depth;
+  uint8_t color_type;
+  bool interlaced;
+  size_t channels;
+  size_t bits_per_pixel;
+  size_t filter_bpp;
+
+  std::vector<uint32_t> palette;
+  bool has_transparent_key = false;
+  uint16_t transparent_key[3] = {0, 0, 0};
+
+  z_stream z;
+  bool stream_ended = false;
+
+  size_t pass_index;
+  size_t pass_w;
+  size_t pass_h;
+  size_t pass_row_size;
+  size_t pass_y;
+  std::vector<uint8_t> cur_row; // Includes the filter type byte
+  size_t cur_row_filled = 0;
+  std::vector<uint8_t> prev_row;
+  std::vector<uint32_t> colors;
+
+  size_t row_size(size_t pixel_count) const {
+    return (pixel_count * this->bits_per_pixel + 7) >> 3;
+  }
+
+  size_t passes_count() const {
+    return this->interlaced ? png_adam7_passes.size() : png_single_pass.size();
+  }
+  const PNGInterlacePass& pass() const {
+    return this->interlaced ? png_adam7_passes[this->pass_index] : png_single_pass[this->pass_index];
+  }
+
+  void start_pass() {
+    // Passes that contain no pixels have no data at all (not even filter type bytes), so we skip them entirely
+    for (; this->pass_index < this->passes_count(); this->pass_index++) {
+      const auto& pass = this->pass();
+      this->pass_w = (this->w > pass.x_offset) ? ((this->w - pass.x_offset + pass.x_step - 1) / pass.x_step) : 0;
+      this->pass_h = (this->h > pass.y_offset) ? ((this->h - pass.y_offset + pass.y_step - 1) / pass.y_step) : 0;
+      if (this->pass_w && this->pass_h) {
+        break;
+      }
+    }
+    this->pass_row_size = this->row_size(this->pass_w);
+    this->pass_y = 0;
+    memset(this->prev_row.data(), 0, this->prev_row.size());
+  }
+
+  uint8_t scale_sample(uint16_t sample) const {
+    switch (this->bit_depth) {
+      case 1:
+        return sample ? 0xFF : 0x00;
+      case 2:
+        return sample * 0x55;
+      case 4:
+        return sample * 0x11;
+      case 8:
+        return sample;
+      case 16:
+        return sample >> 8;
+      default:
+        throw logic_error("invalid PNG bit depth");
+    }
+  }
+
+  void decode_colors(const uint8_t* data) {
+    if (this->bit_depth < 8) {
+      // Grayscale or indexed-color with multiple pixels per byte
+      size_t pixels_per_byte = 8 / this->bit_depth;
+      uint8_t mask = (1 << this->bit_depth) - 1;
+      for (size_t x = 0; x < this->pass_w; x++) {
+        size_t shift = 8 - this->bit_depth * ((x % pixels_per_byte) + 1);
+        uint8_t sample = (data[x / pixels_per_byte] >> shift) & mask;
+        if (this->color_type == 3) {
+          this->colors[x] = this->palette_color(sample);
+        } else {
+          uint8_t v = this->scale_sample(sample);
+          bool transparent = this->has_transparent_key && (sample == this->transparent_key[0]);
+          this->colors[x] = rgba8888_gray(v, transparent ? 0x00 : 0xFF);
+        }
+      }
+      return;
+    }
+
+    size_t sample_bytes = this->bit_depth >> 3;
+    auto get_sample = [&](size_t x, size_t channel) -> uint16_t {
+      const uint8_t* sample = &data[(x * this->channels + channel) * sample_bytes];
+      return (sample_bytes == 2) ? ((sample[0] << 8) | sample[1]) : sample[0];
+    };
+    for (size_t x = 0; x < this->pass_w; x++) {
+      switch (this->color_type) {
+        case 0: {
+          uint16_t sample = get_sample(x, 0);
+          bool transparent = this->has_transparent_key && (sample == this->transparent_key[0]);
+          this->colors[x] = rgba8888_gray(this->scale_sample(sample), transparent ? 0x00 : 0xFF);
+          break;
+        }
+        case 2: {
+          uint16_t r = get_sample(x, 0);
+          uint16_t g = get_sample(x, 1);
+          uint16_t b = get_sample(x, 2);
+          bool transparent = this->has_transparent_key &&
+              (r == this->transparent_key[0]) &&
+              (g == this->transparent_key[1]) &&
+              (b == this->transparent_key[2]);
+          this->colors[x] = rgba8888(
+              this->scale_sample(r), this->scale_sample(g), this->scale_sample(b), transparent ? 0x00 : 0xFF);
+          break;
+        }
+        case 3:
+          this->colors[x] = this->palette_color(get_sample(x, 0));
+          break;
+        case 4:
+          this->colors[x] = rgba8888_gray(this->scale_sample(get_sample(x, 0)), this->scale_sample(get_sample(x, 1)));
+          break;
+        case 6:
+          this->colors[x] = rgba8888(
+              this->scale_sample(get_sample(x, 0)),
+              this->scale_sample(get_sample(x, 1)),
+              this->scale_sample(get_sample(x, 2)),
+              this->scale_sample(get_sample(x, 3)));
+          break;
+        default:
+          throw logic_error("invalid PNG color type");
+      }
+    }
+  }
+
+  uint32_t palette_color(size_t index) const {
+    if (index >= this->palette.size()) {
+      throw runtime_error("PNG pixel refers to a color outside of the palette");
+    }
+    return this->palette[index];
+  }
+
+  void finish_row(const PNGRowFunction& row_fn) {
+    uint8_t* row_data = this->cur_row.data() + 1;
+    png_unfilter_row(this->cur_row[0], row_data, this->prev_row.data(), this->pass_row_size, this->filter_bpp);
+    this->decode_colors(row_data);
+
+    const auto& pass = this->pass();
+    row_fn(pass.y_offset + this->pass_y * pass.y_step, pass.x_offset, pass.x_step, this->colors.data(), this->pass_w);
+
+    memcpy(this->prev_row.data(), row_data, this->pass_row_size);
+    this->cur_row_filled = 0;
+    if (++this->pass_y >= this->pass_h) {
+      this->pass_index++;
+      this->start_pass();
+    }
+  }
+};
+
+void decode_png(const void* data, size_t size, const PNGHeaderFunction& header_fn, const PNGRowFunction& row_fn) {
+  static const uint8_t signature[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+  StringReader r(data, size);
+  if (size < sizeof(signature) || memcmp(r.getv(sizeof(signature)), signature, sizeof(signature))) {
+    throw runtime_error("PNG signature is missing");
+  }
+
+  std::unique_ptr<PNGRowDecoder> decoder;
+  bool seen_idat = false;
+  bool seen_iend = false;
+  while (!seen_iend) {
+    uint32_t chunk_size = r.get_u32b();
+    const uint8_t* chunk_type = reinterpret_cast<const uint8_t*>(r.getv(4));
+    const uint8_t* chunk_data = reinterpret_cast<const uint8_t*>(r.getv(chunk_size));
+    uint32_t expected_crc = r.get_u32b();
+
+    // The checksum includes the chunk type, but not the length
+    uint32_t crc = ::crc32(0, reinterpret_cast<const Bytef*>(chunk_type), 4);
+    crc = ::crc32(crc, reinterpret_cast<const Bytef*>(chunk_data), chunk_size);
+    if (crc != expected_crc) {
+      throw runtime_error("PNG chunk has incorrect checksum");
+    }
+
+    string type_str(reinterpret_cast<const char*>(chunk_type), 4);
+    if (!decoder && type_str != "IHDR") {
+      throw runtime_error("PNG data does not begin with IHDR chunk");
+    }
+    if (type_str == "IHDR") {
+      if (decoder) {
+        throw runtime_error("PNG data contains multiple IHDR chunks");
+      }
+      decoder = make_unique<PNGRowDecoder>(chunk_data, chunk_size);
+      header_fn(decoder->width(), decoder->height());
+    } else if (type_str == "PLTE") {
+      if (seen_idat) {
+        throw runtime_error("PNG PLTE chunk appears after image data");
+      }
+      // Palettes are optional suggestions for non-indexed images, so we only use them for indexed images
+      if (decoder->get_color_type() == 3) {
+        decoder->set_palette(chunk_data, chunk_size);
+      }
+    } else if (type_str == "tRNS") {
+      decoder->set_transparency(chunk_data, chunk_size);
+    } else if (type_str == "IDAT") {
+      seen_idat = true;
+      decoder->add_data(chunk_data, chunk_size, row_fn);
+    } else if (type_str == "IEND") {
+      seen_iend = true;
+    } else if (!(chunk_type[0] & 0x20)) {
+      throw runtime_error("PNG data contains unknown critical chunk " + type_str);
+    }
+  }
+
+  if (!decoder->is_complete()) {
+    throw runtime_error("PNG image data is incomplete");
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PNG encoding
+
+namespace {
+
+// Holds the compressed data for a horizontal strip of a PNG image. Strips are compressed independently (as raw deflate
+// streams), so they can be compressed on separate threads and concatenated afterward.
+struct PNGStrip {
+  std::string compressed;
+  uint32_t adler;
+  size_t uncompressed_size;
+};
+
+class PNGRowFilter {
+public:
+  PNGRowFilter(size_t w, bool has_alpha)
+      : w(w),
+        bpp(has_alpha ? 4 : 3),
+        row_size(w * bpp),
+        colors(w),
+        prev_row(row_size, 0),
+        cur_row(row_size, 0),
+        filtered(5, std::vector<uint8_t>(row_size + 1)) {
+    for (size_t filter_type = 0; filter_type < 5; filter_type++) {
+      this->filtered[filter_type][0] = filter_type;
+    }
+  }
+
+  // Produces the filtered data for the next row (including the filter type byte)
+  const std::vector<uint8_t>& filter_row(size_t y, const PNGRowSourceFunction& row_fn, uint8_t filter_type) {
+    this->load_row(y, row_fn, this->cur_row);
+    this->apply_filters(filter_type, filter_type + 1);
+    this->cur_row.swap(this->prev_row);
+    return this->filtered[filter_type];
+  }
+
+  // Chooses a filter type for each row in [start_y, end_y), which must be the next rows to be filtered. For each row,
+  // the filter type with the lowest estimated cost is chosen. If the estimated cost of the whole strip is no lower than
+  // that of not filtering at all (which is often the case for synthetic images with large flat areas or repeated
+  // patterns), no rows are filtered. This is much cheaper than compressing the strip both ways and keeping the smaller
+  // result, but it may occasionally choose filters that are slightly worse.
+  std::vector<uint8_t> choose_filter_types(size_t start_y, size_t end_y, const PNGRowSourceFunction& row_fn) {
+    std::vector<uint8_t> ret(end_y - start_y, 0);
+    // Each strip's deflate stream starts with an empty dictionary, so the first row can't match any previous row
+    std::vector<uint8_t> prev_output(this->row_size + 1);
+    bool has_prev_output = false;
+    uint64_t filtered_cost = 0;
+    uint64_t unfiltered_cost = 0;
+    for (size_t y = start_y; y < end_y; y++) {
+      this->load_row(y, row_fn, this->cur_row);
+      this->apply_filters(0, 5);
+
+      // If no rows are filtered, the previous output row is the previous unfiltered row
+      unfiltered_cost += this->estimate_cost(this->filtered[0].data() + 1,
+          has_prev_output ? this->prev_row.data() : nullptr);
+
+      uint8_t best_filter_type = 0;
+      uint64_t best_cost = UINT64_MAX;
+      for (uint8_t filter_type = 0; filter_type < 5; filter_type++) {
+        uint64_t cost = this->estimate_cost(
+            this->filtered[filter_type].data() + 1, has_prev_output ? prev_output.data() + 1 : nullptr);
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_filter_type = filter_type;
+        }
+      }
+      ret[y - start_y] = best_filter_type;
+      filtered_cost += best_cost;
+      prev_output.swap(this->filtered[best_filter_type]);
+      this->filtered[best_filter_type][0] = best_filter_type;
+      has_prev_output = true;
+
+      this->cur_row.swap(this->prev_row);
+    }
+
+    if (unfiltered_cost <= filtered_cost) {
+      std::fill(ret.begin(), ret.end(), 0);
+    }
+    return ret;
+  }
+
+  // Sets the previous row, for a strip that doesn't begin at the top of the image
+  void set_prev_row(size_t y, const PNGRowSourceFunction& row_fn) {
+    this->load_row(y, row_fn, this->prev_row);
+  }
+
+private:
+  size_t w;
+  size_t bpp;
+  size_t row_size;
+  std::vector<uint32_t> colors;
+  std::vector<uint8_t> prev_row;
+  std::vector<uint8_t> cur_row;
+  std::vector<std::vector<uint8_t>> filtered;
+
+  // Computes filter types [start_type, end_type) for cur_row into filtered
+  void apply_filters(uint8_t start_type, uint8_t end_type) {
+    const uint8_t* raw = this->cur_row.data();
+    const uint8_t* prev = this->prev_row.data();
+    size_t bpp = std::min(this->bpp, this->row_size);
+    for (uint8_t filter_type = start_type; filter_type < end_type; filter_type++) {
+      uint8_t* out = this->filtered[filter_type].data() + 1;
+      switch (filter_type) {
+        case 0:
+          memcpy(out, raw, this->row_size);
+          break;
+        case 1:
+          memcpy(out, raw, bpp);
+          for (size_t z = bpp; z < this->row_size; z++) {
+            out[z] = raw[z] - raw[z - bpp];
+          }
+          break;
+        case 2:
+          for (size_t z = 0; z < this->row_size; z++) {
+            out[z] = raw[z] - prev[z];
+          }
+          break;
+        case 3:
+          for (size_t z = 0; z < bpp; z++) {
+            out[z] = raw[z] - (prev[z] >> 1);
+          }
+          for (size_t z = bpp; z < this->row_size; z++) {
+            out[z] = raw[z] - ((static_cast<uint16_t>(raw[z - bpp]) + prev[z]) >> 1);
+          }
+          break;
+        case 4:
+          for (size_t z = 0; z < bpp; z++) {
+            out[z] = raw[z] - prev[z];
+          }
+          for (size_t z = bpp; z < this->row_size; z++) {
+            out[z] = raw[z] - png_paeth_predictor(raw[z - bpp], prev[z], prev[z - bpp]);
+          }
+          break;
+      }
+    }
+  }
+
+  // Estimates the relative cost of deflating a filtered row. Bytes in runs of 4 or more that repeat the
+  // bytes one pixel earlier or in the previous output row (if any) are counted as free, since deflate would encode
+  // them as matches; other bytes cost more the further they are from zero, as in the minimum sum of absolute
+  // differences heuristic suggested by the PNG specification
+  uint64_t estimate_cost(const uint8_t* data, const uint8_t* prev_output) const {
+    // The first 3 bytes of a run are charged when they're seen, and refunded if the run reaches 4 bytes; charged holds
+    // the amounts charged for the last 4 bytes, so nothing is refunded twice
+    uint64_t cost = 0;
+    uint32_t charged[4] = {0, 0, 0, 0};
+    size_t pixel_run_length = 0;
+    size_t row_run_length = 0;
+    for (size_t z = 0; z < this->row_size; z++) {
+      pixel_run_length = (z >= this->bpp && data[z] == data[z - this->bpp]) ? (pixel_run_length + 1) : 0;
+      row_run_length = (prev_output && data[z] == prev_output[z]) ? (row_run_length + 1) : 0;
+      if (pixel_run_length >= 4 || row_run_length >= 4) {
+        if (pixel_run_length == 4 || row_run_length == 4) {
+          cost -= charged[(z + 1) & 3] + charged[(z + 2) & 3] + charged[(z + 3) & 3];
+          charged[(z + 1) & 3] = 0;
+          charged[(z + 2) & 3] = 0;
+          charged[(z + 3) & 3] = 0;
+        }
+        charged[z & 3] = 0;
+      } else {
+        charged[z & 3] = abs(static_cast<int8_t>(data[z])) + 8;
+        cost += charged[z & 3];
+      }
+    }
+    return cost;
+  }
+
+  void load_row(size_t y, const PNGRowSourceFunction& row_fn, std::vector<uint8_t>& dest) {
+    row_fn(y, this->colors.data());
+    uint8_t* out = dest.data();
+    if (this->bpp == 4) {
+      for (size_t x = 0; x < this->w; x++) {
+        uint32_t color = this->colors[x];
+        out[x * 4 + 0] = get_r(color);
+        out[x * 4 + 1] = get_g(color);
+        out[x * 4 + 2] = get_b(color);
+        out[x * 4 + 3] = get_a(color);
+      }
+    } else {
+      for (size_t x = 0; x < this->w; x++) {
+        uint32_t color = this->colors[x];
+        out[x * 3 + 0] = get_r(color);
+        out[x * 3 + 1] = get_g(color);
+        out[x * 3 + 2] = get_b(color);
+      }
+    }
+  }
+};
+
+PNGStrip compress_png_strip(
+    size_t w,
+    size_t start_y,
+    size_t end_y,
+    bool is_last_strip,
+    bool has_alpha,
+    bool adaptive_filtering,
+    const PNGRowSourceFunction& row_fn,
+    const PNGEncodeOptions& options) {
+  std::vector<uint8_t> filter_types(end_y - start_y, 0);
+  if (adaptive_filtering) {
+    PNGRowFilter chooser(w, has_alpha);
+    if (start_y > 0) {
+      chooser.set_prev_row(start_y - 1, row_fn);
+    }
+    filter_types = chooser.choose_filter_types(start_y, end_y, row_fn);
+  }
+
+  PNGRowFilter filter(w, has_alpha);
+  if (start_y > 0) {
+    filter.set_prev_row(start_y - 1, row_fn);
+  }
+
+  z_stream z;
+  z.zalloc = Z_NULL;
+  z.zfree = Z_NULL;
+  z.opaque = Z_NULL;
+  // Negative window bits produce a raw deflate stream; the zlib header and checksum are written by the caller
+  if (deflateInit2(&z, options.compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw runtime_error("cannot initialize zlib stream");
+  }
+  auto end_stream = on_close_scope([&]() -> void {
+    deflateEnd(&z);
+  });
+
+  PNGStrip ret;
+  ret.adler = adler32(0, Z_NULL, 0);
+  ret.uncompressed_size = 0;
+  ret.compressed.resize(0x10000);
+  size_t compressed_size = 0;
+  auto deflate_data = [&](const uint8_t* data, size_t size, int flush) -> void {
+    z.next_in = const_cast<Bytef*>(data);
+    z.avail_in = size;
+    for (;;) {
+      if (compressed_size == ret.compressed.size()) {
+        ret.compressed.resize(ret.compressed.size() * 2);
+      }
+      z.next_out = reinterpret_cast<Bytef*>(ret.compressed.data() + compressed_size);
+      z.avail_out = ret.compressed.size() - compressed_size;
+      int z_ret = deflate(&z, flush);
+      if (z_ret != Z_OK && z_ret != Z_STREAM_END && z_ret != Z_BUF_ERROR) {
+        throw runtime_error(std::format("zlib error compressing PNG data: {}", z_ret));
+      }
+      compressed_size = ret.compressed.size() - z.avail_out;
+      // deflate is done with this input when it has consumed all of it and didn't fill the output buffer
+      if (z.avail_in == 0 && z.avail_out != 0) {
+        break;
+      }
+    }
+  };
+
+  for (size_t y = start_y; y < end_y; y++) {
+    const auto& filtered = filter.filter_row(y, row_fn, filter_types[y - start_y]);
+    ret.adler = adler32(ret.adler, filtered.data(), filtered.size());
+    ret.uncompressed_size += filtered.size();
+    deflate_data(filtered.data(), filtered.size(), Z_NO_FLUSH);
+  }
+  // Strips other than the last one end with a sync flush, which leaves the stream byte-aligned without marking the
+  // last block as final, so the next strip's data can follow it directly
+  deflate_data(nullptr, 0, is_last_strip ? Z_FINISH : Z_SYNC_FLUSH);
+
+  ret.compressed.resize(compressed_size);
+  return ret;
+}
+
+} // namespace
+
+std::string encode_png(
+    size_t w, size_t h, bool has_alpha, const PNGRowSourceFunction& row_fn, const PNGEncodeOptions& options) {
+  if (options.compression_level < 0 || options.compression_level > 9) {
+    throw invalid_argument("PNG compression level must be between 0 and 9");
+  }
+
+  // Strips must be large enough that the compression ratio doesn't suffer much from each strip starting with an empty
+  // dictionary
+  size_t num_threads = options.num_threads ? options.num_threads : ThreadPool::shared().size();
+  size_t row_size = w * (has_alpha ? 4 : 3) + 1;
+  size_t min_strip_rows = std::max<size_t>(0x40000 / row_size, 1);
+  size_t num_strips = std::max<size_t>(std::min<size_t>(num_threads, h / min_strip_rows), 1);
+
+  std::vector<PNGStrip> strips(num_strips);
+  auto compress_strip = [&](size_t strip_index, size_t) -> void {
+    size_t start_y = (h * strip_index) / num_strips;
+    size_t end_y = (h * (strip_index + 1)) / num_strips;
+    bool is_last_strip = (strip_index == num_strips - 1);
+    strips[strip_index] = compress_png_strip(
+        w, start_y, end_y, is_last_strip, has_alpha, options.adaptive_filtering, row_fn, options);
+  };
+  if (num_strips > 1) {
+    ThreadPool::shared().parallel_for<size_t>(0, num_strips, compress_strip, 1);
+  } else {
+    compress_strip(0, 0);
+  }
+
+  // Build the zlib header and checksum that wrap the concatenated deflate streams
+  uint8_t level_flags = (options.compression_level < 2) ? 0 : (options.compression_level < 6) ? 1 : (options.compression_level == 6) ? 2 : 3;
+  uint8_t zlib_header[2] = {0x78, static_cast<uint8_t>(level_flags << 6)};
+  zlib_header[1] += 31 - (((zlib_header[0] << 8) | zlib_header[1]) % 31);
+  uint32_t adler = strips[0].adler;
+  for (size_t z = 1; z < strips.size(); z++) {
+    adler = adler32_combine(adler, strips[z].adler, strips[z].uncompressed_size);
+  }
+  be_uint32_t zlib_checksum = adler;
+
+  StringWriter w_data;
+  auto write_png_chunk = [&w_data](const char* type, const std::vector<std::pair<const void*, size_t>>& pieces) {
+    size_t size = 0;
+    for (const auto& piece : pieces) {
+      size += piece.second;
+    }
+    w_data.put_u32b(size);
+    w_data.write(type, 4);
+    // The checksum includes the chunk type, but not the length
+    uint32_t crc = ::crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+    for (const auto& piece : pieces) {
+      w_data.write(piece.first, piece.second);
+      crc = ::crc32(crc, reinterpret_cast<const Bytef*>(piece.first), piece.second);
+    }
+    w_data.put_u32b(crc);
+  };
+
+  constexpr uint8_t signature[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A}; // '\x89PNG\r\n\x1A\n'
+  w_data.write(signature, sizeof(signature));
+
+  const struct {
+    be_uint32_t width;
+    be_uint32_t height;
+    uint8_t bit_depth;
+    uint8_t color_type;
+    uint8_t compression;
+    uint8_t filter;
+    uint8_t interlace;
+  } __attribute__((packed)) IHDR{
+      static_cast<uint32_t>(w),
+      static_cast<uint32_t>(h),
+      8,
+      static_cast<uint8_t>(has_alpha ? 6 : 2),
+      0, // default compression
+      0, // default filter
+      0, // non-interlaced
+  };
+  write_png_chunk("IHDR", {{&IHDR, 13}});
+
+  const be_uint32_t gAMA = 45455; // 1/2.2
+  write_png_chunk("gAMA", {{&gAMA, sizeof(gAMA)}});
+
+  std::vector<std::pair<const void*, size_t>> idat_pieces;
+  idat_pieces.emplace_back(zlib_header, sizeof(zlib_header));
+  for (const auto& strip : strips) {
+    idat_pieces.emplace_back(strip.compressed.data(), strip.compressed.size());
+  }
+  idat_pieces.emplace_back(&zlib_checksum, sizeof(zlib_checksum));
+  write_png_chunk("IDAT", idat_pieces);
+  write_png_chunk("IEND", {});
+  return std::move(w_data.str());
+}
+
+} // namespace phosg
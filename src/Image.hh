@@ -10,11 +10,13 @@
 #include <functional>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "Encoding.hh"
 #include "ImageTextFont.hh"
 #include "Platform.hh"
 #include "Strings.hh"
+#include "Tools.hh"
 
 namespace phosg {
 
@@ -95,6 +97,81 @@ constexpr uint32_t alpha_blend(uint32_t orig_color, uint32_t new_color) {
       get_a(orig_color));
 }
 
+// Like alpha_blend, but for colors with premultiplied alpha. All four channels are blended, so the result's alpha is
+// the combined coverage of both colors.
+constexpr uint32_t alpha_blend_premultiplied(uint32_t orig_color, uint32_t new_color) {
+  uint8_t a = get_a(new_color);
+  return rgba8888(
+      std::min<uint32_t>(get_r(new_color) + ((0xFF - a) * get_r(orig_color)) / 0xFF, 0xFF),
+      std::min<uint32_t>(get_g(new_color) + ((0xFF - a) * get_g(orig_color)) / 0xFF, 0xFF),
+      std::min<uint32_t>(get_b(new_color) + ((0xFF - a) * get_b(orig_color)) / 0xFF, 0xFF),
+      std::min<uint32_t>(a + ((0xFF - a) * get_a(orig_color)) / 0xFF, 0xFF));
+}
+
+// Divides each of the two 16-bit lanes in v (which must each be at most 0xFF * 0xFF) by 0xFF, rounding down. This
+// gives exactly the same results as integer division by 0xFF, but without a divide instruction.
+constexpr uint32_t div255_lanes(uint32_t v) {
+  return ((v + 0x00010001 + ((v >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+}
+
+// The row blending functions below operate on arrays of RGBA8888 colors, processing two channels of each pixel at a
+// time in the lanes of a 32-bit integer (red and blue, then green and alpha). They don't branch per pixel, so the
+// compiler can vectorize them. The results are exactly the same as those of alpha_blend and
+// alpha_blend_premultiplied.
+
+// Blends src over dst using the alpha channel from src, like copy_from_with_blend: fully-transparent source pixels
+// leave dst unchanged, opaque source pixels replace dst entirely, and all other pixels are combined with alpha_blend.
+inline void alpha_blend_row(uint32_t* dst, const uint32_t* src, size_t count) {
+  for (size_t z = 0; z < count; z++) {
+    uint32_t d = dst[z];
+    uint32_t s = src[z];
+    uint32_t a = s & 0xFF;
+    uint32_t rb = div255_lanes(((s >> 8) & 0x00FF00FF) * a + ((d >> 8) & 0x00FF00FF) * (0xFF - a));
+    uint32_t g = div255_lanes((s & 0x00FF0000) * a + (d & 0x00FF0000) * (0xFF - a));
+    dst[z] = (rb << 8) | g | ((a == 0xFF) ? 0xFF : (d & 0xFF));
+  }
+}
+
+// Blends src over dst using a constant alpha value, ignoring src's alpha channel, like copy_from_with_alpha
+inline void alpha_blend_row(uint32_t* dst, const uint32_t* src, uint8_t alpha, size_t count) {
+  uint32_t a = alpha;
+  for (size_t z = 0; z < count; z++) {
+    uint32_t d = dst[z];
+    uint32_t s = src[z];
+    uint32_t rb = div255_lanes(((s >> 8) & 0x00FF00FF) * a + ((d >> 8) & 0x00FF00FF) * (0xFF - a));
+    uint32_t g = div255_lanes((s & 0x00FF0000) * a + (d & 0x00FF0000) * (0xFF - a));
+    dst[z] = (rb << 8) | g | (d & 0xFF);
+  }
+}
+
+// Blends a single color over every pixel in dst, like blend_rect
+inline void alpha_blend_row(uint32_t* dst, uint32_t color, size_t count) {
+  uint32_t a = get_a(color);
+  uint32_t rb_term = ((color >> 8) & 0x00FF00FF) * a;
+  uint32_t g_term = (color & 0x00FF0000) * a;
+  for (size_t z = 0; z < count; z++) {
+    uint32_t d = dst[z];
+    uint32_t rb = div255_lanes(rb_term + ((d >> 8) & 0x00FF00FF) * (0xFF - a));
+    uint32_t g = div255_lanes(g_term + (d & 0x00FF0000) * (0xFF - a));
+    dst[z] = (rb << 8) | g | (d & 0xFF);
+  }
+}
+
+// Blends src over dst, where both contain colors with premultiplied alpha
+inline void alpha_blend_premultiplied_row(uint32_t* dst, const uint32_t* src, size_t count) {
+  for (size_t z = 0; z < count; z++) {
+    uint32_t d = dst[z];
+    uint32_t s = src[z];
+    uint32_t inv_a = 0xFF - (s & 0xFF);
+    uint32_t rb = ((s >> 8) & 0x00FF00FF) + div255_lanes(((d >> 8) & 0x00FF00FF) * inv_a);
+    uint32_t ga = (s & 0x00FF00FF) + div255_lanes((d & 0x00FF00FF) * inv_a);
+    // Each lane is at most 0x1FE here, so saturate any lane that overflowed 8 bits
+    rb = (rb | (((rb >> 8) & 0x00010001) * 0xFF)) & 0x00FF00FF;
+    ga = (ga | (((ga >> 8) & 0x00010001) * 0xFF)) & 0x00FF00FF;
+    dst[z] = (rb << 8) | ga;
+  }
+}
+
 constexpr uint32_t invert(uint32_t color) {
   return rgba8888(0xFF - get_r(color), 0xFF - get_g(color), 0xFF - get_b(color), get_a(color));
 }
@@ -179,6 +256,7 @@ enum class PixelFormat {
 template <typename T, size_t BitsPerPixel = sizeof(T) * 8>
 struct PixelBufferBase {
   using DataT = T;
+  static constexpr size_t BITS_PER_PIXEL = BitsPerPixel;
 
   uint8_t* pixels;
   std::vector<uint8_t> owned_data;
@@ -235,6 +313,24 @@ struct PixelBuffer<PixelFormat::G1> : PixelBufferBase<uint8_t, 1> {
   void write_row(size_t y, const void* data, size_t pixel_count) {
     memcpy(this->row(y), data, (pixel_count + 7) >> 3);
   }
+  static void decode_row_rgba8888(const DataT* src, uint32_t* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = ((src[x >> 3] << (x & 7)) & 0x80) ? 0x000000FF : 0xFFFFFFFF;
+    }
+  }
+  static void encode_row_rgba8888(const uint32_t* src, DataT* dst, size_t count) {
+    // Unused bits at the end of the last byte are set to zero
+    for (size_t x = 0; x < count; x += 8) {
+      uint8_t block = 0;
+      for (size_t z = 0; (z < 8) && (x + z < count); z++) {
+        uint32_t color = src[x + z];
+        if (((get_r(color) + get_g(color) + get_b(color)) / 3) < 0x80) {
+          block |= (0x80 >> z);
+        }
+      }
+      dst[x >> 3] = block;
+    }
+  }
 };
 
 template <>
@@ -242,9 +338,10 @@ struct PixelBuffer<PixelFormat::GA11> : PixelBufferBase<uint8_t, 2> {
   using typename PixelBufferBase::DataT;
   static constexpr bool HAS_ALPHA = true;
 
+  static constexpr uint32_t VALUES[4] = {0x00000000, 0xFFFFFFFF, 0x00000000, 0x000000FF};
+
   uint32_t read(size_t x, size_t y) const {
-    static const uint32_t values[4] = {0x00000000, 0xFFFFFFFF, 0x00000000, 0x000000FF};
-    return values[(this->row(y)[x >> 2] >> (6 - ((x & 3) << 1))) & 3];
+    return VALUES[(this->row(y)[x >> 2] >> (6 - ((x & 3) << 1))) & 3];
   }
   void write(size_t x, size_t y, uint32_t color) {
     uint8_t& block = this->row(y)[x >> 2];
@@ -259,6 +356,25 @@ struct PixelBuffer<PixelFormat::GA11> : PixelBufferBase<uint8_t, 2> {
   void write_row(size_t y, const void* data, size_t pixel_count) {
     memcpy(this->row(y), data, (pixel_count + 3) >> 2);
   }
+  static void decode_row_rgba8888(const DataT* src, uint32_t* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = VALUES[(src[x >> 2] >> (6 - ((x & 3) << 1))) & 3];
+    }
+  }
+  static void encode_row_rgba8888(const uint32_t* src, DataT* dst, size_t count) {
+    // Unused bits at the end of the last byte are set to zero
+    for (size_t x = 0; x < count; x += 4) {
+      uint8_t block = 0;
+      for (size_t z = 0; (z < 4) && (x + z < count); z++) {
+        uint32_t color = src[x + z];
+        if (get_a(color) >= 0x80) {
+          uint8_t value = (((get_r(color) + get_g(color) + get_b(color)) / 3) >= 0x80) ? 1 : 3;
+          block |= (value << (6 - (z << 1)));
+        }
+      }
+      dst[x >> 2] = block;
+    }
+  }
 };
 
 template <>
@@ -273,6 +389,16 @@ struct PixelBuffer<PixelFormat::G8> : PixelBufferBase<uint8_t> {
   void write(size_t x, size_t y, uint32_t color) {
     this->at(x, y) = (get_r(color) + get_g(color) + get_b(color)) / 3;
   }
+  static void decode_row_rgba8888(const DataT* src, uint32_t* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = rgba8888_gray(src[x]);
+    }
+  }
+  static void encode_row_rgba8888(const uint32_t* src, DataT* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = (get_r(src[x]) + get_g(src[x]) + get_b(src[x])) / 3;
+    }
+  }
 };
 
 template <typename T>
@@ -289,6 +415,18 @@ struct PixelBufferGA88 : PixelBufferBase<T> {
     uint8_t g = (get_r(color) + get_g(color) + get_b(color)) / 3;
     this->at(x, y) = (g << 8) | get_a(color);
   }
+  static void decode_row_rgba8888(const DataT* src, uint32_t* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      uint16_t value = src[x];
+      dst[x] = rgba8888_gray(value >> 8, value & 0xFF);
+    }
+  }
+  static void encode_row_rgba8888(const uint32_t* src, DataT* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      uint8_t g = (get_r(src[x]) + get_g(src[x]) + get_b(src[x])) / 3;
+      dst[x] = (g << 8) | get_a(src[x]);
+    }
+  }
 };
 template <>
 struct PixelBuffer<PixelFormat::GA88_NATIVE> : PixelBufferGA88<uint16_t> {
@@ -314,6 +452,16 @@ struct PixelBufferXRGB1555 : PixelBufferBase<T> {
   void write(size_t x, size_t y, uint32_t color) {
     this->at(x, y) = xrgb1555_for_rgba8888(color);
   }
+  static void decode_row_rgba8888(const DataT* src, uint32_t* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = rgba8888_for_xrgb1555(src[x]);
+    }
+  }
+  static void encode_row_rgba8888(const uint32_t* src, DataT* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = xrgb1555_for_rgba8888(src[x]);
+    }
+  }
 };
 template <>
 struct PixelBuffer<PixelFormat::XRGB1555_NATIVE> : PixelBufferXRGB1555<uint16_t> {
@@ -339,6 +487,16 @@ struct PixelBufferARGB1555 : PixelBufferBase<T> {
   void write(size_t x, size_t y, uint32_t color) {
     this->at(x, y) = argb1555_for_rgba8888(color);
   }
+  static void decode_row_rgba8888(const DataT* src, uint32_t* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = rgba8888_for_argb1555(src[x]);
+    }
+  }
+  static void encode_row_rgba8888(const uint32_t* src, DataT* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = argb1555_for_rgba8888(src[x]);
+    }
+  }
 };
 template <>
 struct PixelBuffer<PixelFormat::ARGB1555_NATIVE> : PixelBufferARGB1555<uint16_t> {
@@ -364,6 +522,16 @@ struct PixelBufferRGB565 : PixelBufferBase<T> {
   void write(size_t x, size_t y, uint32_t color) {
     this->at(x, y) = rgb565_for_rgba8888(color);
   }
+  static void decode_row_rgba8888(const DataT* src, uint32_t* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = rgba8888_for_rgb565(src[x]);
+    }
+  }
+  static void encode_row_rgba8888(const uint32_t* src, DataT* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = rgb565_for_rgba8888(src[x]);
+    }
+  }
 };
 template <>
 struct PixelBuffer<PixelFormat::RGB565_NATIVE> : PixelBufferRGB565<uint16_t> {
@@ -394,6 +562,20 @@ struct PixelBufferRGBBytes : PixelBufferBase<uint8_t, 24> {
     pixel[GIndex] = get_g(color);
     pixel[BIndex] = get_b(color);
   }
+  static void decode_row_rgba8888(const DataT* src, uint32_t* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      const DataT* pixel = &src[x * 3];
+      dst[x] = rgba8888(pixel[RIndex], pixel[GIndex], pixel[BIndex], 0xFF);
+    }
+  }
+  static void encode_row_rgba8888(const uint32_t* src, DataT* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      DataT* pixel = &dst[x * 3];
+      pixel[RIndex] = get_r(src[x]);
+      pixel[GIndex] = get_g(src[x]);
+      pixel[BIndex] = get_b(src[x]);
+    }
+  }
 };
 template <>
 struct PixelBuffer<PixelFormat::RGB888> : PixelBufferRGBBytes<0, 1, 2> {
@@ -415,6 +597,16 @@ struct PixelBufferRGBA8888 : PixelBufferBase<T> {
   void write(size_t x, size_t y, uint32_t color) {
     this->at(x, y) = color;
   }
+  static void decode_row_rgba8888(const DataT* src, uint32_t* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = src[x];
+    }
+  }
+  static void encode_row_rgba8888(const uint32_t* src, DataT* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = src[x];
+    }
+  }
 };
 template <>
 struct PixelBuffer<PixelFormat::RGBA8888_NATIVE> : PixelBufferRGBA8888<uint32_t> {
@@ -440,6 +632,16 @@ struct PixelBufferARGB8888 : PixelBufferBase<T> {
   void write(size_t x, size_t y, uint32_t color) {
     this->at(x, y) = argb8888_for_rgba8888(color);
   }
+  static void decode_row_rgba8888(const DataT* src, uint32_t* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = rgba8888_for_argb8888(src[x]);
+    }
+  }
+  static void encode_row_rgba8888(const uint32_t* src, DataT* dst, size_t count) {
+    for (size_t x = 0; x < count; x++) {
+      dst[x] = argb8888_for_rgba8888(src[x]);
+    }
+  }
 };
 template <>
 struct PixelBuffer<PixelFormat::ARGB8888_NATIVE> : PixelBufferARGB8888<uint32_t> {
@@ -461,6 +663,132 @@ enum class ResizeMode {
   TILED,
   NEAREST_NEIGHBOR,
   LINEAR_INTERPOLATION,
+  // These modes use filters whose width scales with the resize factor, so they also antialias when shrinking an image
+  BOX,
+  BICUBIC,
+  LANCZOS,
+};
+
+// Fixed-point filter weights for one axis of a separable resize. Output pixel i is computed from counts[i] consecutive
+// source pixels beginning at starts[i], whose weights are weights[i * taps_per_pixel] onward. Weights are in units of
+// 1/ONE, and the weights for each output pixel sum to exactly ONE.
+struct ResampleWeights {
+  static constexpr int32_t SHIFT = 14;
+  static constexpr int32_t ONE = 1 << SHIFT;
+
+  size_t taps_per_pixel;
+  std::vector<uint32_t> starts;
+  std::vector<uint32_t> counts;
+  std::vector<int32_t> weights;
+
+  ResampleWeights(ResizeMode mode, size_t src_size, size_t dst_size)
+      : taps_per_pixel(0),
+        starts(dst_size, 0),
+        counts(dst_size, 0) {
+    if (src_size == 0) {
+      throw std::logic_error("cannot resample from an empty region");
+    }
+
+    if (mode == ResizeMode::LINEAR_INTERPOLATION) {
+      // This mode maps the first and last source pixels exactly onto the first and last destination pixels, and does
+      // not antialias when shrinking
+      this->taps_per_pixel = 2;
+      this->weights.resize(dst_size * 2, 0);
+      for (size_t x = 0; x < dst_size; x++) {
+        double pos = (dst_size > 1) ? (static_cast<double>(x) * (src_size - 1) / (dst_size - 1)) : 0.0;
+        size_t start = std::min<size_t>(pos, src_size - 1);
+        double float_weights[2] = {1.0 - (pos - start), pos - start};
+        this->set_pixel_weights(x, start, float_weights, (start + 1 < src_size) ? 2 : 1);
+      }
+      return;
+    }
+
+    double (*filter)(double);
+    double support;
+    switch (mode) {
+      case ResizeMode::BOX:
+        filter = &ResampleWeights::box_filter;
+        support = 0.5;
+        break;
+      case ResizeMode::BICUBIC:
+        filter = &ResampleWeights::bicubic_filter;
+        support = 2.0;
+        break;
+      case ResizeMode::LANCZOS:
+        filter = &ResampleWeights::lanczos_filter;
+        support = 3.0;
+        break;
+      default:
+        throw std::logic_error("resize mode does not use a resampling filter");
+    }
+
+    // When shrinking, the filter is stretched so that every source pixel contributes to the output
+    double scale = static_cast<double>(src_size) / dst_size;
+    double filter_scale = std::max<double>(scale, 1.0);
+    double scaled_support = support * filter_scale;
+    this->taps_per_pixel = static_cast<size_t>(ceil(scaled_support)) * 2 + 1;
+    this->weights.resize(dst_size * this->taps_per_pixel, 0);
+    std::vector<double> float_weights(this->taps_per_pixel);
+    for (size_t x = 0; x < dst_size; x++) {
+      double center = (x + 0.5) * scale;
+      ssize_t start = std::max<ssize_t>(static_cast<ssize_t>(center - scaled_support + 0.5), 0);
+      ssize_t end = std::min<ssize_t>(static_cast<ssize_t>(center + scaled_support + 0.5), src_size);
+      size_t count = std::min<size_t>(std::max<ssize_t>(end - start, 1), this->taps_per_pixel);
+      start = std::min<ssize_t>(start, src_size - count);
+      for (size_t z = 0; z < count; z++) {
+        float_weights[z] = filter((start + z + 0.5 - center) / filter_scale);
+      }
+      this->set_pixel_weights(x, start, float_weights.data(), count);
+    }
+  }
+
+  static double box_filter(double x) {
+    return ((x >= -0.5) && (x < 0.5)) ? 1.0 : 0.0;
+  }
+  static double bicubic_filter(double x) {
+    constexpr double a = -0.5;
+    x = fabs(x);
+    if (x < 1.0) {
+      return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+    } else if (x < 2.0) {
+      return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+    } else {
+      return 0.0;
+    }
+  }
+  static double lanczos_filter(double x) {
+    if (x == 0.0) {
+      return 1.0;
+    } else if ((x <= -3.0) || (x >= 3.0)) {
+      return 0.0;
+    } else {
+      return 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+    }
+  }
+
+private:
+  void set_pixel_weights(size_t dst_index, size_t start, const double* float_weights, size_t count) {
+    this->starts[dst_index] = start;
+    this->counts[dst_index] = count;
+
+    double sum = 0.0;
+    for (size_t z = 0; z < count; z++) {
+      sum += float_weights[z];
+    }
+
+    // Normalize the weights, then put any rounding error on the largest weight so that the total is exactly ONE
+    int32_t* weights = &this->weights[dst_index * this->taps_per_pixel];
+    int32_t total = 0;
+    size_t max_index = 0;
+    for (size_t z = 0; z < count; z++) {
+      weights[z] = (sum != 0.0) ? static_cast<int32_t>(lround(float_weights[z] * ONE / sum)) : 0;
+      total += weights[z];
+      if (weights[z] > weights[max_index]) {
+        max_index = z;
+      }
+    }
+    weights[max_index] += ONE - total;
+  }
 };
 
 enum class ImageFormat {
@@ -487,6 +815,35 @@ inline const char* file_extension_for_image_format(ImageFormat format) {
   }
 }
 
+// Decodes a PNG file. All color types, bit depths, and interlacing are supported. header_fn(w, h) is called once,
+// before any rows are decoded. Then, row_fn(y, x_offset, x_step, colors, count) is called for each row as soon as it's
+// decompressed; colors are given in RGBA8888 format, and colors[i] is the pixel at (x_offset + i * x_step, y). For
+// non-interlaced images, x_offset is always 0 and x_step is always 1.
+using PNGHeaderFunction = std::function<void(size_t w, size_t h)>;
+using PNGRowFunction = std::function<void(size_t y, size_t x_offset, size_t x_step, const uint32_t* colors, size_t count)>;
+void decode_png(const void* data, size_t size, const PNGHeaderFunction& header_fn, const PNGRowFunction& row_fn);
+
+struct PNGEncodeOptions {
+  // zlib compression level, from 0 (no compression) to 9 (smallest output)
+  int compression_level = 9;
+  // If true, the filter type that's likely to compress best is chosen for each row, based on a cheap estimate of how
+  // well each filtered row will compress. This greatly reduces the size of photographic images. Filtering often makes
+  // synthetic images (with large flat areas or repeated patterns) larger, so if the estimate for a strip is no better
+  // than with no filtering, that strip isn't filtered. The estimate isn't exact, so rarely, the output may be slightly
+  // larger than with no filtering. If false, rows are not filtered
+  bool adaptive_filtering = false;
+  // If not 1, large images are split into horizontal strips which are compressed in parallel. The output is slightly
+  // larger since each strip is compressed independently. 0 means to use one strip per CPU core.
+  size_t num_threads = 1;
+};
+
+// Encodes a PNG file with 8-bit RGB or RGBA pixels. row_fn(y, colors) must write the RGBA8888 colors for row y into
+// colors; it may be called multiple times for the same row, and from multiple threads at once if
+// options.num_threads is not 1.
+using PNGRowSourceFunction = std::function<void(size_t y, uint32_t* colors)>;
+std::string encode_png(
+    size_t w, size_t h, bool has_alpha, const PNGRowSourceFunction& row_fn, const PNGEncodeOptions& options);
+
 template <PixelFormat Format>
 class Image : public PixelBuffer<Format> {
 public:
@@ -536,11 +893,33 @@ public:
     return ret;
   }
 
-  // File (PPM/BMP) parsing constructor
+  // File (PPM/BMP/PNG) parsing constructor
   static Image<Format> from_file_data(const void* data, size_t size) {
     StringReader r(data, size);
     uint16_t sig = r.get_u16b(0);
 
+    if (sig == 0x8950) { // \x89P
+      Image<Format> ret;
+      decode_png(
+          data, size,
+          [&](size_t w, size_t h) -> void {
+            ret.w = w;
+            ret.h = h;
+            ret.stride = ret.default_stride();
+            ret.create_owned_data();
+          },
+          [&](size_t y, size_t x_offset, size_t x_step, const uint32_t* colors, size_t count) -> void {
+            if (x_step == 1) {
+              PixelBuffer<Format>::encode_row_rgba8888(colors, ret.row(y), count);
+            } else {
+              for (size_t z = 0; z < count; z++) {
+                ret.write(x_offset + z * x_step, y, colors[z]);
+              }
+            }
+          });
+      return ret;
+    }
+
     ImageFormat format;
     bool is_extended_ppm = false;
     if (sig == 0x5035) { // P5
@@ -790,6 +1169,8 @@ public:
     memcpy(ret.pixels, this->pixels, this->data_size());
     return ret;
   }
+  // Converts the image to a different pixel format. Each row is decoded to RGBA8888, passed through transform_color
+  // one pixel at a time, then encoded in the new format.
   template <PixelFormat NewFormat, typename FnT>
     requires std::is_invocable_r_v<uint32_t, FnT, uint32_t>
   Image<NewFormat> change_pixel_format(FnT&& transform_color) const {
@@ -798,16 +1179,45 @@ public:
     ret.h = this->h;
     ret.stride = ret.default_stride();
     ret.create_owned_data();
+    std::vector<uint32_t> colors(this->w);
     for (size_t y = 0; y < this->h; y++) {
-      for (size_t x = 0; x < this->w; x++) {
-        ret.write(x, y, transform_color(this->read(x, y)));
+      PixelBuffer<Format>::decode_row_rgba8888(this->row(y), colors.data(), this->w);
+      for (auto& color : colors) {
+        color = transform_color(color);
       }
+      PixelBuffer<NewFormat>::encode_row_rgba8888(colors.data(), ret.row(y), this->w);
     }
     return ret;
   }
+  // Converts the image to a different pixel format without changing any colors (except as needed to fit the new
+  // format). If either format is RGBA8888_NATIVE, rows are converted directly without an intermediate buffer.
   template <PixelFormat NewFormat>
   Image<NewFormat> change_pixel_format() const {
-    return this->change_pixel_format<NewFormat>([](uint32_t color) { return color; });
+    Image<NewFormat> ret;
+    ret.w = this->w;
+    ret.h = this->h;
+    ret.stride = ret.default_stride();
+    ret.create_owned_data();
+    if constexpr (NewFormat == Format) {
+      for (size_t y = 0; y < this->h; y++) {
+        memcpy(ret.row(y), this->row(y), ret.stride);
+      }
+    } else if constexpr (Format == PixelFormat::RGBA8888_NATIVE) {
+      for (size_t y = 0; y < this->h; y++) {
+        PixelBuffer<NewFormat>::encode_row_rgba8888(this->row(y), ret.row(y), this->w);
+      }
+    } else if constexpr (NewFormat == PixelFormat::RGBA8888_NATIVE) {
+      for (size_t y = 0; y < this->h; y++) {
+        PixelBuffer<Format>::decode_row_rgba8888(this->row(y), ret.row(y), this->w);
+      }
+    } else {
+      std::vector<uint32_t> colors(this->w);
+      for (size_t y = 0; y < this->h; y++) {
+        PixelBuffer<Format>::decode_row_rgba8888(this->row(y), colors.data(), this->w);
+        PixelBuffer<NewFormat>::encode_row_rgba8888(colors.data(), ret.row(y), this->w);
+      }
+    }
+    return ret;
   }
   template <PixelFormat NewFormat = PixelFormat::RGB888>
     requires(Format == PixelFormat::G1)
@@ -939,82 +1349,8 @@ public:
         return std::move(w.str());
       }
 
-      case ImageFormat::PNG: {
-        StringWriter w;
-        auto write_png_chunk = [&w](const char* type, const void* data, size_t size) {
-          w.put_u32b(size);
-          w.write(type, 4);
-          if (size > 0) {
-            w.write(data, size);
-          }
-          // The checksum includes the chunk type, but not the length
-          uint32_t crc = ::crc32(0, reinterpret_cast<const Bytef*>(type), 4);
-          if (size > 0) {
-            crc = ::crc32(crc, reinterpret_cast<const Bytef*>(data), size);
-          }
-          w.put_u32b(crc);
-        };
-
-        constexpr uint8_t signature[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A}; // '\x89PNG\r\n\x1A\n'
-        w.write(signature, sizeof(signature));
-
-        // Write IDHR chunk
-        const struct {
-          be_uint32_t width;
-          be_uint32_t height;
-          uint8_t bit_depth;
-          uint8_t color_type;
-          uint8_t compression;
-          uint8_t filter;
-          uint8_t interlace;
-        } IHDR{
-            this->w,
-            this->h,
-            8,
-            static_cast<uint8_t>(HAS_ALPHA ? 6 : 2),
-            0, // default compression
-            0, // default filter
-            0, // non-interlaced
-        };
-        write_png_chunk("IHDR", &IHDR, 13);
-
-        // Write gAMA chunk
-        const be_uint32_t gAMA = 45455; // 1/2.2
-        write_png_chunk("gAMA", &gAMA, sizeof(gAMA));
-
-        // Write IDAT chunk
-        StringWriter idat_w;
-        for (size_t y = 0; y < this->h; y++) {
-          idat_w.put_u8(0); // No filter
-          for (size_t x = 0; x < this->w; x++) {
-            if constexpr (HAS_ALPHA) {
-              idat_w.put_u32b(this->read(x, y));
-            } else {
-              uint32_t color = this->read(x, y);
-              idat_w.put_u8(get_r(color));
-              idat_w.put_u8(get_g(color));
-              idat_w.put_u8(get_b(color));
-            }
-          }
-        }
-        if (idat_w.size() != this->h * (1 + this->w * (HAS_ALPHA ? 4 : 3))) {
-          throw std::logic_error("PNG IDAT encoding produced incorrect data size");
-        }
-        uLongf idat_size = compressBound(idat_w.str().size());
-        auto idat_data = malloc_unique(idat_size);
-        int compress_result = compress2(
-            static_cast<Bytef*>(idat_data.get()),
-            &idat_size,
-            reinterpret_cast<const Bytef*>(idat_w.str().data()),
-            idat_w.str().size(),
-            9);
-        if (compress_result) {
-          throw std::runtime_error(std::format("zlib error compressing png data: {}", compress_result));
-        }
-        write_png_chunk("IDAT", idat_data.get(), idat_size);
-        write_png_chunk("IEND", nullptr, 0);
-        return std::move(w.str());
-      }
+      case ImageFormat::PNG:
+        return this->serialize_png();
 
       case ImageFormat::PNG_DATA_URL:
         return "data:image/png;base64," + base64_encode(this->serialize(ImageFormat::PNG));
@@ -1024,6 +1360,12 @@ public:
     }
   }
 
+  std::string serialize_png(const PNGEncodeOptions& options = PNGEncodeOptions()) const {
+    return encode_png(this->w, this->h, HAS_ALPHA, [this](size_t y, uint32_t* colors) -> void {
+      PixelBuffer<Format>::decode_row_rgba8888(this->row(y), colors, this->w);
+    }, options);
+  }
+
   /////////////////////////////////////////////////////////////////////////////
   // Comparators & basic introspection
 
@@ -1075,6 +1417,151 @@ public:
     }
   }
 
+  // Returns a copy of this image, stretched or shrunk to the given size
+  Image<Format> scaled(size_t new_w, size_t new_h, ResizeMode resize_mode = ResizeMode::LINEAR_INTERPOLATION) const {
+    Image<Format> ret(new_w, new_h);
+    ret.copy_from(*this, 0, 0, new_w, new_h, 0, 0, this->w, this->h, resize_mode);
+    return ret;
+  }
+
+  // Resamples the given rectangle of this image to dst_w x dst_h pixels using a separable filter (resize_mode must be
+  // LINEAR_INTERPOLATION, BOX, BICUBIC, or LANCZOS). Returns the result as RGBA8888 colors in row-major order. Pixels
+  // outside of this image are treated as transparent black. This works on whole rows in fixed-point arithmetic, and
+  // large images are processed on multiple threads.
+  std::vector<uint32_t> resample_rgba8888(
+      ssize_t x, ssize_t y, size_t w, size_t h, size_t dst_w, size_t dst_h, ResizeMode resize_mode) const {
+    std::vector<uint32_t> ret(dst_w * dst_h, 0);
+    if (dst_w == 0 || dst_h == 0 || w == 0 || h == 0) {
+      return ret;
+    }
+
+    ResampleWeights x_weights(resize_mode, w, dst_w);
+    ResampleWeights y_weights(resize_mode, h, dst_h);
+
+    // The horizontal pass produces one intermediate row for each source row that's used by the vertical pass. The
+    // intermediate values have 7 fractional bits, so the only significant rounding happens once, at the very end
+    size_t first_src_row = h;
+    size_t last_src_row = 0;
+    for (size_t yy = 0; yy < dst_h; yy++) {
+      first_src_row = std::min<size_t>(first_src_row, y_weights.starts[yy]);
+      last_src_row = std::max<size_t>(last_src_row, y_weights.starts[yy] + y_weights.counts[yy]);
+    }
+    size_t intermediate_stride = dst_w * 4;
+    std::vector<int16_t> intermediate((last_src_row - first_src_row) * intermediate_stride);
+
+    ThreadPool* pool = ((w * h + dst_w * dst_h) >= 0x40000) ? &ThreadPool::shared() : nullptr;
+    size_t num_scratch_buffers = pool ? pool->size() : 1;
+    auto for_each_row = [&](size_t start_row, size_t end_row, auto&& fn) -> void {
+      if (pool) {
+        pool->parallel_for<size_t>(start_row, end_row, fn);
+      } else {
+        for (size_t row = start_row; row < end_row; row++) {
+          fn(row, 0);
+        }
+      }
+    };
+
+    // Only the part of the source row that's within this image is read; the rest stays transparent black
+    ssize_t read_start_x = std::clamp<ssize_t>(x, 0, this->w);
+    ssize_t read_end_x = std::clamp<ssize_t>(x + w, 0, this->w);
+    std::vector<std::vector<uint8_t>> src_rows(num_scratch_buffers, std::vector<uint8_t>(w * 4, 0));
+    for_each_row(first_src_row, last_src_row, [&](size_t src_row, size_t slot_num) -> void {
+      uint8_t* src_row_data = src_rows[slot_num].data();
+      ssize_t read_y = y + src_row;
+      if ((read_y >= 0) && (read_y < static_cast<ssize_t>(this->h))) {
+        for (ssize_t xx = read_start_x; xx < read_end_x; xx++) {
+          uint32_t color = this->read(xx, read_y);
+          uint8_t* pixel = &src_row_data[(xx - x) * 4];
+          pixel[0] = get_r(color);
+          pixel[1] = get_g(color);
+          pixel[2] = get_b(color);
+          pixel[3] = get_a(color);
+        }
+      } else {
+        memset(src_row_data, 0, w * 4);
+      }
+
+      int16_t* out = &intermediate[(src_row - first_src_row) * intermediate_stride];
+      for (size_t xx = 0; xx < dst_w; xx++) {
+        const int32_t* weights = &x_weights.weights[xx * x_weights.taps_per_pixel];
+        const uint8_t* src = &src_row_data[x_weights.starts[xx] * 4];
+        int32_t acc[4] = {0x40, 0x40, 0x40, 0x40};
+        for (size_t z = 0; z < x_weights.counts[xx]; z++) {
+          for (size_t c = 0; c < 4; c++) {
+            acc[c] += weights[z] * src[z * 4 + c];
+          }
+        }
+        for (size_t c = 0; c < 4; c++) {
+          out[xx * 4 + c] = std::clamp<int32_t>(acc[c] >> 7, 0, 0xFF << 7);
+        }
+      }
+    });
+
+    // The vertical pass accumulates entire rows at once, which the compiler can vectorize
+    constexpr int32_t final_shift = ResampleWeights::SHIFT + 7;
+    std::vector<std::vector<int32_t>> accumulators(num_scratch_buffers, std::vector<int32_t>(intermediate_stride));
+    for_each_row(0, dst_h, [&](size_t dst_row, size_t slot_num) -> void {
+      int32_t* acc = accumulators[slot_num].data();
+      for (size_t z = 0; z < intermediate_stride; z++) {
+        acc[z] = 1 << (final_shift - 1);
+      }
+      const int32_t* weights = &y_weights.weights[dst_row * y_weights.taps_per_pixel];
+      for (size_t z = 0; z < y_weights.counts[dst_row]; z++) {
+        int32_t weight = weights[z];
+        const int16_t* in = &intermediate[(y_weights.starts[dst_row] + z - first_src_row) * intermediate_stride];
+        for (size_t zz = 0; zz < intermediate_stride; zz++) {
+          acc[zz] += weight * in[zz];
+        }
+      }
+      uint32_t* out = &ret[dst_row * dst_w];
+      for (size_t xx = 0; xx < dst_w; xx++) {
+        out[xx] = rgba8888(
+            std::clamp<int32_t>(acc[xx * 4 + 0] >> final_shift, 0, 0xFF),
+            std::clamp<int32_t>(acc[xx * 4 + 1] >> final_shift, 0, 0xFF),
+            std::clamp<int32_t>(acc[xx * 4 + 2] >> final_shift, 0, 0xFF),
+            std::clamp<int32_t>(acc[xx * 4 + 3] >> final_shift, 0, 0xFF));
+      }
+    });
+
+    return ret;
+  }
+
+  // Returns count pixels starting at (x, y) as RGBA8888 colors. If the image's format is RGBA8888_NATIVE, the returned
+  // pointer points into the image's data; otherwise, the pixels are converted into buf (which must have room for count
+  // colors) and buf is returned. Modified colors can be stored back into the image with write_rgba8888_span.
+  const uint32_t* read_rgba8888_span(size_t x, size_t y, size_t count, uint32_t* buf) const {
+    if constexpr (Format == PixelFormat::RGBA8888_NATIVE) {
+      return reinterpret_cast<const uint32_t*>(this->pixels + y * this->stride) + x;
+    } else if constexpr (PixelBuffer<Format>::BITS_PER_PIXEL & 7) {
+      for (size_t z = 0; z < count; z++) {
+        buf[z] = this->read(x + z, y);
+      }
+      return buf;
+    } else {
+      const uint8_t* src = this->pixels + y * this->stride + x * (PixelBuffer<Format>::BITS_PER_PIXEL >> 3);
+      PixelBuffer<Format>::decode_row_rgba8888(reinterpret_cast<const typename PixelBuffer<Format>::DataT*>(src), buf, count);
+      return buf;
+    }
+  }
+  uint32_t* read_rgba8888_span(size_t x, size_t y, size_t count, uint32_t* buf) {
+    return const_cast<uint32_t*>(std::as_const(*this).read_rgba8888_span(x, y, count, buf));
+  }
+  void write_rgba8888_span(size_t x, size_t y, size_t count, const uint32_t* colors) {
+    if constexpr (Format == PixelFormat::RGBA8888_NATIVE) {
+      uint32_t* dst = reinterpret_cast<uint32_t*>(this->pixels + y * this->stride) + x;
+      if (dst != colors) {
+        memmove(dst, colors, count * sizeof(uint32_t));
+      }
+    } else if constexpr (PixelBuffer<Format>::BITS_PER_PIXEL & 7) {
+      for (size_t z = 0; z < count; z++) {
+        this->write(x + z, y, colors[z]);
+      }
+    } else {
+      uint8_t* dst = this->pixels + y * this->stride + x * (PixelBuffer<Format>::BITS_PER_PIXEL >> 3);
+      PixelBuffer<Format>::encode_row_rgba8888(colors, reinterpret_cast<typename PixelBuffer<Format>::DataT*>(dst), count);
+    }
+  }
+
   // Sets all pixels to the given color, without alpha blending
   void clear(uint32_t color) {
     for (size_t y = 0; y < this->h; y++) {
@@ -1101,10 +1588,14 @@ public:
       return;
     }
     this->clamp_rect(x, y, w, h);
+    if (w <= 0 || h <= 0) {
+      return;
+    }
+    std::vector<uint32_t> buf((Format == PixelFormat::RGBA8888_NATIVE) ? 0 : w);
     for (ssize_t yy = 0; yy < h; yy++) {
-      for (ssize_t xx = 0; xx < w; xx++) {
-        this->write(x + xx, y + yy, alpha_blend(this->read(x + xx, y + yy), color));
-      }
+      uint32_t* colors = this->read_rgba8888_span(x, y + yy, w, buf.data());
+      alpha_blend_row(colors, color, w);
+      this->write_rgba8888_span(x, y + yy, w, colors);
     }
   }
 
@@ -1154,6 +1645,54 @@ public:
   /////////////////////////////////////////////////////////////////////////////
   // Blitting functions
 
+  // Calls row_fn(dst_colors, src_colors, count) for each row of the given rect, clipped to the bounds of both images.
+  // Both rows are given as RGBA8888 colors; row_fn should modify dst_colors, which is then written back to this image.
+  template <PixelFormat SourceFormat, typename FnT>
+    requires std::is_invocable_r_v<void, FnT, uint32_t*, const uint32_t*, size_t>
+  void copy_rows_from_with_custom(
+      const Image<SourceFormat>& source,
+      ssize_t dst_x,
+      ssize_t dst_y,
+      ssize_t w,
+      ssize_t h,
+      ssize_t src_x,
+      ssize_t src_y,
+      FnT&& row_fn) {
+    ssize_t x_start = std::max<ssize_t>({0, -dst_x, -src_x});
+    ssize_t y_start = std::max<ssize_t>({0, -dst_y, -src_y});
+    ssize_t x_end = std::min<ssize_t>(
+        {w, static_cast<ssize_t>(this->w) - dst_x, static_cast<ssize_t>(source.get_width()) - src_x});
+    ssize_t y_end = std::min<ssize_t>(
+        {h, static_cast<ssize_t>(this->h) - dst_y, static_cast<ssize_t>(source.get_height()) - src_y});
+    if (x_start >= x_end || y_start >= y_end) {
+      return;
+    }
+
+    // If the source and destination are the same image, the regions may overlap, so we have to go one pixel at a time
+    // to preserve the order in which pixels are read and written
+    if (static_cast<const void*>(&source) == static_cast<const void*>(this)) {
+      for (ssize_t y = y_start; y < y_end; y++) {
+        for (ssize_t x = x_start; x < x_end; x++) {
+          uint32_t dst_color = this->read(dst_x + x, dst_y + y);
+          uint32_t src_color = source.read(src_x + x, src_y + y);
+          row_fn(&dst_color, &src_color, 1);
+          this->write(dst_x + x, dst_y + y, dst_color);
+        }
+      }
+      return;
+    }
+
+    size_t count = x_end - x_start;
+    std::vector<uint32_t> dst_buf((Format == PixelFormat::RGBA8888_NATIVE) ? 0 : count);
+    std::vector<uint32_t> src_buf((SourceFormat == PixelFormat::RGBA8888_NATIVE) ? 0 : count);
+    for (ssize_t y = y_start; y < y_end; y++) {
+      uint32_t* dst_colors = this->read_rgba8888_span(dst_x + x_start, dst_y + y, count, dst_buf.data());
+      const uint32_t* src_colors = source.read_rgba8888_span(src_x + x_start, src_y + y, count, src_buf.data());
+      row_fn(dst_colors, src_colors, count);
+      this->write_rgba8888_span(dst_x + x_start, dst_y + y, count, dst_colors);
+    }
+  }
+
   template <PixelFormat SourceFormat, typename FnT>
     requires std::is_invocable_r_v<uint32_t, FnT, uint32_t, uint32_t>
   void copy_from_with_custom(
@@ -1175,22 +1714,15 @@ public:
     }
 
     switch (resize_mode) {
-      case ResizeMode::NONE: {
+      case ResizeMode::NONE:
         // Just render as much data as available, anchored to the upper-left corner
-        for (ssize_t y = 0; y < dst_h; y++) {
-          size_t src_row_y = src_y + y;
-          size_t dst_row_y = dst_y + y;
-          for (ssize_t x = 0; x < dst_w; x++) {
-            ssize_t src_col_x = src_x + x;
-            ssize_t dst_col_x = dst_x + x;
-            if (this->check(dst_col_x, dst_row_y) && source.check(src_col_x, src_row_y)) {
-              this->write(dst_col_x, dst_row_y,
-                  per_pixel_fn(this->read(dst_col_x, dst_row_y), source.read(src_col_x, src_row_y)));
-            }
-          }
-        }
+        this->copy_rows_from_with_custom(source, dst_x, dst_y, dst_w, dst_h, src_x, src_y,
+            [&](uint32_t* dst_colors, const uint32_t* src_colors, size_t count) -> void {
+              for (size_t z = 0; z < count; z++) {
+                dst_colors[z] = per_pixel_fn(dst_colors[z], src_colors[z]);
+              }
+            });
         break;
-      }
 
       case ResizeMode::TILED:
         // Repeat the source image in both dimensions as needed
@@ -1225,49 +1757,26 @@ public:
         break;
 
       case ResizeMode::LINEAR_INTERPOLATION:
-        // Stretch the source image into the dest rect, using 2-D linear interpolation
+      case ResizeMode::BOX:
+      case ResizeMode::BICUBIC:
+      case ResizeMode::LANCZOS: {
+        // Stretch the source image into the dest rect, using a separable resampling filter
+        if (dst_w <= 0 || dst_h <= 0 || src_w <= 0 || src_h <= 0) {
+          break;
+        }
+        auto resampled = source.resample_rgba8888(src_x, src_y, src_w, src_h, dst_w, dst_h, resize_mode);
         for (ssize_t y = 0; y < dst_h; y++) {
-          double y_rel_dist = static_cast<double>(y) / (dst_h - 1);
-          double source_y_progress = y_rel_dist * (src_h - 1);
-          size_t source_y1 = src_y + source_y_progress;
-          size_t source_y2 = source_y1 + 1;
-          double source_y2_factor = source_y_progress - source_y1;
-          double source_y1_factor = 1.0 - source_y2_factor;
-
+          const uint32_t* resampled_row = &resampled[y * dst_w];
+          size_t dst_row_y = dst_y + y;
           for (ssize_t x = 0; x < dst_w; x++) {
-            double x_rel_dist = static_cast<double>(x) / (dst_w - 1);
-            double source_x_progress = x_rel_dist * (src_w - 1);
-            size_t source_x1 = src_x + source_x_progress;
-            size_t source_x2 = source_x1 + 1;
-            double source_x2_factor = source_x_progress - source_x1;
-            double source_x1_factor = 1.0 - source_x2_factor;
-
-            uint32_t s11 = source.check(source_x1, source_y1) ? source.read(source_x1, source_y1) : 0x00000000;
-            uint32_t s12 = source.check(source_x1, source_y2) ? source.read(source_x1, source_y2) : 0x00000000;
-            uint32_t s21 = source.check(source_x2, source_y1) ? source.read(source_x2, source_y1) : 0x00000000;
-            uint32_t s22 = source.check(source_x2, source_y2) ? source.read(source_x2, source_y2) : 0x00000000;
-
-            uint8_t dr = get_r(s11) * (source_x1_factor * source_y1_factor) +
-                get_r(s12) * (source_x1_factor * source_y2_factor) +
-                get_r(s21) * (source_x2_factor * source_y1_factor) +
-                get_r(s22) * (source_x2_factor * source_y2_factor);
-            uint8_t dg = get_g(s11) * (source_x1_factor * source_y1_factor) +
-                get_g(s12) * (source_x1_factor * source_y2_factor) +
-                get_g(s21) * (source_x2_factor * source_y1_factor) +
-                get_g(s22) * (source_x2_factor * source_y2_factor);
-            uint8_t db = get_b(s11) * (source_x1_factor * source_y1_factor) +
-                get_b(s12) * (source_x1_factor * source_y2_factor) +
-                get_b(s21) * (source_x2_factor * source_y1_factor) +
-                get_b(s22) * (source_x2_factor * source_y2_factor);
-            uint8_t da = get_a(s11) * (source_x1_factor * source_y1_factor) +
-                get_a(s12) * (source_x1_factor * source_y2_factor) +
-                get_a(s21) * (source_x2_factor * source_y1_factor) +
-                get_a(s22) * (source_x2_factor * source_y2_factor);
-
-            this->write(dst_x + x, dst_y + y, per_pixel_fn(this->read(dst_x + x, dst_y + y), rgba8888(dr, dg, db, da)));
+            ssize_t dst_col_x = dst_x + x;
+            if (this->check(dst_col_x, dst_row_y)) {
+              this->write(dst_col_x, dst_row_y, per_pixel_fn(this->read(dst_col_x, dst_row_y), resampled_row[x]));
+            }
           }
         }
         break;
+      }
       default:
         throw std::logic_error("Invalid resize mode");
     }
@@ -1333,6 +1842,11 @@ public:
       return;
     } else if (alpha == 0xFF) {
       this->copy_from(source, dst_x, dst_y, dst_w, dst_h, src_x, src_y, src_w, src_h, resize_mode);
+    } else if (resize_mode == ResizeMode::NONE || (src_w == dst_w && src_h == dst_h)) {
+      this->copy_rows_from_with_custom(source, dst_x, dst_y, dst_w, dst_h, src_x, src_y,
+          [alpha](uint32_t* dst_colors, const uint32_t* src_colors, size_t count) -> void {
+            alpha_blend_row(dst_colors, src_colors, alpha, count);
+          });
     } else {
       this->copy_from_with_custom(source, dst_x, dst_y, dst_w, dst_h, src_x, src_y, src_w, src_h, resize_mode,
           [alpha](uint32_t dest_color, uint32_t src_color) -> uint32_t {
@@ -1368,6 +1882,13 @@ public:
       ssize_t src_w,
       ssize_t src_h,
       ResizeMode resize_mode) {
+    if (resize_mode == ResizeMode::NONE || (src_w == dst_w && src_h == dst_h)) {
+      this->copy_rows_from_with_custom(source, dst_x, dst_y, dst_w, dst_h, src_x, src_y,
+          [](uint32_t* dst_colors, const uint32_t* src_colors, size_t count) -> void {
+            alpha_blend_row(dst_colors, src_colors, count);
+          });
+      return;
+    }
     this->copy_from_with_custom(source, dst_x, dst_y, dst_w, dst_h, src_x, src_y, src_w, src_h, resize_mode,
         [](uint32_t dest_color, uint32_t src_color) -> uint32_t {
           // a = 0 and a = FF are common so we special-case them before doing a
@@ -1394,6 +1915,42 @@ public:
     this->copy_from_with_blend(source, dst_x, dst_y, w, h, src_x, src_y, w, h, ResizeMode::NONE);
   }
 
+  // Like copy_from_with_blend, but for images whose colors have premultiplied alpha. The source and destination
+  // alpha channels are combined, as with alpha_blend_premultiplied.
+  template <PixelFormat SourceFormat>
+  void copy_from_with_premultiplied_blend(
+      const Image<SourceFormat>& source,
+      ssize_t dst_x,
+      ssize_t dst_y,
+      ssize_t dst_w,
+      ssize_t dst_h,
+      ssize_t src_x,
+      ssize_t src_y,
+      ssize_t src_w,
+      ssize_t src_h,
+      ResizeMode resize_mode) {
+    if (resize_mode == ResizeMode::NONE || (src_w == dst_w && src_h == dst_h)) {
+      this->copy_rows_from_with_custom(source, dst_x, dst_y, dst_w, dst_h, src_x, src_y,
+          [](uint32_t* dst_colors, const uint32_t* src_colors, size_t count) -> void {
+            alpha_blend_premultiplied_row(dst_colors, src_colors, count);
+          });
+    } else {
+      this->copy_from_with_custom(source, dst_x, dst_y, dst_w, dst_h, src_x, src_y, src_w, src_h, resize_mode,
+          alpha_blend_premultiplied);
+    }
+  }
+  template <PixelFormat SourceFormat>
+  void copy_from_with_premultiplied_blend(
+      const Image<SourceFormat>& source,
+      ssize_t dst_x,
+      ssize_t dst_y,
+      ssize_t w,
+      ssize_t h,
+      ssize_t src_x,
+      ssize_t src_y) {
+    this->copy_from_with_premultiplied_blend(source, dst_x, dst_y, w, h, src_x, src_y, w, h, ResizeMode::NONE);
+  }
+
   // Copies pixels from another image to this one, but does not copy pixels
   // whose color in the source image matches the given color.
   template <PixelFormat SourceFormat>
@@ -1586,6 +2143,25 @@ public:
   // Text functions. These are generally for debugging and reverse-engineering;
   // they use a fixed-size ASCII-only font.
 
+  // Returns the width and height of the area that draw_text would draw the given text in, not including the 1-pixel
+  // background border around it. These are the same values that draw_text returns in *width and *height.
+  template <typename... ArgTs>
+  static std::pair<ssize_t, ssize_t> measure_text(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
+    std::string text = std::format(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+    size_t num_lines = 1;
+    size_t max_line_length = 0;
+    size_t line_length = 0;
+    for (char ch : text) {
+      if (ch == '\n') {
+        num_lines++;
+        line_length = 0;
+      } else if (ch != '\r') {
+        max_line_length = std::max<size_t>(max_line_length, ++line_length);
+      }
+    }
+    return std::make_pair(max_line_length * 6, (num_lines - 1) * 8 + 7);
+  }
+
   template <typename... ArgTs>
   void draw_text(
       ssize_t x,
@@ -1599,47 +2175,66 @@ public:
 
     std::string text = std::format(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
 
-    ssize_t max_x_pos = 0;
-    ssize_t x_pos = x, y_pos = y;
-    for (size_t z = 0; z < text.size(); z++) {
-      uint8_t ch = text[z];
-      if (ch == '\r') {
-        continue;
-      }
-      if (ch == '\n') {
-        this->blend_rect(x_pos - 1, y_pos - 1, 1, 9, bg_color);
-        y_pos += 8;
-        x_pos = x;
-        if (x_pos > max_x_pos) {
-          max_x_pos = x_pos;
-        }
-        continue;
-      }
+    // For formats with whole-byte pixels, the text color is converted only once, and glyph pixels are copied directly
+    // into the image's rows
+    constexpr size_t bytes_per_pixel = PixelBuffer<Format>::BITS_PER_PIXEL >> 3;
+    constexpr bool write_direct = !(PixelBuffer<Format>::BITS_PER_PIXEL & 7);
+    alignas(typename PixelBuffer<Format>::DataT) uint8_t encoded_color[write_direct ? bytes_per_pixel : 1];
+    if constexpr (write_direct) {
+      PixelBuffer<Format>::encode_row_rgba8888(
+          &text_color, reinterpret_cast<typename PixelBuffer<Format>::DataT*>(encoded_color), 1);
+    }
 
-      if (ch < 0x20 || ch > 0x7F) {
-        ch = 0x7F;
+    ssize_t max_line_width = 0;
+    ssize_t y_pos = y;
+    for (size_t line_start = 0; line_start <= text.size(); y_pos += 8) {
+      size_t line_end = text.find('\n', line_start);
+      if (line_end == std::string::npos) {
+        line_end = text.size();
       }
-      ch -= 0x20;
 
-      this->blend_rect(x_pos - 1, y_pos - 1, 6, 9, bg_color);
-      for (ssize_t yy = 0; yy < 7; yy++) {
-        for (ssize_t xx = 0; xx < 5; xx++) {
-          if (font[ch][yy * 5 + xx] && this->check(x_pos + xx, y_pos + yy)) {
-            this->write(x_pos + xx, y_pos + yy, text_color);
+      // Draw the background for the entire line at once, then draw the glyphs over it
+      ssize_t line_width = 6 * (line_end - line_start - std::count(text.begin() + line_start, text.begin() + line_end, '\r'));
+      this->blend_rect(x - 1, y_pos - 1, line_width + 1, 9, bg_color);
+      max_line_width = std::max<ssize_t>(max_line_width, line_width);
+
+      ssize_t x_pos = x;
+      for (size_t z = line_start; z < line_end; z++) {
+        uint8_t ch = text[z];
+        if (ch == '\r') {
+          continue;
+        }
+        if (ch < 0x20 || ch > 0x7F) {
+          ch = 0x7F;
+        }
+        const auto& glyph_rows = font_rows[ch - 0x20];
+        for (ssize_t yy = 0; yy < 7; yy++) {
+          uint8_t bits = glyph_rows[yy];
+          if (!bits || (y_pos + yy < 0) || (y_pos + yy >= static_cast<ssize_t>(this->h))) {
+            continue;
+          }
+          for (ssize_t xx = 0; xx < 5; xx++) {
+            ssize_t px = x_pos + xx;
+            if ((bits & (0x10 >> xx)) && (px >= 0) && (px < static_cast<ssize_t>(this->w))) {
+              if constexpr (write_direct) {
+                memcpy(this->pixels + (y_pos + yy) * this->stride + px * bytes_per_pixel, encoded_color, bytes_per_pixel);
+              } else {
+                this->write(px, y_pos + yy, text_color);
+              }
+            }
           }
         }
+        x_pos += 6;
       }
 
-      x_pos += 6;
+      line_start = line_end + 1;
     }
 
-    this->blend_rect(x_pos - 1, y_pos - 1, 1, 9, bg_color);
-
     if (width) {
-      *width = (x_pos > max_x_pos ? x_pos : max_x_pos) - x;
+      *width = max_line_width;
     }
     if (height) {
-      *height = y_pos + 7 - y;
+      *height = y_pos - 8 + 7 - y;
     }
   }
 
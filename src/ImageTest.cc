@@ -2,14 +2,18 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <sys/time.h>
+#include <zlib.h>
 
+#include <array>
 #include <filesystem>
 #include <format>
+#include <functional>
 #include <vector>
 
 #include "Filesystem.hh"
 #include "Image.hh"
 #include "Strings.hh"
+#include "Time.hh"
 #include "UnitTest.hh"
 
 using namespace std;
@@ -97,10 +101,8 @@ void test_pixel_format(const char* format_name) {
 
     fwrite_fmt(stderr, "-- [Image:{}/{}] serialize\n", format_name, ext);
     string serialized = img.serialize(format);
-    if (format != ImageFormat::PNG) {
-      fwrite_fmt(stderr, "-- [Image:{}/{}] parse\n", format_name, ext);
-      expect_eq(Image<Format>::from_file_data(serialized), img);
-    }
+    fwrite_fmt(stderr, "-- [Image:{}/{}] parse\n", format_name, ext);
+    expect_eq(Image<Format>::from_file_data(serialized), img);
 
     string reference_filename = std::format("reference/ImageTestReference.{}.{}", format_name, ext);
     fwrite_fmt(stderr, "-- [Image:{}/{}] vs. reference\n", format_name, ext);
@@ -117,10 +119,8 @@ void test_pixel_format(const char* format_name) {
 
       fwrite_fmt(stderr, "-- [Image:{}/{}] colorized serialize\n", format_name, ext);
       string color_serialized = color_img.serialize(format);
-      if (format != ImageFormat::PNG) {
-        fwrite_fmt(stderr, "-- [Image:{}/{}] colorized parse\n", format_name, ext);
-        expect_eq(Image<PixelFormat::RGBA8888_NATIVE>::from_file_data(color_serialized), color_img);
-      }
+      fwrite_fmt(stderr, "-- [Image:{}/{}] colorized parse\n", format_name, ext);
+      expect_eq(Image<PixelFormat::RGBA8888_NATIVE>::from_file_data(color_serialized), color_img);
 
       string color_reference_filename = std::format("reference/ImageTestReference.{}.colorized.{}", format_name, ext);
       fwrite_fmt(stderr, "-- [Image:{}/{}] vs. reference\n", format_name, ext);
@@ -133,7 +133,732 @@ void test_pixel_format(const char* format_name) {
   }
 }
 
+// This is the per-pixel bilinear implementation that copy_from_with_custom used before the separable resampler was
+// added; the resampler's output should match it within 1 per channel
+static ImageRGBA8888N reference_linear_resize(const ImageRGBA8888N& source, size_t dst_w, size_t dst_h) {
+  ImageRGBA8888N ret(dst_w, dst_h);
+  size_t src_w = source.get_width();
+  size_t src_h = source.get_height();
+  for (size_t y = 0; y < dst_h; y++) {
+    double source_y_progress = (static_cast<double>(y) / (dst_h - 1)) * (src_h - 1);
+    size_t source_y1 = source_y_progress;
+    size_t source_y2 = source_y1 + 1;
+    double source_y2_factor = source_y_progress - source_y1;
+    double source_y1_factor = 1.0 - source_y2_factor;
+    for (size_t x = 0; x < dst_w; x++) {
+      double source_x_progress = (static_cast<double>(x) / (dst_w - 1)) * (src_w - 1);
+      size_t source_x1 = source_x_progress;
+      size_t source_x2 = source_x1 + 1;
+      double source_x2_factor = source_x_progress - source_x1;
+      double source_x1_factor = 1.0 - source_x2_factor;
+      uint32_t s11 = source.check(source_x1, source_y1) ? source.read(source_x1, source_y1) : 0x00000000;
+      uint32_t s12 = source.check(source_x1, source_y2) ? source.read(source_x1, source_y2) : 0x00000000;
+      uint32_t s21 = source.check(source_x2, source_y1) ? source.read(source_x2, source_y1) : 0x00000000;
+      uint32_t s22 = source.check(source_x2, source_y2) ? source.read(source_x2, source_y2) : 0x00000000;
+      uint32_t color = 0;
+      for (size_t shift = 0; shift < 32; shift += 8) {
+        uint8_t v = ((s11 >> shift) & 0xFF) * (source_x1_factor * source_y1_factor) +
+            ((s12 >> shift) & 0xFF) * (source_x1_factor * source_y2_factor) +
+            ((s21 >> shift) & 0xFF) * (source_x2_factor * source_y1_factor) +
+            ((s22 >> shift) & 0xFF) * (source_x2_factor * source_y2_factor);
+        color |= (v << shift);
+      }
+      ret.write(x, y, color);
+    }
+  }
+  return ret;
+}
+
+static void expect_colors_close(uint32_t a, uint32_t b, int tolerance) {
+  for (size_t shift = 0; shift < 32; shift += 8) {
+    int diff = static_cast<int>((a >> shift) & 0xFF) - static_cast<int>((b >> shift) & 0xFF);
+    expect_le(abs(diff), tolerance);
+  }
+}
+
+static ImageRGBA8888N make_noise_image(size_t w, size_t h) {
+  ImageRGBA8888N ret(w, h);
+  uint32_t state = 0x12345678;
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      state = state * 1103515245 + 12345;
+      ret.write(x, y, state ^ (state >> 16));
+    }
+  }
+  return ret;
+}
+
+void test_resize() {
+  ImageRGBA8888N source = make_noise_image(67, 53);
+
+  {
+    fwrite_fmt(stderr, "-- [Image] linear interpolation matches per-pixel implementation\n");
+    for (const auto& [w, h] : vector<pair<size_t, size_t>>{{150, 120}, {31, 29}, {67, 200}, {2, 2}}) {
+      ImageRGBA8888N expected = reference_linear_resize(source, w, h);
+      ImageRGBA8888N actual = source.scaled(w, h, ResizeMode::LINEAR_INTERPOLATION);
+      for (size_t y = 0; y < h; y++) {
+        for (size_t x = 0; x < w; x++) {
+          expect_colors_close(expected.read(x, y), actual.read(x, y), 1);
+        }
+      }
+    }
+  }
+
+  {
+    fwrite_fmt(stderr, "-- [Image] filters preserve solid colors\n");
+    ImageRGBA8888N solid(67, 53, 0x80C040FF);
+    for (auto mode : {ResizeMode::LINEAR_INTERPOLATION, ResizeMode::BOX, ResizeMode::BICUBIC, ResizeMode::LANCZOS}) {
+      for (const auto& [w, h] : vector<pair<size_t, size_t>>{{150, 120}, {31, 29}, {1, 1}}) {
+        ImageRGBA8888N resized = solid.scaled(w, h, mode);
+        for (size_t y = 0; y < h; y++) {
+          for (size_t x = 0; x < w; x++) {
+            expect_eq(0x80C040FF, resized.read(x, y));
+          }
+        }
+      }
+    }
+  }
+
+  {
+    fwrite_fmt(stderr, "-- [Image] box filter averages blocks when shrinking by an integer factor\n");
+    ImageRGBA8888N even_source = make_noise_image(64, 48);
+    ImageRGBA8888N resized = even_source.scaled(32, 24, ResizeMode::BOX);
+    for (size_t y = 0; y < 24; y++) {
+      for (size_t x = 0; x < 32; x++) {
+        uint32_t expected = 0;
+        for (size_t shift = 0; shift < 32; shift += 8) {
+          uint32_t sum = ((even_source.read(x * 2, y * 2) >> shift) & 0xFF) +
+              ((even_source.read(x * 2 + 1, y * 2) >> shift) & 0xFF) +
+              ((even_source.read(x * 2, y * 2 + 1) >> shift) & 0xFF) +
+              ((even_source.read(x * 2 + 1, y * 2 + 1) >> shift) & 0xFF);
+          expected |= ((sum + 2) / 4) << shift;
+        }
+        expect_colors_close(expected, resized.read(x, y), 1);
+      }
+    }
+  }
+
+  {
+    fwrite_fmt(stderr, "-- [Image] resize into a partially off-image rect\n");
+    ImageRGBA8888N dest(40, 40, 0x000000FF);
+    dest.copy_from(source, 20, 20, 50, 50, 0, 0, 67, 53, ResizeMode::BICUBIC);
+    expect_eq(0x000000FF, dest.read(19, 19));
+  }
+
+  {
+    ImageRGBA8888N large = make_noise_image(2048, 1536);
+    for (auto mode : {ResizeMode::LINEAR_INTERPOLATION, ResizeMode::BOX, ResizeMode::BICUBIC, ResizeMode::LANCZOS}) {
+      uint64_t start_time = now();
+      ImageRGBA8888N thumbnail = large.scaled(320, 240, mode);
+      uint64_t duration = now() - start_time;
+      fwrite_fmt(stderr, "-- [Image] resize 2048x1536 to 320x240 (mode {}): {} usecs ({:g} megapixels/sec)\n",
+          static_cast<int>(mode), duration, (2048.0 * 1536.0) / std::max<uint64_t>(duration, 1));
+    }
+  }
+}
+
+template <PixelFormat SourceFormat, PixelFormat DestFormat>
+void test_change_pixel_format(const char* source_name, const char* dest_name) {
+  fwrite_fmt(stderr, "-- [Image] change_pixel_format {} -> {}\n", source_name, dest_name);
+
+  // Use an odd width so the packed formats have partial bytes at the end of each row. Where possible, convert from a
+  // view so the source stride doesn't match the destination stride (views can't be made for packed formats)
+  Image<SourceFormat> source_parent = make_noise_image(77, 19).change_pixel_format<SourceFormat>();
+  Image<SourceFormat> source;
+  if constexpr (SourceFormat == PixelFormat::G1 || SourceFormat == PixelFormat::GA11) {
+    source = make_noise_image(37, 15).change_pixel_format<SourceFormat>();
+  } else {
+    source = source_parent.view(3, 2, 37, 15);
+  }
+  Image<DestFormat> converted = source.template change_pixel_format<DestFormat>();
+  Image<DestFormat> expected(37, 15);
+  for (size_t y = 0; y < 15; y++) {
+    for (size_t x = 0; x < 37; x++) {
+      expected.write(x, y, source.read(x, y));
+    }
+  }
+  expect_eq(expected, converted);
+
+  auto inverted = source.template change_pixel_format<DestFormat>([](uint32_t color) -> uint32_t {
+    return invert(color);
+  });
+  for (size_t y = 0; y < 15; y++) {
+    for (size_t x = 0; x < 37; x++) {
+      expected.write(x, y, invert(source.read(x, y)));
+    }
+  }
+  expect_eq(expected, inverted);
+}
+
+void test_change_pixel_format_all() {
+  test_change_pixel_format<PixelFormat::RGBA8888_NATIVE, PixelFormat::RGB888>("rgba8888", "rgb888");
+  test_change_pixel_format<PixelFormat::RGB888, PixelFormat::RGBA8888_NATIVE>("rgb888", "rgba8888");
+  test_change_pixel_format<PixelFormat::RGBA8888_BE, PixelFormat::BGR888>("rgba8888be", "bgr888");
+  test_change_pixel_format<PixelFormat::BGR888, PixelFormat::RGBA8888_LE>("bgr888", "rgba8888le");
+  test_change_pixel_format<PixelFormat::RGBA8888_NATIVE, PixelFormat::RGBA8888_BE>("rgba8888", "rgba8888be");
+  test_change_pixel_format<PixelFormat::ARGB8888_LE, PixelFormat::RGBA8888_BE>("argb8888le", "rgba8888be");
+  test_change_pixel_format<PixelFormat::RGB565_BE, PixelFormat::RGBA8888_NATIVE>("rgb565be", "rgba8888");
+  test_change_pixel_format<PixelFormat::RGBA8888_NATIVE, PixelFormat::RGB565_LE>("rgba8888", "rgb565le");
+  test_change_pixel_format<PixelFormat::ARGB1555_LE, PixelFormat::ARGB8888_NATIVE>("argb1555le", "argb8888");
+  test_change_pixel_format<PixelFormat::RGBA8888_NATIVE, PixelFormat::XRGB1555_BE>("rgba8888", "xrgb1555be");
+  test_change_pixel_format<PixelFormat::G8, PixelFormat::RGBA8888_NATIVE>("g8", "rgba8888");
+  test_change_pixel_format<PixelFormat::RGBA8888_NATIVE, PixelFormat::G8>("rgba8888", "g8");
+  test_change_pixel_format<PixelFormat::GA88_BE, PixelFormat::RGBA8888_LE>("ga88be", "rgba8888le");
+  test_change_pixel_format<PixelFormat::RGBA8888_NATIVE, PixelFormat::G1>("rgba8888", "g1");
+  test_change_pixel_format<PixelFormat::G1, PixelFormat::RGB888>("g1", "rgb888");
+  test_change_pixel_format<PixelFormat::RGBA8888_NATIVE, PixelFormat::GA11>("rgba8888", "ga11");
+  test_change_pixel_format<PixelFormat::GA11, PixelFormat::RGBA8888_NATIVE>("ga11", "rgba8888");
+  test_change_pixel_format<PixelFormat::RGB565_NATIVE, PixelFormat::RGB565_NATIVE>("rgb565", "rgb565");
+
+  ImageRGBA8888N large = make_noise_image(2048, 1536);
+  uint64_t start_time = now();
+  ImageRGB888 converted = large.change_pixel_format<PixelFormat::RGB888>();
+  uint64_t duration = now() - start_time;
+  fwrite_fmt(stderr, "-- [Image] change_pixel_format rgba8888 -> rgb888 (2048x1536): {} usecs\n", duration);
+}
+
+template <PixelFormat Format>
+void test_blend_format(const char* name) {
+  fwrite_fmt(stderr, "-- [Image] blend functions match per-pixel blending ({})\n", name);
+
+  // Make sure the fully-transparent and fully-opaque special cases are covered
+  ImageRGBA8888N source = make_noise_image(45, 33);
+  for (size_t y = 0; y < 33; y++) {
+    source.write(y, y, source.read(y, y) & 0xFFFFFF00);
+    source.write(y + 1, y, source.read(y + 1, y) | 0x000000FF);
+  }
+  Image<Format> orig = make_noise_image(64, 48).change_pixel_format<Format>();
+
+  auto expect_blend = [&](auto&& blend_fn, auto&& per_pixel_fn) -> void {
+    Image<Format> result = orig.copy();
+    blend_fn(result);
+    Image<Format> expected = orig.copy();
+    for (ssize_t y = 0; y < 33; y++) {
+      for (ssize_t x = 0; x < 45; x++) {
+        if (expected.check(x + 30, y + 20)) {
+          expected.write(x + 30, y + 20, per_pixel_fn(expected.read(x + 30, y + 20), source.read(x, y)));
+        }
+      }
+    }
+    expect_eq(expected, result);
+  };
+
+  expect_blend([&](Image<Format>& img) -> void {
+    img.copy_from_with_blend(source, 30, 20, 45, 33, 0, 0);
+  }, [](uint32_t dest_color, uint32_t src_color) -> uint32_t {
+    uint8_t a = get_a(src_color);
+    return (a == 0) ? dest_color : (a == 0xFF) ? src_color : alpha_blend(dest_color, src_color);
+  });
+  expect_blend([&](Image<Format>& img) -> void {
+    img.copy_from_with_alpha(source, 30, 20, 45, 33, 0, 0, 0x60);
+  }, [](uint32_t dest_color, uint32_t src_color) -> uint32_t {
+    return alpha_blend(dest_color, replace_alpha(src_color, 0x60));
+  });
+  expect_blend([&](Image<Format>& img) -> void {
+    img.copy_from_with_premultiplied_blend(source, 30, 20, 45, 33, 0, 0);
+  }, alpha_blend_premultiplied);
+  expect_blend([&](Image<Format>& img) -> void {
+    img.blend_rect(30, 20, 45, 33, 0x3080C0A0);
+  }, [](uint32_t dest_color, uint32_t) -> uint32_t {
+    return alpha_blend(dest_color, 0x3080C0A0);
+  });
+}
+
+// This is the per-character implementation that draw_text used before glyph rows were drawn directly
+template <PixelFormat Format>
+static void reference_draw_text(Image<Format>& img, ssize_t x, ssize_t y, uint32_t text_color, uint32_t bg_color, const string& text) {
+  ssize_t x_pos = x, y_pos = y;
+  for (uint8_t ch : text) {
+    if (ch == '\r') {
+      continue;
+    }
+    if (ch == '\n') {
+      img.blend_rect(x_pos - 1, y_pos - 1, 1, 9, bg_color);
+      y_pos += 8;
+      x_pos = x;
+      continue;
+    }
+    if (ch < 0x20 || ch > 0x7F) {
+      ch = 0x7F;
+    }
+    img.blend_rect(x_pos - 1, y_pos - 1, 6, 9, bg_color);
+    for (ssize_t yy = 0; yy < 7; yy++) {
+      for (ssize_t xx = 0; xx < 5; xx++) {
+        if (font[ch - 0x20][yy * 5 + xx] && img.check(x_pos + xx, y_pos + yy)) {
+          img.write(x_pos + xx, y_pos + yy, text_color);
+        }
+      }
+    }
+    x_pos += 6;
+  }
+  img.blend_rect(x_pos - 1, y_pos - 1, 1, 9, bg_color);
+}
+
+template <PixelFormat Format>
+void test_draw_text_format(const char* name) {
+  fwrite_fmt(stderr, "-- [Image] draw_text matches per-character rendering ({})\n", name);
+  Image<Format> orig = make_noise_image(100, 40).change_pixel_format<Format>();
+  // Include text that's clipped by every edge, overlapping lines, control characters, and non-ASCII characters
+  const vector<tuple<ssize_t, ssize_t, uint32_t, uint32_t, string>> cases{
+      {2, 2, 0xFFFFFFFF, 0x00000080, "Hello, world!"},
+      {-4, -3, 0x00FF00FF, 0x000000FF, "clip\r\nleft\n\ntop"},
+      {80, 30, 0xFF0000FF, 0x20408060, "right and bottom\nedges"},
+      {10, 20, 0x0000FF80, 0x00000000, "\x01\x7F\x80\xFF tab\t"},
+      {10, 20, 0x0000FF80, 0xFFFFFFFF, ""},
+  };
+  for (const auto& [x, y, text_color, bg_color, text] : cases) {
+    Image<Format> img = orig.copy();
+    ssize_t w, h;
+    img.draw_text(x, y, &w, &h, text_color, bg_color, "{}", text);
+    Image<Format> expected = orig.copy();
+    reference_draw_text(expected, x, y, text_color, bg_color, text);
+    expect_eq(expected, img);
+    auto [measured_w, measured_h] = Image<Format>::measure_text("{}", text);
+    expect_eq(measured_w, w);
+    expect_eq(measured_h, h);
+  }
+}
+
+void test_draw_text() {
+  test_draw_text_format<PixelFormat::RGBA8888_NATIVE>("rgba8888");
+  test_draw_text_format<PixelFormat::RGB888>("rgb888");
+  test_draw_text_format<PixelFormat::RGB565_BE>("rgb565be");
+  test_draw_text_format<PixelFormat::G1>("g1");
+  test_draw_text_format<PixelFormat::GA11>("ga11");
+
+  fwrite_fmt(stderr, "-- [Image] measure_text\n");
+  auto [empty_w, empty_h] = ImageRGBA8888N::measure_text("");
+  expect_eq(0, empty_w);
+  expect_eq(7, empty_h);
+  auto [line_w, line_h] = ImageRGBA8888N::measure_text("abc");
+  expect_eq(18, line_w);
+  expect_eq(7, line_h);
+  // The width is that of the longest line, not the last line
+  auto [multiline_w, multiline_h] = ImageRGBA8888N::measure_text("abc\r\n{}\nd", "efghi");
+  expect_eq(30, multiline_w);
+  expect_eq(23, multiline_h);
+
+  ImageRGBA8888N img(1024, 768, 0xFFFFFFFF);
+  uint64_t start_time = now();
+  for (size_t z = 0; z < 100000; z++) {
+    img.draw_text((z * 37) % 960, (z * 53) % 760, 0x000000FF, 0x80808040, "label {}", z);
+  }
+  uint64_t duration = now() - start_time;
+  fwrite_fmt(stderr, "-- [Image] draw_text 100000 labels: {} usecs\n", duration);
+}
+
+void test_blend() {
+  fwrite_fmt(stderr, "-- [Image] row blend functions match scalar blend functions\n");
+  uint32_t state = 0x87654321;
+  vector<uint32_t> dst_colors(0x100 * 64), src_colors(0x100 * 64);
+  for (size_t z = 0; z < dst_colors.size(); z++) {
+    state = state * 1103515245 + 12345;
+    dst_colors[z] = state ^ (state >> 13);
+    state = state * 1103515245 + 12345;
+    // Cover every alpha value, and the extreme channel values
+    src_colors[z] = (z & 0x40) ? (((state ^ (state >> 13)) & 0xFFFFFF00) | (z >> 6)) : ((z & 1) ? 0xFFFFFF00 : 0) | (z >> 6);
+  }
+
+  vector<uint32_t> result = dst_colors;
+  alpha_blend_row(result.data(), src_colors.data(), result.size());
+  for (size_t z = 0; z < result.size(); z++) {
+    uint8_t a = get_a(src_colors[z]);
+    uint32_t expected = (a == 0) ? dst_colors[z] : (a == 0xFF) ? src_colors[z] : alpha_blend(dst_colors[z], src_colors[z]);
+    expect_eq(expected, result[z]);
+  }
+
+  for (size_t alpha = 0; alpha < 0x100; alpha += 0x11) {
+    result = dst_colors;
+    alpha_blend_row(result.data(), src_colors.data(), alpha, result.size());
+    for (size_t z = 0; z < result.size(); z++) {
+      expect_eq(alpha_blend(dst_colors[z], replace_alpha(src_colors[z], alpha)), result[z]);
+    }
+  }
+
+  for (size_t z = 0; z < src_colors.size(); z += 61) {
+    result = dst_colors;
+    alpha_blend_row(result.data(), src_colors[z], result.size());
+    for (size_t w = 0; w < result.size(); w++) {
+      expect_eq(alpha_blend(dst_colors[w], src_colors[z]), result[w]);
+    }
+  }
+
+  result = dst_colors;
+  alpha_blend_premultiplied_row(result.data(), src_colors.data(), result.size());
+  for (size_t z = 0; z < result.size(); z++) {
+    expect_eq(alpha_blend_premultiplied(dst_colors[z], src_colors[z]), result[z]);
+  }
+
+  test_blend_format<PixelFormat::RGBA8888_NATIVE>("rgba8888");
+  test_blend_format<PixelFormat::RGB888>("rgb888");
+  test_blend_format<PixelFormat::ARGB1555_BE>("argb1555be");
+  test_blend_format<PixelFormat::GA11>("ga11");
+
+  ImageRGBA8888N large = make_noise_image(2048, 1536);
+  ImageRGBA8888N overlay = make_noise_image(2048, 1536);
+  uint64_t start_time = now();
+  large.copy_from_with_blend(overlay, 0, 0, 2048, 1536, 0, 0);
+  uint64_t duration = now() - start_time;
+  fwrite_fmt(stderr, "-- [Image] copy_from_with_blend 2048x1536: {} usecs ({:g} megapixels/sec)\n",
+      duration, (2048.0 * 1536.0) / std::max<uint64_t>(duration, 1));
+  start_time = now();
+  large.blend_rect(0, 0, 2048, 1536, 0x3080C0A0);
+  duration = now() - start_time;
+  fwrite_fmt(stderr, "-- [Image] blend_rect 2048x1536: {} usecs ({:g} megapixels/sec)\n",
+      duration, (2048.0 * 1536.0) / std::max<uint64_t>(duration, 1));
+}
+
+// Encodes a PNG image without using Image::serialize, so the decoder can be tested with all color types, bit depths,
+// filter types, and interlacing. sample_fn(x, y, channel) returns the raw sample value for each channel of a pixel. The
+// filter type for each row is chosen in rotation.
+static string encode_test_png(
+    size_t w,
+    size_t h,
+    uint8_t bit_depth,
+    uint8_t color_type,
+    bool interlaced,
+    function<uint16_t(size_t, size_t, size_t)> sample_fn,
+    const vector<pair<string, string>>& extra_chunks = {}) {
+  static const size_t channels_for_color_type[7] = {1, 0, 3, 1, 2, 0, 4};
+  size_t channels = channels_for_color_type[color_type];
+  size_t bits_per_pixel = channels * bit_depth;
+  size_t bpp = max<size_t>(bits_per_pixel / 8, 1);
+
+  vector<array<size_t, 4>> passes;
+  if (interlaced) {
+    passes = {{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4}, {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}};
+  } else {
+    passes = {{0, 0, 1, 1}};
+  }
+
+  string raw_data;
+  size_t row_index = 0;
+  for (const auto& [x_offset, y_offset, x_step, y_step] : passes) {
+    size_t pass_w = (w > x_offset) ? ((w - x_offset + x_step - 1) / x_step) : 0;
+    size_t pass_h = (h > y_offset) ? ((h - y_offset + y_step - 1) / y_step) : 0;
+    if (!pass_w || !pass_h) {
+      continue;
+    }
+    size_t row_size = (pass_w * bits_per_pixel + 7) / 8;
+    string prev_row(row_size, '\0');
+    for (size_t py = 0; py < pass_h; py++) {
+      string row(row_size, '\0');
+      for (size_t px = 0; px < pass_w; px++) {
+        for (size_t c = 0; c < channels; c++) {
+          uint16_t sample = sample_fn(x_offset + px * x_step, y_offset + py * y_step, c);
+          size_t bit_offset = (px * channels + c) * bit_depth;
+          if (bit_depth == 16) {
+            row[bit_offset / 8] = sample >> 8;
+            row[bit_offset / 8 + 1] = sample;
+          } else {
+            row[bit_offset / 8] |= sample << (8 - bit_depth - (bit_offset % 8));
+          }
+        }
+      }
+
+      uint8_t filter_type = (row_index++) % 5;
+      raw_data.push_back(filter_type);
+      for (size_t z = 0; z < row_size; z++) {
+        uint8_t a = (z >= bpp) ? row[z - bpp] : 0;
+        uint8_t b = prev_row[z];
+        uint8_t c = (z >= bpp) ? prev_row[z - bpp] : 0;
+        uint8_t predicted = 0;
+        if (filter_type == 1) {
+          predicted = a;
+        } else if (filter_type == 2) {
+          predicted = b;
+        } else if (filter_type == 3) {
+          predicted = (a + b) / 2;
+        } else if (filter_type == 4) {
+          int p = a + b - c;
+          int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+          predicted = (pa <= pb && pa <= pc) ? a : ((pb <= pc) ? b : c);
+        }
+        raw_data.push_back(static_cast<uint8_t>(row[z] - predicted));
+      }
+      prev_row = std::move(row);
+    }
+  }
+
+  StringWriter w_data;
+  auto write_chunk = [&](const char* type, const string& data) {
+    w_data.put_u32b(data.size());
+    w_data.write(type, 4);
+    w_data.write(data);
+    uint32_t crc = ::crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+    crc = ::crc32(crc, reinterpret_cast<const Bytef*>(data.data()), data.size());
+    w_data.put_u32b(crc);
+  };
+  w_data.write("\x89PNG\r\n\x1A\n", 8);
+  StringWriter ihdr;
+  ihdr.put_u32b(w);
+  ihdr.put_u32b(h);
+  ihdr.put_u8(bit_depth);
+  ihdr.put_u8(color_type);
+  ihdr.put_u8(0);
+  ihdr.put_u8(0);
+  ihdr.put_u8(interlaced ? 1 : 0);
+  write_chunk("IHDR", ihdr.str());
+  for (const auto& [type, data] : extra_chunks) {
+    write_chunk(type.c_str(), data);
+  }
+
+  uLongf compressed_size = compressBound(raw_data.size());
+  string compressed(compressed_size, '\0');
+  compress2(reinterpret_cast<Bytef*>(compressed.data()), &compressed_size,
+      reinterpret_cast<const Bytef*>(raw_data.data()), raw_data.size(), 6);
+  compressed.resize(compressed_size);
+  // Split the compressed data across several IDAT chunks, to make sure the decoder handles rows that span chunks
+  for (size_t offset = 0; offset < compressed.size(); offset += 37) {
+    write_chunk("IDAT", compressed.substr(offset, 37));
+  }
+  write_chunk("IEND", "");
+  return std::move(w_data.str());
+}
+
+void test_png_decode() {
+  static const size_t w = 37;
+  static const size_t h = 23;
+  auto noise = [](size_t x, size_t y, size_t c) -> uint16_t {
+    uint64_t v = (((x << 16) | (y << 2) | c) + 1) * 0x9E3779B97F4A7C15ULL;
+    v = (v ^ (v >> 29)) * 0xBF58476D1CE4E5B9ULL;
+    return v ^ (v >> 32);
+  };
+
+  for (bool interlaced : {false, true}) {
+    const char* interlace_str = interlaced ? "interlaced" : "non-interlaced";
+
+    for (uint8_t bit_depth : {1, 2, 4, 8, 16}) {
+      fwrite_fmt(stderr, "-- [Image] PNG decode grayscale {}-bit {}\n", bit_depth, interlace_str);
+      uint16_t mask = (1 << bit_depth) - 1;
+      uint16_t key = 1 & mask;
+      StringWriter trns;
+      trns.put_u16b(key);
+      string data = encode_test_png(w, h, bit_depth, 0, interlaced, [&](size_t x, size_t y, size_t c) -> uint16_t {
+        return noise(x, y, c) & mask;
+      }, {{"tRNS", trns.str()}});
+      auto img = ImageRGBA8888N::from_file_data(data);
+      expect_eq(w, img.get_width());
+      expect_eq(h, img.get_height());
+      for (size_t y = 0; y < h; y++) {
+        for (size_t x = 0; x < w; x++) {
+          uint16_t sample = noise(x, y, 0) & mask;
+          uint8_t v = (bit_depth == 16) ? (sample >> 8) : ((sample * 0xFF) / mask);
+          expect_eq(rgba8888_gray(v, (sample == key) ? 0x00 : 0xFF), img.read(x, y));
+        }
+      }
+    }
+
+    for (uint8_t bit_depth : {8, 16}) {
+      uint16_t mask = (bit_depth == 16) ? 0xFFFF : 0xFF;
+      auto expected_channel = [&](size_t x, size_t y, size_t c) -> uint8_t {
+        return (bit_depth == 16) ? (noise(x, y, c) >> 8) : (noise(x, y, c) & 0xFF);
+      };
+
+      fwrite_fmt(stderr, "-- [Image] PNG decode RGB {}-bit {}\n", bit_depth, interlace_str);
+      StringWriter trns;
+      for (size_t c = 0; c < 3; c++) {
+        trns.put_u16b(noise(5, 7, c) & mask);
+      }
+      string data = encode_test_png(w, h, bit_depth, 2, interlaced, [&](size_t x, size_t y, size_t c) -> uint16_t {
+        return noise(x, y, c) & mask;
+      }, {{"tRNS", trns.str()}});
+      auto img = ImageRGBA8888N::from_file_data(data);
+      for (size_t y = 0; y < h; y++) {
+        for (size_t x = 0; x < w; x++) {
+          bool is_key = ((noise(x, y, 0) & mask) == (noise(5, 7, 0) & mask)) &&
+              ((noise(x, y, 1) & mask) == (noise(5, 7, 1) & mask)) &&
+              ((noise(x, y, 2) & mask) == (noise(5, 7, 2) & mask));
+          uint8_t a = is_key ? 0x00 : 0xFF;
+          expect_eq(rgba8888(expected_channel(x, y, 0), expected_channel(x, y, 1), expected_channel(x, y, 2), a),
+              img.read(x, y));
+        }
+      }
+
+      fwrite_fmt(stderr, "-- [Image] PNG decode grayscale+alpha {}-bit {}\n", bit_depth, interlace_str);
+      data = encode_test_png(w, h, bit_depth, 4, interlaced, [&](size_t x, size_t y, size_t c) -> uint16_t {
+        return noise(x, y, c) & mask;
+      });
+      img = ImageRGBA8888N::from_file_data(data);
+      for (size_t y = 0; y < h; y++) {
+        for (size_t x = 0; x < w; x++) {
+          expect_eq(rgba8888_gray(expected_channel(x, y, 0), expected_channel(x, y, 1)), img.read(x, y));
+        }
+      }
+
+      fwrite_fmt(stderr, "-- [Image] PNG decode RGBA {}-bit {}\n", bit_depth, interlace_str);
+      data = encode_test_png(w, h, bit_depth, 6, interlaced, [&](size_t x, size_t y, size_t c) -> uint16_t {
+        return noise(x, y, c) & mask;
+      });
+      img = ImageRGBA8888N::from_file_data(data);
+      for (size_t y = 0; y < h; y++) {
+        for (size_t x = 0; x < w; x++) {
+          expect_eq(rgba8888(expected_channel(x, y, 0), expected_channel(x, y, 1), expected_channel(x, y, 2),
+                        expected_channel(x, y, 3)),
+              img.read(x, y));
+        }
+      }
+    }
+
+    for (uint8_t bit_depth : {1, 2, 4, 8}) {
+      fwrite_fmt(stderr, "-- [Image] PNG decode indexed {}-bit {}\n", bit_depth, interlace_str);
+      size_t num_colors = 1 << bit_depth;
+      string palette;
+      string trns;
+      for (size_t z = 0; z < num_colors; z++) {
+        palette.push_back(z * 3);
+        palette.push_back(z * 5);
+        palette.push_back(z * 7);
+        if (z < num_colors / 2) {
+          trns.push_back(z * 11);
+        }
+      }
+      string data = encode_test_png(w, h, bit_depth, 3, interlaced, [&](size_t x, size_t y, size_t c) -> uint16_t {
+        return noise(x, y, c) & (num_colors - 1);
+      }, {{"PLTE", palette}, {"tRNS", trns}});
+      auto img = ImageRGBA8888N::from_file_data(data);
+      for (size_t y = 0; y < h; y++) {
+        for (size_t x = 0; x < w; x++) {
+          size_t index = noise(x, y, 0) & (num_colors - 1);
+          uint8_t a = (index < num_colors / 2) ? (index * 11) : 0xFF;
+          expect_eq(rgba8888(index * 3, index * 5, index * 7, a), img.read(x, y));
+        }
+      }
+    }
+  }
+
+  {
+    fwrite_fmt(stderr, "-- [Image] PNG decode into packed pixel format\n");
+    string data = encode_test_png(w, h, 1, 0, true, [&](size_t x, size_t y, size_t c) -> uint16_t {
+      return noise(x, y, c) & 1;
+    });
+    auto img = ImageG1::from_file_data(data);
+    for (size_t y = 0; y < h; y++) {
+      for (size_t x = 0; x < w; x++) {
+        expect_eq((noise(x, y, 0) & 1) ? 0xFFFFFFFF : 0x000000FF, img.read(x, y));
+      }
+    }
+  }
+
+  {
+    fwrite_fmt(stderr, "-- [Image] PNG decode errors\n");
+    string data = encode_test_png(w, h, 8, 6, false, noise);
+    string corrupt = data;
+    corrupt[0x20] ^= 0x01; // Inside the IHDR chunk's data
+    expect_raises(runtime_error, [&]() {
+      ImageRGBA8888N::from_file_data(corrupt);
+    });
+    // Remove the IDAT chunks' data after the first one
+    string truncated = data.substr(0, 8 + 25 + 12 + 37);
+    truncated += data.substr(data.size() - 12);
+    expect_raises(runtime_error, [&]() {
+      ImageRGBA8888N::from_file_data(truncated);
+    });
+  }
+}
+
+void test_png_encode() {
+  // A smooth image with some noise, which is similar to photographic content
+  auto make_test_image = [](size_t w, size_t h) -> ImageRGBA8888N {
+    ImageRGBA8888N ret(w, h);
+    uint32_t state = 1;
+    for (size_t y = 0; y < h; y++) {
+      for (size_t x = 0; x < w; x++) {
+        state = state * 1103515245 + 12345;
+        uint8_t noise = (state >> 16) & 7;
+        ret.write(x, y, rgba8888(x / 4 + noise, y / 3 + noise, (x + y) / 8 + noise, 0xFF - (x / 8)));
+      }
+    }
+    return ret;
+  };
+
+  {
+    fwrite_fmt(stderr, "-- [Image] PNG encode options\n");
+    ImageRGBA8888N img = make_test_image(97, 61);
+    ImageRGB888 rgb_img = img.change_pixel_format<PixelFormat::RGB888>();
+    for (int level : {0, 1, 6, 9}) {
+      for (bool adaptive : {false, true}) {
+        PNGEncodeOptions options;
+        options.compression_level = level;
+        options.adaptive_filtering = adaptive;
+        expect_eq(img, ImageRGBA8888N::from_file_data(img.serialize_png(options)));
+        expect_eq(rgb_img, ImageRGB888::from_file_data(rgb_img.serialize_png(options)));
+      }
+    }
+    PNGEncodeOptions options;
+    options.compression_level = 10;
+    expect_raises(invalid_argument, [&]() {
+      img.serialize_png(options);
+    });
+  }
+
+  {
+    fwrite_fmt(stderr, "-- [Image] PNG encode in parallel strips\n");
+    ImageRGBA8888N img = make_test_image(256, 1031);
+    for (size_t num_threads : {0, 2, 3, 4}) {
+      for (bool adaptive : {false, true}) {
+        PNGEncodeOptions options;
+        options.num_threads = num_threads;
+        options.adaptive_filtering = adaptive;
+        expect_eq(img, ImageRGBA8888N::from_file_data(img.serialize_png(options)));
+      }
+    }
+  }
+
+  {
+    fwrite_fmt(stderr, "-- [Image] PNG adaptive filtering doesn't make synthetic images larger\n");
+    // This image has large flat areas, which compress better without filtering
+    ImageRGBA8888N img(200, 100, 0x000000FF);
+    img.write_rect(20, 10, 60, 30, 0xFF8040FF);
+    img.draw_text(5, 50, 0xFFFFFFFF, 0x00000000, "Synthetic image");
+    PNGEncodeOptions options;
+    string unfiltered_data = img.serialize_png(options);
+    options.adaptive_filtering = true;
+    string filtered_data = img.serialize_png(options);
+    expect_le(filtered_data.size(), unfiltered_data.size());
+    expect_eq(img, ImageRGBA8888N::from_file_data(filtered_data));
+  }
+
+  {
+    fwrite_fmt(stderr, "-- [Image] PNG encode empty image\n");
+    ImageRGBA8888N img(0, 0);
+    string data = img.serialize_png();
+    expect(data.starts_with("\x89PNG\r\n\x1A\n"));
+    PNGEncodeOptions options;
+    options.adaptive_filtering = true;
+    ImageRGBA8888N zero_width_img(0, 4);
+    data = zero_width_img.serialize_png(options);
+    expect(data.starts_with("\x89PNG\r\n\x1A\n"));
+  }
+
+  {
+    ImageRGBA8888N img = make_test_image(1024, 768);
+    auto report = [&](const char* name, const PNGEncodeOptions& options) -> void {
+      uint64_t start_time = now();
+      string data = img.serialize_png(options);
+      uint64_t duration = now() - start_time;
+      fwrite_fmt(stderr, "-- [Image] PNG encode 1024x768 ({}): {} bytes in {} usecs\n", name, data.size(), duration);
+    };
+    report("default options", PNGEncodeOptions());
+    PNGEncodeOptions options;
+    options.adaptive_filtering = true;
+    report("adaptive filtering", options);
+    options.compression_level = 1;
+    report("adaptive filtering, level 1", options);
+    options.compression_level = 9;
+    options.num_threads = 0;
+    report("adaptive filtering, all cores", options);
+  }
+}
+
 int main(int, char**) {
+  test_resize();
+  test_png_decode();
+  test_png_encode();
+  test_change_pixel_format_all();
+  test_blend();
+  test_draw_text();
+
   test_pixel_format<PixelFormat::G1>("g1");
   test_pixel_format<PixelFormat::GA11>("ga11");
   test_pixel_format<PixelFormat::G8>("g8");
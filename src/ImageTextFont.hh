@@ -2,6 +2,8 @@
 
 #include <inttypes.h>
 
+#include <array>
+
 namespace phosg {
 
 // clang-format off
@@ -681,4 +683,17 @@ inline constexpr uint8_t font[96][35] = {
 };
 // clang-format on
 
+// The same glyphs as font, with each row packed into the low 5 bits of a byte. The leftmost pixel is bit 4.
+inline constexpr auto font_rows = []() -> std::array<std::array<uint8_t, 7>, 96> {
+  std::array<std::array<uint8_t, 7>, 96> ret{};
+  for (size_t ch = 0; ch < 96; ch++) {
+    for (size_t y = 0; y < 7; y++) {
+      for (size_t x = 0; x < 5; x++) {
+        ret[ch][y] |= font[ch][y * 5 + x] ? (0x10 >> x) : 0;
+      }
+    }
+  }
+  return ret;
+}();
+
 } // namespace phosg
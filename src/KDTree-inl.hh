@@ -2,42 +2,113 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
+#include <limits>
 #include <map>
 #include <memory>
+#include <new>
+#include <queue>
 #include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "Tools.hh"
+
 namespace phosg {
 
 template <typename CoordType, typename ValueType>
 KDTree<CoordType, ValueType>::KDTree()
-    : root(nullptr),
+    : slab_next(nullptr),
+      slab_remaining(0),
+      free_head(nullptr),
+      root(nullptr),
       node_count(0) {}
 
+template <typename CoordType, typename ValueType>
+KDTree<CoordType, ValueType>::KDTree(
+    const std::vector<std::pair<CoordType, ValueType>>& items, size_t num_threads)
+    : KDTree() {
+  // all of the nodes go in a single slab, since the final size is already known
+  if (!items.empty()) {
+    this->add_slab(items.size());
+  }
+  std::vector<Node*> nodes;
+  nodes.reserve(items.size());
+  for (const auto& it : items) {
+    nodes.emplace_back(this->allocate_node(it.first, it.second));
+  }
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  this->root = KDTree::build_subtree(nodes.data(), nodes.data() + nodes.size(), 0, nullptr, num_threads);
+  this->node_count = nodes.size();
+}
+
 template <typename CoordType, typename ValueType>
 KDTree<CoordType, ValueType>::~KDTree() {
-  std::deque<Node*> to_delete;
-  to_delete.emplace_back(this->root);
-  while (!to_delete.empty()) {
-    Node* n = to_delete.front();
-    to_delete.pop_front();
+  // the slabs are freed automatically; we only need to walk the tree if the
+  // nodes have destructors that need to be called
+  if constexpr (!std::is_trivially_destructible_v<Node>) {
+    std::deque<Node*> to_delete;
+    if (this->root) {
+      to_delete.emplace_back(this->root);
+    }
+    while (!to_delete.empty()) {
+      Node* n = to_delete.front();
+      to_delete.pop_front();
 
-    if (n->before) {
-      to_delete.emplace_back(n->before);
+      if (n->before) {
+        to_delete.emplace_back(n->before);
+      }
+      if (n->after_or_equal) {
+        to_delete.emplace_back(n->after_or_equal);
+      }
+      n->~Node();
     }
-    if (n->after_or_equal) {
-      to_delete.emplace_back(n->after_or_equal);
+  }
+}
+
+template <typename CoordType, typename ValueType>
+void KDTree<CoordType, ValueType>::add_slab(size_t size) {
+  this->slabs.emplace_back(new NodeStorage[size]);
+  this->slab_next = this->slabs.back().get();
+  this->slab_remaining = size;
+}
+
+template <typename CoordType, typename ValueType>
+template <typename... Args>
+typename KDTree<CoordType, ValueType>::Node*
+KDTree<CoordType, ValueType>::allocate_node(Args&&... args) {
+  NodeStorage* storage;
+  if (this->free_head) {
+    storage = this->free_head;
+    this->free_head = *reinterpret_cast<NodeStorage**>(storage);
+  } else {
+    if (this->slab_remaining == 0) {
+      // each new slab is about as large as the entire tree so far, up to a
+      // limit, so small trees don't waste much memory and large trees don't
+      // have too many slabs
+      this->add_slab(std::clamp<size_t>(this->node_count, 0x40, 0x10000));
     }
-    delete n;
+    storage = this->slab_next++;
+    this->slab_remaining--;
   }
+  return new (storage) Node(std::forward<Args>(args)...);
+}
+
+template <typename CoordType, typename ValueType>
+void KDTree<CoordType, ValueType>::free_node(Node* n) {
+  n->~Node();
+  NodeStorage* storage = reinterpret_cast<NodeStorage*>(n);
+  *reinterpret_cast<NodeStorage**>(storage) = this->free_head;
+  this->free_head = storage;
 }
 
 template <typename CoordType, typename ValueType>
 typename KDTree<CoordType, ValueType>::Iterator
 KDTree<CoordType, ValueType>::insert(const CoordType& pt, const ValueType& v) {
-  Node* n = new Node(pt, v);
+  Node* n = this->allocate_node(pt, v);
   this->link_node(n);
   return Iterator(n);
 }
@@ -46,7 +117,7 @@ template <typename CoordType, typename ValueType>
 template <typename... Args>
 typename KDTree<CoordType, ValueType>::Iterator
 KDTree<CoordType, ValueType>::emplace(const CoordType& pt, Args&&... args) {
-  Node* n = new Node(pt, std::forward(args)...);
+  Node* n = this->allocate_node(pt, std::forward<Args>(args)...);
   this->link_node(n);
   return Iterator(n);
 }
@@ -229,6 +300,146 @@ bool KDTree<CoordType, ValueType>::exists(const CoordType& low,
   return false;
 }
 
+template <typename CoordType, typename ValueType>
+template <typename DistanceFnT, typename VisitFnT>
+void KDTree<CoordType, ValueType>::visit_nearest(
+    const CoordType& pt, DistanceFnT& dist_fn, VisitFnT&& visit_fn) const {
+  if (this->root == nullptr) {
+    return;
+  }
+
+  // each pending entry is a subtree along with a lower bound on the distance
+  // from pt to any point in that subtree
+  double threshold = std::numeric_limits<double>::infinity();
+  std::vector<std::pair<const Node*, double>> pending;
+  pending.emplace_back(this->root, 0.0);
+  while (!pending.empty()) {
+    auto [n, min_dist] = pending.back();
+    pending.pop_back();
+    if (min_dist > threshold) {
+      continue;
+    }
+
+    threshold = visit_fn(n, dist_fn(pt, n->pt));
+
+    // the subtree on the same side of the split as pt might contain points at
+    // any distance, but points on the other side can be no closer than the
+    // splitting plane. push the far side first so the near side is searched
+    // first, which makes the threshold shrink as quickly as possible
+    const Node* near_child;
+    const Node* far_child;
+    if (pt.at(n->dim) < n->pt.at(n->dim)) {
+      near_child = n->before;
+      far_child = n->after_or_equal;
+    } else {
+      near_child = n->after_or_equal;
+      far_child = n->before;
+    }
+    if (far_child) {
+      CoordType plane_pt = pt;
+      plane_pt.at(n->dim) = n->pt.at(n->dim);
+      double plane_dist = dist_fn(pt, plane_pt);
+      if (plane_dist <= threshold) {
+        pending.emplace_back(far_child, std::max(min_dist, plane_dist));
+      }
+    }
+    if (near_child) {
+      pending.emplace_back(near_child, min_dist);
+    }
+  }
+}
+
+template <typename CoordType, typename ValueType>
+template <typename DistanceFnT>
+std::pair<CoordType, ValueType> KDTree<CoordType, ValueType>::nearest(
+    const CoordType& pt, DistanceFnT dist_fn) const {
+  const Node* best = nullptr;
+  double best_dist = std::numeric_limits<double>::infinity();
+  this->visit_nearest(pt, dist_fn, [&](const Node* n, double dist) -> double {
+    if (!best || (dist < best_dist)) {
+      best = n;
+      best_dist = dist;
+    }
+    return best_dist;
+  });
+  if (!best) {
+    throw std::out_of_range("no such item");
+  }
+  return std::make_pair(best->pt, best->value);
+}
+
+template <typename CoordType, typename ValueType>
+template <typename DistanceFnT>
+std::vector<std::pair<CoordType, ValueType>> KDTree<CoordType, ValueType>::k_nearest(
+    const CoordType& pt, size_t k, DistanceFnT dist_fn) const {
+  if (k == 0) {
+    return {};
+  }
+
+  // the heap's top is the farthest of the closest k points seen so far
+  std::priority_queue<std::pair<double, const Node*>> heap;
+  this->visit_nearest(pt, dist_fn, [&](const Node* n, double dist) -> double {
+    if (heap.size() < k) {
+      heap.emplace(dist, n);
+    } else if (dist < heap.top().first) {
+      heap.pop();
+      heap.emplace(dist, n);
+    }
+    return (heap.size() < k) ? std::numeric_limits<double>::infinity() : heap.top().first;
+  });
+
+  std::vector<std::pair<CoordType, ValueType>> ret(heap.size());
+  for (size_t z = ret.size(); z > 0; z--) {
+    const Node* n = heap.top().second;
+    heap.pop();
+    ret[z - 1] = std::make_pair(n->pt, n->value);
+  }
+  return ret;
+}
+
+template <typename CoordType, typename ValueType>
+template <typename DistanceFnT>
+std::vector<std::pair<CoordType, ValueType>> KDTree<CoordType, ValueType>::within_radius(
+    const CoordType& pt, double radius, DistanceFnT dist_fn) const {
+  std::vector<std::pair<CoordType, ValueType>> ret;
+  this->visit_nearest(pt, dist_fn, [&](const Node* n, double dist) -> double {
+    if (dist <= radius) {
+      ret.emplace_back(std::make_pair(n->pt, n->value));
+    }
+    return radius;
+  });
+  return ret;
+}
+
+template <typename CoordType, typename ValueType>
+template <typename DistanceFnT>
+std::vector<std::pair<CoordType, ValueType>> KDTree<CoordType, ValueType>::nearest_batch(
+    const std::vector<CoordType>& pts, size_t num_threads, DistanceFnT dist_fn) const {
+  if (this->root == nullptr) {
+    throw std::out_of_range("no such item");
+  }
+  std::vector<std::pair<CoordType, ValueType>> ret(pts.size());
+  parallel<size_t>([&](size_t z, size_t) -> bool {
+    ret[z] = this->nearest(pts[z], dist_fn);
+    return false;
+  },
+      0, pts.size(), num_threads, nullptr);
+  return ret;
+}
+
+template <typename CoordType, typename ValueType>
+template <typename DistanceFnT>
+std::vector<std::vector<std::pair<CoordType, ValueType>>> KDTree<CoordType, ValueType>::k_nearest_batch(
+    const std::vector<CoordType>& pts, size_t k, size_t num_threads, DistanceFnT dist_fn) const {
+  std::vector<std::vector<std::pair<CoordType, ValueType>>> ret(pts.size());
+  parallel<size_t>([&](size_t z, size_t) -> bool {
+    ret[z] = this->k_nearest(pts[z], k, dist_fn);
+    return false;
+  },
+      0, pts.size(), num_threads, nullptr);
+  return ret;
+}
+
 template <typename CoordType, typename ValueType>
 size_t KDTree<CoordType, ValueType>::size() const {
   return this->node_count;
@@ -239,6 +450,63 @@ size_t KDTree<CoordType, ValueType>::depth() const {
   return this->depth_recursive(this->root, 0);
 }
 
+template <typename CoordType, typename ValueType>
+void KDTree<CoordType, ValueType>::rebalance(size_t num_threads) {
+  std::vector<Node*> nodes;
+  nodes.reserve(this->node_count);
+  this->collect_into(this->root, nodes);
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  this->root = KDTree::build_subtree(nodes.data(), nodes.data() + nodes.size(), 0, nullptr, num_threads);
+}
+
+template <typename CoordType, typename ValueType>
+typename KDTree<CoordType, ValueType>::Node*
+KDTree<CoordType, ValueType>::build_subtree(
+    Node** begin, Node** end, size_t dim, Node* parent, size_t num_threads) {
+  if (begin == end) {
+    return nullptr;
+  }
+
+  // put the median node (along this dimension) in the middle of the range.
+  // nth_element only guarantees that the nodes before it are less than or
+  // equal to it, but lookups expect all nodes in the before subtree to be
+  // strictly less, so move any nodes equal to the median to the end of the
+  // lower half and use the first of them as this subtree's root instead
+  Node** mid = begin + (end - begin) / 2;
+  std::nth_element(begin, mid, end, [dim](const Node* a, const Node* b) {
+    return a->pt.at(dim) < b->pt.at(dim);
+  });
+  auto split_value = (*mid)->pt.at(dim);
+  mid = std::partition(begin, mid, [dim, &split_value](const Node* n) {
+    return n->pt.at(dim) < split_value;
+  });
+
+  Node* n = *mid;
+  n->dim = dim;
+  n->parent = parent;
+
+  // don't bother creating tasks for small subtrees; the overhead of
+  // scheduling the task would exceed the time saved. the task group's
+  // destructor waits for the task, so if building the other half throws,
+  // the task doesn't outlive the nodes it's working on
+  size_t next_dim = (dim + 1) % CoordType::dimensions();
+  if ((num_threads > 1) && (end - begin >= 0x1000)) {
+    size_t before_threads = num_threads / 2;
+    ThreadPool::TaskGroup g(ThreadPool::shared());
+    g.run([&]() -> void {
+      n->before = KDTree::build_subtree(begin, mid, next_dim, n, before_threads);
+    });
+    n->after_or_equal = KDTree::build_subtree(mid + 1, end, next_dim, n, num_threads - before_threads);
+    g.wait();
+  } else {
+    n->before = KDTree::build_subtree(begin, mid, next_dim, n, 1);
+    n->after_or_equal = KDTree::build_subtree(mid + 1, end, next_dim, n, 1);
+  }
+  return n;
+}
+
 template <typename CoordType, typename ValueType>
 size_t KDTree<CoordType, ValueType>::depth_recursive(Node* n,
     size_t depth) {
@@ -310,14 +578,16 @@ bool KDTree<CoordType, ValueType>::delete_node(Node* n) {
   bool was_leaf_node = true;
   while (n->before || n->after_or_equal) {
     was_leaf_node = false;
-    Node* target;
-    if (n->before) {
-      target = KDTree::find_subtree_min_max(n->before, n->dim, true);
-    } else if (n->after_or_equal) {
-      target = KDTree::find_subtree_min_max(n->after_or_equal, n->dim, false);
-    } else {
-      throw std::logic_error("node is a leaf but still claims to be movable");
+    // always replace the node with the minimum from its after_or_equal
+    // subtree. using the maximum from the before subtree instead would be
+    // incorrect if there are other nodes there with the same coordinate, since
+    // they would not be strictly less than the replacement. if there's no
+    // after_or_equal subtree, move the before subtree there first
+    if (!n->after_or_equal) {
+      n->after_or_equal = n->before;
+      n->before = nullptr;
     }
+    Node* target = KDTree::find_subtree_min_max(n->after_or_equal, n->dim, false);
     n->pt = target->pt;
     n->value = std::move(target->value);
     n = target;
@@ -337,7 +607,7 @@ bool KDTree<CoordType, ValueType>::delete_node(Node* n) {
 
   // delete the (now-leaf) node
   this->node_count--;
-  delete n;
+  this->free_node(n);
 
   return was_leaf_node;
 }
@@ -533,4 +803,233 @@ KDTree<CoordType, ValueType>::end() const {
   return Iterator(nullptr);
 }
 
+template <typename CoordType, typename ValueType, size_t BucketSize>
+StaticKDTree<CoordType, ValueType, BucketSize>::StaticKDTree(const KDTree<CoordType, ValueType>& tree)
+    : StaticKDTree(std::vector<std::pair<CoordType, ValueType>>(tree.begin(), tree.end())) {}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+StaticKDTree<CoordType, ValueType, BucketSize>::StaticKDTree(std::vector<std::pair<CoordType, ValueType>> items)
+    : levels(0) {
+  // use the smallest number of levels such that no leaf bucket contains more
+  // than BucketSize points. splitting each range in half at every level
+  // guarantees that all buckets have either floor or ceil of
+  // (size / leaf count) points
+  while (((items.size() + (1ULL << this->levels) - 1) >> this->levels) > BucketSize) {
+    this->levels++;
+  }
+  size_t leaf_count = 1ULL << this->levels;
+  this->splits.resize(leaf_count - 1);
+  this->leaf_offsets.resize(leaf_count + 1);
+  this->leaf_offsets[leaf_count] = items.size();
+  this->build_subtree(items.data(), 0, items.size(), 0, 0);
+
+  for (size_t dim = 0; dim < CoordType::dimensions(); dim++) {
+    auto& dim_coords = this->coords[dim];
+    dim_coords.reserve(items.size());
+    for (const auto& it : items) {
+      dim_coords.emplace_back(it.first.at(dim));
+    }
+  }
+  this->values.reserve(items.size());
+  for (auto& it : items) {
+    this->values.emplace_back(std::move(it.second));
+  }
+}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+void StaticKDTree<CoordType, ValueType, BucketSize>::build_subtree(
+    std::pair<CoordType, ValueType>* items, size_t begin, size_t end, size_t node_index, size_t level) {
+  if (level == this->levels) {
+    this->leaf_offsets[node_index - this->splits.size()] = begin;
+    return;
+  }
+
+  // split along the dimension in which the points are most spread out
+  auto& split = this->splits[node_index];
+  split.dim = 0;
+  if (end - begin > 1) {
+    double max_spread = -1.0;
+    for (size_t dim = 0; dim < CoordType::dimensions(); dim++) {
+      auto [min_it, max_it] = std::minmax_element(items + begin, items + end, [dim](const auto& a, const auto& b) {
+        return a.first.at(dim) < b.first.at(dim);
+      });
+      double spread = static_cast<double>(max_it->first.at(dim)) - static_cast<double>(min_it->first.at(dim));
+      if (spread > max_spread) {
+        max_spread = spread;
+        split.dim = dim;
+      }
+    }
+  }
+
+  size_t mid = begin + (end - begin) / 2;
+  size_t dim = split.dim;
+  if (mid < end) {
+    std::nth_element(items + begin, items + mid, items + end, [dim](const auto& a, const auto& b) {
+      return a.first.at(dim) < b.first.at(dim);
+    });
+    split.value = items[mid].first.at(dim);
+  } else {
+    split.value = CoordValueType();
+  }
+
+  this->build_subtree(items, begin, mid, 2 * node_index + 1, level + 1);
+  this->build_subtree(items, mid, end, 2 * node_index + 2, level + 1);
+}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+CoordType StaticKDTree<CoordType, ValueType, BucketSize>::point_at(size_t index) const {
+  CoordType ret;
+  for (size_t dim = 0; dim < CoordType::dimensions(); dim++) {
+    ret.at(dim) = this->coords[dim][index];
+  }
+  return ret;
+}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+size_t StaticKDTree<CoordType, ValueType, BucketSize>::find_in_leaf(size_t leaf_index, const CoordType& pt) const {
+  size_t begin = this->leaf_offsets[leaf_index];
+  size_t count = this->leaf_offsets[leaf_index + 1] - begin;
+
+  // this is written without early exits so the compiler can vectorize it
+  uint8_t matches[BucketSize];
+  for (size_t z = 0; z < count; z++) {
+    matches[z] = 1;
+  }
+  for (size_t dim = 0; dim < CoordType::dimensions(); dim++) {
+    const CoordValueType* dim_coords = this->coords[dim].data() + begin;
+    CoordValueType v = pt.at(dim);
+    for (size_t z = 0; z < count; z++) {
+      matches[z] &= (dim_coords[z] == v);
+    }
+  }
+  for (size_t z = 0; z < count; z++) {
+    if (matches[z]) {
+      return begin + z;
+    }
+  }
+  return this->values.size();
+}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+template <typename FnT>
+bool StaticKDTree<CoordType, ValueType, BucketSize>::find_within_leaf(
+    size_t leaf_index, const CoordType& low, const CoordType& high, FnT&& fn) const {
+  size_t begin = this->leaf_offsets[leaf_index];
+  size_t count = this->leaf_offsets[leaf_index + 1] - begin;
+
+  uint8_t matches[BucketSize];
+  for (size_t z = 0; z < count; z++) {
+    matches[z] = 1;
+  }
+  for (size_t dim = 0; dim < CoordType::dimensions(); dim++) {
+    const CoordValueType* dim_coords = this->coords[dim].data() + begin;
+    CoordValueType low_v = low.at(dim);
+    CoordValueType high_v = high.at(dim);
+    for (size_t z = 0; z < count; z++) {
+      matches[z] &= (dim_coords[z] >= low_v) & (dim_coords[z] < high_v);
+    }
+  }
+  for (size_t z = 0; z < count; z++) {
+    if (matches[z] && fn(begin + z)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+template <typename FnT>
+bool StaticKDTree<CoordType, ValueType, BucketSize>::find_within(
+    const CoordType& low, const CoordType& high, FnT&& fn) const {
+  std::vector<size_t> pending;
+  pending.emplace_back(0);
+  while (!pending.empty()) {
+    size_t node_index = pending.back();
+    pending.pop_back();
+
+    if (node_index >= this->splits.size()) {
+      if (this->find_within_leaf(node_index - this->splits.size(), low, high, fn)) {
+        return true;
+      }
+      continue;
+    }
+
+    const auto& split = this->splits[node_index];
+    if (high.at(split.dim) > split.value) {
+      pending.emplace_back(2 * node_index + 2);
+    }
+    if (low.at(split.dim) <= split.value) {
+      pending.emplace_back(2 * node_index + 1);
+    }
+  }
+  return false;
+}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+const ValueType& StaticKDTree<CoordType, ValueType, BucketSize>::at(const CoordType& pt) const {
+  // points equal to a split value may be on either side of it, so we may
+  // have to look at both subtrees
+  std::vector<size_t> pending;
+  pending.emplace_back(0);
+  while (!pending.empty()) {
+    size_t node_index = pending.back();
+    pending.pop_back();
+
+    if (node_index >= this->splits.size()) {
+      size_t index = this->find_in_leaf(node_index - this->splits.size(), pt);
+      if (index < this->values.size()) {
+        return this->values[index];
+      }
+      continue;
+    }
+
+    const auto& split = this->splits[node_index];
+    if (pt.at(split.dim) >= split.value) {
+      pending.emplace_back(2 * node_index + 2);
+    }
+    if (pt.at(split.dim) <= split.value) {
+      pending.emplace_back(2 * node_index + 1);
+    }
+  }
+  throw std::out_of_range("no such item");
+}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+bool StaticKDTree<CoordType, ValueType, BucketSize>::exists(const CoordType& pt) const {
+  try {
+    this->at(pt);
+    return true;
+  } catch (const std::out_of_range&) {
+    return false;
+  }
+}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+std::vector<std::pair<CoordType, ValueType>> StaticKDTree<CoordType, ValueType, BucketSize>::within(
+    const CoordType& low, const CoordType& high) const {
+  std::vector<std::pair<CoordType, ValueType>> ret;
+  this->find_within(low, high, [&](size_t index) -> bool {
+    ret.emplace_back(std::make_pair(this->point_at(index), this->values[index]));
+    return false;
+  });
+  return ret;
+}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+bool StaticKDTree<CoordType, ValueType, BucketSize>::exists(const CoordType& low, const CoordType& high) const {
+  return this->find_within(low, high, [](size_t) -> bool {
+    return true;
+  });
+}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+size_t StaticKDTree<CoordType, ValueType, BucketSize>::size() const {
+  return this->values.size();
+}
+
+template <typename CoordType, typename ValueType, size_t BucketSize>
+size_t StaticKDTree<CoordType, ValueType, BucketSize>::depth() const {
+  return this->levels + 1;
+}
+
 } // namespace phosg
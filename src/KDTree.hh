@@ -1,14 +1,41 @@
 #pragma once
 
+#include <math.h>
 #include <stdint.h>
 #include <sys/types.h>
 
 #include <deque>
 #include <memory>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 namespace phosg {
 
+// Distance functions for use with KDTree's nearest-neighbor queries. Custom
+// distance functions may also be used; they must be callable as
+// fn(const CoordType&, const CoordType&) -> double, and must never return a
+// smaller value when any single coordinate of either point moves farther from
+// the corresponding coordinate of the other point (this is true of all L-norms,
+// for example).
+template <typename CoordType>
+struct KDTreeL2Distance {
+  double operator()(const CoordType& a, const CoordType& b) const {
+    return (a - b).norm();
+  }
+};
+
+template <typename CoordType>
+struct KDTreeL1Distance {
+  double operator()(const CoordType& a, const CoordType& b) const {
+    double ret = 0.0;
+    for (size_t dim = 0; dim < CoordType::dimensions(); dim++) {
+      ret += fabs(static_cast<double>(a.at(dim)) - static_cast<double>(b.at(dim)));
+    }
+    return ret;
+  }
+};
+
 template <typename CoordType, typename ValueType>
 class KDTree {
 private:
@@ -28,13 +55,31 @@ private:
     Node(const CoordType& pt, Args&&... args);
   };
 
+  // Nodes are allocated from slabs owned by the tree, and erased nodes are
+  // kept on a free list for reuse. This avoids a heap allocation for each
+  // insert, and if the coordinate and value types are trivially destructible,
+  // destroying the tree only needs to free the slabs.
+  struct alignas(Node) NodeStorage {
+    uint8_t data[sizeof(Node)];
+  };
+  std::vector<std::unique_ptr<NodeStorage[]>> slabs;
+  NodeStorage* slab_next;
+  size_t slab_remaining;
+  NodeStorage* free_head;
+
   Node* root;
   size_t node_count;
 
+  void add_slab(size_t size);
+  template <typename... Args>
+  Node* allocate_node(Args&&... args);
+  void free_node(Node* n);
+
   // TODO: make this not recursive
   static size_t count_subtree(const Node* n);
   static size_t depth_recursive(Node* n, size_t depth);
   void collect_into(Node* n, std::vector<Node*>& ret);
+  static Node* build_subtree(Node** begin, Node** end, size_t dim, Node* parent, size_t num_threads);
 
   void link_node(Node* new_node);
 
@@ -42,6 +87,12 @@ private:
 
   Node* find_subtree_min_max(Node* n, size_t target_dim, bool find_max);
 
+  // Calls visit_fn(node, distance) for each node that could be closer to pt
+  // than the threshold that visit_fn returns. Nodes are visited in
+  // approximately nearest-first order, so the threshold shrinks quickly.
+  template <typename DistanceFnT, typename VisitFnT>
+  void visit_nearest(const CoordType& pt, DistanceFnT& dist_fn, VisitFnT&& visit_fn) const;
+
 public:
   class Iterator {
   public:
@@ -67,6 +118,12 @@ public:
   };
 
   KDTree();
+  // Builds a balanced tree from the given points. This is much faster than
+  // calling insert() for each point, and the resulting tree's depth is
+  // O(log(n)) regardless of the order of the input points. If num_threads is
+  // greater than 1, independent subtrees are built in parallel on
+  // ThreadPool::shared(); if it's 0, the number of CPU cores is used.
+  explicit KDTree(const std::vector<std::pair<CoordType, ValueType>>& items, size_t num_threads = 1);
   ~KDTree();
 
   // TODO: be unlazy
@@ -89,13 +146,99 @@ public:
       const CoordType& high) const;
   bool exists(const CoordType& low, const CoordType& high) const;
 
+  // Returns the point closest to pt. If there are multiple points at the same
+  // distance, it is not specified which of them is returned. Throws
+  // out_of_range if the tree is empty.
+  template <typename DistanceFnT = KDTreeL2Distance<CoordType>>
+  std::pair<CoordType, ValueType> nearest(const CoordType& pt, DistanceFnT dist_fn = DistanceFnT()) const;
+  // Returns the k points closest to pt, sorted by increasing distance. If the
+  // tree contains fewer than k points, returns all of them.
+  template <typename DistanceFnT = KDTreeL2Distance<CoordType>>
+  std::vector<std::pair<CoordType, ValueType>> k_nearest(
+      const CoordType& pt, size_t k, DistanceFnT dist_fn = DistanceFnT()) const;
+  // Returns all points whose distance from pt is less than or equal to radius,
+  // in no particular order.
+  template <typename DistanceFnT = KDTreeL2Distance<CoordType>>
+  std::vector<std::pair<CoordType, ValueType>> within_radius(
+      const CoordType& pt, double radius, DistanceFnT dist_fn = DistanceFnT()) const;
+
+  // Like nearest() and k_nearest(), but answer many queries at once using
+  // multiple threads. The results are in the same order as the queries. If
+  // num_threads is 0, the number of CPU cores is used. The tree must not be
+  // modified while these functions are running.
+  template <typename DistanceFnT = KDTreeL2Distance<CoordType>>
+  std::vector<std::pair<CoordType, ValueType>> nearest_batch(
+      const std::vector<CoordType>& pts, size_t num_threads = 0, DistanceFnT dist_fn = DistanceFnT()) const;
+  template <typename DistanceFnT = KDTreeL2Distance<CoordType>>
+  std::vector<std::vector<std::pair<CoordType, ValueType>>> k_nearest_batch(
+      const std::vector<CoordType>& pts, size_t k, size_t num_threads = 0, DistanceFnT dist_fn = DistanceFnT()) const;
+
   size_t size() const;
   size_t depth() const;
 
+  // Rebuilds the tree so that it's balanced. This is useful if many points
+  // were inserted in sorted or nearly-sorted order, or many erases have made
+  // the tree lopsided. Existing nodes are reused, so this doesn't allocate
+  // any memory except for temporary storage. This invalidates all iterators.
+  void rebalance(size_t num_threads = 1);
+
   Iterator begin() const;
   Iterator end() const;
 };
 
+// An immutable KD-tree optimized for fast queries on large read-mostly
+// datasets. Unlike KDTree, there are no per-node allocations or pointers: the
+// splitting planes are stored in a single array in Eytzinger order (the
+// children of node i are 2i+1 and 2i+2), and the points are stored in buckets
+// of at most BucketSize points at the leaves. Coordinates are stored in
+// separate arrays for each dimension, so the scans over each bucket can be
+// vectorized by the compiler.
+template <typename CoordType, typename ValueType, size_t BucketSize = 32>
+class StaticKDTree {
+  static_assert(BucketSize > 0, "BucketSize must be nonzero");
+
+public:
+  using CoordValueType = std::remove_cvref_t<decltype(std::declval<const CoordType&>().at(0))>;
+
+  explicit StaticKDTree(const KDTree<CoordType, ValueType>& tree);
+  explicit StaticKDTree(std::vector<std::pair<CoordType, ValueType>> items);
+  ~StaticKDTree() = default;
+
+  const ValueType& at(const CoordType& pt) const;
+  bool exists(const CoordType& pt) const;
+  std::vector<std::pair<CoordType, ValueType>> within(const CoordType& low, const CoordType& high) const;
+  bool exists(const CoordType& low, const CoordType& high) const;
+
+  size_t size() const;
+  size_t depth() const;
+
+private:
+  struct Split {
+    CoordValueType value;
+    size_t dim;
+  };
+
+  // there are (1 << levels) leaves and (1 << levels) - 1 splits. points in
+  // the left subtree of a split have coordinates less than or equal to
+  // split.value along split.dim; points in the right subtree have coordinates
+  // greater than or equal to it
+  size_t levels;
+  std::vector<Split> splits;
+  std::vector<size_t> leaf_offsets;
+  std::vector<CoordValueType> coords[CoordType::dimensions()];
+  std::vector<ValueType> values;
+
+  void build_subtree(std::pair<CoordType, ValueType>* items, size_t begin, size_t end, size_t node_index, size_t level);
+  CoordType point_at(size_t index) const;
+  // returns the index of the first matching point, or values.size() if none
+  // match
+  size_t find_in_leaf(size_t leaf_index, const CoordType& pt) const;
+  template <typename FnT>
+  bool find_within_leaf(size_t leaf_index, const CoordType& low, const CoordType& high, FnT&& fn) const;
+  template <typename FnT>
+  bool find_within(const CoordType& low, const CoordType& high, FnT&& fn) const;
+};
+
 } // namespace phosg
 
 #include "KDTree-inl.hh"
@@ -4,9 +4,12 @@
 #include <stdio.h>
 #include <time.h>
 
+#include <algorithm>
+#include <map>
 #include <set>
 #include <string>
 
+#include "Time.hh"
 #include "UnitTest.hh"
 #include "Vector.hh"
 
@@ -206,9 +209,295 @@ void run_basic_test() {
   }
 }
 
+void run_bulk_build_test() {
+  fwrite_fmt(stdout, "-- bulk build\n");
+
+  // points along a diagonal line make insert() produce a completely degenerate
+  // tree, since every point goes into the after_or_equal subtree
+  vector<pair<Vector2<int64_t>, int64_t>> items;
+  for (int64_t z = 0; z < 0x1000; z++) {
+    items.emplace_back(make_pair(Vector2<int64_t>(z, z), z));
+  }
+  // add some duplicate coordinates along each dimension too
+  for (int64_t z = 0; z < 0x100; z++) {
+    items.emplace_back(make_pair(Vector2<int64_t>(z, 0x80), z + 0x1000));
+    items.emplace_back(make_pair(Vector2<int64_t>(0x80, z), z + 0x1100));
+  }
+
+  auto check_tree = [&](const KDTree<Vector2<int64_t>, int64_t>& t) {
+    expect_eq(items.size(), t.size());
+    for (const auto& it : items) {
+      expect(t.exists(it.first));
+    }
+    expect(!t.exists({0x1000, 0x1000}));
+    expect_eq(0x1FF, t.at({0x1FF, 0x1FF}));
+
+    set<int64_t> remaining_values;
+    for (const auto& it : items) {
+      if ((it.first.x >= 0x40) && (it.first.x < 0xC0) && (it.first.y >= 0x60) && (it.first.y < 0x100)) {
+        remaining_values.emplace(it.second);
+      }
+    }
+    for (const auto& it : t.within({0x40, 0x60}, {0xC0, 0x100})) {
+      expect_eq(1, remaining_values.erase(it.second));
+    }
+    expect_eq(0, remaining_values.size());
+  };
+
+  for (size_t num_threads : {1, 4}) {
+    fwrite_fmt(stdout, "--   construction ({} threads)\n", num_threads);
+    KDTree<Vector2<int64_t>, int64_t> t(items, num_threads);
+    fwrite_fmt(stderr, "--     tree: size={}, depth={}\n", t.size(), t.depth());
+    expect_le(t.depth(), 20);
+    check_tree(t);
+  }
+
+  fwrite_fmt(stdout, "--   rebalance\n");
+  {
+    KDTree<Vector2<int64_t>, int64_t> t;
+    for (const auto& it : items) {
+      t.insert(it.first, it.second);
+    }
+    fwrite_fmt(stderr, "--     before: size={}, depth={}\n", t.size(), t.depth());
+    expect_ge(t.depth(), 0x1000);
+    t.rebalance();
+    fwrite_fmt(stderr, "--     after: size={}, depth={}\n", t.size(), t.depth());
+    expect_le(t.depth(), 20);
+    check_tree(t);
+
+    // parent links must be correct for erase to work after rebalancing
+    for (int64_t z = 0; z < 0x1000; z += 2) {
+      expect(t.erase({z, z}, z));
+    }
+    expect_eq(items.size() - 0x800, t.size());
+    for (int64_t z = 1; z < 0x1000; z += 2) {
+      expect(t.exists({z, z}));
+      expect(!t.exists({z - 1, z - 1}) || (z - 1 == 0x80));
+    }
+  }
+
+  fwrite_fmt(stdout, "--   empty\n");
+  {
+    KDTree<Vector2<int64_t>, int64_t> t(vector<pair<Vector2<int64_t>, int64_t>>{});
+    expect_eq(0, t.size());
+    expect(!t.exists({0, 0}));
+    t.rebalance();
+    expect_eq(0, t.size());
+  }
+}
+
+template <typename DistanceFnT>
+void run_nearest_test(const char* distance_name) {
+  fwrite_fmt(stdout, "-- nearest ({})\n", distance_name);
+
+  DistanceFnT dist_fn;
+  vector<pair<Vector2<int64_t>, int64_t>> items;
+  for (size_t z = 0; z < 1000000; z++) {
+    items.emplace_back(make_pair(Vector2<int64_t>(rand() % 100000, rand() % 100000), z));
+  }
+  KDTree<Vector2<int64_t>, int64_t> t(items);
+
+  vector<Vector2<int64_t>> queries;
+  for (size_t z = 0; z < 200; z++) {
+    queries.emplace_back(rand() % 120000 - 10000, rand() % 120000 - 10000);
+  }
+
+  auto closest_distances = [&](const Vector2<int64_t>& q) -> vector<double> {
+    vector<double> ret;
+    for (const auto& it : items) {
+      ret.emplace_back(dist_fn(q, it.first));
+    }
+    // only the closest few are needed
+    partial_sort(ret.begin(), ret.begin() + 64, ret.end());
+    return ret;
+  };
+
+  // brute-force search over 1M points takes a long time in unoptimized builds, so only the first few queries are
+  // checked against it; the tree answers all of them
+  static constexpr size_t NUM_CHECKED_QUERIES = 20;
+
+  fwrite_fmt(stdout, "--   nearest/k_nearest/within_radius\n");
+  uint64_t brute_force_time = 0;
+  uint64_t tree_time = 0;
+  for (size_t query_index = 0; query_index < queries.size(); query_index++) {
+    const auto& q = queries[query_index];
+    uint64_t start = now();
+    auto nearest = t.nearest(q, dist_fn);
+    tree_time += now() - start;
+    expect_eq(nearest.second, t.at(nearest.first));
+    auto k_nearest = t.k_nearest(q, 10, dist_fn);
+    expect_eq(10, k_nearest.size());
+    if (query_index >= NUM_CHECKED_QUERIES) {
+      continue;
+    }
+
+    start = now();
+    auto expected_distances = closest_distances(q);
+    brute_force_time += now() - start;
+
+    expect_eq(expected_distances[0], dist_fn(q, nearest.first));
+    for (size_t z = 0; z < k_nearest.size(); z++) {
+      expect_eq(expected_distances[z], dist_fn(q, k_nearest[z].first));
+    }
+
+    double radius = expected_distances[50];
+    auto in_radius = t.within_radius(q, radius, dist_fn);
+    size_t expected_count = count_if(expected_distances.begin(), expected_distances.end(), [&](double d) {
+      return d <= radius;
+    });
+    expect_eq(expected_count, in_radius.size());
+    for (const auto& it : in_radius) {
+      expect_le(dist_fn(q, it.first), radius);
+    }
+  }
+  fwrite_fmt(stderr, "--     {} points; per query: brute force time: {}, tree time: {}\n", items.size(),
+      brute_force_time / NUM_CHECKED_QUERIES, tree_time / queries.size());
+
+  fwrite_fmt(stdout, "--   batch\n");
+  auto nearest_results = t.nearest_batch(queries, 4, dist_fn);
+  auto k_nearest_results = t.k_nearest_batch(queries, 5, 4, dist_fn);
+  expect_eq(queries.size(), nearest_results.size());
+  expect_eq(queries.size(), k_nearest_results.size());
+  for (size_t z = 0; z < queries.size(); z++) {
+    expect_eq(dist_fn(queries[z], t.nearest(queries[z], dist_fn).first), dist_fn(queries[z], nearest_results[z].first));
+    auto k_nearest = t.k_nearest(queries[z], 5, dist_fn);
+    expect_eq(5, k_nearest_results[z].size());
+    for (size_t x = 0; x < 5; x++) {
+      expect_eq(dist_fn(queries[z], k_nearest[x].first), dist_fn(queries[z], k_nearest_results[z][x].first));
+    }
+  }
+
+  fwrite_fmt(stdout, "--   edge cases\n");
+  expect_eq(items.size(), t.k_nearest({0, 0}, items.size() + 10, dist_fn).size());
+  expect_eq(0, t.k_nearest({0, 0}, 0, dist_fn).size());
+  KDTree<Vector2<int64_t>, int64_t> empty_t;
+  expect_raises(out_of_range, [&]() {
+    empty_t.nearest({0, 0}, dist_fn);
+  });
+  expect_eq(0, empty_t.k_nearest({0, 0}, 5, dist_fn).size());
+  expect_eq(0, empty_t.within_radius({0, 0}, 100.0, dist_fn).size());
+}
+
+void run_static_test() {
+  fwrite_fmt(stdout, "-- static\n");
+
+  fwrite_fmt(stdout, "--   construction\n");
+  KDTree<Vector3<int64_t>, int64_t> t;
+  for (size_t z = 0; z < 10000; z++) {
+    t.insert({rand() % 100, rand() % 100, rand() % 100}, z);
+  }
+  // make sure some buckets are full of identical points
+  for (size_t z = 0; z < 100; z++) {
+    t.insert({50, 50, 50}, z + 10000);
+  }
+  StaticKDTree<Vector3<int64_t>, int64_t> st(t);
+  StaticKDTree<Vector3<int64_t>, int64_t, 4> st4(vector<pair<Vector3<int64_t>, int64_t>>(t.begin(), t.end()));
+  expect_eq(t.size(), st.size());
+  expect_eq(t.size(), st4.size());
+  fwrite_fmt(stderr, "--     trees: size={}, depth={}, depth4={}\n", st.size(), st.depth(), st4.depth());
+
+  auto check_tree = [&](const auto& st) {
+    fwrite_fmt(stdout, "--   at/exists\n");
+    // at() may return any of the values for a duplicated point
+    map<Vector3<int64_t>, set<int64_t>> point_values;
+    for (const auto& it : t) {
+      point_values[it.first].emplace(it.second);
+    }
+    for (const auto& it : point_values) {
+      expect(st.exists(it.first));
+      expect_eq(1, it.second.count(st.at(it.first)));
+    }
+    expect(!st.exists({100, 0, 0}));
+    expect(!st.exists({-1, 50, 50}));
+    expect_raises(out_of_range, [&]() {
+      st.at({100, 100, 100});
+    });
+
+    fwrite_fmt(stdout, "--   within\n");
+    for (size_t z = 0; z < 100; z++) {
+      Vector3<int64_t> low(rand() % 110 - 5, rand() % 110 - 5, rand() % 110 - 5);
+      Vector3<int64_t> high = low + Vector3<int64_t>(rand() % 40, rand() % 40, rand() % 40);
+      set<int64_t> expected_values;
+      if (t.exists(low, high)) {
+        for (const auto& it : t.within(low, high)) {
+          expected_values.emplace(it.second);
+        }
+      }
+      expect_eq(!expected_values.empty(), st.exists(low, high));
+      for (const auto& it : st.within(low, high)) {
+        expect_eq(1, point_values.at(it.first).count(it.second));
+        expect_eq(1, expected_values.erase(it.second));
+      }
+      expect_eq(0, expected_values.size());
+    }
+  };
+  check_tree(st);
+  check_tree(st4);
+
+  fwrite_fmt(stdout, "--   empty\n");
+  StaticKDTree<Vector3<int64_t>, int64_t> empty_st(vector<pair<Vector3<int64_t>, int64_t>>{});
+  expect_eq(0, empty_st.size());
+  expect(!empty_st.exists({0, 0, 0}));
+  expect(!empty_st.exists({0, 0, 0}, {100, 100, 100}));
+  expect_eq(0, empty_st.within({0, 0, 0}, {100, 100, 100}).size());
+}
+
+void run_node_allocation_test() {
+  fwrite_fmt(stdout, "-- node allocation\n");
+
+  // values with nontrivial destructors require walking the tree when it's
+  // destroyed; trivial values don't
+  {
+    KDTree<Vector2<int64_t>, string> t;
+    for (int64_t z = 0; z < 1000; z++) {
+      t.insert({z % 37, z / 37}, string(z % 100, 'x'));
+    }
+    for (int64_t z = 0; z < 1000; z += 3) {
+      expect(t.erase({z % 37, z / 37}, string(z % 100, 'x')));
+    }
+    // these reuse the erased nodes
+    for (int64_t z = 0; z < 1000; z += 3) {
+      t.insert({z % 37, z / 37}, string(z % 50, 'y'));
+    }
+    expect_eq(1000, t.size());
+    for (int64_t z = 0; z < 1000; z++) {
+      expect_eq(string(z % ((z % 3) ? 100 : 50), (z % 3) ? 'x' : 'y'), t.at({z % 37, z / 37}));
+    }
+  }
+
+  uint64_t start = now();
+  {
+    KDTree<Vector2<int64_t>, int64_t> t;
+    for (int64_t z = 0; z < 200000; z++) {
+      t.insert({rand(), rand()}, z);
+    }
+    uint64_t insert_end = now();
+    fwrite_fmt(stderr, "--   insert time: {}\n", insert_end - start);
+
+    size_t erased = 0;
+    for (auto it = t.begin(); it != t.end();) {
+      if (it->second & 1) {
+        t.erase_advance(it);
+        erased++;
+      } else {
+        ++it;
+      }
+    }
+    expect_eq(200000 - erased, t.size());
+    start = now();
+    fwrite_fmt(stderr, "--   erase time: {}\n", start - insert_end);
+  }
+  fwrite_fmt(stderr, "--   destroy time: {}\n", now() - start);
+}
+
 int main(int, char**) {
   run_basic_test();
   run_randomized_test();
+  run_bulk_build_test();
+  run_nearest_test<KDTreeL2Distance<Vector2<int64_t>>>("L2");
+  run_nearest_test<KDTreeL1Distance<Vector2<int64_t>>>("L1");
+  run_static_test();
+  run_node_allocation_test();
   fwrite_fmt(stdout, "KDTreeTest: all tests passed\n");
   return 0;
 }
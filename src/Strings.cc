@@ -1,6 +1,7 @@
 #include "Strings.hh"
 
 #define _STDC_FORMAT_MACROS
+#include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -8,10 +9,17 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include <array>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
 #include <format>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "Platform.hh"
@@ -65,64 +73,154 @@ string str_replace_all(const string& s, const char* target, const char* replacem
   return ret;
 }
 
-string escape_quotes(const string& s) {
-  string ret;
-  for (size_t x = 0; x < s.size(); x++) {
-    char ch = s[x];
-    if (ch == '\"') {
-      ret += "\\\"";
-    } else if (ch < 0x20 || ch > 0x7E) {
-      ret += std::format("\\x{:02X}", static_cast<uint8_t>(ch));
-    } else {
-      ret += ch;
+// Each escape function is described by a table giving the escaped size of each byte (1 if the byte isn't escaped). The
+// output size is computed from the table first, so the output is allocated once, then runs of bytes that don't need
+// escaping are copied in bulk.
+using EscapeSizeTable = std::array<uint8_t, 0x100>;
+
+template <typename NeedsHexEscapeFnT>
+static constexpr EscapeSizeTable make_escape_size_table(
+    const char* named_escapes, size_t hex_escape_size, NeedsHexEscapeFnT&& needs_hex_escape) {
+  EscapeSizeTable ret{};
+  for (size_t z = 0; z < 0x100; z++) {
+    char ch = static_cast<char>(z);
+    ret[z] = 1;
+    for (const char* n = named_escapes; *n; n++) {
+      if (*n == ch) {
+        ret[z] = 2;
+      }
+    }
+    if ((ret[z] == 1) && needs_hex_escape(ch)) {
+      ret[z] = hex_escape_size;
     }
   }
   return ret;
 }
 
-string escape_controls(const string& s, bool escape_non_ascii) {
-  string ret;
-  for (size_t x = 0; x < s.size(); x++) {
-    char ch = s[x];
-    if (ch == '\"') {
-      ret += "\\\"";
-    } else if (ch == '\'') {
-      ret += "\\\'";
-    } else if (ch == '\\') {
-      ret += "\\\\";
-    } else if (ch == '\t') {
-      ret += "\\t";
-    } else if (ch == '\r') {
-      ret += "\\r";
-    } else if (ch == '\n') {
-      ret += "\\n";
-    } else if (ch == '\f') {
-      ret += "\\f";
-    } else if (ch == '\b') {
-      ret += "\\b";
-    } else if (ch == '\a') {
-      ret += "\\a";
-    } else if (ch == '\v') {
-      ret += "\\v";
-    } else if (escape_non_ascii ? (ch < 0x20 || ch > 0x7E) : (!(ch & 0x80) && ((ch < 0x20) || ch == 0x7F))) {
-      ret += std::format("\\x{:02X}", static_cast<uint8_t>(ch));
-    } else {
-      ret += ch;
+static constexpr char QUOTES_NAMED_ESCAPES[] = "\"";
+static constexpr char CONTROLS_NAMED_ESCAPES[] = "\"\'\\\t\r\n\f\b\a\v";
+static constexpr EscapeSizeTable QUOTES_ESCAPE_SIZES = make_escape_size_table(
+    QUOTES_NAMED_ESCAPES, 4, [](char ch) { return ch < 0x20 || ch > 0x7E; });
+static constexpr EscapeSizeTable CONTROLS_ASCII_ESCAPE_SIZES = make_escape_size_table(
+    CONTROLS_NAMED_ESCAPES, 4, [](char ch) { return ch < 0x20 || ch > 0x7E; });
+static constexpr EscapeSizeTable CONTROLS_UTF8_ESCAPE_SIZES = make_escape_size_table(
+    CONTROLS_NAMED_ESCAPES, 4, [](char ch) { return !(ch & 0x80) && ((ch < 0x20) || ch == 0x7F); });
+static constexpr auto is_url_safe_char = [](char ch) -> bool {
+  return ((ch >= '0') && (ch <= '9')) || ((ch >= 'A') && (ch <= 'Z')) || ((ch >= 'a') && (ch <= 'z')) ||
+      (ch == '-') || (ch == '_') || (ch == '.') || (ch == '~') || (ch == '=') || (ch == '&');
+};
+static constexpr EscapeSizeTable URL_ESCAPE_SIZES = make_escape_size_table(
+    "", 3, [](char ch) { return !is_url_safe_char(ch) && (ch != '/'); });
+static constexpr EscapeSizeTable URL_ESCAPE_SLASH_SIZES = make_escape_size_table(
+    "", 3, [](char ch) { return !is_url_safe_char(ch); });
+
+template <typename WriteEscapeFnT>
+static void escape_append_inner(
+    string& out, string_view s, const EscapeSizeTable& sizes, WriteEscapeFnT&& write_escape) {
+  size_t escaped_size = 0;
+  for (char ch : s) {
+    escaped_size += sizes[static_cast<uint8_t>(ch)];
+  }
+  if (escaped_size == s.size()) {
+    out.append(s);
+    return;
+  }
+
+  size_t out_offset = out.size();
+  out.resize(out_offset + escaped_size);
+  char* dest = out.data() + out_offset;
+  for (size_t z = 0; z < s.size();) {
+    size_t run_start = z;
+    while ((z < s.size()) && (sizes[static_cast<uint8_t>(s[z])] == 1)) {
+      z++;
+    }
+    memcpy(dest, s.data() + run_start, z - run_start);
+    dest += (z - run_start);
+    if (z < s.size()) {
+      dest = write_escape(dest, s[z++]);
     }
   }
+}
+
+static constexpr char UPPERCASE_HEX_DIGITS[] = "0123456789ABCDEF";
+
+static char* write_hex_escape(char* dest, char prefix, char ch) {
+  *(dest++) = prefix;
+  *(dest++) = UPPERCASE_HEX_DIGITS[static_cast<uint8_t>(ch) >> 4];
+  *(dest++) = UPPERCASE_HEX_DIGITS[static_cast<uint8_t>(ch) & 0x0F];
+  return dest;
+}
+
+void escape_quotes_append(string& out, string_view s) {
+  escape_append_inner(out, s, QUOTES_ESCAPE_SIZES, [](char* dest, char ch) -> char* {
+    *(dest++) = '\\';
+    if (ch == '\"') {
+      *(dest++) = '\"';
+      return dest;
+    }
+    return write_hex_escape(dest, 'x', ch);
+  });
+}
+
+void escape_controls_append(string& out, string_view s, bool escape_non_ascii) {
+  escape_append_inner(
+      out, s, escape_non_ascii ? CONTROLS_ASCII_ESCAPE_SIZES : CONTROLS_UTF8_ESCAPE_SIZES,
+      [](char* dest, char ch) -> char* {
+        *(dest++) = '\\';
+        switch (ch) {
+          case '\"':
+          case '\'':
+          case '\\':
+            *(dest++) = ch;
+            return dest;
+          case '\t':
+            *(dest++) = 't';
+            return dest;
+          case '\r':
+            *(dest++) = 'r';
+            return dest;
+          case '\n':
+            *(dest++) = 'n';
+            return dest;
+          case '\f':
+            *(dest++) = 'f';
+            return dest;
+          case '\b':
+            *(dest++) = 'b';
+            return dest;
+          case '\a':
+            *(dest++) = 'a';
+            return dest;
+          case '\v':
+            *(dest++) = 'v';
+            return dest;
+          default:
+            return write_hex_escape(dest, 'x', ch);
+        }
+      });
+}
+
+void escape_url_append(string& out, string_view s, bool escape_slash) {
+  escape_append_inner(out, s, escape_slash ? URL_ESCAPE_SLASH_SIZES : URL_ESCAPE_SIZES, [](char* dest, char ch) -> char* {
+    return write_hex_escape(dest, '%', ch);
+  });
+}
+
+string escape_quotes(const string& s) {
+  string ret;
+  escape_quotes_append(ret, s);
+  return ret;
+}
+
+string escape_controls(const string& s, bool escape_non_ascii) {
+  string ret;
+  escape_controls_append(ret, s, escape_non_ascii);
   return ret;
 }
 
 string escape_url(const string& s, bool escape_slash) {
   string ret;
-  for (char ch : s) {
-    if (isalnum(ch) || (ch == '-') || (ch == '_') || (ch == '.') ||
-        (ch == '~') || (ch == '=') || (ch == '&') || (!escape_slash && (ch == '/'))) {
-      ret += ch;
-    } else {
-      ret += std::format("%{:02X}", ch);
-    }
-  }
+  escape_url_append(ret, s, escape_slash);
   return ret;
 }
 
@@ -195,18 +293,506 @@ static const vector<char> log_level_chars({
     'E',
 });
 
-void print_log_prefix(FILE* stream, LogLevel level) {
-  char time_buffer[32];
-  time_t now_secs = time(nullptr);
-  struct tm now_tm;
+static void append_log_prefix_for_time(string& out, LogLevel level, time_t now_secs) {
+  // Formatting the time is relatively slow, so it's only done once per second on each thread
+  static thread_local time_t cached_secs = -1;
+  static thread_local char time_buffer[32];
+  static thread_local size_t time_buffer_size = 0;
+  if (now_secs != cached_secs) {
+    struct tm now_tm;
 #ifndef PHOSG_WINDOWS
-  localtime_r(&now_secs, &now_tm);
+    localtime_r(&now_secs, &now_tm);
 #else
-  localtime_s(&now_tm, &now_secs);
+    localtime_s(&now_tm, &now_secs);
 #endif
-  strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", &now_tm);
+    time_buffer_size = strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", &now_tm);
+    cached_secs = now_secs;
+  }
   char level_char = log_level_chars.at(static_cast<int>(level));
-  fwrite_fmt(stream, "{:c} {} {} - ", level_char, getpid_cached(), &time_buffer[0]);
+  std::format_to(std::back_inserter(out), "{:c} {} {} - ",
+      level_char, getpid_cached(), string_view(time_buffer, time_buffer_size));
+}
+
+void append_log_prefix(string& out, LogLevel level) {
+  append_log_prefix_for_time(out, level, time(nullptr));
+}
+
+// In deferred formatting mode, each message is stored as one of these, followed by the logger's prefix, followed by
+// the encoded arguments. Lines that were already formatted are stored with format_fn = nullptr, followed by the text.
+struct DeferredLogRecordHeader {
+  uint32_t size; // Including this header
+  LogLevel level;
+  uint32_t prefix_size;
+  time_t time_secs;
+  DeferredLogFormatFn format_fn;
+  const char* fmt_data;
+  size_t fmt_size;
+};
+
+string& begin_deferred_log_record(LogLevel level, string_view prefix, string_view fmt, DeferredLogFormatFn format_fn) {
+  string& record = log_line_buffer();
+  DeferredLogRecordHeader header{0, level, static_cast<uint32_t>(prefix.size()), time(nullptr), format_fn, fmt.data(),
+      fmt.size()};
+  record.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  record.append(prefix);
+  return record;
+}
+
+static void format_deferred_log_record(string& out, const void* record) {
+  DeferredLogRecordHeader header;
+  memcpy(&header, record, sizeof(header));
+  const char* body = reinterpret_cast<const char*>(record) + sizeof(header);
+  if (!header.format_fn) {
+    out.append(body, header.size - sizeof(header));
+  } else {
+    append_log_prefix_for_time(out, header.level, header.time_secs);
+    out.append(body, header.prefix_size);
+    header.format_fn(out, string_view(header.fmt_data, header.fmt_size), body + header.prefix_size);
+    out.push_back('\n');
+  }
+}
+
+void print_log_prefix(FILE* stream, LogLevel level) {
+  string prefix;
+  append_log_prefix(prefix, level);
+  fwritex(stream, prefix);
+}
+
+// A single-producer, single-consumer ring buffer of log text. Each thread that logs while async logging is enabled
+// gets its own ring, so threads never contend with each other when logging; only the writer thread reads from them.
+// Lines (or deferred log records) are always added whole, so the readable part of the ring always consists of
+// complete lines or records.
+struct LogRing {
+  string data;
+  // These are total byte counts, not offsets within data
+  atomic<size_t> write_count = 0;
+  atomic<size_t> read_count = 0;
+  // Set while the owning thread is adding a line, so disable_async_logging can wait for it to finish
+  atomic<bool> in_use = false;
+  atomic<bool> owner_exited = false;
+
+  explicit LogRing(size_t size) : data(size, '\0') {}
+
+  // Returns false if there isn't enough space for the line. If the line is added, sets crossed_half_full to whether
+  // the ring was at most half full before and is more than half full after.
+  bool try_push(string_view line, bool* crossed_half_full) {
+    size_t w = this->write_count.load(memory_order_relaxed);
+    size_t r = this->read_count.load(memory_order_acquire);
+    if (this->data.size() - (w - r) < line.size()) {
+      return false;
+    }
+    size_t half_size = this->data.size() / 2;
+    *crossed_half_full = ((w - r) <= half_size) && ((w - r + line.size()) > half_size);
+    size_t offset = w % this->data.size();
+    size_t first_size = std::min<size_t>(line.size(), this->data.size() - offset);
+    memcpy(this->data.data() + offset, line.data(), first_size);
+    memcpy(this->data.data(), line.data() + first_size, line.size() - first_size);
+    this->write_count.store(w + line.size(), memory_order_release);
+    return true;
+  }
+};
+
+class AsyncLogWriter {
+public:
+  AsyncLogWriter() = default;
+  ~AsyncLogWriter() {
+    this->stop();
+  }
+
+  bool is_enabled() const {
+    return this->enabled.load(memory_order_seq_cst);
+  }
+
+  bool is_deferred() const {
+    return this->deferred.load(memory_order_relaxed) && this->enabled.load(memory_order_relaxed);
+  }
+
+  void start(size_t ring_size, LogOverflowPolicy overflow_policy, int fd, bool deferred) {
+    lock_guard g(this->config_lock);
+    if (this->writer_thread.joinable()) {
+      throw logic_error("async logging is already enabled");
+    }
+    if (ring_size == 0) {
+      throw invalid_argument("async log buffer size must be nonzero");
+    }
+    {
+      lock_guard rg(this->rings_lock);
+      this->ring_size = ring_size;
+      this->overflow_policy = overflow_policy;
+      this->fd = fd;
+      this->deferred = deferred;
+      this->session++;
+    }
+    this->should_exit = false;
+    this->writer_thread = thread(&AsyncLogWriter::writer_thread_fn, this);
+    this->enabled = true;
+  }
+
+  void stop() {
+    lock_guard g(this->config_lock);
+    if (!this->writer_thread.joinable()) {
+      return;
+    }
+    // After this, no thread can start adding a line to a ring, but some may be in the middle of doing so; wait for
+    // them to finish so their lines are written before the writer thread exits
+    this->enabled = false;
+    {
+      lock_guard rg(this->rings_lock);
+      for (const auto& ring : this->rings) {
+        while (ring->in_use.load(memory_order_seq_cst)) {
+          this_thread::yield();
+        }
+      }
+    }
+    this->should_exit = true;
+    this->wake_writer();
+    this->writer_thread.join();
+    lock_guard rg(this->rings_lock);
+    this->rings.clear();
+  }
+
+  // Returns false if async logging isn't enabled (or if is_record doesn't match the current mode), in which case the
+  // caller should write the line directly
+  bool write(string_view data, bool is_record) {
+    struct ThreadState {
+      shared_ptr<LogRing> ring;
+      uint64_t session = 0;
+      ~ThreadState() {
+        if (this->ring) {
+          this->ring->owner_exited = true;
+        }
+      }
+    };
+    static thread_local ThreadState thread_state;
+
+    if (!this->enabled.load(memory_order_relaxed)) {
+      return false;
+    }
+    if (!thread_state.ring || (thread_state.session != this->session)) {
+      lock_guard g(this->rings_lock);
+      if (!this->enabled) {
+        return false;
+      }
+      if (thread_state.ring) {
+        thread_state.ring->owner_exited = true;
+      }
+      thread_state.ring = make_shared<LogRing>(this->ring_size);
+      thread_state.session = this->session;
+      this->rings.emplace_back(thread_state.ring);
+    }
+
+    auto& ring = *thread_state.ring;
+    ring.in_use.store(true, memory_order_seq_cst);
+    bool ret = this->enabled.load(memory_order_seq_cst) && (this->deferred.load(memory_order_relaxed) == is_record) &&
+        this->write_to_ring(ring, data);
+    ring.in_use.store(false, memory_order_release);
+    return ret;
+  }
+
+  void flush() {
+    if (!this->is_enabled()) {
+      return;
+    }
+    for (;;) {
+      bool all_empty = true;
+      {
+        lock_guard g(this->rings_lock);
+        for (const auto& ring : this->rings) {
+          all_empty &= (ring->read_count.load(memory_order_acquire) == ring->write_count.load(memory_order_acquire));
+        }
+      }
+      if (all_empty) {
+        return;
+      }
+      this->wake_writer();
+      this_thread::yield();
+    }
+  }
+
+  size_t get_dropped_count() const {
+    return this->dropped_count.load(memory_order_relaxed);
+  }
+
+private:
+  mutex config_lock;
+  size_t ring_size = 0;
+  LogOverflowPolicy overflow_policy = LogOverflowPolicy::BLOCK;
+  int fd = 2;
+  atomic<uint64_t> session = 0;
+  atomic<bool> deferred = false;
+  atomic<bool> enabled = false;
+  atomic<bool> should_exit = false;
+
+  mutex rings_lock;
+  vector<shared_ptr<LogRing>> rings;
+
+  // Held while writing to fd, so lines written directly don't interleave with batches from the writer thread
+  mutex write_lock;
+  thread writer_thread;
+  mutex wake_lock;
+  condition_variable wake_cv;
+  bool wake_requested = false;
+  atomic<size_t> dropped_count = 0;
+  // Formatted text from deferred log records (only used by the writer thread)
+  string pending_text;
+
+  bool write_to_ring(LogRing& ring, string_view line) {
+    if (line.size() > ring.data.size()) {
+      // The line can never fit in the ring, so write it directly after everything this thread has already logged
+      while (ring.read_count.load(memory_order_acquire) != ring.write_count.load(memory_order_relaxed)) {
+        this->wake_writer();
+        this_thread::yield();
+      }
+      if (this->deferred.load(memory_order_relaxed)) {
+        string formatted;
+        format_deferred_log_record(formatted, line.data());
+        lock_guard g(this->write_lock);
+        this->write_all(formatted.data(), formatted.size());
+      } else {
+        lock_guard g(this->write_lock);
+        this->write_all(line.data(), line.size());
+      }
+      return true;
+    }
+
+    // The writer thread wakes up periodically on its own, so it only needs to be woken up early if this thread is
+    // logging fast enough to fill its ring before then
+    bool crossed_half_full;
+    while (!ring.try_push(line, &crossed_half_full)) {
+      if (this->overflow_policy == LogOverflowPolicy::DROP) {
+        this->dropped_count.fetch_add(1, memory_order_relaxed);
+        return true;
+      }
+      this->wake_writer();
+      this_thread::yield();
+    }
+    if (crossed_half_full) {
+      this->wake_writer();
+    }
+    return true;
+  }
+
+  void wake_writer() {
+    {
+      lock_guard g(this->wake_lock);
+      this->wake_requested = true;
+    }
+    this->wake_cv.notify_one();
+  }
+
+  void write_all(const void* data, size_t size) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    while (size > 0) {
+      ssize_t bytes_written = ::write(this->fd, bytes, size);
+      if (bytes_written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return; // There's nowhere to report errors in writing the log, so the data is dropped
+      }
+      bytes += bytes_written;
+      size -= bytes_written;
+    }
+  }
+
+  // Writes everything currently in all rings, using as few system calls as possible. Returns true if anything was
+  // written.
+  bool write_pending() {
+    vector<shared_ptr<LogRing>> rings_to_write;
+    {
+      lock_guard g(this->rings_lock);
+      // Rings whose threads have exited can be removed once they're empty
+      std::erase_if(this->rings, [](const shared_ptr<LogRing>& ring) -> bool {
+        return ring->owner_exited.load(memory_order_acquire) &&
+            (ring->read_count.load(memory_order_acquire) == ring->write_count.load(memory_order_acquire));
+      });
+      rings_to_write = this->rings;
+    }
+
+    if (this->deferred.load(memory_order_relaxed)) {
+      return this->write_pending_records(rings_to_write);
+    }
+
+    vector<struct iovec> iovs;
+    vector<size_t> write_counts;
+    write_counts.reserve(rings_to_write.size());
+    size_t total_size = 0;
+    for (const auto& ring : rings_to_write) {
+      size_t r = ring->read_count.load(memory_order_relaxed);
+      size_t w = ring->write_count.load(memory_order_acquire);
+      write_counts.emplace_back(w);
+      if (r == w) {
+        continue;
+      }
+      size_t offset = r % ring->data.size();
+      size_t first_size = std::min<size_t>(w - r, ring->data.size() - offset);
+      iovs.emplace_back(iovec{ring->data.data() + offset, first_size});
+      if (first_size < w - r) {
+        iovs.emplace_back(iovec{ring->data.data(), (w - r) - first_size});
+      }
+      total_size += (w - r);
+    }
+    if (total_size == 0) {
+      return false;
+    }
+
+    {
+      lock_guard g(this->write_lock);
+#ifndef PHOSG_WINDOWS
+      static constexpr size_t MAX_IOVS_PER_CALL = 1024;
+      size_t iov_index = 0;
+      while (iov_index < iovs.size()) {
+        size_t num_iovs = std::min<size_t>(iovs.size() - iov_index, MAX_IOVS_PER_CALL);
+        ssize_t bytes_written = ::writev(this->fd, &iovs[iov_index], num_iovs);
+        if (bytes_written < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          break; // As in write_all, the data is dropped
+        }
+        // Skip the buffers that were completely written, and adjust the first one that was partially written (if any)
+        size_t remaining = bytes_written;
+        while ((iov_index < iovs.size()) && (remaining >= iovs[iov_index].iov_len)) {
+          remaining -= iovs[iov_index].iov_len;
+          iov_index++;
+        }
+        if (remaining) {
+          iovs[iov_index].iov_base = reinterpret_cast<char*>(iovs[iov_index].iov_base) + remaining;
+          iovs[iov_index].iov_len -= remaining;
+        }
+      }
+#else
+      for (const auto& iov : iovs) {
+        this->write_all(iov.iov_base, iov.iov_len);
+      }
+#endif
+    }
+
+    for (size_t z = 0; z < rings_to_write.size(); z++) {
+      rings_to_write[z]->read_count.store(write_counts[z], memory_order_release);
+    }
+    return true;
+  }
+
+  // Formats all deferred log records in the given rings, then writes the resulting text
+  bool write_pending_records(const vector<shared_ptr<LogRing>>& rings_to_write) {
+    string record;
+    vector<size_t> write_counts;
+    write_counts.reserve(rings_to_write.size());
+    for (const auto& ring : rings_to_write) {
+      size_t r = ring->read_count.load(memory_order_relaxed);
+      size_t w = ring->write_count.load(memory_order_acquire);
+      write_counts.emplace_back(w);
+      // Records may wrap around the end of the ring, so copy each one out before formatting it
+      auto copy_out = [&](void* dest, size_t offset, size_t size) -> void {
+        offset %= ring->data.size();
+        size_t first_size = std::min<size_t>(size, ring->data.size() - offset);
+        memcpy(dest, ring->data.data() + offset, first_size);
+        memcpy(reinterpret_cast<char*>(dest) + first_size, ring->data.data(), size - first_size);
+      };
+      while (r < w) {
+        uint32_t record_size;
+        copy_out(&record_size, r, sizeof(record_size));
+        record.resize(record_size);
+        copy_out(record.data(), r, record_size);
+        format_deferred_log_record(this->pending_text, record.data());
+        r += record_size;
+      }
+    }
+    if (this->pending_text.empty()) {
+      return false;
+    }
+
+    {
+      lock_guard g(this->write_lock);
+      this->write_all(this->pending_text.data(), this->pending_text.size());
+    }
+    this->pending_text.clear();
+    for (size_t z = 0; z < rings_to_write.size(); z++) {
+      rings_to_write[z]->read_count.store(write_counts[z], memory_order_release);
+    }
+    return true;
+  }
+
+  void writer_thread_fn() {
+    // Writing pending lines at a fixed interval (instead of as soon as they're logged) lets each write call cover many
+    // lines, and means logging threads don't have to wake up this thread for every line
+    static constexpr auto WRITE_INTERVAL = chrono::milliseconds(10);
+    for (;;) {
+      bool wrote_anything = this->write_pending();
+      if (this->should_exit.load(memory_order_acquire)) {
+        if (!wrote_anything) {
+          break;
+        }
+        continue;
+      }
+      unique_lock g(this->wake_lock);
+      this->wake_cv.wait_for(g, WRITE_INTERVAL, [&]() -> bool { return this->wake_requested; });
+      this->wake_requested = false;
+    }
+  }
+};
+
+static AsyncLogWriter async_log_writer;
+
+void enable_async_logging(size_t thread_buffer_size, LogOverflowPolicy overflow_policy, int fd, bool defer_formatting) {
+  async_log_writer.start(thread_buffer_size, overflow_policy, fd, defer_formatting);
+}
+
+void disable_async_logging() {
+  async_log_writer.stop();
+}
+
+bool async_logging_enabled() {
+  return async_log_writer.is_enabled();
+}
+
+bool deferred_log_formatting_enabled() {
+  return async_log_writer.is_deferred();
+}
+
+void flush_log() {
+  async_log_writer.flush();
+  fflush(stderr);
+}
+
+size_t dropped_log_message_count() {
+  return async_log_writer.get_dropped_count();
+}
+
+string& log_line_buffer() {
+  static thread_local string buffer;
+  buffer.clear();
+  return buffer;
+}
+
+void write_log_line(string_view line) {
+  bool written;
+  if (async_log_writer.is_deferred()) {
+    // The line may be in log_line_buffer, so build the record in a separate buffer
+    static thread_local string record;
+    DeferredLogRecordHeader header{static_cast<uint32_t>(sizeof(header) + line.size()), LogLevel::L_USE_DEFAULT, 0, 0,
+        nullptr, nullptr, 0};
+    record.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+    record.append(line);
+    written = async_log_writer.write(record, true);
+  } else {
+    written = async_log_writer.write(line, false);
+  }
+  if (!written) {
+    fwritex(stderr, line.data(), line.size());
+  }
+}
+
+void write_deferred_log_record(string& record) {
+  uint32_t size = record.size();
+  memcpy(record.data(), &size, sizeof(size));
+  if (!async_log_writer.write(record, true)) {
+    // Async logging was disabled after this record was started, so format and write it immediately
+    string formatted;
+    format_deferred_log_record(formatted, record.data());
+    fwritex(stderr, formatted.data(), formatted.size());
+  }
 }
 
 PrefixedLogger::PrefixedLogger(const string& prefix, LogLevel min_level)
@@ -238,19 +824,35 @@ vector<RetT> split_inner(InT s, CharT delim, size_t max_splits) {
 }
 
 std::vector<std::string> split(const std::string& s, char delim, size_t max_splits) {
-  return split_inner<std::string, const std::string&, char>(s, delim, max_splits);
+  vector<std::string> ret;
+  for (std::string_view token : SplitRange(s, delim, max_splits)) {
+    ret.emplace_back(token);
+  }
+  return ret;
 }
 
 std::vector<std::string_view> split_view(std::string_view s, char delim, size_t max_splits) {
-  return split_inner<std::string_view, std::string_view, char>(s, delim, max_splits);
+  vector<std::string_view> ret;
+  for (std::string_view token : SplitRange(s, delim, max_splits)) {
+    ret.emplace_back(token);
+  }
+  return ret;
+}
+
+std::vector<std::string_view> split_any_view(std::string_view s, std::string_view delims, size_t max_splits) {
+  vector<std::string_view> ret;
+  for (std::string_view token : SplitRange(s, delims, max_splits)) {
+    ret.emplace_back(token);
+  }
+  return ret;
 }
 
 std::vector<std::wstring> split(const std::wstring& s, wchar_t delim, size_t max_splits) {
-  return split_inner<std::wstring, const std::wstring&, char>(s, delim, max_splits);
+  return split_inner<std::wstring, const std::wstring&, wchar_t>(s, delim, max_splits);
 }
 
 std::vector<std::wstring_view> split_view(std::wstring_view s, wchar_t delim, size_t max_splits) {
-  return split_inner<std::wstring_view, std::wstring_view, char>(s, delim, max_splits);
+  return split_inner<std::wstring_view, std::wstring_view, wchar_t>(s, delim, max_splits);
 }
 
 template <typename RetT, typename InT, typename CharT>
@@ -463,12 +1065,52 @@ bool print_binary_diff(
     bool use_color,
     size_t context_lines,
     uint64_t base_offset) {
-  const uint8_t* data1 = reinterpret_cast<const uint8_t*>(data1v);
-  const uint8_t* data2 = reinterpret_cast<const uint8_t*>(data2v);
+  StringReader r1(data1v, size1);
+  StringReader r2(data2v, size2);
+  return print_binary_diff(
+      stream,
+      [&](void* data, size_t size) -> size_t { return r1.read(data, size); },
+      [&](void* data, size_t size) -> size_t { return r2.read(data, size); },
+      use_color, context_lines, base_offset, std::max<size_t>(size1, size2));
+}
 
-  size_t max_data_size = std::max<size_t>(size1, size2);
+bool print_binary_diff(
+    FILE* stream, FILE* file1, FILE* file2, bool use_color, size_t context_lines, uint64_t base_offset) {
+  // If both inputs are regular files, use their sizes to choose the offset column width, so the output matches what
+  // the in-memory version would produce
+  uint64_t max_data_size = 0;
+  for (FILE* f : {file1, file2}) {
+    struct stat st;
+    off_t pos = ftello(f);
+    if ((max_data_size != UINT64_MAX) && (pos >= 0) && !fstat(fileno(f), &st) && S_ISREG(st.st_mode)) {
+      max_data_size = std::max<uint64_t>(max_data_size, (st.st_size > pos) ? (st.st_size - pos) : 0);
+    } else {
+      max_data_size = UINT64_MAX;
+    }
+  }
+  auto read_fn = [](FILE* f) -> BinaryDiffReadFn {
+    return [f](void* data, size_t size) -> size_t {
+      size_t bytes_read = fread(data, 1, size, f);
+      if ((bytes_read < size) && ferror(f)) {
+        throw runtime_error("cannot read from file");
+      }
+      return bytes_read;
+    };
+  };
+  return print_binary_diff(
+      stream, read_fn(file1), read_fn(file2), use_color, context_lines, base_offset, max_data_size);
+}
+
+bool print_binary_diff(
+    FILE* stream,
+    const BinaryDiffReadFn& read1,
+    const BinaryDiffReadFn& read2,
+    bool use_color,
+    size_t context_lines,
+    uint64_t base_offset,
+    uint64_t max_data_size) {
   int offset_width_digits;
-  if (base_offset + max_data_size > 0x100000000) {
+  if ((max_data_size == UINT64_MAX) || (base_offset + max_data_size > 0x100000000)) {
     offset_width_digits = 16;
   } else if (base_offset + max_data_size > 0x10000) {
     offset_width_digits = 8;
@@ -478,28 +1120,46 @@ bool print_binary_diff(
     offset_width_digits = 2;
   }
 
+  // The inputs are compared one block at a time, so memory usage doesn't depend on the input sizes. The block size
+  // must be a multiple of the line size, so lines never span blocks. Small inputs only need a small block.
+  static constexpr size_t MAX_BLOCK_SIZE = 0x100000;
+  const size_t BLOCK_SIZE = (max_data_size < MAX_BLOCK_SIZE)
+      ? std::max<size_t>((max_data_size + 0x0F) & (~0x0F), 0x10)
+      : MAX_BLOCK_SIZE;
+  string block1(BLOCK_SIZE, '\0');
+  string block2(BLOCK_SIZE, '\0');
+  // Leading context lines from before the current block come from the previous block's tail, so there can't be more
+  // of them than fit in one block
+  context_lines = std::min<size_t>(context_lines, BLOCK_SIZE / 0x10);
+  const uint8_t* data1 = reinterpret_cast<const uint8_t*>(block1.data());
+  const uint8_t* data2 = reinterpret_cast<const uint8_t*>(block2.data());
+  size_t size1 = 0;
+  size_t size2 = 0;
+  size_t block_start_line_index = 0;
+  // The last few lines of data1 from the previous block, in case they need to be printed as context before a
+  // difference near the beginning of the current block
+  string prev_tail;
+
   bool is_identical = true;
   auto print_diff_line = [&](char left_ch,
-                             const uint8_t* data,
-                             size_t size,
+                             const uint8_t* line_data,
+                             size_t line_size,
                              size_t line_index,
                              uint16_t diff_flags,
                              TerminalFormat color) {
-    size_t line_start_offset = line_index * 0x10;
     if (use_color) {
       print_color_escape(stream, color, TerminalFormat::END);
     }
-    uint64_t address = base_offset + line_start_offset;
+    uint64_t address = base_offset + line_index * 0x10;
     fwrite_fmt(stream, "{:c} {:0>{}X} |", left_ch, address, offset_width_digits);
     for (size_t within_line_offset = 0; within_line_offset < 0x10; within_line_offset++) {
-      size_t offset = (line_index * 0x10) + within_line_offset;
-      if (offset < size) {
+      if (within_line_offset < line_size) {
         if (use_color && (diff_flags & (1 << within_line_offset))) {
           print_color_escape(stream, color, TerminalFormat::BOLD, TerminalFormat::END);
-          fwrite_fmt(stream, " {:02X}", data[offset]);
+          fwrite_fmt(stream, " {:02X}", line_data[within_line_offset]);
           print_color_escape(stream, TerminalFormat::NORMAL, color, TerminalFormat::END);
         } else {
-          fwrite_fmt(stream, " {:02X}", data[offset]);
+          fwrite_fmt(stream, " {:02X}", line_data[within_line_offset]);
         }
       } else {
         fwrite_fmt(stream, "   ");
@@ -507,9 +1167,8 @@ bool print_binary_diff(
     }
     fwrite_fmt(stream, " | ");
     for (size_t within_line_offset = 0; within_line_offset < 0x10; within_line_offset++) {
-      size_t offset = (line_index * 0x10) + within_line_offset;
-      if (offset < size) {
-        char ch = data[offset];
+      if (within_line_offset < line_size) {
+        char ch = line_data[within_line_offset];
         if (ch < 0x20 || ch > 0x7E) {
           ch = ' ';
         }
@@ -531,66 +1190,373 @@ bool print_binary_diff(
   };
 
   auto print_diff_line_pair = [&](size_t line_index, uint16_t diff_flags) -> void {
-    size_t line_start_offset = line_index * 0x10;
+    if (line_index < block_start_line_index) {
+      // Lines before the current block are only ever printed as context, so they're identical in both inputs
+      size_t tail_offset = prev_tail.size() - (block_start_line_index - line_index) * 0x10;
+      print_diff_line(' ', reinterpret_cast<const uint8_t*>(prev_tail.data() + tail_offset), 0x10, line_index,
+          diff_flags, TerminalFormat::NORMAL);
+      return;
+    }
+    size_t line_start_offset = (line_index - block_start_line_index) * 0x10;
+    size_t line_size1 = (line_start_offset < size1) ? std::min<size_t>(size1 - line_start_offset, 0x10) : 0;
+    size_t line_size2 = (line_start_offset < size2) ? std::min<size_t>(size2 - line_start_offset, 0x10) : 0;
     if (diff_flags == 0) {
-      print_diff_line(' ', data1, size1, line_index, diff_flags, TerminalFormat::NORMAL);
+      print_diff_line(' ', data1 + line_start_offset, line_size1, line_index, diff_flags, TerminalFormat::NORMAL);
     } else {
-      if (line_start_offset < size1) {
-        print_diff_line('-', data1, size1, line_index, diff_flags, TerminalFormat::FG_RED);
+      if (line_size1) {
+        print_diff_line('-', data1 + line_start_offset, line_size1, line_index, diff_flags, TerminalFormat::FG_RED);
+      }
+      if (line_size2) {
+        print_diff_line('+', data2 + line_start_offset, line_size2, line_index, diff_flags, TerminalFormat::FG_GREEN);
       }
-      if (line_start_offset < size2) {
-        print_diff_line('+', data2, size2, line_index, diff_flags, TerminalFormat::FG_GREEN);
+    }
+  };
+
+  auto read_block = [&](const BinaryDiffReadFn& read_fn, string& block) -> size_t {
+    size_t bytes_read = 0;
+    while (bytes_read < BLOCK_SIZE) {
+      size_t ret = read_fn(block.data() + bytes_read, BLOCK_SIZE - bytes_read);
+      if (ret == 0) {
+        break;
       }
+      bytes_read += ret;
     }
+    return bytes_read;
   };
 
   size_t first_unprinted_line_index = 0;
   ssize_t last_different_line_index = -(context_lines + 1);
-  size_t num_lines = ((max_data_size + 0x0F) >> 4);
-  for (size_t line_index = 0; line_index < num_lines; line_index++) {
-    uint16_t diff_flags = 0;
-    for (size_t within_line_offset = 0; within_line_offset < 0x10; within_line_offset++) {
-      size_t offset = (line_index * 0x10) + within_line_offset;
-      uint16_t data1_value = (offset < size1) ? static_cast<uint8_t>(data1[offset]) : 0xFFFF;
-      uint16_t data2_value = (offset < size2) ? static_cast<uint8_t>(data2[offset]) : 0xFFFF;
-      if (data1_value != data2_value) {
-        is_identical = false;
-        diff_flags |= (1 << within_line_offset);
-      }
+  for (;;) {
+    size1 = read_block(read1, block1);
+    size2 = read_block(read2, block2);
+    size_t block_size = std::max<size_t>(size1, size2);
+    if (block_size == 0) {
+      break;
     }
-    if (diff_flags == 0) {
-      if (static_cast<ssize_t>(line_index) <= last_different_line_index + static_cast<ssize_t>(context_lines)) {
+    size_t common_size = std::min<size_t>(size1, size2);
+    size_t block_num_lines = (block_size + 0x0F) >> 4;
+
+    for (size_t block_line_index = 0; block_line_index < block_num_lines; block_line_index++) {
+      size_t line_index = block_start_line_index + block_line_index;
+
+      // If this line wouldn't be printed as trailing context, skip directly to the next line that differs. memcmp
+      // compares large spans much faster than the per-byte loop below, so identical regions are skipped quickly.
+      if (static_cast<ssize_t>(line_index) > last_different_line_index + static_cast<ssize_t>(context_lines)) {
+        size_t offset = block_line_index * 0x10;
+        static constexpr size_t SKIP_STEP = 0x1000;
+        while ((offset + SKIP_STEP <= common_size) && !memcmp(data1 + offset, data2 + offset, SKIP_STEP)) {
+          offset += SKIP_STEP;
+        }
+        while ((offset < common_size) && (data1[offset] == data2[offset])) {
+          offset++;
+        }
+        block_line_index = std::max<size_t>(block_line_index, offset >> 4);
+        if (block_line_index >= block_num_lines) {
+          break;
+        }
+        line_index = block_start_line_index + block_line_index;
+      }
+
+      uint16_t diff_flags = 0;
+      for (size_t within_line_offset = 0; within_line_offset < 0x10; within_line_offset++) {
+        size_t offset = (block_line_index * 0x10) + within_line_offset;
+        uint16_t data1_value = (offset < size1) ? static_cast<uint8_t>(data1[offset]) : 0xFFFF;
+        uint16_t data2_value = (offset < size2) ? static_cast<uint8_t>(data2[offset]) : 0xFFFF;
+        if (data1_value != data2_value) {
+          is_identical = false;
+          diff_flags |= (1 << within_line_offset);
+        }
+      }
+      if (diff_flags == 0) {
+        if (static_cast<ssize_t>(line_index) <= last_different_line_index + static_cast<ssize_t>(context_lines)) {
+          print_diff_line_pair(line_index, diff_flags);
+          first_unprinted_line_index = line_index + 1;
+        }
+
+      } else {
+        bool has_unprinted_gap;
+        size_t chunk_start_line_index;
+        if ((first_unprinted_line_index + context_lines) >= line_index) {
+          chunk_start_line_index = first_unprinted_line_index;
+          has_unprinted_gap = false;
+        } else {
+          chunk_start_line_index = line_index - context_lines;
+          has_unprinted_gap = true;
+        }
+
+        if (has_unprinted_gap) {
+          fwrite_fmt(stream, "  ...\n");
+        }
+
+        for (size_t z = chunk_start_line_index; z < line_index; z++) {
+          print_diff_line_pair(z, 0x0000);
+        }
         print_diff_line_pair(line_index, diff_flags);
         first_unprinted_line_index = line_index + 1;
+        last_different_line_index = line_index;
       }
+    }
 
-    } else {
-      bool has_unprinted_gap;
-      size_t chunk_start_line_index;
-      if ((first_unprinted_line_index + context_lines) >= line_index) {
-        chunk_start_line_index = first_unprinted_line_index;
-        has_unprinted_gap = false;
-      } else {
-        chunk_start_line_index = line_index - context_lines;
-        has_unprinted_gap = true;
+    block_start_line_index += block_num_lines;
+    if ((size1 < BLOCK_SIZE) && (size2 < BLOCK_SIZE)) {
+      break;
+    }
+    // If either block is incomplete, its last lines differ from the other input's and were already printed, so only
+    // complete lines from the tail can be printed as context later
+    size_t tail_size = context_lines * 0x10;
+    prev_tail.assign(block1.data() + BLOCK_SIZE - tail_size, tail_size);
+  }
+
+  if ((first_unprinted_line_index < block_start_line_index) && !is_identical) {
+    fwrite_fmt(stream, "  ...\n");
+  }
+  return is_identical;
+}
+
+vector<BinaryDiffMatch> find_binary_diff_matches(
+    const void* data1v, size_t size1, const void* data2v, size_t size2, size_t block_size) {
+  const uint8_t* data1 = reinterpret_cast<const uint8_t*>(data1v);
+  const uint8_t* data2 = reinterpret_cast<const uint8_t*>(data2v);
+
+  // Limit the number of indexed blocks so the index stays reasonably small (and mostly in cache) for large inputs
+  if (block_size == 0) {
+    block_size = std::max<size_t>(32, std::bit_ceil(size1 >> 22));
+  }
+  vector<BinaryDiffMatch> ret;
+  if (size1 < block_size || size2 < block_size) {
+    // There's no room for a full block in one of the inputs, so just match the common prefix and suffix
+    size_t min_size = std::min<size_t>(size1, size2);
+    size_t prefix_size = 0;
+    while ((prefix_size < min_size) && (data1[prefix_size] == data2[prefix_size])) {
+      prefix_size++;
+    }
+    size_t suffix_size = 0;
+    while ((prefix_size + suffix_size < min_size) &&
+        (data1[size1 - suffix_size - 1] == data2[size2 - suffix_size - 1])) {
+      suffix_size++;
+    }
+    if (prefix_size > 0) {
+      ret.emplace_back(BinaryDiffMatch{0, 0, prefix_size});
+    }
+    if (suffix_size > 0) {
+      ret.emplace_back(BinaryDiffMatch{size1 - suffix_size, size2 - suffix_size, suffix_size});
+    }
+    return ret;
+  }
+
+  // Index every aligned block in data1 by its polynomial hash, keeping only the first occurrence of each. The index is
+  // an open-addressed hash table, and a bitmap of hash values is checked first, since most lookups (at positions in
+  // data2 that aren't the start of any block in data1) don't find anything.
+  static constexpr uint64_t HASH_BASE = 0x100000001B3;
+  uint64_t base_pow = 1; // HASH_BASE ** (block_size - 1)
+  for (size_t z = 1; z < block_size; z++) {
+    base_pow *= HASH_BASE;
+  }
+  auto hash_block = [&](const uint8_t* data) -> uint64_t {
+    uint64_t h = 0;
+    for (size_t z = 0; z < block_size; z++) {
+      h = h * HASH_BASE + data[z];
+    }
+    return h;
+  };
+  // The hash's low bits only depend on the last few bytes, so mix it before using it as a table index
+  auto mix = [](uint64_t h) -> uint64_t {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCD;
+    h ^= h >> 33;
+    return h;
+  };
+
+  size_t num_blocks = size1 / block_size;
+  size_t table_size = std::bit_ceil(num_blocks * 2);
+  // The filter needs at least one word, even if data1 has only one or two blocks
+  size_t filter_bits = std::max<size_t>(table_size * 8, 64);
+  vector<pair<uint64_t, size_t>> table(table_size, make_pair(0, SIZE_MAX));
+  vector<uint64_t> filter(filter_bits >> 6, 0);
+  for (size_t block_index = 0; block_index < num_blocks; block_index++) {
+    uint64_t h = hash_block(data1 + block_index * block_size);
+    uint64_t m = mix(h);
+    filter[(m & (filter_bits - 1)) >> 6] |= (1ULL << (m & 0x3F));
+    for (size_t slot = m & (table_size - 1);; slot = (slot + 1) & (table_size - 1)) {
+      if (table[slot].second == SIZE_MAX) {
+        table[slot] = make_pair(h, block_index * block_size);
+        break;
+      } else if (table[slot].first == h) {
+        break;
       }
+    }
+  }
+  auto find_block = [&](uint64_t h, const uint8_t* data) -> size_t {
+    uint64_t m = mix(h);
+    if (!(filter[(m & (filter_bits - 1)) >> 6] & (1ULL << (m & 0x3F)))) {
+      return SIZE_MAX;
+    }
+    for (size_t slot = m & (table_size - 1); table[slot].second != SIZE_MAX; slot = (slot + 1) & (table_size - 1)) {
+      if (table[slot].first == h) {
+        return memcmp(data1 + table[slot].second, data, block_size) ? SIZE_MAX : table[slot].second;
+      }
+    }
+    return SIZE_MAX;
+  };
+
+  // Scan data2 with a rolling hash. At each position, first check if the data continues at the same relative offset
+  // as the previous match (this keeps repeated data, like runs of zeroes, from being reported as moved), then look up
+  // the hash in the index. When a match is found, extend it in both directions and skip over it.
+  size_t next_offset1 = 0; // Where data1 would continue if the next match follows the previous one
+  size_t offset2 = 0;
+  size_t unmatched_start2 = 0;
+  uint64_t h = hash_block(data2);
+  while (offset2 + block_size <= size2) {
+    size_t match_offset1 = SIZE_MAX;
+    size_t expected_offset1 = next_offset1 + (offset2 - unmatched_start2);
+    if ((expected_offset1 + block_size <= size1) &&
+        !memcmp(data1 + expected_offset1, data2 + offset2, block_size)) {
+      match_offset1 = expected_offset1;
+    } else {
+      match_offset1 = find_block(h, data2 + offset2);
+    }
 
-      if (has_unprinted_gap) {
-        fwrite_fmt(stream, "  ...\n");
+    if (match_offset1 == SIZE_MAX) {
+      if (offset2 + block_size < size2) {
+        h = (h - data2[offset2] * base_pow) * HASH_BASE + data2[offset2 + block_size];
       }
+      offset2++;
+      continue;
+    }
+
+    size_t start1 = match_offset1;
+    size_t start2 = offset2;
+    while ((start1 > 0) && (start2 > unmatched_start2) && (data1[start1 - 1] == data2[start2 - 1])) {
+      start1--;
+      start2--;
+    }
+    size_t end1 = match_offset1 + block_size;
+    size_t end2 = offset2 + block_size;
+    while ((end1 < size1) && (end2 < size2) && (data1[end1] == data2[end2])) {
+      end1++;
+      end2++;
+    }
+    ret.emplace_back(BinaryDiffMatch{start1, start2, end2 - start2});
+
+    next_offset1 = end1;
+    unmatched_start2 = end2;
+    offset2 = end2;
+    if (offset2 + block_size <= size2) {
+      h = hash_block(data2 + offset2);
+    }
+  }
+  return ret;
+}
 
-      for (size_t z = chunk_start_line_index; z < line_index; z++) {
-        print_diff_line_pair(z, 0x0000);
+static void print_binary_diff_range(
+    FILE* stream,
+    char left_ch,
+    const uint8_t* data,
+    size_t start_offset,
+    size_t end_offset,
+    uint64_t base_offset,
+    int offset_width_digits,
+    bool use_color,
+    TerminalFormat color) {
+  if (start_offset >= end_offset) {
+    return;
+  }
+  for (uint64_t line_address = (base_offset + start_offset) & (~0x0F); line_address < base_offset + end_offset;
+      line_address += 0x10) {
+    if (use_color) {
+      print_color_escape(stream, color, TerminalFormat::END);
+    }
+    string hex_column, ascii_column;
+    for (uint64_t address = line_address; address < line_address + 0x10; address++) {
+      if ((address < base_offset + start_offset) || (address >= base_offset + end_offset)) {
+        hex_column += "   ";
+        ascii_column += ' ';
+      } else {
+        uint8_t v = data[address - base_offset];
+        hex_column += std::format(" {:02X}", v);
+        ascii_column += ((v < 0x20) || (v > 0x7E)) ? ' ' : static_cast<char>(v);
       }
-      print_diff_line_pair(line_index, diff_flags);
-      first_unprinted_line_index = line_index + 1;
-      last_different_line_index = line_index;
     }
+    fwrite_fmt(stream, "{:c} {:0>{}X} |{} | {}", left_ch, line_address, offset_width_digits, hex_column, ascii_column);
+    if (use_color) {
+      print_color_escape(stream, TerminalFormat::NORMAL, TerminalFormat::END);
+    }
+    fputc('\n', stream);
   }
+}
 
-  if ((first_unprinted_line_index < num_lines) && !is_identical) {
-    fwrite_fmt(stream, "  ...\n");
+bool print_binary_diff_aligned(
+    FILE* stream,
+    const void* data1v,
+    size_t size1,
+    const void* data2v,
+    size_t size2,
+    bool use_color,
+    size_t context_lines,
+    uint64_t base_offset) {
+  const uint8_t* data1 = reinterpret_cast<const uint8_t*>(data1v);
+  const uint8_t* data2 = reinterpret_cast<const uint8_t*>(data2v);
+
+  size_t max_data_size = std::max<size_t>(size1, size2);
+  int offset_width_digits;
+  if (base_offset + max_data_size > 0x100000000) {
+    offset_width_digits = 16;
+  } else if (base_offset + max_data_size > 0x10000) {
+    offset_width_digits = 8;
+  } else if (base_offset + max_data_size > 0x100) {
+    offset_width_digits = 4;
+  } else {
+    offset_width_digits = 2;
   }
+
+  auto matches = find_binary_diff_matches(data1, size1, data2, size2);
+  // Add an empty match at the end, so the data after the last real match is handled by the same logic
+  matches.emplace_back(BinaryDiffMatch{size1, size2, 0});
+
+  bool is_identical = true;
+  size_t context_bytes = context_lines * 0x10;
+  size_t offset1 = 0;
+  size_t offset2 = 0;
+  size_t printed_end2 = 0; // End of the last context printed (in data2), so context isn't printed twice
+  size_t prev_match_start2 = 0;
+  for (size_t z = 0; z < matches.size(); z++) {
+    const auto& m = matches[z];
+    bool is_moved = (m.offset1 < offset1);
+    size_t deleted_end1 = is_moved ? offset1 : m.offset1;
+    if ((deleted_end1 > offset1) || (m.offset2 > offset2)) {
+      is_identical = false;
+      fwrite_fmt(stream, "@@ -{:X},{:X} +{:X},{:X} @@\n",
+          base_offset + offset1, deleted_end1 - offset1, base_offset + offset2, m.offset2 - offset2);
+      size_t context_start2 = std::max<size_t>(
+          {printed_end2, prev_match_start2, (offset2 > context_bytes) ? (offset2 - context_bytes) : 0});
+      if (context_start2 < offset2) {
+        if (context_start2 > printed_end2) {
+          fwrite_fmt(stream, "  ...\n");
+        }
+        print_binary_diff_range(stream, ' ', data2, context_start2, offset2, base_offset, offset_width_digits, false,
+            TerminalFormat::NORMAL);
+      }
+      print_binary_diff_range(stream, '-', data1, offset1, deleted_end1, base_offset, offset_width_digits, use_color,
+          TerminalFormat::FG_RED);
+      print_binary_diff_range(stream, '+', data2, offset2, m.offset2, base_offset, offset_width_digits, use_color,
+          TerminalFormat::FG_GREEN);
+      size_t context_end2 = is_moved ? m.offset2 : std::min<size_t>(m.offset2 + m.size, m.offset2 + context_bytes);
+      print_binary_diff_range(stream, ' ', data2, m.offset2, context_end2, base_offset, offset_width_digits, false,
+          TerminalFormat::NORMAL);
+      printed_end2 = context_end2;
+    }
+    if (is_moved) {
+      is_identical = false;
+      fwrite_fmt(stream, "@@ moved -{:X},{:X} +{:X},{:X} @@\n",
+          base_offset + m.offset1, m.size, base_offset + m.offset2, m.size);
+      printed_end2 = m.offset2 + m.size;
+    } else {
+      offset1 = m.offset1 + m.size;
+    }
+    offset2 = m.offset2 + m.size;
+    prev_match_start2 = m.offset2;
+  }
+
   return is_identical;
 }
 
@@ -1003,6 +1969,79 @@ string format_size(size_t size, bool include_bytes) {
 
 #endif
 
+size_t scan_decimal_u64(string_view s, uint64_t* value) {
+  const char* data = s.data();
+  size_t size = s.size();
+  size_t offset = 0;
+  uint64_t v = 0;
+
+  // Check and convert 8 digits at a time while the result can't overflow (two groups of 8 digits are always safe).
+  // This relies on the first digit being in the lowest byte of the loaded word.
+  if constexpr (std::endian::native == std::endian::little) {
+    while ((offset + 8 <= size) && (offset < 16)) {
+      uint64_t chunk;
+      memcpy(&chunk, data + offset, 8);
+      // Each byte is a digit if its high nybble is 3 and adding 6 to it doesn't carry into the high nybble
+      if (((chunk & 0xF0F0F0F0F0F0F0F0) | (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) !=
+          0x3333333333333333) {
+        break;
+      }
+      // Combine pairs of adjacent digits, then pairs of 2-digit values, then pairs of 4-digit values
+      chunk = ((chunk & 0x0F0F0F0F0F0F0F0F) * 2561) >> 8;
+      chunk = ((chunk & 0x00FF00FF00FF00FF) * 6553601) >> 16;
+      chunk = ((chunk & 0x0000FFFF0000FFFF) * 42949672960001) >> 32;
+      v = v * 100000000 + static_cast<uint32_t>(chunk);
+      offset += 8;
+    }
+  }
+
+  // Any 19-digit number fits in 64 bits, so overflow only needs to be checked after that
+  for (; (offset < size) && (offset < 19) && (data[offset] >= '0') && (data[offset] <= '9'); offset++) {
+    v = v * 10 + (data[offset] - '0');
+  }
+  for (; (offset < size) && (data[offset] >= '0') && (data[offset] <= '9'); offset++) {
+    uint64_t digit = data[offset] - '0';
+    if (v > (UINT64_MAX - digit) / 10) {
+      throw out_of_range("number is out of range");
+    }
+    v = v * 10 + digit;
+  }
+  if (offset > 0) {
+    *value = v;
+  }
+  return offset;
+}
+
+static constexpr auto decimal_digit_pairs = []() {
+  std::array<char, 200> ret{};
+  for (size_t z = 0; z < 100; z++) {
+    ret[z * 2] = '0' + (z / 10);
+    ret[z * 2 + 1] = '0' + (z % 10);
+  }
+  return ret;
+}();
+
+size_t format_decimal_u64(char* buf, uint64_t value) {
+  // Write two digits at a time from the end of a temporary buffer, then copy the result to the beginning of buf
+  char temp[20];
+  char* end = temp + sizeof(temp);
+  char* p = end;
+  while (value >= 100) {
+    size_t pair_index = (value % 100) * 2;
+    value /= 100;
+    p -= 2;
+    memcpy(p, &decimal_digit_pairs[pair_index], 2);
+  }
+  if (value >= 10) {
+    p -= 2;
+    memcpy(p, &decimal_digit_pairs[value * 2], 2);
+  } else {
+    *(--p) = '0' + value;
+  }
+  memcpy(buf, p, end - p);
+  return end - p;
+}
+
 size_t parse_size(const char* str) {
   // input is like [0-9](\.[0-9]+)? *[KkMmGgTtPpEe]?[Bb]?
   // fortunately this can just be parsed left-to-right
@@ -1100,13 +2139,33 @@ uint64_t BitReader::pread(size_t start_offset, uint8_t size) {
   if (size > 64) {
     throw logic_error("BitReader cannot return more than 64 bits at once");
   }
+  if (size == 0) {
+    return 0;
+  }
 
-  uint64_t ret = 0;
-  for (uint8_t ret_bits = 0; ret_bits < size; ret_bits++) {
-    size_t bit_offset = start_offset + ret_bits;
-    ret = (ret << 1) | ((this->data[bit_offset >> 3] >> (7 - (bit_offset & 7))) & 1);
+  // Gather the bytes containing the requested bits into a big-endian word, then shift the requested bits into place.
+  // The bits can span up to 9 bytes; the 9th byte (if needed) only contributes its high bits.
+  size_t first_byte = start_offset >> 3;
+  uint8_t skip_bits = start_offset & 7;
+  size_t num_bytes = (skip_bits + size + 7) >> 3;
+  uint64_t word;
+  if (first_byte + 8 <= ((this->length + 7) >> 3)) {
+    memcpy(&word, this->data + first_byte, 8);
+    if constexpr (std::endian::native == std::endian::little) {
+      word = bswap64(word);
+    }
+  } else {
+    // Don't read past the end of the data
+    word = 0;
+    for (size_t z = 0; z < min<size_t>(num_bytes, 8); z++) {
+      word |= static_cast<uint64_t>(this->data[first_byte + z]) << (56 - z * 8);
+    }
   }
-  return ret;
+  uint64_t ret = word << skip_bits;
+  if (num_bytes > 8) {
+    ret |= this->data[first_byte + 8] >> (8 - skip_bits);
+  }
+  return ret >> (64 - size);
 }
 
 uint64_t BitReader::read(uint8_t size, bool advance) {
@@ -1117,7 +2176,7 @@ uint64_t BitReader::read(uint8_t size, bool advance) {
   return ret;
 }
 
-BitWriter::BitWriter() : last_byte_unset_bits(0) {}
+BitWriter::BitWriter(BitOrder order) : order(order), last_byte_unset_bits(0) {}
 
 size_t BitWriter::size() const {
   return this->data.size() * 8 - this->last_byte_unset_bits;
@@ -1137,22 +2196,76 @@ void BitWriter::truncate(size_t size) {
   // The if statement is important here (we can't just let the & become
   // degenerate) because this->data could now be empty
   if (this->last_byte_unset_bits) {
-    this->data[this->data.size() - 1] &= (0xFF << this->last_byte_unset_bits);
+    if (this->order == BitOrder::MSB_FIRST) {
+      this->data[this->data.size() - 1] &= (0xFF << this->last_byte_unset_bits);
+    } else {
+      this->data[this->data.size() - 1] &= (0xFF >> this->last_byte_unset_bits);
+    }
   }
 }
 
 void BitWriter::write(bool v) {
   if (this->last_byte_unset_bits > 0) {
-    this->last_byte_unset_bits--;
     if (v) {
-      this->data[this->data.size() - 1] |= (1 << this->last_byte_unset_bits);
+      uint8_t bit_index = (this->order == BitOrder::MSB_FIRST)
+          ? (this->last_byte_unset_bits - 1)
+          : (8 - this->last_byte_unset_bits);
+      this->data[this->data.size() - 1] |= (1 << bit_index);
     }
+    this->last_byte_unset_bits--;
   } else {
-    this->data.push_back(v ? 0x80 : 0x00);
+    this->data.push_back(v ? ((this->order == BitOrder::MSB_FIRST) ? 0x80 : 0x01) : 0x00);
     this->last_byte_unset_bits = 7;
   }
 }
 
+void BitWriter::write(uint64_t value, uint8_t bits) {
+  if (bits > 64) {
+    throw logic_error("BitWriter cannot write more than 64 bits at once");
+  }
+  if (bits < 64) {
+    value &= (1ULL << bits) - 1;
+  }
+
+  // Fill the unset bits in the last byte first, then write whole bytes, then start a new partial byte if needed
+  if (this->order == BitOrder::MSB_FIRST) {
+    if (this->last_byte_unset_bits && bits) {
+      uint8_t bits_to_write = min<uint8_t>(this->last_byte_unset_bits, bits);
+      uint8_t chunk = value >> (bits - bits_to_write);
+      this->data[this->data.size() - 1] |= chunk << (this->last_byte_unset_bits - bits_to_write);
+      this->last_byte_unset_bits -= bits_to_write;
+      bits -= bits_to_write;
+    }
+    while (bits >= 8) {
+      bits -= 8;
+      this->data.push_back(value >> bits);
+    }
+    if (bits) {
+      this->data.push_back(value << (8 - bits));
+      this->last_byte_unset_bits = 8 - bits;
+    }
+
+  } else {
+    if (this->last_byte_unset_bits && bits) {
+      uint8_t bits_to_write = min<uint8_t>(this->last_byte_unset_bits, bits);
+      uint8_t chunk = value & ((1 << bits_to_write) - 1);
+      this->data[this->data.size() - 1] |= chunk << (8 - this->last_byte_unset_bits);
+      this->last_byte_unset_bits -= bits_to_write;
+      value >>= bits_to_write;
+      bits -= bits_to_write;
+    }
+    while (bits >= 8) {
+      this->data.push_back(value);
+      value >>= 8;
+      bits -= 8;
+    }
+    if (bits) {
+      this->data.push_back(value);
+      this->last_byte_unset_bits = 8 - bits;
+    }
+  }
+}
+
 IOVecByteReader::IOVecByteReader(const struct iovec* iovs, size_t num_iovs) : iovs(iovs), num_iovs(num_iovs) {}
 
 uint8_t IOVecByteReader::get_u8() {
@@ -1421,6 +2534,31 @@ string StringReader::get_line(bool advance) {
   return ret;
 }
 
+template <typename T>
+static T string_reader_get_decimal(StringReader& r, bool advance) {
+  T ret;
+  size_t size = scan_number<T>(string_view(reinterpret_cast<const char*>(r.peek(0)), r.remaining()), &ret);
+  if (size == 0) {
+    throw invalid_argument("no number at current offset");
+  }
+  if (advance) {
+    r.skip(size);
+  }
+  return ret;
+}
+
+uint64_t StringReader::get_decimal_u64(bool advance) {
+  return string_reader_get_decimal<uint64_t>(*this, advance);
+}
+
+int64_t StringReader::get_decimal_s64(bool advance) {
+  return string_reader_get_decimal<int64_t>(*this, advance);
+}
+
+double StringReader::get_decimal_f64(bool advance) {
+  return string_reader_get_decimal<double>(*this, advance);
+}
+
 string StringReader::get_cstr(bool advance) {
   string ret = this->pget_cstr(this->offset);
   if (advance) {
@@ -4,11 +4,17 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include <array>
+#include <bit>
+#include <charconv>
 #include <cstdarg>
 #include <deque>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include "Encoding.hh"
@@ -175,6 +181,12 @@ std::string escape_quotes(const std::string& s);
 std::string escape_controls(const std::string& s, bool escape_non_ascii);
 std::string escape_url(const std::string& s, bool escape_slash = false);
 
+// Like the above, but append the escaped string to out instead of returning a new string. If out is reused (and
+// cleared between calls), these don't allocate memory once its capacity is large enough.
+void escape_quotes_append(std::string& out, std::string_view s);
+void escape_controls_append(std::string& out, std::string_view s, bool escape_non_ascii);
+void escape_url_append(std::string& out, std::string_view s, bool escape_slash = false);
+
 inline std::string escape_controls_ascii(const std::string& s) {
   return escape_controls(s, true);
 }
@@ -230,15 +242,122 @@ inline bool should_log(LogLevel incoming_level) {
 }
 
 void print_log_prefix(FILE* stream, LogLevel level);
+void append_log_prefix(std::string& out, LogLevel level);
+
+// By default, log messages are written to stderr synchronously. When async logging is enabled, each message is
+// instead copied into a buffer owned by the calling thread (which doesn't require any locks), and a background thread
+// writes messages from all threads' buffers to fd in batches, at least every 10ms. Messages from each thread are
+// written in order, but messages from different threads may be reordered relative to each other. The overflow policy
+// determines what happens when a thread's buffer is full: DROP discards the message (see dropped_log_message_count),
+// and BLOCK waits for the background thread to write some of the buffer's contents. disable_async_logging writes all
+// pending messages before returning; this also happens automatically at exit.
+enum class LogOverflowPolicy {
+  DROP = 0,
+  BLOCK,
+};
+// If defer_formatting is true, log calls whose arguments are all numbers or strings don't format their messages;
+// instead, they copy the arguments into the thread's buffer, and the background thread formats them later. (Calls
+// with other argument types are formatted immediately, as in the non-deferred mode.) The output is the same in both
+// modes, but in deferred mode, string arguments are copied, so this mode is only faster when most arguments are
+// numbers or short strings.
+void enable_async_logging(
+    size_t thread_buffer_size = 0x40000,
+    LogOverflowPolicy overflow_policy = LogOverflowPolicy::BLOCK,
+    int fd = 2,
+    bool defer_formatting = false);
+void disable_async_logging();
+bool async_logging_enabled();
+bool deferred_log_formatting_enabled();
+// Waits until all pending messages have been written
+void flush_log();
+size_t dropped_log_message_count();
+
+// Returns an empty per-thread string for building log lines, so logging doesn't have to allocate for each message
+std::string& log_line_buffer();
+// Writes a complete log line (including the trailing newline) to stderr or the async logging buffer
+void write_log_line(std::string_view line);
+
+// Deferred log arguments are encoded as their raw bytes (for numbers) or as a size_t length followed by the data (for
+// strings), and are decoded as the same number types or as string_views
+template <typename T>
+concept DeferredLogArgument = std::is_arithmetic_v<std::remove_cvref_t<T>> ||
+    std::is_convertible_v<const std::remove_cvref_t<T>&, std::string_view>;
+
+template <typename T>
+using DeferredLogDecodedType = std::conditional_t<
+    std::is_arithmetic_v<std::remove_cvref_t<T>>, std::remove_cvref_t<T>, std::string_view>;
+
+template <typename T>
+void encode_deferred_log_argument(std::string& out, const T& value) {
+  if constexpr (std::is_arithmetic_v<T>) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  } else {
+    std::string_view s = value;
+    size_t size = s.size();
+    out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.append(s);
+  }
+}
+
+template <typename T>
+DeferredLogDecodedType<T> decode_deferred_log_argument(const char*& data) {
+  if constexpr (std::is_arithmetic_v<std::remove_cvref_t<T>>) {
+    std::remove_cvref_t<T> value;
+    memcpy(&value, data, sizeof(value));
+    data += sizeof(value);
+    return value;
+  } else {
+    size_t size;
+    memcpy(&size, data, sizeof(size));
+    std::string_view ret(data + sizeof(size), size);
+    data += sizeof(size) + size;
+    return ret;
+  }
+}
+
+using DeferredLogFormatFn = void (*)(std::string& out, std::string_view fmt, const char* args_data);
+
+template <typename... ArgTs>
+void format_deferred_log_arguments(std::string& out, std::string_view fmt, [[maybe_unused]] const char* args_data) {
+  // Elements of a braced initializer list are evaluated in order, so the arguments are decoded in order
+  std::tuple<DeferredLogDecodedType<ArgTs>...> args{decode_deferred_log_argument<ArgTs>(args_data)...};
+  std::apply([&](auto&... decoded_args) -> void {
+    std::vformat_to(std::back_inserter(out), fmt, std::make_format_args(decoded_args...));
+  },
+      args);
+}
+
+// Returns log_line_buffer() with the record header and prefix written; the caller appends the encoded arguments and
+// calls write_deferred_log_record
+std::string& begin_deferred_log_record(
+    LogLevel level, std::string_view prefix, std::string_view fmt, DeferredLogFormatFn format_fn);
+void write_deferred_log_record(std::string& record);
+
+template <typename... ArgTs>
+void write_log_f(LogLevel level, std::string_view prefix, std::format_string<ArgTs...> fmt, ArgTs&&... args) {
+  if constexpr ((DeferredLogArgument<ArgTs> && ...)) {
+    if (deferred_log_formatting_enabled()) {
+      std::string& record = begin_deferred_log_record(
+          level, prefix, fmt.get(), &format_deferred_log_arguments<std::remove_cvref_t<ArgTs>...>);
+      (encode_deferred_log_argument<std::remove_cvref_t<ArgTs>>(record, args), ...);
+      write_deferred_log_record(record);
+      return;
+    }
+  }
+  std::string& line = log_line_buffer();
+  append_log_prefix(line, level);
+  line.append(prefix);
+  std::format_to(std::back_inserter(line), fmt, std::forward<ArgTs>(args)...);
+  line.push_back('\n');
+  write_log_line(line);
+}
 
 template <LogLevel Level, typename... ArgTs>
 bool log_f(std::format_string<ArgTs...> fmt, ArgTs&&... args) {
   if (!should_log(Level, log_level())) {
     return false;
   }
-  print_log_prefix(stderr, Level);
-  fwrite_fmt(stderr, fmt, std::forward<ArgTs>(args)...);
-  fputc('\n', stderr);
+  write_log_f(Level, "", fmt, std::forward<ArgTs>(args)...);
   return true;
 }
 
@@ -280,10 +399,7 @@ struct PrefixedLogger {
     if (!this->should_log(Level)) {
       return false;
     }
-    print_log_prefix(stderr, Level);
-    fwritex(stderr, this->prefix);
-    fwrite_fmt(stderr, fmt, std::forward<ArgTs>(args)...);
-    fputc('\n', stderr);
+    write_log_f(Level, this->prefix, fmt, std::forward<ArgTs>(args)...);
     return true;
   }
 
@@ -309,11 +425,114 @@ std::vector<std::string> split(const std::string& s, char delim, size_t max_spli
 std::vector<std::string_view> split_view(std::string_view s, char delim, size_t max_splits = 0);
 std::vector<std::wstring> split(const std::wstring& s, wchar_t delim, size_t max_splits = 0);
 std::vector<std::wstring_view> split_view(std::wstring_view s, wchar_t delim, size_t max_splits = 0);
+std::vector<std::string_view> split_any_view(std::string_view s, std::string_view delims, size_t max_splits = 0);
 std::vector<std::string> split_context(const std::string& s, char delim, size_t max_splits = 0);
 std::vector<std::string_view> split_context_view(std::string_view s, char delim, size_t max_splits = 0);
 
 std::vector<std::string> split_args(const std::string& s);
 
+// Splits a string lazily, producing each token only when the iterator reaches it, so nothing is allocated. The tokens
+// are views into the original string, so it must outlive the range and its iterators. The tokens produced are the same
+// as those returned by split_view (or split_any_view, if multiple delimiters are given). For example:
+//   for (std::string_view line : SplitRange(contents, '\n')) { ... }
+class SplitRange {
+public:
+  SplitRange(std::string_view s, char delim, size_t max_splits = 0)
+      : s(s), delim(delim), max_splits(max_splits), multiple_delims(false) {}
+  // Splits on any of the characters in delims
+  SplitRange(std::string_view s, std::string_view delims, size_t max_splits = 0)
+      : s(s), delim(delims.empty() ? '\0' : delims[0]), max_splits(max_splits), multiple_delims(delims.size() > 1) {
+    if (delims.empty()) {
+      throw std::invalid_argument("at least one delimiter is required");
+    }
+    if (this->multiple_delims) {
+      this->delim_table.fill(false);
+      for (char ch : delims) {
+        this->delim_table[static_cast<uint8_t>(ch)] = true;
+      }
+    }
+  }
+
+  class Iterator {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+
+    Iterator() = default;
+    explicit Iterator(const SplitRange* range) : range(range) {
+      this->find_token_end();
+    }
+
+    inline std::string_view operator*() const {
+      return this->range->s.substr(this->token_start, this->token_end - this->token_start);
+    }
+    inline Iterator& operator++() {
+      if (this->is_last_token) {
+        this->range = nullptr;
+      } else {
+        this->token_start = this->token_end + 1;
+        this->num_splits++;
+        this->find_token_end();
+      }
+      return *this;
+    }
+    inline void operator++(int) {
+      ++*this;
+    }
+    inline bool operator==(std::default_sentinel_t) const {
+      return this->range == nullptr;
+    }
+
+  private:
+    const SplitRange* range = nullptr;
+    size_t token_start = 0;
+    size_t token_end = 0;
+    size_t num_splits = 0;
+    bool is_last_token = false;
+
+    inline void find_token_end() {
+      size_t delim_offset = (this->range->max_splits && (this->num_splits == this->range->max_splits))
+          ? std::string_view::npos
+          : this->range->find_delimiter(this->token_start);
+      this->is_last_token = (delim_offset == std::string_view::npos);
+      this->token_end = this->is_last_token ? this->range->s.size() : delim_offset;
+    }
+  };
+
+  inline Iterator begin() const {
+    return Iterator(this);
+  }
+  inline std::default_sentinel_t end() const {
+    return std::default_sentinel;
+  }
+
+  // Returns the offset of the first delimiter at or after offset, or npos if there isn't one
+  inline size_t find_delimiter(size_t offset) const {
+    if (offset >= this->s.size()) {
+      return std::string_view::npos;
+    }
+    if (!this->multiple_delims) {
+      // memchr is vectorized in most libcs, so this is much faster than scanning byte by byte for long tokens
+      const void* found = memchr(this->s.data() + offset, this->delim, this->s.size() - offset);
+      return found ? (reinterpret_cast<const char*>(found) - this->s.data()) : std::string_view::npos;
+    }
+    for (; offset < this->s.size(); offset++) {
+      if (this->delim_table[static_cast<uint8_t>(this->s[offset])]) {
+        return offset;
+      }
+    }
+    return std::string_view::npos;
+  }
+
+private:
+  std::string_view s;
+  char delim;
+  size_t max_splits;
+  bool multiple_delims;
+  std::array<bool, 0x100> delim_table;
+};
+
 template <typename ItemContainerT, typename DelimiterT>
 std::string join(const ItemContainerT& items, DelimiterT& delim) {
   std::string ret;
@@ -415,6 +634,158 @@ std::string format_data_string(const void* data, size_t size, const void* mask =
 std::string format_size(size_t size, bool include_bytes = false);
 size_t parse_size(const char* str);
 
+// Numeric text scanning and formatting. These work on string_views and don't allocate (except for appending to the
+// output containers), so they're much faster than splitting text and calling stoull/stod on each token.
+
+// Parses a decimal unsigned integer from the beginning of s. Returns the number of characters used, or 0 if s doesn't
+// begin with a digit. Throws out_of_range if the value doesn't fit in 64 bits.
+size_t scan_decimal_u64(std::string_view s, uint64_t* value);
+// Writes the decimal representation of value to buf, which must have space for at least 20 characters. Returns the
+// number of characters written.
+size_t format_decimal_u64(char* buf, uint64_t value);
+
+// Parses a decimal number from the beginning of s. Returns the number of characters used, or 0 if s doesn't begin with
+// a number. Throws out_of_range if the value doesn't fit in T. Integers may begin with '-' if T is signed; floating-
+// point values may be in any format std::from_chars accepts (which doesn't include a leading '+').
+template <typename T>
+  requires(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>)
+size_t scan_number(std::string_view s, T* value) {
+  if constexpr (std::is_floating_point_v<T>) {
+    auto res = std::from_chars(s.data(), s.data() + s.size(), *value);
+    if (res.ec == std::errc::result_out_of_range) {
+      throw std::out_of_range("number is out of range");
+    }
+    return (res.ec == std::errc()) ? (res.ptr - s.data()) : 0;
+
+  } else {
+    bool negative = std::is_signed_v<T> && !s.empty() && (s[0] == '-');
+    uint64_t magnitude;
+    size_t digits_size = scan_decimal_u64(s.substr(negative ? 1 : 0), &magnitude);
+    if (digits_size == 0) {
+      return 0;
+    }
+    if (negative) {
+      if (magnitude > static_cast<uint64_t>(std::numeric_limits<T>::max()) + 1) {
+        throw std::out_of_range("number is out of range");
+      }
+      *value = static_cast<T>(0 - magnitude);
+      return digits_size + 1;
+    }
+    if (magnitude > static_cast<uint64_t>(std::numeric_limits<T>::max())) {
+      throw std::out_of_range("number is out of range");
+    }
+    *value = static_cast<T>(magnitude);
+    return digits_size;
+  }
+}
+
+// Parses s as a single decimal number. Throws invalid_argument if s contains anything else, or out_of_range if the
+// value doesn't fit in T.
+template <typename T>
+T parse_number(std::string_view s) {
+  T ret;
+  size_t size = scan_number<T>(s, &ret);
+  if ((size == 0) || (size != s.size())) {
+    throw std::invalid_argument("invalid number: " + std::string(s));
+  }
+  return ret;
+}
+
+// Parses all numbers in s, which are separated by any of the characters in delims, and appends them to out. Empty
+// tokens (between consecutive delimiters) are skipped. Returns the number of values parsed.
+template <typename T>
+size_t parse_numbers(std::vector<T>& out, std::string_view s, std::string_view delims = " \t\r\n,") {
+  std::array<bool, 0x100> is_delim{};
+  for (char ch : delims) {
+    is_delim[static_cast<uint8_t>(ch)] = true;
+  }
+  size_t start_size = out.size();
+  size_t offset = 0;
+  for (;;) {
+    while ((offset < s.size()) && is_delim[static_cast<uint8_t>(s[offset])]) {
+      offset++;
+    }
+    if (offset >= s.size()) {
+      break;
+    }
+    T value;
+    size_t size = scan_number<T>(s.substr(offset), &value);
+    if ((size == 0) || ((offset + size < s.size()) && !is_delim[static_cast<uint8_t>(s[offset + size])])) {
+      throw std::invalid_argument(std::format("invalid number at offset {}", offset));
+    }
+    out.emplace_back(value);
+    offset += size;
+  }
+  return out.size() - start_size;
+}
+
+template <typename T>
+std::vector<std::vector<T>> parse_number_columns(std::string_view s, char field_delim = ',') {
+  static constexpr std::string_view whitespace = " \t\r";
+  std::vector<std::vector<T>> columns;
+  size_t line_num = 0;
+  for (std::string_view line : SplitRange(s, '\n')) {
+    line_num++;
+    if (line.find_first_not_of(whitespace) == std::string_view::npos) {
+      continue;
+    }
+    bool is_first_row = columns.empty();
+    size_t column_index = 0;
+    for (std::string_view field : SplitRange(line, field_delim)) {
+      size_t start = field.find_first_not_of(whitespace);
+      field = (start == std::string_view::npos) ? std::string_view() : field.substr(start);
+      field = field.substr(0, field.find_last_not_of(whitespace) + 1);
+      if (column_index >= columns.size()) {
+        if (!is_first_row) {
+          throw std::runtime_error(std::format("line {} has too many fields", line_num));
+        }
+        columns.emplace_back();
+      }
+      columns[column_index++].emplace_back(parse_number<T>(field));
+    }
+    if (column_index < columns.size()) {
+      throw std::runtime_error(std::format("line {} has too few fields", line_num));
+    }
+  }
+  return columns;
+}
+
+// Appends the decimal representation of value to out. Floating-point values are written in the shortest form that
+// parses back to the same value.
+template <typename T>
+  requires(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>)
+void append_number(std::string& out, T value) {
+  char buf[64];
+  size_t size;
+  if constexpr (std::is_floating_point_v<T>) {
+    size = std::to_chars(buf, buf + sizeof(buf), value).ptr - buf;
+  } else if constexpr (std::is_signed_v<T>) {
+    if (value < 0) {
+      buf[0] = '-';
+      size = format_decimal_u64(buf + 1, 0 - static_cast<uint64_t>(value)) + 1;
+    } else {
+      size = format_decimal_u64(buf, value);
+    }
+  } else {
+    size = format_decimal_u64(buf, value);
+  }
+  out.append(buf, size);
+}
+
+// Returns the decimal representations of all values, separated by delim
+template <typename T>
+std::string join_numbers(const std::vector<T>& values, std::string_view delim = ",") {
+  std::string ret;
+  ret.reserve(values.size() * (delim.size() + 4));
+  for (size_t z = 0; z < values.size(); z++) {
+    if (z) {
+      ret.append(delim);
+    }
+    append_number(ret, values[z]);
+  }
+  return ret;
+}
+
 class BitReader {
 public:
   BitReader();
@@ -441,12 +812,153 @@ private:
   size_t offset;
 };
 
+// The order of bits within each byte. In MSB_FIRST order, the first bit is the high bit of the first byte, and
+// multi-bit values are stored with their high bit first. In LSB_FIRST order (used by DEFLATE, for example), the first
+// bit is the low bit of the first byte, and multi-bit values are stored with their low bit first.
+enum class BitOrder {
+  MSB_FIRST = 0,
+  LSB_FIRST,
+};
+
+// Like BitReader, but keeps up to 64 bits of the input in a register, so each read is a shift and a mask instead of a
+// loop over bits. This is meant for decoding packed formats sequentially; go() discards the cache, so seeking is
+// slower than with BitReader. In MSB_FIRST order, the results are the same as BitReader's. Unlike BitReader, reading
+// past the end throws out_of_range.
+template <BitOrder Order = BitOrder::MSB_FIRST>
+class BufferedBitReader {
+public:
+  // As for BitReader, size and offset are in bits
+  BufferedBitReader(const void* data, size_t size, size_t offset = 0)
+      : data(reinterpret_cast<const uint8_t*>(data)),
+        length(size),
+        data_bytes((size + 7) >> 3) {
+    this->go(offset);
+  }
+  BufferedBitReader(const std::string& data, size_t offset = 0)
+      : BufferedBitReader(data.data(), data.size() * 8, offset) {}
+
+  inline size_t where() const {
+    return (this->next_byte_offset << 3) - this->cache_bits;
+  }
+  inline size_t size() const {
+    return this->length;
+  }
+  inline size_t remaining() const {
+    return this->length - this->where();
+  }
+  inline bool eof() const {
+    return this->where() >= this->length;
+  }
+
+  void go(size_t offset) {
+    this->next_byte_offset = offset >> 3;
+    this->cache = 0;
+    this->cache_bits = 0;
+    if (offset & 7) {
+      this->refill();
+      this->consume(offset & 7);
+    }
+  }
+  void skip(size_t bits) {
+    size_t cached_bits_to_skip = std::min<size_t>(bits, this->cache_bits);
+    this->consume(cached_bits_to_skip);
+    if (bits > cached_bits_to_skip) {
+      this->go(this->where() + (bits - cached_bits_to_skip));
+    }
+  }
+
+  // Reads up to 64 bits; the first bit read is the high bit of the result in MSB_FIRST order, or the low bit in
+  // LSB_FIRST order
+  inline uint64_t read(uint8_t size = 1) {
+    if (size > 64) {
+      throw std::logic_error("BufferedBitReader cannot return more than 64 bits at once");
+    }
+    if (this->where() + size > this->length) {
+      throw std::out_of_range("end of bit stream");
+    }
+    if (size <= 56) [[likely]] {
+      return this->read_cached(size);
+    }
+    // The cache is only guaranteed to have 56 bits after refilling, so read large values in two pieces
+    uint64_t first = this->read_cached(32);
+    uint64_t second = this->read_cached(size - 32);
+    return (Order == BitOrder::MSB_FIRST) ? ((first << (size - 32)) | second) : (first | (second << 32));
+  }
+
+private:
+  const uint8_t* data;
+  size_t length;
+  size_t data_bytes;
+  size_t next_byte_offset;
+  // In MSB_FIRST order, the next bit is the high bit of cache; in LSB_FIRST order, it's the low bit
+  uint64_t cache;
+  uint8_t cache_bits;
+
+  // size must be 56 or less
+  inline uint64_t read_cached(uint8_t size) {
+    // Refilling unconditionally is faster than checking if it's needed, since the check is unpredictable when the
+    // read sizes vary, and refill() does nothing if the cache is already full
+    this->refill();
+    uint64_t ret;
+    if constexpr (Order == BitOrder::MSB_FIRST) {
+      // The extra shift avoids an undefined 64-bit shift when size is 0
+      ret = (this->cache >> 1) >> (63 - size);
+    } else {
+      ret = this->cache & ((1ULL << size) - 1);
+    }
+    this->consume(size);
+    return ret;
+  }
+
+  inline void consume(uint8_t size) {
+    if constexpr (Order == BitOrder::MSB_FIRST) {
+      this->cache <<= size;
+    } else {
+      this->cache >>= size;
+    }
+    this->cache_bits -= size;
+  }
+
+  // Loads whole bytes into the cache until it has at least 56 bits or the input is exhausted. Bits past the end of
+  // the cache may also be filled in from the following byte; this is harmless since they will be filled in with the
+  // same values later.
+  inline void refill() {
+    if (this->next_byte_offset + 8 <= this->data_bytes) [[likely]] {
+      uint64_t word;
+      memcpy(&word, this->data + this->next_byte_offset, 8);
+      if constexpr (Order == BitOrder::MSB_FIRST) {
+        if constexpr (std::endian::native == std::endian::little) {
+          word = bswap64(word);
+        }
+        this->cache |= word >> this->cache_bits;
+      } else {
+        if constexpr (std::endian::native == std::endian::big) {
+          word = bswap64(word);
+        }
+        this->cache |= word << this->cache_bits;
+      }
+      this->next_byte_offset += (63 - this->cache_bits) >> 3;
+      this->cache_bits |= 56;
+    } else {
+      while ((this->cache_bits < 56) && (this->next_byte_offset < this->data_bytes)) {
+        uint64_t byte = this->data[this->next_byte_offset++];
+        if constexpr (Order == BitOrder::MSB_FIRST) {
+          this->cache |= byte << (56 - this->cache_bits);
+        } else {
+          this->cache |= byte << this->cache_bits;
+        }
+        this->cache_bits += 8;
+      }
+    }
+  }
+};
+
 // This class exists because apparently vector<bool> isn't required to store its
 // elements continguously, and in many reverse-engineering situations we
 // definitely want the bits to all be contiguous.
 class BitWriter {
 public:
-  BitWriter();
+  explicit BitWriter(BitOrder order = BitOrder::MSB_FIRST);
   ~BitWriter() = default;
 
   size_t size() const;
@@ -455,6 +967,10 @@ public:
   void truncate(size_t bits);
 
   void write(bool v);
+  // Writes the low `bits` bits of value (up to 64). In MSB_FIRST order, the high bit of the value is written first,
+  // so this is equivalent to calling write(bool) for each bit from high to low; in LSB_FIRST order, the low bit is
+  // written first.
+  void write(uint64_t value, uint8_t bits);
 
   inline const std::string& str() {
     return this->data;
@@ -462,6 +978,7 @@ public:
 
 private:
   std::string data;
+  BitOrder order;
   uint8_t last_byte_unset_bits;
 };
 
@@ -482,6 +999,108 @@ struct IOVecByteReader {
 
 class StringReader {
 public:
+  // A Window is a cursor over a range of a StringReader's data. The range's bounds are checked once when the Window
+  // is created (by StringReader::window or pwindow), and the Window's reads don't check them again. This is useful for
+  // parsing structures whose size is known up front (e.g. a table of fixed-size records whose count is given in a
+  // header), where per-field bounds checks would be redundant. Reading past the end of a Window is undefined
+  // behavior, not an out_of_range exception, so only use offsets and sizes that are known to be within size().
+  class Window {
+  public:
+    Window(const void* data, size_t size) : data(reinterpret_cast<const uint8_t*>(data)), length(size), offset(0) {}
+    ~Window() = default;
+
+    inline size_t where() const {
+      return this->offset;
+    }
+    inline size_t size() const {
+      return this->length;
+    }
+    inline size_t remaining() const {
+      return this->length - this->offset;
+    }
+    inline bool eof() const {
+      return this->offset >= this->length;
+    }
+    inline void go(size_t offset) {
+      this->offset = offset;
+    }
+    inline void skip(size_t bytes) {
+      this->offset += bytes;
+    }
+
+    template <typename T>
+    const T& pget(size_t offset) const {
+      return *reinterpret_cast<const T*>(this->data + offset);
+    }
+    template <typename T>
+    const T& get(bool advance = true) {
+      const T& ret = this->pget<T>(this->offset);
+      if (advance) {
+        this->offset += sizeof(T);
+      }
+      return ret;
+    }
+    template <typename T>
+    const T* pget_array(size_t offset) const {
+      return reinterpret_cast<const T*>(this->data + offset);
+    }
+    template <typename T>
+    const T* get_array(size_t count, bool advance = true) {
+      const T* ret = this->pget_array<T>(this->offset);
+      if (advance) {
+        this->offset += count * sizeof(T);
+      }
+      return ret;
+    }
+
+    inline uint8_t get_u8(bool advance = true) { return this->get<uint8_t>(advance); }
+    inline int8_t get_s8(bool advance = true) { return this->get<int8_t>(advance); }
+    inline uint8_t pget_u8(size_t offset) const { return this->pget<uint8_t>(offset); }
+    inline int8_t pget_s8(size_t offset) const { return this->pget<int8_t>(offset); }
+
+    inline uint16_t get_u16b(bool advance = true) { return this->get<be_uint16_t>(advance); }
+    inline uint16_t get_u16l(bool advance = true) { return this->get<le_uint16_t>(advance); }
+    inline int16_t get_s16b(bool advance = true) { return this->get<be_int16_t>(advance); }
+    inline int16_t get_s16l(bool advance = true) { return this->get<le_int16_t>(advance); }
+    inline uint16_t pget_u16b(size_t offset) const { return this->pget<be_uint16_t>(offset); }
+    inline uint16_t pget_u16l(size_t offset) const { return this->pget<le_uint16_t>(offset); }
+    inline int16_t pget_s16b(size_t offset) const { return this->pget<be_int16_t>(offset); }
+    inline int16_t pget_s16l(size_t offset) const { return this->pget<le_int16_t>(offset); }
+
+    inline uint32_t get_u32b(bool advance = true) { return this->get<be_uint32_t>(advance); }
+    inline uint32_t get_u32l(bool advance = true) { return this->get<le_uint32_t>(advance); }
+    inline int32_t get_s32b(bool advance = true) { return this->get<be_int32_t>(advance); }
+    inline int32_t get_s32l(bool advance = true) { return this->get<le_int32_t>(advance); }
+    inline uint32_t pget_u32b(size_t offset) const { return this->pget<be_uint32_t>(offset); }
+    inline uint32_t pget_u32l(size_t offset) const { return this->pget<le_uint32_t>(offset); }
+    inline int32_t pget_s32b(size_t offset) const { return this->pget<be_int32_t>(offset); }
+    inline int32_t pget_s32l(size_t offset) const { return this->pget<le_int32_t>(offset); }
+
+    inline uint64_t get_u64b(bool advance = true) { return this->get<be_uint64_t>(advance); }
+    inline uint64_t get_u64l(bool advance = true) { return this->get<le_uint64_t>(advance); }
+    inline int64_t get_s64b(bool advance = true) { return this->get<be_int64_t>(advance); }
+    inline int64_t get_s64l(bool advance = true) { return this->get<le_int64_t>(advance); }
+    inline uint64_t pget_u64b(size_t offset) const { return this->pget<be_uint64_t>(offset); }
+    inline uint64_t pget_u64l(size_t offset) const { return this->pget<le_uint64_t>(offset); }
+    inline int64_t pget_s64b(size_t offset) const { return this->pget<be_int64_t>(offset); }
+    inline int64_t pget_s64l(size_t offset) const { return this->pget<le_int64_t>(offset); }
+
+    inline float get_f32b(bool advance = true) { return this->get<be_float>(advance); }
+    inline float get_f32l(bool advance = true) { return this->get<le_float>(advance); }
+    inline float pget_f32b(size_t offset) const { return this->pget<be_float>(offset); }
+    inline float pget_f32l(size_t offset) const { return this->pget<le_float>(offset); }
+
+    inline double get_f64b(bool advance = true) { return this->get<be_double>(advance); }
+    inline double get_f64l(bool advance = true) { return this->get<le_double>(advance); }
+    inline double pget_f64b(size_t offset) const { return this->pget<be_double>(offset); }
+    inline double pget_f64l(size_t offset) const { return this->pget<le_double>(offset); }
+
+  private:
+    const uint8_t* data;
+    size_t length;
+    size_t offset;
+  };
+
   StringReader();
   explicit StringReader(std::shared_ptr<std::string> data, size_t offset = 0);
   StringReader(const void* data, size_t size, size_t offset = 0);
@@ -558,6 +1177,46 @@ public:
     return ret;
   }
 
+  // These check that size bytes are available, and return a Window over them (see above)
+  inline Window pwindow(size_t offset, size_t size) const {
+    return Window(this->pgetv(offset, size), size);
+  }
+  inline Window window(size_t size, bool advance = true) {
+    return Window(this->getv(size, advance), size);
+  }
+
+  // These decode an array of endian-converted values (e.g. be_uint32_t) into native values, checking bounds only once
+  // for the whole array. The conversion loop compiles to byteswap instructions, and can be vectorized by the
+  // compiler when building for a target with a vector byte shuffle (e.g. SSSE3 or NEON).
+  template <ConvertedEndian T>
+  void pget_converted_array(size_t offset, typename T::ExposedType* out, size_t count) const {
+    const T* src = this->pget_array<T>(offset, count);
+    for (size_t z = 0; z < count; z++) {
+      out[z] = src[z].load();
+    }
+  }
+  template <ConvertedEndian T>
+  std::vector<typename T::ExposedType> pget_converted_array(size_t offset, size_t count) const {
+    std::vector<typename T::ExposedType> ret(count);
+    this->pget_converted_array<T>(offset, ret.data(), count);
+    return ret;
+  }
+  template <ConvertedEndian T>
+  void get_converted_array(typename T::ExposedType* out, size_t count, bool advance = true) {
+    this->pget_converted_array<T>(this->offset, out, count);
+    if (advance) {
+      this->offset += count * sizeof(T);
+    }
+  }
+  template <ConvertedEndian T>
+  std::vector<typename T::ExposedType> get_converted_array(size_t count, bool advance = true) {
+    auto ret = this->pget_converted_array<T>(this->offset, count);
+    if (advance) {
+      this->offset += count * sizeof(T);
+    }
+    return ret;
+  }
+
   inline uint8_t get_u8(bool advance = true) { return this->get<uint8_t>(advance); }
   inline int8_t get_s8(bool advance = true) { return this->get<int8_t>(advance); }
   inline uint8_t pget_u8(size_t offset) const { return this->pget<uint8_t>(offset); }
@@ -675,6 +1334,12 @@ public:
 
   std::string get_line(bool advance = true);
 
+  // These parse a decimal number at the current offset (without skipping any whitespace) using scan_number, and
+  // throw invalid_argument if there isn't one
+  uint64_t get_decimal_u64(bool advance = true);
+  int64_t get_decimal_s64(bool advance = true);
+  double get_decimal_f64(bool advance = true);
+
   std::string get_cstr(bool advance = true);
   std::string pget_cstr(size_t offset) const;
 
@@ -978,6 +1643,59 @@ bool print_binary_diff(
     size_t context_lines = 3,
     uint64_t base_offset = 0);
 
+// Like the above, but reads the data incrementally instead of requiring both inputs to be in memory, so memory usage
+// is bounded regardless of the input sizes. Each read function is called with a buffer and its size, and should return
+// the number of bytes read into it (or 0 at the end of its input). max_data_size is used to choose the width of the
+// offset column (if it's UINT64_MAX, the size is unknown and 16 digits are used) and the size of the read buffers; if
+// it's too small, the output is still correct, but more read calls are made. context_lines is limited to the number
+// of lines in one buffer, which is 65536 lines for large inputs.
+using BinaryDiffReadFn = std::function<size_t(void* data, size_t size)>;
+bool print_binary_diff(
+    FILE* stream,
+    const BinaryDiffReadFn& read1,
+    const BinaryDiffReadFn& read2,
+    bool use_color,
+    size_t context_lines = 3,
+    uint64_t base_offset = 0,
+    uint64_t max_data_size = UINT64_MAX);
+// Reads from two files starting at their current offsets. If both are regular files, the output is the same as if
+// their contents had been loaded and passed to the in-memory version.
+bool print_binary_diff(
+    FILE* stream,
+    FILE* file1,
+    FILE* file2,
+    bool use_color,
+    size_t context_lines = 3,
+    uint64_t base_offset = 0);
+
+// Like print_binary_diff, but finds data that was inserted, deleted, or moved, instead of comparing the two buffers
+// offset by offset. Each difference is printed as a hunk like "@@ -offset1,size1 +offset2,size2 @@", followed by the
+// removed bytes (from data1) and the added bytes (from data2), with context lines (from data2) before and after.
+// Blocks that appear in data2 before data they came after in data1 are reported as moved, without their data.
+// Returns true if the buffers are identical.
+bool print_binary_diff_aligned(
+    FILE* stream,
+    const void* data1v,
+    size_t size1,
+    const void* data2v,
+    size_t size2,
+    bool use_color,
+    size_t context_lines = 3,
+    uint64_t base_offset = 0);
+
+struct BinaryDiffMatch {
+  size_t offset1;
+  size_t offset2;
+  size_t size;
+};
+
+// Finds runs of bytes that appear in both buffers, possibly at different offsets, in time roughly proportional to
+// size1 + size2. Matches are at least block_size bytes long (0 = choose automatically based on size1), are returned in
+// order of offset2, and don't overlap in data2; they may be out of order in data1 if data was moved. If either buffer
+// is shorter than block_size, only the common prefix and suffix (of any length) are returned.
+std::vector<BinaryDiffMatch> find_binary_diff_matches(
+    const void* data1, size_t size1, const void* data2, size_t size2, size_t block_size = 0);
+
 enum FormatDataFlags {
   USE_COLOR = 0x0001, // Force color output (for diffs and non-ASCII)
   PRINT_ASCII = 0x0002, // Print ASCII view on the right
@@ -1001,6 +1719,21 @@ concept DataReader = requires(T r) {
 
 // Abstract cases of format_data (with arbitrary reader types)
 
+// Reads up to size bytes from r, and returns the number of bytes read. Readers that can copy multiple bytes at once
+// (like StringReader) are much faster than reading one byte at a time.
+template <DataReader ReaderT>
+size_t read_format_data_bytes(ReaderT& r, uint8_t* dest, size_t size) {
+  if constexpr (requires(void* p, size_t n) { { r.read(p, n) } -> std::same_as<size_t>; }) {
+    return r.read(dest, size);
+  } else {
+    size_t z = 0;
+    for (; (z < size) && !r.eof(); z++) {
+      dest[z] = r.get_u8();
+    }
+    return z;
+  }
+}
+
 template <WriteFn WriteFnT, DataReader DataReaderT, DataReader PrevReaderT, DataReader CensorReaderT>
 void format_data_custom(
     WriteFnT& write_data,
@@ -1061,6 +1794,21 @@ void format_data_custom(
   bool collapse_zero_lines = flags & FormatDataFlags::COLLAPSE_ZERO_LINES;
   bool skip_separator = flags & FormatDataFlags::SKIP_SEPARATOR;
 
+  // Lines are rendered into a buffer, which is passed to write_data when it's nearly full (and at the end), instead of
+  // calling write_data for each field
+  static constexpr char hex_digits[] = "0123456789ABCDEF";
+  std::string changed_escape, inverse_escape, normal_escape;
+  if (use_color) {
+    changed_escape = format_color_escape(TerminalFormat::FG_RED, TerminalFormat::BOLD, TerminalFormat::END);
+    inverse_escape = format_color_escape(TerminalFormat::INVERSE, TerminalFormat::END);
+    normal_escape = format_color_escape(TerminalFormat::NORMAL, TerminalFormat::END);
+  }
+  size_t max_line_size = 16 + 3 + 0x10 * (3 + changed_escape.size() + normal_escape.size()) + 3 +
+      0x10 * (1 + changed_escape.size() + inverse_escape.size() + 2 * normal_escape.size()) + 1;
+  size_t max_num_lines = (total_size >> 4) + 2;
+  std::string buffer(std::max<size_t>(std::min<size_t>(0x10000, max_num_lines * max_line_size), max_line_size), '\0');
+  size_t buffer_used = 0;
+
   LineData line_data;
   LineData prev_data;
   LineData censor_data;
@@ -1074,13 +1822,18 @@ void format_data_custom(
     uint8_t line_invalid_end_bytes = std::max<int64_t>(line_end_address - end_address, 0);
     uint8_t line_bytes = 0x10 - line_invalid_end_bytes - line_invalid_start_bytes;
 
-    // Read the data, previous, and censor for this line
-    for (size_t z = 0; z < line_bytes; z++) {
-      uint8_t data_v = data_r.get_u8();
-      line_data.u8[z + line_invalid_start_bytes] = data_v;
-      prev_data.u8[z + line_invalid_start_bytes] = prev_r.eof() ? data_v : prev_r.get_u8();
-      censor_data.u8[z + line_invalid_start_bytes] = censor_r.eof() ? 0 : censor_r.get_u8();
+    // Read the data, previous, and censor for this line. If the previous data ends before the current data, the rest
+    // of the line is treated as unchanged; if the censor data ends early, the rest of the line is not censored.
+    uint8_t* line_data_start = &line_data.u8[line_invalid_start_bytes];
+    uint8_t* prev_data_start = &prev_data.u8[line_invalid_start_bytes];
+    uint8_t* censor_data_start = &censor_data.u8[line_invalid_start_bytes];
+    if (read_format_data_bytes(data_r, line_data_start, line_bytes) < line_bytes) {
+      throw std::out_of_range("end of data");
     }
+    size_t prev_bytes = read_format_data_bytes(prev_r, prev_data_start, line_bytes);
+    memcpy(prev_data_start + prev_bytes, line_data_start + prev_bytes, line_bytes - prev_bytes);
+    size_t censor_bytes = read_format_data_bytes(censor_r, censor_data_start, line_bytes);
+    memset(censor_data_start + censor_bytes, 0, line_bytes - censor_bytes);
 
     // If the line is all zeroes, matches the previous, and is not censored, hide it
     if (collapse_zero_lines && (line_start_address > start_address) && (line_end_address < end_address) &&
@@ -1090,64 +1843,124 @@ void format_data_custom(
       continue;
     }
 
-    std::string line = std::format("{:0>{}X}{}", line_start_address, addr_width_digits, skip_separator ? "" : " |");
-    write_data(line.data(), line.size());
+    // Make sure there's enough space in the buffer for the longest possible line (every byte highlighted in both
+    // columns), flushing the buffer first if needed
+    if (buffer.size() - buffer_used < max_line_size) {
+      write_data(buffer.data(), buffer_used);
+      buffer_used = 0;
+    }
+    char* p = buffer.data() + buffer_used;
+    auto append = [&p](const std::string& s) -> void {
+      memcpy(p, s.data(), s.size());
+      p += s.size();
+    };
+
+    // The address column is zero-padded to addr_width_digits, but is never truncated
+    for (size_t z = std::max<size_t>(addr_width_digits, (std::bit_width(line_start_address) + 3) >> 2); z > 0; z--) {
+      *(p++) = hex_digits[(line_start_address >> ((z - 1) << 2)) & 0x0F];
+    }
+    if (!skip_separator) {
+      *(p++) = ' ';
+      *(p++) = '|';
+    }
 
-    {
+    // Most lines are complete and have no highlighted or censored bytes, so they don't need any per-byte checks
+    bool plain_line = !use_color && (line_bytes == 0x10) && (censor_data.u64[0] == 0) && (censor_data.u64[1] == 0);
+    if (plain_line) {
+      for (size_t x = 0; x < 0x10; x++) {
+        uint8_t current_value = line_data.u8[x];
+        p[0] = ' ';
+        p[1] = hex_digits[current_value >> 4];
+        p[2] = hex_digits[current_value & 0x0F];
+        p += 3;
+      }
+    } else {
       size_t x = 0;
       for (; x < line_invalid_start_bytes; x++) {
-        write_data("   ", 3);
+        memcpy(p, "   ", 3);
+        p += 3;
       }
       for (; x < static_cast<size_t>(0x10 - line_invalid_end_bytes); x++) {
         uint8_t current_value = line_data.u8[x];
-        uint8_t previous_value = prev_data.u8[x];
-        uint8_t censor_value = censor_data.u8[x];
-
-        if (censor_value) {
-          write_data(" --", 3);
+        if (censor_data.u8[x]) {
+          memcpy(p, " --", 3);
+          p += 3;
         } else {
-          TerminalFormatGuard<WriteFnT, TerminalFormat::FG_RED, TerminalFormat::BOLD> g(
-              write_data, use_color && (previous_value != current_value));
-          std::string field = std::format(" {:02X}", current_value);
-          write_data(field.data(), field.size());
+          bool highlight = use_color && (prev_data.u8[x] != current_value);
+          if (highlight) {
+            append(changed_escape);
+          }
+          p[0] = ' ';
+          p[1] = hex_digits[current_value >> 4];
+          p[2] = hex_digits[current_value & 0x0F];
+          p += 3;
+          if (highlight) {
+            append(normal_escape);
+          }
         }
       }
       for (; x < 0x10; x++) {
-        write_data("   ", 3);
+        memcpy(p, "   ", 3);
+        p += 3;
       }
     }
 
     if (print_ascii) {
-      write_data(" | ", skip_separator ? 1 : 3);
-
-      size_t x = 0;
-      for (; x < line_invalid_start_bytes; x++) {
-        write_data(" ", 1);
+      if (skip_separator) {
+        *(p++) = ' ';
+      } else {
+        memcpy(p, " | ", 3);
+        p += 3;
       }
-      for (; x < static_cast<size_t>(0x10 - line_invalid_end_bytes); x++) {
-        uint8_t current_value = line_data.u8[x];
-        uint8_t previous_value = prev_data.u8[x];
-        uint8_t censor_value = censor_data.u8[x];
 
-        if (censor_value) {
-          write_data("-", 1);
-        } else {
-          TerminalFormatGuard<WriteFnT, TerminalFormat::FG_RED, TerminalFormat::BOLD> g1(
-              write_data, use_color && (previous_value != current_value));
-          if ((current_value < 0x20) || (current_value >= 0x7F)) {
-            TerminalFormatGuard<WriteFnT, TerminalFormat::INVERSE> g2(write_data, use_color);
-            write_data(" ", 1);
+      if (plain_line) {
+        for (size_t x = 0; x < 0x10; x++) {
+          uint8_t current_value = line_data.u8[x];
+          p[x] = ((current_value < 0x20) || (current_value >= 0x7F)) ? ' ' : current_value;
+        }
+        p += 0x10;
+      } else {
+        size_t x = 0;
+        for (; x < line_invalid_start_bytes; x++) {
+          *(p++) = ' ';
+        }
+        for (; x < static_cast<size_t>(0x10 - line_invalid_end_bytes); x++) {
+          uint8_t current_value = line_data.u8[x];
+          if (censor_data.u8[x]) {
+            *(p++) = '-';
           } else {
-            write_data(&current_value, 1);
+            bool highlight = use_color && (prev_data.u8[x] != current_value);
+            if (highlight) {
+              append(changed_escape);
+            }
+            if ((current_value < 0x20) || (current_value >= 0x7F)) {
+              if (use_color) {
+                append(inverse_escape);
+                *(p++) = ' ';
+                append(normal_escape);
+              } else {
+                *(p++) = ' ';
+              }
+            } else {
+              *(p++) = current_value;
+            }
+            if (highlight) {
+              append(normal_escape);
+            }
           }
         }
-      }
-      for (; x < 0x10; x++) {
-        write_data(" ", 1);
+        for (; x < 0x10; x++) {
+          *(p++) = ' ';
+        }
       }
     }
 
-    write_data("\n", 1);
+    *(p++) = '\n';
+    buffer_used = p - buffer.data();
+  }
+
+  if (buffer_used) {
+    write_data(buffer.data(), buffer_used);
   }
 }
 
@@ -1,10 +1,15 @@
 #define _STDC_FORMAT_MACROS
 #include <assert.h>
 #include <inttypes.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <unistd.h>
+
+#include <thread>
 
 #include "Filesystem.hh"
 #include "Strings.hh"
+#include "Time.hh"
 #include "UnitTest.hh"
 
 using namespace std;
@@ -180,6 +185,136 @@ void test_bit_reader() {
   expect(r.eof());
 }
 
+void test_buffered_bit_reader_and_writer() {
+  fwrite_fmt(stderr, "-- BufferedBitReader/BitWriter\n");
+
+  // Reference implementations that work one bit at a time
+  auto ref_read = [](const string& data, size_t offset, uint8_t size, BitOrder order) -> uint64_t {
+    uint64_t ret = 0;
+    for (uint8_t z = 0; z < size; z++) {
+      size_t bit_offset = offset + z;
+      if (order == BitOrder::MSB_FIRST) {
+        ret = (ret << 1) | ((data[bit_offset >> 3] >> (7 - (bit_offset & 7))) & 1);
+      } else {
+        ret |= static_cast<uint64_t>((data[bit_offset >> 3] >> (bit_offset & 7)) & 1) << z;
+      }
+    }
+    return ret;
+  };
+
+  string data;
+  uint32_t state = 0x27182818;
+  for (size_t z = 0; z < 0x10000; z++) {
+    state = state * 1103515245 + 12345;
+    data.push_back(state >> 16);
+  }
+  vector<uint8_t> sizes;
+  for (size_t total = 0;;) {
+    state = state * 1103515245 + 12345;
+    uint8_t size = (state >> 16) % 65;
+    if (total + size > data.size() * 8) {
+      break;
+    }
+    sizes.emplace_back(size);
+    total += size;
+  }
+
+  {
+    BitReader r(data);
+    BufferedBitReader<BitOrder::MSB_FIRST> msb_r(data);
+    BufferedBitReader<BitOrder::LSB_FIRST> lsb_r(data);
+    BitWriter msb_w;
+    BitWriter msb_ref_w;
+    BitWriter lsb_w(BitOrder::LSB_FIRST);
+    BitWriter lsb_ref_w(BitOrder::LSB_FIRST);
+    for (uint8_t size : sizes) {
+      size_t offset = r.where();
+      uint64_t expected_msb = ref_read(data, offset, size, BitOrder::MSB_FIRST);
+      uint64_t expected_lsb = ref_read(data, offset, size, BitOrder::LSB_FIRST);
+      expect_eq(offset, msb_r.where());
+      expect_eq(offset, lsb_r.where());
+      expect_eq(expected_msb, r.read(size));
+      expect_eq(expected_msb, msb_r.read(size));
+      expect_eq(expected_lsb, lsb_r.read(size));
+
+      msb_w.write(expected_msb, size);
+      lsb_w.write(expected_lsb, size);
+      for (uint8_t z = 0; z < size; z++) {
+        msb_ref_w.write(static_cast<bool>((expected_msb >> (size - z - 1)) & 1));
+        lsb_ref_w.write(static_cast<bool>((expected_lsb >> z) & 1));
+      }
+      expect_eq(msb_ref_w.size(), msb_w.size());
+      expect_eq(lsb_ref_w.size(), lsb_w.size());
+    }
+    expect_eq(msb_ref_w.str(), msb_w.str());
+    expect_eq(lsb_ref_w.str(), lsb_w.str());
+    // Both orders should reproduce the input data exactly (except for any unwritten bits at the end)
+    expect_eq(data.substr(0, msb_w.str().size() - 1), msb_w.str().substr(0, msb_w.str().size() - 1));
+    expect_eq(data.substr(0, lsb_w.str().size() - 1), lsb_w.str().substr(0, lsb_w.str().size() - 1));
+
+    expect_raises(out_of_range, [&]() {
+      msb_r.read(msb_r.remaining() + 1);
+    });
+    msb_r.read(msb_r.remaining());
+    expect(msb_r.eof());
+  }
+
+  {
+    // Seeking and reading from a stream whose size isn't a multiple of 8 bits
+    BufferedBitReader<> r("\x01\x02\xFF\x80\xC0", 34);
+    expect_eq(0x01, r.read(8));
+    r.skip(4);
+    expect_eq(0x01, r.read(3));
+    expect_eq(0x01FF, r.read(10));
+    r.go(25);
+    expect_eq(0x00, r.read(7));
+    expect_eq(0x03, r.read(2));
+    expect(r.eof());
+    expect_raises(out_of_range, [&]() {
+      r.read(1);
+    });
+
+    BitWriter w(BitOrder::LSB_FIRST);
+    w.write(0x5, 3);
+    w.write(0x1F, 5);
+    w.write(0x3, 2);
+    expect_eq("\xFD\x03", w.str());
+    w.truncate(9);
+    expect_eq("\xFD\x01", w.str());
+  }
+
+  // Benchmark: decode the data as a sequence of fixed-size fields
+  for (uint8_t size : {3, 13}) {
+    size_t num_fields = data.size() * 8 / size;
+    auto time_fn = [&](const char* name, auto fn) -> void {
+      uint64_t start_time = now();
+      uint64_t checksum = 0;
+      for (size_t z = 0; z < 20; z++) {
+        checksum += fn();
+      }
+      uint64_t duration = now() - start_time;
+      fwrite_fmt(stderr, "-- [bit reader benchmark] {}: {} {}-bit fields in {} usecs (checksum {:016X})\n",
+          name, num_fields * 20, size, duration, checksum);
+    };
+    time_fn("BitReader", [&]() -> uint64_t {
+      BitReader r(data);
+      uint64_t ret = 0;
+      for (size_t z = 0; z < num_fields; z++) {
+        ret += r.read(size);
+      }
+      return ret;
+    });
+    time_fn("BufferedBitReader", [&]() -> uint64_t {
+      BufferedBitReader<> r(data);
+      uint64_t ret = 0;
+      for (size_t z = 0; z < num_fields; z++) {
+        ret += r.read(size);
+      }
+      return ret;
+    });
+  }
+}
+
 void test_string_reader() {
   fwrite_fmt(stderr, "-- StringReader\n");
 
@@ -356,6 +491,757 @@ void test_string_reader() {
   expect_eq(r.get_cstr(), "and this is a cstring");
   expect(r.eof());
   expect_eq(r.pget_cstr(0x3A), "and this is a cstring");
+
+  fwrite_fmt(stderr, "---- window/pwindow\n");
+  r.go(4);
+  auto w = r.window(0x1C);
+  expect_eq(r.where(), 0x20);
+  expect_eq(w.size(), 0x1C);
+  expect_eq(w.get_u8(), 0x04);
+  expect_eq(w.get_u16b(), 0x0506);
+  expect_eq(w.get_u32l(), 0x0A090807);
+  expect_eq(w.get_s8(false), 0x0B);
+  expect_eq(w.get_u64b(), 0x0B0C0D0E0F3F8000);
+  expect_eq(w.where(), 0x0F);
+  expect_eq(w.pget_f32b(0x0C), 1.0f);
+  expect_eq(w.pget_f32l(0x10), 1.0f);
+  w.go(0x14);
+  expect_eq(w.get_f64b(), 1.0);
+  expect(w.eof());
+  expect_eq(r.pwindow(0x20, 8).get_f64l(), 1.0);
+  expect_raises(out_of_range, [&]() {
+    r.window(r.remaining() + 1);
+  });
+  expect_raises(out_of_range, [&]() {
+    r.pwindow(0x48, 9);
+  });
+  expect_eq(r.where(), 0x20);
+
+  fwrite_fmt(stderr, "---- get_converted_array/pget_converted_array\n");
+  expect_eq(r.pget_converted_array<be_uint32_t>(0, 3), vector<uint32_t>({0x00010203, 0x04050607, 0x08090A0B}));
+  expect_eq(r.pget_converted_array<le_uint16_t>(1, 2), vector<uint16_t>({0x0201, 0x0403}));
+  expect_eq(r.pget_converted_array<be_float>(0x10, 1), vector<float>({1.0f}));
+  r.go(2);
+  expect_eq(r.get_converted_array<be_int16_t>(2), vector<int16_t>({0x0203, 0x0405}));
+  expect_eq(r.where(), 6);
+  int32_t converted[2];
+  r.get_converted_array<le_int32_t>(converted, 2, false);
+  expect_eq(converted[0], 0x09080706);
+  expect_eq(converted[1], 0x0D0C0B0A);
+  expect_eq(r.where(), 6);
+  expect_raises(out_of_range, [&]() {
+    r.pget_converted_array<be_uint64_t>(0x41, 2);
+  });
+}
+
+void string_reader_benchmark() {
+  string data;
+  uint32_t state = 0x16180339;
+  for (size_t z = 0; z < 0x100000; z++) {
+    state = state * 1103515245 + 12345;
+    data.append(reinterpret_cast<const char*>(&state), sizeof(state));
+  }
+  size_t count = data.size() / sizeof(uint32_t);
+
+  auto time_fn = [&](const char* name, auto fn) -> void {
+    uint64_t start_time = now();
+    uint64_t checksum = 0;
+    for (size_t z = 0; z < 10; z++) {
+      checksum += fn();
+    }
+    uint64_t duration = now() - start_time;
+    fwrite_fmt(stderr, "-- [StringReader benchmark] {}: {} bytes in {} usecs (checksum {:016X})\n",
+        name, data.size() * 10, duration, checksum);
+  };
+  // Decode the data as 16-byte records of mixed fields
+  time_fn("StringReader records", [&]() -> uint64_t {
+    StringReader r(data);
+    uint64_t ret = 0;
+    while (!r.eof()) {
+      ret += r.get_u32b();
+      ret += r.get_u16b();
+      ret += r.get_s16l();
+      ret += r.get_u8();
+      r.skip(1);
+      ret += r.get_u16l();
+      ret += r.get_u32b();
+    }
+    return ret;
+  });
+  time_fn("Window records", [&]() -> uint64_t {
+    StringReader r(data);
+    uint64_t ret = 0;
+    while (!r.eof()) {
+      auto w = r.window(16);
+      ret += w.get_u32b();
+      ret += w.get_u16b();
+      ret += w.get_s16l();
+      ret += w.get_u8();
+      w.skip(1);
+      ret += w.get_u16l();
+      ret += w.get_u32b();
+    }
+    return ret;
+  });
+
+  vector<uint32_t> values(count);
+  time_fn("get_u32b array", [&]() -> uint64_t {
+    StringReader r(data);
+    for (size_t z = 0; z < count; z++) {
+      values[z] = r.get_u32b();
+    }
+    return values[count - 1];
+  });
+  time_fn("get_converted_array", [&]() -> uint64_t {
+    StringReader r(data);
+    r.get_converted_array<be_uint32_t>(values.data(), count);
+    return values[count - 1];
+  });
+}
+
+// This is the per-field implementation that format_data_custom used before lines were rendered into a buffer. It
+// doesn't collapse zero lines, so COLLAPSE_ZERO_LINES is tested separately.
+static string reference_format_data(
+    const string& data, uint64_t start_address, const string& prev, const string& censor, uint64_t flags) {
+  string ret;
+  auto write_data = [&](const void* data, size_t size) -> void {
+    ret.append(reinterpret_cast<const char*>(data), size);
+  };
+  uint64_t end_address = start_address + data.size();
+  int addr_width_digits;
+  if (flags & FormatDataFlags::OFFSET_8_BITS) {
+    addr_width_digits = 2;
+  } else if (flags & FormatDataFlags::OFFSET_16_BITS) {
+    addr_width_digits = 4;
+  } else if (flags & FormatDataFlags::OFFSET_32_BITS) {
+    addr_width_digits = 8;
+  } else if (flags & FormatDataFlags::OFFSET_64_BITS) {
+    addr_width_digits = 16;
+  } else if (end_address > 0x100000000) {
+    addr_width_digits = 16;
+  } else if (end_address > 0x10000) {
+    addr_width_digits = 8;
+  } else if (end_address > 0x100) {
+    addr_width_digits = 4;
+  } else {
+    addr_width_digits = 2;
+  }
+  bool use_color = flags & FormatDataFlags::USE_COLOR;
+  bool skip_separator = flags & FormatDataFlags::SKIP_SEPARATOR;
+
+  for (uint64_t line_addr = start_address & (~0x0F); line_addr < end_address; line_addr += 0x10) {
+    ret += std::format("{:0>{}X}{}", line_addr, addr_width_digits, skip_separator ? "" : " |");
+    for (uint64_t addr = line_addr; addr < line_addr + 0x10; addr++) {
+      if (addr < start_address || addr >= end_address) {
+        write_data("   ", 3);
+        continue;
+      }
+      size_t offset = addr - start_address;
+      uint8_t v = data[offset];
+      if (offset < censor.size() && censor[offset]) {
+        write_data(" --", 3);
+      } else {
+        bool changed = (offset < prev.size()) && (static_cast<uint8_t>(prev[offset]) != v);
+        TerminalFormatGuard<decltype(write_data), TerminalFormat::FG_RED, TerminalFormat::BOLD> g(
+            write_data, use_color && changed);
+        ret += std::format(" {:02X}", v);
+      }
+    }
+    if (flags & FormatDataFlags::PRINT_ASCII) {
+      write_data(" | ", skip_separator ? 1 : 3);
+      for (uint64_t addr = line_addr; addr < line_addr + 0x10; addr++) {
+        if (addr < start_address || addr >= end_address) {
+          write_data(" ", 1);
+          continue;
+        }
+        size_t offset = addr - start_address;
+        uint8_t v = data[offset];
+        if (offset < censor.size() && censor[offset]) {
+          write_data("-", 1);
+        } else {
+          bool changed = (offset < prev.size()) && (static_cast<uint8_t>(prev[offset]) != v);
+          TerminalFormatGuard<decltype(write_data), TerminalFormat::FG_RED, TerminalFormat::BOLD> g1(
+              write_data, use_color && changed);
+          if ((v < 0x20) || (v >= 0x7F)) {
+            TerminalFormatGuard<decltype(write_data), TerminalFormat::INVERSE> g2(write_data, use_color);
+            write_data(" ", 1);
+          } else {
+            write_data(&v, 1);
+          }
+        }
+      }
+    }
+    write_data("\n", 1);
+  }
+  return ret;
+}
+
+void format_data_matches_reference_test() {
+  fwrite_fmt(stderr, "-- [format_data] output matches per-field implementation for all flags\n");
+  string data, prev, censor;
+  for (size_t z = 0; z < 0x123; z++) {
+    data.push_back(z * 7);
+    prev.push_back((z % 5) ? (z * 7) : z);
+    censor.push_back((z % 37) == 3);
+  }
+  prev.resize(0xF0);
+
+  static const vector<uint64_t> offset_flags = {0, FormatDataFlags::OFFSET_8_BITS, FormatDataFlags::OFFSET_16_BITS,
+      FormatDataFlags::OFFSET_32_BITS, FormatDataFlags::OFFSET_64_BITS};
+  for (uint64_t start_address : {0x0ULL, 0x3ULL, 0xFFF7ULL, 0xFFFFFFF5ULL, 0xFFFFFFFFFFF0ULL}) {
+    for (uint64_t offset_flag : offset_flags) {
+      for (uint64_t other_flags = 0; other_flags < 8; other_flags++) {
+        uint64_t flags = offset_flag |
+            ((other_flags & 1) ? FormatDataFlags::USE_COLOR : 0) |
+            ((other_flags & 2) ? FormatDataFlags::PRINT_ASCII : 0) |
+            ((other_flags & 4) ? FormatDataFlags::SKIP_SEPARATOR : 0);
+        expect_eq(reference_format_data(data, start_address, prev, censor, flags),
+            format_data(data, start_address, prev, censor, flags));
+        expect_eq(reference_format_data(data, start_address, "", "", flags), format_data(data, start_address, flags));
+      }
+    }
+  }
+
+  fwrite_fmt(stderr, "-- [format_data] COLLAPSE_ZERO_LINES\n");
+  string zeroes = data.substr(0, 0x20) + string(0x40, '\0') + data.substr(0, 0x18);
+  auto lines = split(reference_format_data(zeroes, 0, "", "", FormatDataFlags::PRINT_ASCII), '\n');
+  // Lines 2-5 are all zeroes, so they should be omitted
+  lines.erase(lines.begin() + 2, lines.begin() + 6);
+  string expected = join(lines, "\n");
+  expect_eq(expected, format_data(zeroes, 0, FormatDataFlags::PRINT_ASCII | FormatDataFlags::COLLAPSE_ZERO_LINES));
+
+  string large(0x1000000, '\0');
+  for (size_t z = 0; z < large.size(); z++) {
+    large[z] = z * 0x9D;
+  }
+  uint64_t start_time = now();
+  string formatted = format_data(large, 0, FormatDataFlags::PRINT_ASCII);
+  uint64_t duration = now() - start_time;
+  fwrite_fmt(stderr, "-- [format_data] 16MB in {} usecs ({:g} GB/sec)\n",
+      duration, static_cast<double>(large.size()) / (std::max<uint64_t>(duration, 1) * 1000.0));
+}
+
+void numbers_test() {
+  fwrite_fmt(stderr, "-- scan_number/parse_number\n");
+  expect_eq(0, parse_number<uint64_t>("0"));
+  expect_eq(1234567890123456789ULL, parse_number<uint64_t>("1234567890123456789"));
+  expect_eq(UINT64_MAX, parse_number<uint64_t>("18446744073709551615"));
+  expect_eq(1, parse_number<uint64_t>("00000000000000000000000001"));
+  expect_raises(out_of_range, [&]() {
+    parse_number<uint64_t>("18446744073709551616");
+  });
+  expect_eq(INT64_MIN, parse_number<int64_t>("-9223372036854775808"));
+  expect_eq(INT64_MAX, parse_number<int64_t>("9223372036854775807"));
+  expect_raises(out_of_range, [&]() {
+    parse_number<int64_t>("-9223372036854775809");
+  });
+  expect_eq(-128, parse_number<int8_t>("-128"));
+  expect_raises(out_of_range, [&]() {
+    parse_number<int8_t>("128");
+  });
+  expect_raises(out_of_range, [&]() {
+    parse_number<uint16_t>("65536");
+  });
+  expect_eq(3.25, parse_number<double>("3.25"));
+  expect_eq(-1e10, parse_number<double>("-1e10"));
+  expect_eq(0.5f, parse_number<float>("0.5"));
+  for (const char* invalid : {"", "-", "12a", " 12", "-5"}) {
+    expect_raises(invalid_argument, [&]() {
+      parse_number<uint32_t>(invalid);
+    });
+  }
+  uint64_t value = 7;
+  expect_eq(0, scan_number<uint64_t>("x123", &value));
+  expect_eq(7, value);
+  expect_eq(12, scan_number<uint64_t>("123456789012,345", &value));
+  expect_eq(123456789012, value);
+
+  fwrite_fmt(stderr, "-- parse_numbers/parse_number_columns\n");
+  vector<int32_t> ints{99};
+  expect_eq(5, parse_numbers(ints, "1, 2,3\n-4\t\t5\n"));
+  expect_eq(vector<int32_t>({99, 1, 2, 3, -4, 5}), ints);
+  vector<double> doubles;
+  expect_eq(3, parse_numbers(doubles, "1.5;-2;3e3", ";"));
+  expect_eq(vector<double>({1.5, -2.0, 3000.0}), doubles);
+  expect_raises(invalid_argument, [&]() {
+    parse_numbers(ints, "1,2,x");
+  });
+  auto columns = parse_number_columns<uint64_t>("1,2,3\r\n 4 , 5 ,6\n\n7,8,9\n");
+  expect_eq(3, columns.size());
+  expect_eq(vector<uint64_t>({1, 4, 7}), columns[0]);
+  expect_eq(vector<uint64_t>({2, 5, 8}), columns[1]);
+  expect_eq(vector<uint64_t>({3, 6, 9}), columns[2]);
+  expect_raises(runtime_error, [&]() {
+    parse_number_columns<uint64_t>("1,2,3\n4,5\n");
+  });
+  expect_raises(runtime_error, [&]() {
+    parse_number_columns<uint64_t>("1,2\n4,5,6\n");
+  });
+
+  fwrite_fmt(stderr, "-- append_number/join_numbers\n");
+  expect_eq("0,9,10,99,100,12345,18446744073709551615",
+      join_numbers(vector<uint64_t>({0, 9, 10, 99, 100, 12345, UINT64_MAX})));
+  expect_eq("-9223372036854775808 -1 0 7", join_numbers(vector<int64_t>({INT64_MIN, -1, 0, 7}), " "));
+  expect_eq("-128,127", join_numbers(vector<int8_t>({-128, 127})));
+  expect_eq("0.1,-2.5,1e+20", join_numbers(vector<double>({0.1, -2.5, 1e20})));
+  uint32_t state = 0x12345678;
+  for (size_t z = 0; z < 10000; z++) {
+    state = state * 1103515245 + 12345;
+    uint64_t v = (static_cast<uint64_t>(state) << 32) | (state * 7);
+    v >>= (z % 64);
+    string s;
+    append_number(s, v);
+    expect_eq(std::to_string(v), s);
+    expect_eq(v, parse_number<uint64_t>(s));
+  }
+
+  fwrite_fmt(stderr, "-- StringReader::get_decimal_*\n");
+  string decimal_data = "123 -45 6.5x";
+  StringReader r(decimal_data);
+  expect_eq(123, r.get_decimal_u64());
+  r.skip(1);
+  expect_eq(-45, r.get_decimal_s64(false));
+  expect_eq(-45, r.get_decimal_s64());
+  r.skip(1);
+  expect_eq(6.5, r.get_decimal_f64());
+  expect_raises(invalid_argument, [&]() {
+    r.get_decimal_u64();
+  });
+  expect_eq('x', r.get_s8());
+  expect_raises(invalid_argument, [&]() {
+    r.get_decimal_u64();
+  });
+
+  string data;
+  vector<uint64_t> values;
+  for (size_t z = 0; z < 1000000; z++) {
+    state = state * 1103515245 + 12345;
+    values.emplace_back(static_cast<uint64_t>(state) * (z % 1000));
+  }
+  uint64_t start_time = now();
+  data = join_numbers(values, "\n");
+  uint64_t duration = now() - start_time;
+  fwrite_fmt(stderr, "-- [numbers benchmark] join_numbers: {} values in {} usecs\n", values.size(), duration);
+
+  start_time = now();
+  string std_data;
+  for (uint64_t v : values) {
+    std_data += std::to_string(v);
+    std_data.push_back('\n');
+  }
+  duration = now() - start_time;
+  std_data.pop_back();
+  expect_eq(std_data, data);
+  fwrite_fmt(stderr, "-- [numbers benchmark] to_string: {} values in {} usecs\n", values.size(), duration);
+
+  start_time = now();
+  vector<uint64_t> parsed;
+  parse_numbers(parsed, data);
+  duration = now() - start_time;
+  expect_eq(values, parsed);
+  fwrite_fmt(stderr, "-- [numbers benchmark] parse_numbers: {} values in {} usecs\n", values.size(), duration);
+
+  start_time = now();
+  parsed.clear();
+  for (const auto& token : split(data, '\n')) {
+    parsed.emplace_back(stoull(token));
+  }
+  duration = now() - start_time;
+  expect_eq(values, parsed);
+  fwrite_fmt(stderr, "-- [numbers benchmark] split+stoull: {} values in {} usecs\n", values.size(), duration);
+}
+
+void split_benchmark() {
+  string data;
+  uint32_t state = 0x31415926;
+  for (size_t z = 0; z < 200000; z++) {
+    state = state * 1103515245 + 12345;
+    data += std::format("{:08X} INFO [component {}] request {} completed in {} usecs\n",
+        z, (state >> 16) & 0x0F, z * 7, (state >> 8) & 0xFFF);
+  }
+
+  auto time_fn = [&](const char* name, auto fn) -> void {
+    uint64_t start_time = now();
+    size_t total_size = fn();
+    uint64_t duration = now() - start_time;
+    fwrite_fmt(stderr, "-- [split benchmark] {}: {} bytes of tokens in {} usecs\n", name, total_size, duration);
+  };
+  size_t expected_size = 0;
+  time_fn("split", [&]() -> size_t {
+    for (const auto& line : split(data, '\n')) {
+      expected_size += line.size();
+    }
+    return expected_size;
+  });
+  time_fn("split_view", [&]() -> size_t {
+    size_t total_size = 0;
+    for (const auto& line : split_view(data, '\n')) {
+      total_size += line.size();
+    }
+    expect_eq(expected_size, total_size);
+    return total_size;
+  });
+  time_fn("SplitRange", [&]() -> size_t {
+    size_t total_size = 0;
+    for (string_view line : SplitRange(data, '\n')) {
+      total_size += line.size();
+    }
+    expect_eq(expected_size, total_size);
+    return total_size;
+  });
+  time_fn("SplitRange (multiple delimiters)", [&]() -> size_t {
+    size_t total_size = 0;
+    for (string_view token : SplitRange(data, " \n")) {
+      total_size += token.size();
+    }
+    return total_size;
+  });
+}
+
+void async_logging_test(bool defer_formatting) {
+  const char* mode_str = defer_formatting ? "deferred formatting" : "immediate formatting";
+  fwrite_fmt(stderr, "-- async logging ({})\n", mode_str);
+  int fd = open("StringsTest-log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  expect_ge(fd, 0);
+
+  expect(!async_logging_enabled());
+  enable_async_logging(0x1000, LogOverflowPolicy::BLOCK, fd, defer_formatting);
+  expect(async_logging_enabled());
+  expect_eq(defer_formatting, deferred_log_formatting_enabled());
+  expect_raises(logic_error, [&]() {
+    enable_async_logging();
+  });
+
+  static constexpr size_t NUM_THREADS = 4;
+  static constexpr size_t NUM_MESSAGES = 5000;
+  PrefixedLogger logger("[prefix] ");
+  vector<thread> threads;
+  for (size_t thread_num = 0; thread_num < NUM_THREADS; thread_num++) {
+    threads.emplace_back([&, thread_num]() -> void {
+      for (size_t z = 0; z < NUM_MESSAGES; z++) {
+        logger.info_f("thread {} message {}", thread_num, z);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  // This line is larger than the thread's buffer, so it's written directly
+  log_warning_f("{}", string(0x2000, 'x'));
+  log_debug_f("this message is below the log level and should not be written");
+  // Arguments of all the types that can be deferred should be formatted the same way as in immediate mode
+  string s = "string";
+  string_view sv = "view";
+  const char* cs = "cstr";
+  uint32_t u32 = 0xDEADBEEF;
+  int8_t s8 = -5;
+  log_error_f("{} {} {} {} {:08X} {} {:.3f} {:c} {} {}", s, sv, cs, "literal", u32, s8, 3.14159, 'c', true, 42);
+  s = "changed after logging";
+  disable_async_logging();
+  expect(!async_logging_enabled());
+
+  // All messages from each thread should be present, in order, and have the same prefix format as synchronous logs
+  auto lines = split(load_file("StringsTest-log"), '\n');
+  expect_eq(NUM_THREADS * NUM_MESSAGES + 3, lines.size());
+  expect_eq("", lines.back());
+  string expected_prefix;
+  append_log_prefix(expected_prefix, LogLevel::L_INFO);
+  vector<size_t> next_message_nums(NUM_THREADS, 0);
+  size_t num_warning_lines = 0;
+  size_t num_error_lines = 0;
+  for (size_t z = 0; z < lines.size() - 1; z++) {
+    const string& line = lines[z];
+    if (line.starts_with("E ")) {
+      expect(line.ends_with(" - string view cstr literal DEADBEEF -5 3.142 c true 42"));
+      num_error_lines++;
+      continue;
+    }
+    if (line.starts_with("W ")) {
+      expect_eq(string(0x2000, 'x'), line.substr(line.size() - 0x2000));
+      num_warning_lines++;
+      continue;
+    }
+    expect(line.starts_with(std::format("I {} ", getpid())));
+    size_t message_offset = line.find(" - [prefix] thread ");
+    expect_eq(expected_prefix.size() - 3, message_offset);
+    auto tokens = split(line.substr(message_offset + 19), ' ');
+    expect_eq(3, tokens.size());
+    size_t thread_num = stoul(tokens[0]);
+    expect_eq(next_message_nums.at(thread_num)++, stoul(tokens[2]));
+  }
+  expect_eq(1, num_warning_lines);
+  expect_eq(1, num_error_lines);
+  for (size_t num : next_message_nums) {
+    expect_eq(NUM_MESSAGES, num);
+  }
+
+  fwrite_fmt(stderr, "-- async logging with DROP overflow policy ({})\n", mode_str);
+  expect_eq(0, ftruncate(fd, 0));
+  expect_eq(0, lseek(fd, 0, SEEK_SET));
+  // dropped_log_message_count is cumulative over the life of the process
+  size_t prev_dropped_count = dropped_log_message_count();
+  enable_async_logging(0x100, LogOverflowPolicy::DROP, fd, defer_formatting);
+  for (size_t z = 0; z < NUM_MESSAGES; z++) {
+    log_info_f("message {}", z);
+  }
+  flush_log();
+  size_t dropped_count = dropped_log_message_count() - prev_dropped_count;
+  disable_async_logging();
+  lines = split(load_file("StringsTest-log"), '\n');
+  expect_eq(NUM_MESSAGES + 1, lines.size() + dropped_count);
+
+  fwrite_fmt(stderr, "-- async logging throughput ({})\n", mode_str);
+  close(fd);
+  fd = open("/dev/null", O_WRONLY);
+  expect_ge(fd, 0);
+  enable_async_logging(0x100000, LogOverflowPolicy::BLOCK, fd, defer_formatting);
+  uint64_t start_time = now();
+  for (size_t z = 0; z < 100000; z++) {
+    log_info_f("message {} with some additional text", z);
+  }
+  uint64_t log_duration = now() - start_time;
+  disable_async_logging();
+  uint64_t total_duration = now() - start_time;
+  fwrite_fmt(stderr, "-- [async logging] 100000 messages with {}: {} usecs to log, {} usecs including writing\n",
+      mode_str, log_duration, total_duration);
+  close(fd);
+  unlink("StringsTest-log");
+}
+
+static string binary_diff_output(const string& data1, const string& data2, size_t context_lines, bool* is_identical) {
+  {
+    auto f = fopen_unique("StringsTest-data", "w");
+    *is_identical = print_binary_diff(
+        f.get(), data1.data(), data1.size(), data2.data(), data2.size(), false, context_lines);
+  }
+  return load_file("StringsTest-data");
+}
+
+static string binary_diff_streaming_output(
+    const string& data1, const string& data2, size_t context_lines, bool* is_identical) {
+  save_file("StringsTest-data1", data1);
+  save_file("StringsTest-data2", data2);
+  {
+    auto f = fopen_unique("StringsTest-data", "w");
+    auto f1 = fopen_unique("StringsTest-data1", "rb");
+    auto f2 = fopen_unique("StringsTest-data2", "rb");
+    *is_identical = print_binary_diff(f.get(), f1.get(), f2.get(), false, context_lines);
+  }
+  unlink("StringsTest-data1");
+  unlink("StringsTest-data2");
+  return load_file("StringsTest-data");
+}
+
+void binary_diff_streaming_test() {
+  fwrite_fmt(stderr, "-- [print_binary_diff] differences and context across block boundaries\n");
+  string data1(0x100100, '\0');
+  for (size_t z = 0; z < data1.size(); z += 0x1000) {
+    data1[z] = 'A';
+  }
+  string data2 = data1;
+  data2[0xFFFF5] = 'x';
+  data2[0x100013] = 'y';
+  data2.resize(0x1000F8);
+
+  const string expected =
+      "  ...\n"
+      "  000FFFD0 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n"
+      "  000FFFE0 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n"
+      "- 000FFFF0 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n"
+      "+ 000FFFF0 | 00 00 00 00 00 78 00 00 00 00 00 00 00 00 00 00 |      x          \n"
+      "  00100000 | 41 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 | A               \n"
+      "- 00100010 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n"
+      "+ 00100010 | 00 00 00 79 00 00 00 00 00 00 00 00 00 00 00 00 |    y            \n"
+      "  00100020 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n"
+      "  00100030 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n"
+      "  ...\n"
+      "  001000D0 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n"
+      "  001000E0 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n"
+      "- 001000F0 | 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 |                 \n"
+      "+ 001000F0 | 00 00 00 00 00 00 00 00                         |                 \n";
+  bool is_identical;
+  expect_eq(expected, binary_diff_output(data1, data2, 2, &is_identical));
+  expect(!is_identical);
+  expect_eq(expected, binary_diff_streaming_output(data1, data2, 2, &is_identical));
+  expect(!is_identical);
+  expect_eq("", binary_diff_streaming_output(data1, data1, 2, &is_identical));
+  expect(is_identical);
+
+  fwrite_fmt(stderr, "-- [print_binary_diff] more context lines than fit in one block\n");
+  string data5(0x300000, '\0');
+  string data6 = data5;
+  data6[0x280000] = 'z';
+  // The leading context is limited to one block (0x10000 lines), and the trailing context runs to the end of the data
+  auto lines = split(binary_diff_streaming_output(data5, data6, 0x20000, &is_identical), '\n');
+  expect(!is_identical);
+  expect_eq(0x18003, lines.size());
+  expect_eq("  ...", lines[0]);
+  expect(lines[1].starts_with("  00180000 |"));
+  expect(lines[0x10001].starts_with("- 00280000 |"));
+  expect(lines[0x10002].starts_with("+ 00280000 |"));
+  expect(lines[0x18001].starts_with("  002FFFF0 |"));
+
+  fwrite_fmt(stderr, "-- [print_binary_diff] underestimated max_data_size\n");
+  {
+    string small1 = data1.substr(0xFF000, 0x100);
+    string small2 = data2.substr(0xFF000, 0x100);
+    small2[0x35] = 'q';
+    small2[0xC1] = 'r';
+    StringReader r1(small1);
+    StringReader r2(small2);
+    string output;
+    {
+      auto f = fopen_unique("StringsTest-data", "w");
+      is_identical = print_binary_diff(
+          f.get(),
+          [&](void* data, size_t size) -> size_t { return r1.read(data, size); },
+          [&](void* data, size_t size) -> size_t { return r2.read(data, size); },
+          false, 1, 0, 0x20);
+    }
+    expect(!is_identical);
+    expect_eq(binary_diff_output(small1, small2, 1, &is_identical), load_file("StringsTest-data"));
+  }
+
+  fwrite_fmt(stderr, "-- [print_binary_diff] streaming output matches in-memory output\n");
+  uint32_t state = 0x2468ACE0;
+  string data3(0x280000, '\0');
+  for (size_t z = 0; z < data3.size(); z++) {
+    state = state * 1103515245 + 12345;
+    data3[z] = state >> 16;
+  }
+  string data4 = data3;
+  for (size_t offset : {0x00, 0x35, 0xFFFFF, 0x100000, 0x1FFFE0, 0x200020, 0x27FFFF}) {
+    data4[offset] ^= 0x20;
+  }
+  for (size_t context_lines : {0, 1, 4}) {
+    bool streaming_is_identical;
+    expect_eq(binary_diff_output(data3, data4, context_lines, &is_identical),
+        binary_diff_streaming_output(data3, data4, context_lines, &streaming_is_identical));
+    expect_eq(is_identical, streaming_is_identical);
+    expect_eq(binary_diff_output(data3, data4.substr(0, 0x1FFFF7), context_lines, &is_identical),
+        binary_diff_streaming_output(data3, data4.substr(0, 0x1FFFF7), context_lines, &streaming_is_identical));
+    expect_eq(is_identical, streaming_is_identical);
+  }
+
+  string large(0x4000000, '\0');
+  for (size_t z = 0; z < large.size(); z += 0x100) {
+    large[z] = z >> 8;
+  }
+  uint64_t start_time = now();
+  binary_diff_output(large, large, 3, &is_identical);
+  uint64_t duration = now() - start_time;
+  expect(is_identical);
+  fwrite_fmt(stderr, "-- [print_binary_diff] identical 64MB inputs in {} usecs\n", duration);
+}
+
+static string binary_diff_aligned_output(const string& data1, const string& data2, size_t context_lines, bool* is_identical) {
+  {
+    auto f = fopen_unique("StringsTest-data", "w");
+    *is_identical = print_binary_diff_aligned(
+        f.get(), data1.data(), data1.size(), data2.data(), data2.size(), false, context_lines);
+  }
+  return load_file("StringsTest-data");
+}
+
+void binary_diff_aligned_test() {
+  fwrite_fmt(stderr, "-- [print_binary_diff_aligned] insertions, deletions, and moves\n");
+  string data1;
+  uint32_t state = 0x13579BDF;
+  for (size_t z = 0; z < 0x10000; z++) {
+    state = state * 1103515245 + 12345;
+    data1.push_back(state >> 16);
+  }
+
+  bool is_identical;
+  expect_eq("", binary_diff_aligned_output(data1, data1, 3, &is_identical));
+  expect(is_identical);
+
+  // Insert 5 bytes at 0x1003, delete 7 bytes at 0x8000, and move 0x200 bytes from 0x100 to the end
+  string data2 = data1.substr(0, 0x100) + data1.substr(0x300, 0x1003 - 0x300) + "ABCDE" +
+      data1.substr(0x1003, 0x8000 - 0x1003) + data1.substr(0x8007) + data1.substr(0x100, 0x200);
+  auto matches = find_binary_diff_matches(data1.data(), data1.size(), data2.data(), data2.size());
+  const vector<BinaryDiffMatch> expected_matches{
+      {0x0000, 0x0000, 0x0100},
+      {0x0300, 0x0100, 0x0D03},
+      {0x1003, 0x0E08, 0x6FFD},
+      {0x8007, 0x7E05, 0x7FF9},
+      {0x0100, 0xFDFE, 0x0200},
+  };
+  expect_eq(expected_matches.size(), matches.size());
+  for (size_t z = 0; z < matches.size(); z++) {
+    expect_eq(expected_matches[z].offset1, matches[z].offset1);
+    expect_eq(expected_matches[z].offset2, matches[z].offset2);
+    expect_eq(expected_matches[z].size, matches[z].size);
+  }
+
+  string output = binary_diff_aligned_output(data1, data2, 0, &is_identical);
+  expect(!is_identical);
+  expect(output.starts_with("@@ -100,200 +100,0 @@\n- 0100 |"));
+  auto lines = split(output, '\n');
+  vector<string> headers;
+  for (const auto& line : lines) {
+    if (line.starts_with("@@")) {
+      headers.emplace_back(line);
+    }
+  }
+  expect_eq(4, headers.size());
+  expect_eq("@@ -100,200 +100,0 @@", headers[0]);
+  expect_eq("@@ -1003,0 +E03,5 @@", headers[1]);
+  expect_eq("@@ -8000,7 +7E05,0 @@", headers[2]);
+  expect_eq("@@ moved -100,200 +FDFE,200 @@", headers[3]);
+
+  fwrite_fmt(stderr, "-- [print_binary_diff_aligned] completely different data\n");
+  string data3(0x1000, 'x');
+  output = binary_diff_aligned_output(data1.substr(0, 0x1000), data3, 0, &is_identical);
+  expect(!is_identical);
+  expect(output.starts_with("@@ -0,1000 +0,1000 @@\n- 0000 |"));
+  expect_eq(0x202, split(output, '\n').size());
+
+  fwrite_fmt(stderr, "-- [print_binary_diff_aligned] inputs shorter than the block size\n");
+  expect_eq("", binary_diff_aligned_output("", "", 3, &is_identical));
+  expect(is_identical);
+  expect_eq("", binary_diff_aligned_output("short data", "short data", 3, &is_identical));
+  expect(is_identical);
+  matches = find_binary_diff_matches("abcdef", 6, "abcXdef", 7);
+  expect_eq(2, matches.size());
+  expect_eq(0, matches[0].offset1);
+  expect_eq(0, matches[0].offset2);
+  expect_eq(3, matches[0].size);
+  expect_eq(3, matches[1].offset1);
+  expect_eq(4, matches[1].offset2);
+  expect_eq(3, matches[1].size);
+  output = binary_diff_aligned_output("abcdef", "abcXdef", 0, &is_identical);
+  expect(!is_identical);
+  expect_eq("@@ -3,0 +3,1 @@\n+ 00 |          58                                     |    X            \n", output);
+  // One input is long enough for the block index, but the other isn't
+  output = binary_diff_aligned_output(data1.substr(0, 0x100), data1.substr(0, 0x10), 0, &is_identical);
+  expect(!is_identical);
+  expect(output.starts_with("@@ -10,F0 +10,0 @@\n"));
+  // data1 has exactly one or two blocks, so the block index is very small
+  for (size_t num_blocks = 1; num_blocks <= 2; num_blocks++) {
+    string small1 = data1.substr(0x100, num_blocks * 0x20);
+    string small2 = "prefix" + small1 + "suffix";
+    matches = find_binary_diff_matches(small1.data(), small1.size(), small2.data(), small2.size());
+    expect_eq(1, matches.size());
+    expect_eq(0, matches[0].offset1);
+    expect_eq(6, matches[0].offset2);
+    expect_eq(small1.size(), matches[0].size);
+    output = binary_diff_aligned_output(small1, small2, 0, &is_identical);
+    expect(!is_identical);
+    expect(output.starts_with("@@ -0,0 +0,6 @@\n"));
+  }
+
+  string large1(0x4000000, '\0');
+  for (size_t z = 0; z < large1.size(); z++) {
+    state = state * 1103515245 + 12345;
+    large1[z] = state >> 16;
+  }
+  string large2 = large1.substr(0, 0x1000000) + "inserted" + large1.substr(0x1000000, 0x2000000) + large1.substr(0x3000100);
+  uint64_t start_time = now();
+  matches = find_binary_diff_matches(large1.data(), large1.size(), large2.data(), large2.size());
+  uint64_t duration = now() - start_time;
+  expect_eq(3, matches.size());
+  fwrite_fmt(stderr, "-- [print_binary_diff_aligned] find_binary_diff_matches on 64MB: {} usecs\n", duration);
 }
 
 int main(int, char**) {
@@ -516,6 +1402,31 @@ int main(int, char**) {
     expect_eq(vector<string_view>({"12", "34", "567", "", ""}), split_view("12,34,567,,", ','));
     expect_eq(vector<string_view>({""}), split_view("", ','));
     expect_eq(vector<string_view>({"a", "b", "c d e f"}), split_view("a b c d e f", ' ', 2));
+    expect_eq(vector<wstring>({L"12", L"34\u0100", L"567"}), split(L"12\u012C34\u0100\u012C567", L'\u012C'));
+  }
+
+  {
+    fwrite_fmt(stderr, "-- SplitRange/split_any_view\n");
+    auto collect = [](SplitRange&& range) -> vector<string_view> {
+      vector<string_view> ret;
+      for (string_view token : range) {
+        ret.emplace_back(token);
+      }
+      return ret;
+    };
+    expect_eq(vector<string_view>({"12", "34", "567", "abc"}), collect(SplitRange("12,34,567,abc", ',')));
+    expect_eq(vector<string_view>({"12", "34", "567", "", ""}), collect(SplitRange("12,34,567,,", ',')));
+    expect_eq(vector<string_view>({""}), collect(SplitRange("", ',')));
+    expect_eq(vector<string_view>({"a", "b", "c d e f"}), collect(SplitRange("a b c d e f", ' ', 2)));
+    expect_eq(vector<string_view>({"a", "b", "c", "", "d"}), collect(SplitRange("a b\tc\n\nd", " \t\n")));
+    expect_eq(vector<string_view>({"a", "b", "c\n\nd"}), collect(SplitRange("a b\tc\n\nd", " \t\n", 2)));
+    expect_eq(vector<string_view>({"12", "34"}), collect(SplitRange("12,34", ",")));
+    expect_eq(vector<string_view>({"", "", ""}), split_any_view(";,", ",;"));
+    expect_eq(vector<string_view>({"k", "v", "k2", "v2"}), split_any_view("k=v&k2=v2", "=&"));
+    expect_eq(3, std::ranges::distance(SplitRange("a/b/c", '/')));
+    expect_raises(invalid_argument, [&]() {
+      SplitRange("abc", "");
+    });
   }
 
   {
@@ -713,13 +1624,54 @@ int main(int, char**) {
     expect_eq("omg%20hax", escape_url("omg hax"));
     expect_eq("slash/es", escape_url("slash/es"));
     expect_eq("slash%2Fes", escape_url("slash/es", true));
+    expect_eq("%C3%A9t%C3%A9%3F%20a=b&c", escape_url("\xC3\xA9t\xC3\xA9? a=b&c"));
+  }
+
+  fwrite_fmt(stderr, "-- escape_controls\n");
+  {
+    expect_eq("", escape_controls_ascii(""));
+    expect_eq("omg hax", escape_controls_ascii("omg hax"));
+    expect_eq("\\\'omg\\\' \\\"hax\\\" \\\\ \\t\\r\\n\\f\\b\\a\\v",
+        escape_controls_ascii("\'omg\' \"hax\" \\ \t\r\n\f\b\a\v"));
+    expect_eq("\\x00\\x1B\\x7F\\xC3\\xA9", escape_controls_ascii(string("\x00\x1B\x7F\xC3\xA9", 5)));
+    expect_eq("\\x00\\x1B\\x7F\xC3\xA9", escape_controls_utf8(string("\x00\x1B\x7F\xC3\xA9", 5)));
+  }
+
+  fwrite_fmt(stderr, "-- escape_*_append\n");
+  {
+    string out = "prefix:";
+    escape_quotes_append(out, "a\"b");
+    expect_eq("prefix:a\\\"b", out);
+    escape_controls_append(out, "\n", true);
+    expect_eq("prefix:a\\\"b\\n", out);
+    escape_url_append(out, "/ x");
+    expect_eq("prefix:a\\\"b\\n/%20x", out);
+    escape_url_append(out, "clean");
+    expect_eq("prefix:a\\\"b\\n/%20xclean", out);
+
+    // 26 bytes are hex-escaped (+3 bytes each) and 10 have named escapes (+1 byte each)
+    string all_bytes;
+    for (size_t z = 0; z < 0x100; z++) {
+      all_bytes.push_back(z);
+    }
+    out.clear();
+    escape_controls_append(out, all_bytes, false);
+    expect_eq(escape_controls_utf8(all_bytes), out);
+    expect_eq(all_bytes.size() + 26 * 3 + 10, out.size());
   }
 
   print_data_test();
+  format_data_matches_reference_test();
+  split_benchmark();
+  numbers_test();
+  binary_diff_streaming_test();
+  binary_diff_aligned_test();
 
   test_bit_reader();
+  test_buffered_bit_reader_and_writer();
 
   test_string_reader();
+  string_reader_benchmark();
 
   fwrite_fmt(stderr, "-- parse_positional\n");
   {
@@ -741,6 +1693,9 @@ int main(int, char**) {
     expect_eq(0, ss2);
   }
 
+  async_logging_test(false);
+  async_logging_test(true);
+
   // TODO: test log_level, set_log_level, log
   // TODO: test get_time_string
   // TODO: test string_for_error
@@ -0,0 +1,442 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <format>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Filesystem.hh"
+#include "Image.hh"
+#include "LRUMap.hh"
+#include "Tools.hh"
+
+namespace phosg {
+
+// An image that is stored as a grid of square tiles, for canvases too large to fit in a single allocation (or in
+// memory at all). Tiles are allocated only when they're first written to; until then, they read as the background
+// color. If max_resident_tiles is not zero, at most that many tiles are kept in memory, and the least-recently-used
+// tiles are moved to a temporary swap file when more are needed.
+//
+// The drawing and copying functions have the same semantics as the corresponding functions on Image. TiledImage is not
+// thread-safe, except that for_each_tile may call its callback on multiple threads.
+template <PixelFormat Format>
+class TiledImage {
+public:
+  TiledImage(size_t w, size_t h, uint32_t background_color = 0x00000000, size_t tile_size = 256, size_t max_resident_tiles = 0)
+      : w(w),
+        h(h),
+        background_color(background_color),
+        tile_size(check_tile_size(tile_size)),
+        tiles_w((w + this->tile_size - 1) / this->tile_size),
+        tiles_h((h + this->tile_size - 1) / this->tile_size),
+        max_resident_tiles(max_resident_tiles),
+        tile_states(this->tiles_w * this->tiles_h, TileState::UNALLOCATED),
+        num_pinned_tiles(0),
+        swap_file(nullptr, fclose),
+        cached_tile_index(SIZE_MAX),
+        cached_tile(nullptr) {
+    this->tile_slot_size = Image<Format>(tile_size, 1).data_size() * tile_size;
+  }
+  TiledImage(const TiledImage&) = delete;
+  TiledImage(TiledImage&&) = delete;
+  TiledImage& operator=(const TiledImage&) = delete;
+  TiledImage& operator=(TiledImage&&) = delete;
+  ~TiledImage() = default;
+
+  size_t get_width() const {
+    return this->w;
+  }
+  size_t get_height() const {
+    return this->h;
+  }
+  size_t get_tile_size() const {
+    return this->tile_size;
+  }
+  // Returns the number of tiles that are currently in memory
+  size_t resident_tile_count() const {
+    return this->resident_tiles.count() + this->num_pinned_tiles;
+  }
+
+  bool check(size_t x, size_t y) const {
+    return (x < this->w) && (y < this->h);
+  }
+
+  uint32_t read(size_t x, size_t y) const {
+    size_t index = this->tile_index_for_pixel(x, y);
+    if (this->tile_states[index] == TileState::UNALLOCATED) {
+      return this->background_color;
+    }
+    return this->tile(index).read(x % this->tile_size, y % this->tile_size);
+  }
+  void write(size_t x, size_t y, uint32_t color) {
+    this->tile(this->tile_index_for_pixel(x, y)).write(x % this->tile_size, y % this->tile_size, color);
+  }
+
+  /////////////////////////////////////////////////////////////////////////////
+  // Tile access
+
+  // Calls fn(tile, x, y) for each tile in the image, where (x, y) is the position of the tile's upper-left corner. This
+  // allocates all tiles that aren't already allocated. If num_threads is not 1, tiles are processed in parallel on the
+  // shared ThreadPool, with at most num_threads calls running at once (0 means as many as the pool has threads); each
+  // tile is only given to one call at a time, and tiles in use are never evicted.
+  template <typename FnT>
+    requires(std::is_invocable_v<FnT, Image<Format>&, size_t, size_t>)
+  void for_each_tile(FnT&& fn, size_t num_threads = 1) {
+    size_t num_tiles = this->tile_states.size();
+    if (num_threads == 1) {
+      for (size_t index = 0; index < num_tiles; index++) {
+        fn(this->tile(index), (index % this->tiles_w) * this->tile_size, (index / this->tiles_w) * this->tile_size);
+      }
+      return;
+    }
+
+    std::mutex tiles_lock;
+    parallel<size_t>(&ThreadPool::shared(), [&](size_t index, size_t) -> bool {
+      Image<Format> tile;
+      {
+        std::lock_guard g(tiles_lock);
+        tile = this->pin_tile(index);
+      }
+      auto unpin = on_close_scope([&]() -> void {
+        std::lock_guard g(tiles_lock);
+        this->unpin_tile(index, std::move(tile));
+      });
+      fn(tile, (index % this->tiles_w) * this->tile_size, (index / this->tiles_w) * this->tile_size);
+      return false;
+    },
+        0, num_tiles, num_threads, nullptr);
+  }
+
+  // Returns a copy of the given region as a single Image
+  Image<Format> to_image(size_t x, size_t y, size_t w, size_t h) const {
+    Image<Format> ret(w, h, this->background_color);
+    this->for_each_tile_in_rect(x, y, w, h, [&](size_t index, ssize_t tile_x, ssize_t tile_y) -> void {
+      if (this->tile_states[index] != TileState::UNALLOCATED) {
+        ret.copy_from(this->tile(index), 0, 0, w, h, x - tile_x, y - tile_y);
+      }
+    });
+    return ret;
+  }
+  Image<Format> to_image() const {
+    return this->to_image(0, 0, this->w, this->h);
+  }
+
+  /////////////////////////////////////////////////////////////////////////////
+  // Drawing and blitting functions
+
+  void clear(uint32_t color) {
+    this->resident_tiles.clear();
+    this->cached_tile_index = SIZE_MAX;
+    this->cached_tile = nullptr;
+    std::fill(this->tile_states.begin(), this->tile_states.end(), TileState::UNALLOCATED);
+    this->swap_file.reset();
+    this->background_color = color;
+  }
+
+  void write_rect(ssize_t x, ssize_t y, ssize_t w, ssize_t h, uint32_t color) {
+    this->for_each_tile_in_rect(x, y, w, h, [&](size_t index, ssize_t tile_x, ssize_t tile_y) -> void {
+      this->tile(index).write_rect(x - tile_x, y - tile_y, w, h, color);
+    });
+  }
+  void blend_rect(ssize_t x, ssize_t y, ssize_t w, ssize_t h, uint32_t color) {
+    this->for_each_tile_in_rect(x, y, w, h, [&](size_t index, ssize_t tile_x, ssize_t tile_y) -> void {
+      this->tile(index).blend_rect(x - tile_x, y - tile_y, w, h, color);
+    });
+  }
+
+  template <PixelFormat SourceFormat>
+  void copy_from(const Image<SourceFormat>& src, ssize_t dst_x, ssize_t dst_y, ssize_t w, ssize_t h, ssize_t src_x, ssize_t src_y) {
+    this->for_each_tile_in_rect(dst_x, dst_y, w, h, [&](size_t index, ssize_t tile_x, ssize_t tile_y) -> void {
+      this->tile(index).copy_from(src, dst_x - tile_x, dst_y - tile_y, w, h, src_x, src_y);
+    });
+  }
+  template <PixelFormat SourceFormat>
+  void copy_from_with_blend(
+      const Image<SourceFormat>& src, ssize_t dst_x, ssize_t dst_y, ssize_t w, ssize_t h, ssize_t src_x, ssize_t src_y) {
+    this->for_each_tile_in_rect(dst_x, dst_y, w, h, [&](size_t index, ssize_t tile_x, ssize_t tile_y) -> void {
+      this->tile(index).copy_from_with_blend(src, dst_x - tile_x, dst_y - tile_y, w, h, src_x, src_y);
+    });
+  }
+
+  // Uses the Bresenham algorithm to draw a line between the specified points, like Image::draw_line_custom.
+  template <typename FnT>
+    requires(std::is_invocable_r_v<void, FnT, size_t, size_t>)
+  void draw_line_custom(ssize_t x0, ssize_t y0, ssize_t x1, ssize_t y1, FnT fn) {
+    bool steep = abs(y1 - y0) > abs(x1 - x0);
+    if (steep) {
+      std::swap(x0, y0);
+      std::swap(x1, y1);
+    }
+    if (x0 > x1) {
+      std::swap(x0, x1);
+      std::swap(y0, y1);
+    }
+
+    ssize_t dx = x1 - x0;
+    ssize_t dy = abs(y1 - y0);
+    double error = 0;
+    double derror = (double)dy / (double)dx;
+    ssize_t ystep = (y0 < y1) ? 1 : -1;
+    ssize_t y = y0;
+    for (ssize_t x = x0; x <= x1; x++) {
+      if (steep) {
+        if (this->check(y, x)) {
+          fn(y, x);
+        }
+      } else {
+        if (this->check(x, y)) {
+          fn(x, y);
+        }
+      }
+      error += derror;
+      if (error >= 0.5) {
+        y += ystep;
+        error -= 1.0;
+      }
+    }
+  }
+
+  void draw_line(ssize_t x0, ssize_t y0, ssize_t x1, ssize_t y1, uint32_t color) {
+    this->draw_line_custom(x0, y0, x1, y1, [this, color](size_t x, size_t y) -> void {
+      this->write(x, y, color);
+    });
+  }
+
+  void draw_horizontal_line(ssize_t x1, ssize_t x2, ssize_t y, ssize_t dash_length, uint32_t color) {
+    if (y < 0 || y >= static_cast<ssize_t>(this->h)) {
+      return;
+    }
+    x1 = std::max<ssize_t>(x1, 0);
+    x2 = std::min<ssize_t>(x2, this->w - 1);
+    for (ssize_t x = x1; x <= x2; x++) {
+      if (!dash_length || !((x / dash_length) & 1)) {
+        this->write(x, y, color);
+      }
+    }
+  }
+
+  void draw_vertical_line(ssize_t x, ssize_t y1, ssize_t y2, ssize_t dash_length, uint32_t color) {
+    if (x < 0 || x >= static_cast<ssize_t>(this->w)) {
+      return;
+    }
+    y1 = std::max<ssize_t>(y1, 0);
+    y2 = std::min<ssize_t>(y2, this->h - 1);
+    for (ssize_t y = y1; y <= y2; y++) {
+      if (!dash_length || !((y / dash_length) & 1)) {
+        this->write(x, y, color);
+      }
+    }
+  }
+
+  void draw_rect(ssize_t x, ssize_t y, ssize_t w, ssize_t h, uint32_t color) {
+    if (w <= 0 || h <= 0) {
+      return;
+    }
+    this->draw_horizontal_line(x, x + w - 1, y, 0, color);
+    this->draw_horizontal_line(x, x + w - 1, y + h - 1, 0, color);
+    this->draw_vertical_line(x, y + 1, y + h - 1, 0, color);
+    this->draw_vertical_line(x + w - 1, y + 1, y + h - 1, 0, color);
+  }
+
+  template <typename... ArgTs>
+  void draw_text(
+      ssize_t x,
+      ssize_t y,
+      ssize_t* width,
+      ssize_t* height,
+      uint32_t text_color,
+      uint32_t bg_color,
+      std::format_string<ArgTs...> fmt,
+      ArgTs&&... args) {
+    std::string text = std::format(std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+
+    // Image::draw_text draws a 1-pixel background border around the text, so only tiles that overlap that area need to
+    // be drawn on
+    auto [text_w, text_h] = Image<Format>::measure_text("{}", text);
+    this->for_each_tile_in_rect(x - 1, y - 1, text_w + 1, text_h + 2, [&](size_t index, ssize_t tile_x, ssize_t tile_y) -> void {
+      this->tile(index).draw_text(x - tile_x, y - tile_y, text_color, bg_color, "{}", text);
+    });
+    if (width) {
+      *width = text_w;
+    }
+    if (height) {
+      *height = text_h;
+    }
+  }
+  template <typename... ArgTs>
+  void draw_text(
+      ssize_t x, ssize_t y, uint32_t text_color, uint32_t bg_color, std::format_string<ArgTs...> fmt, ArgTs&&... args) {
+    this->draw_text(
+        x, y, nullptr, nullptr, text_color, bg_color,
+        std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+  }
+  template <typename... ArgTs>
+  void draw_text(ssize_t x, ssize_t y, uint32_t text_color, std::format_string<ArgTs...> fmt, ArgTs&&... args) {
+    this->draw_text(
+        x, y, nullptr, nullptr, text_color, 0x00000000,
+        std::forward<std::format_string<ArgTs...>>(fmt), std::forward<ArgTs>(args)...);
+  }
+
+private:
+  enum class TileState : uint8_t {
+    UNALLOCATED = 0, // Never written; reads as the background color
+    RESIDENT, // In memory, either in resident_tiles or pinned by for_each_tile
+    SWAPPED, // In the swap file
+  };
+
+  size_t w;
+  size_t h;
+  uint32_t background_color;
+  size_t tile_size;
+  size_t tiles_w;
+  size_t tiles_h;
+  size_t max_resident_tiles;
+  size_t tile_slot_size; // Bytes per tile in the swap file
+
+  // Tile management state is mutable because reading a pixel may require loading a tile from the swap file
+  mutable std::vector<TileState> tile_states;
+  mutable LRUMap<size_t, Image<Format>> resident_tiles;
+  mutable size_t num_pinned_tiles;
+  mutable std::unique_ptr<FILE, int (*)(FILE*)> swap_file;
+  // The most recently used tile, so that consecutive accesses to the same tile don't need to look it up
+  mutable size_t cached_tile_index;
+  mutable Image<Format>* cached_tile;
+
+  // This is called in the constructor's initializer list, so the tile size is checked before anything divides by it
+  static size_t check_tile_size(size_t tile_size) {
+    if (tile_size == 0) {
+      throw std::invalid_argument("tile size must not be zero");
+    }
+    return tile_size;
+  }
+
+  size_t tile_index_for_pixel(size_t x, size_t y) const {
+    if (!this->check(x, y)) {
+      throw std::out_of_range("pixel is outside of the image");
+    }
+    return (y / this->tile_size) * this->tiles_w + (x / this->tile_size);
+  }
+
+  // Calls fn(index, tile_x, tile_y) for each tile that overlaps the given rect, where (tile_x, tile_y) is the tile's
+  // upper-left corner
+  template <typename FnT>
+  void for_each_tile_in_rect(ssize_t x, ssize_t y, ssize_t w, ssize_t h, FnT&& fn) const {
+    ssize_t start_x = std::max<ssize_t>(x, 0);
+    ssize_t start_y = std::max<ssize_t>(y, 0);
+    ssize_t end_x = std::min<ssize_t>(x + w, this->w);
+    ssize_t end_y = std::min<ssize_t>(y + h, this->h);
+    if (start_x >= end_x || start_y >= end_y) {
+      return;
+    }
+    for (size_t ty = start_y / this->tile_size; ty <= (end_y - 1) / this->tile_size; ty++) {
+      for (size_t tx = start_x / this->tile_size; tx <= (end_x - 1) / this->tile_size; tx++) {
+        fn(ty * this->tiles_w + tx, tx * this->tile_size, ty * this->tile_size);
+      }
+    }
+  }
+
+  size_t tile_byte_offset(size_t index) const {
+    // Every tile gets a full-size slot in the swap file, so edge tiles waste some space. The file is sparse, so only
+    // tiles that have actually been swapped out use any disk space
+    return index * this->tile_slot_size;
+  }
+
+  // Loads or creates a tile and returns it. The tile is not in resident_tiles afterward; the caller is responsible for
+  // putting it there (or for keeping track of it otherwise).
+  Image<Format> take_tile(size_t index) const {
+    if (this->cached_tile_index == index) {
+      this->cached_tile_index = SIZE_MAX;
+      this->cached_tile = nullptr;
+    }
+
+    size_t tile_x = index % this->tiles_w;
+    size_t tile_y = index / this->tiles_w;
+    size_t tile_w = std::min<size_t>(this->tile_size, this->w - tile_x * this->tile_size);
+    size_t tile_h = std::min<size_t>(this->tile_size, this->h - tile_y * this->tile_size);
+
+    switch (this->tile_states[index]) {
+      case TileState::UNALLOCATED:
+        this->tile_states[index] = TileState::RESIDENT;
+        return Image<Format>(tile_w, tile_h, this->background_color);
+      case TileState::RESIDENT: {
+        Image<Format> ret = std::move(this->resident_tiles.at(index));
+        this->resident_tiles.erase(index);
+        return ret;
+      }
+      case TileState::SWAPPED: {
+        Image<Format> ret(tile_w, tile_h);
+        preadx(fileno(this->swap_file.get()), ret.pixels, ret.data_size(), this->tile_byte_offset(index));
+        this->tile_states[index] = TileState::RESIDENT;
+        return ret;
+      }
+      default:
+        throw std::logic_error("invalid tile state");
+    }
+  }
+
+  // Moves tiles to the swap file until there is room for one more resident tile. Tiles that are pinned can't be
+  // evicted, so this may leave more than max_resident_tiles in memory if many tiles are pinned.
+  void evict_tiles_for_new_tile() const {
+    if (this->max_resident_tiles == 0) {
+      return;
+    }
+    while (!this->resident_tiles.empty() && (this->resident_tile_count() >= this->max_resident_tiles)) {
+      auto evicted = this->resident_tiles.evict_object();
+      if (!this->swap_file) {
+        this->swap_file.reset(tmpfile());
+        if (!this->swap_file) {
+          throw std::runtime_error("cannot create swap file for tiled image");
+        }
+      }
+      pwritex(fileno(this->swap_file.get()), evicted.value.pixels, evicted.value.data_size(),
+          this->tile_byte_offset(evicted.key));
+      this->tile_states[evicted.key] = TileState::SWAPPED;
+      if (this->cached_tile_index == evicted.key) {
+        this->cached_tile_index = SIZE_MAX;
+        this->cached_tile = nullptr;
+      }
+    }
+  }
+
+  Image<Format>& tile(size_t index) const {
+    if (this->cached_tile_index == index) {
+      return *this->cached_tile;
+    }
+    if (this->tile_states[index] == TileState::RESIDENT) {
+      this->cached_tile = &this->resident_tiles.at(index);
+    } else {
+      this->evict_tiles_for_new_tile();
+      Image<Format> tile = this->take_tile(index);
+      this->resident_tiles.emplace(size_t(index), std::move(tile));
+      this->cached_tile = &this->resident_tiles.at(index);
+    }
+    this->cached_tile_index = index;
+    return *this->cached_tile;
+  }
+
+  Image<Format> pin_tile(size_t index) {
+    if (this->tile_states[index] != TileState::RESIDENT) {
+      this->evict_tiles_for_new_tile();
+    }
+    Image<Format> ret = this->take_tile(index);
+    this->num_pinned_tiles++;
+    return ret;
+  }
+
+  void unpin_tile(size_t index, Image<Format>&& tile) {
+    this->num_pinned_tiles--;
+    this->resident_tiles.emplace(size_t(index), std::move(tile));
+    // If tiles were loaded while this one was pinned, there may be more than max_resident_tiles in memory now
+    if (this->max_resident_tiles && (this->resident_tile_count() > this->max_resident_tiles)) {
+      this->evict_tiles_for_new_tile();
+    }
+  }
+};
+
+} // namespace phosg
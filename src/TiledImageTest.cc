@@ -0,0 +1,157 @@
+#include <stdio.h>
+
+#include <atomic>
+#include <format>
+#include <vector>
+
+#include "Image.hh"
+#include "Strings.hh"
+#include "TiledImage.hh"
+#include "UnitTest.hh"
+
+using namespace std;
+using namespace phosg;
+
+template <PixelFormat Format>
+static void expect_images_equal(const Image<Format>& a, const Image<Format>& b) {
+  expect_eq(a.get_width(), b.get_width());
+  expect_eq(a.get_height(), b.get_height());
+  for (size_t y = 0; y < a.get_height(); y++) {
+    for (size_t x = 0; x < a.get_width(); x++) {
+      if (a.read(x, y) != b.read(x, y)) {
+        throw runtime_error(std::format("images differ at ({}, {}): {:08X} vs {:08X}", x, y, a.read(x, y), b.read(x, y)));
+      }
+    }
+  }
+}
+
+static void test_lazy_allocation() {
+  fwrite_fmt(stderr, "-- lazy allocation\n");
+  TiledImage<PixelFormat::RGBA8888_NATIVE> img(100000, 100000, 0x204060FF, 256);
+  expect_eq(img.get_width(), 100000);
+  expect_eq(img.get_height(), 100000);
+  expect_eq(img.read(0, 0), 0x204060FF);
+  expect_eq(img.read(99999, 99999), 0x204060FF);
+  expect_eq(img.resident_tile_count(), 0);
+
+  img.write(50000, 50000, 0xFF0000FF);
+  expect_eq(img.resident_tile_count(), 1);
+  expect_eq(img.read(50000, 50000), 0xFF0000FF);
+  expect_eq(img.read(50001, 50000), 0x204060FF);
+
+  expect_raises(out_of_range, [&]() {
+    img.read(100000, 0);
+  });
+  expect_raises(out_of_range, [&]() {
+    img.write(0, 100000, 0);
+  });
+
+  img.clear(0x000000FF);
+  expect_eq(img.resident_tile_count(), 0);
+  expect_eq(img.read(50000, 50000), 0x000000FF);
+
+  expect_raises(invalid_argument, [&]() {
+    TiledImage<PixelFormat::RGBA8888_NATIVE>(100, 100, 0x000000FF, 0);
+  });
+}
+
+static void test_drawing_matches_image() {
+  fwrite_fmt(stderr, "-- drawing across tile boundaries\n");
+  // Use a tile size that doesn't divide the image size, so there are partial tiles at the right and bottom edges
+  TiledImage<PixelFormat::RGBA8888_NATIVE> tiled(203, 151, 0x000000FF, 32);
+  Image<PixelFormat::RGBA8888_NATIVE> ref(203, 151, 0x000000FF);
+
+  Image<PixelFormat::RGBA8888_NATIVE> sprite(50, 40);
+  for (size_t y = 0; y < 40; y++) {
+    for (size_t x = 0; x < 50; x++) {
+      sprite.write(x, y, rgba8888(x * 5, y * 6, x ^ y, (x + y) * 3));
+    }
+  }
+
+  auto draw_all = [&](auto& img) -> void {
+    img.write_rect(-10, 20, 100, 50, 0x804020FF);
+    img.blend_rect(20, 10, 150, 70, 0x00FF0080);
+    img.draw_line(0, 0, 202, 150, 0xFFFFFFFF);
+    img.draw_line(190, 5, 3, 140, 0xFF00FFFF);
+    img.draw_horizontal_line(-5, 250, 100, 7, 0x00FFFFFF);
+    img.draw_vertical_line(63, -5, 200, 5, 0xFFFF00FF);
+    img.draw_rect(30, 30, 100, 80, 0x0000FFFF);
+    img.copy_from(sprite, 25, 90, 50, 40, 0, 0);
+    img.copy_from_with_blend(sprite, 170, 120, 50, 40, 0, 0);
+    img.draw_text(60, 28, 0xFFFFFFFF, 0x00000080, "Text across\ntile edges {}", 42);
+  };
+  draw_all(tiled);
+  draw_all(ref);
+
+  expect_images_equal(tiled.to_image(), ref);
+  auto sub = tiled.to_image(20, 30, 100, 60);
+  Image<PixelFormat::RGBA8888_NATIVE> ref_sub(100, 60);
+  ref_sub.copy_from(ref, 0, 0, 100, 60, 20, 30);
+  expect_images_equal(sub, ref_sub);
+
+  ssize_t tiled_w, tiled_h, ref_w, ref_h;
+  tiled.draw_text(500, 500, &tiled_w, &tiled_h, 0xFFFFFFFF, 0x00000000, "abc\ndefgh");
+  ref.draw_text(500, 500, &ref_w, &ref_h, 0xFFFFFFFF, 0x00000000, "abc\ndefgh");
+  expect_eq(tiled_w, ref_w);
+  expect_eq(tiled_h, ref_h);
+}
+
+static void test_eviction() {
+  fwrite_fmt(stderr, "-- eviction to swap file\n");
+  TiledImage<PixelFormat::RGB888> img(1000, 1000, 0x000000FF, 64, 3);
+  for (size_t y = 0; y < 1000; y++) {
+    for (size_t x = 0; x < 1000; x++) {
+      img.write(x, y, rgba8888(x, y, x + y, 0xFF));
+    }
+    expect_le(img.resident_tile_count(), 3);
+  }
+  for (size_t y = 0; y < 1000; y++) {
+    for (size_t x = 0; x < 1000; x++) {
+      expect_eq(img.read(x, y), rgba8888(x, y, x + y, 0xFF));
+    }
+  }
+  expect_le(img.resident_tile_count(), 3);
+}
+
+static void test_for_each_tile(size_t num_threads) {
+  fwrite_fmt(stderr, "-- for_each_tile with {} threads\n", num_threads);
+  TiledImage<PixelFormat::RGBA8888_NATIVE> img(700, 500, 0x000000FF, 64, 4);
+  atomic<size_t> num_tiles = 0;
+  atomic<size_t> num_active = 0;
+  atomic<size_t> max_active = 0;
+  img.for_each_tile([&](Image<PixelFormat::RGBA8888_NATIVE>& tile, size_t tile_x, size_t tile_y) -> void {
+    size_t active = ++num_active;
+    size_t prev_max = max_active.load();
+    while ((active > prev_max) && !max_active.compare_exchange_weak(prev_max, active)) {
+    }
+    auto dec_active = on_close_scope([&]() -> void {
+      num_active--;
+    });
+    for (size_t y = 0; y < tile.get_height(); y++) {
+      for (size_t x = 0; x < tile.get_width(); x++) {
+        tile.write(x, y, rgba8888(tile_x + x, tile_y + y, 0x80, 0xFF));
+      }
+    }
+    num_tiles++;
+  }, num_threads);
+  expect_eq(num_tiles.load(), 11 * 8);
+  if (num_threads != 0) {
+    expect_le(max_active.load(), num_threads);
+  }
+  for (size_t y = 0; y < 500; y++) {
+    for (size_t x = 0; x < 700; x++) {
+      expect_eq(img.read(x, y), rgba8888(x, y, 0x80, 0xFF));
+    }
+  }
+}
+
+int main(int, char**) {
+  test_lazy_allocation();
+  test_drawing_matches_image();
+  test_eviction();
+  test_for_each_tile(1);
+  test_for_each_tile(2);
+  test_for_each_tile(0);
+  fwrite_fmt(stdout, "TiledImageTest: all tests passed\n");
+  return 0;
+}
@@ -10,4 +10,270 @@ CallOnDestroy::~CallOnDestroy() {
   this->f();
 }
 
+struct ThreadPool::Task {
+  function<void()> fn;
+  TaskGroup* group;
+};
+
+struct alignas(64) ThreadPool::Worker {
+  mutex lock;
+  deque<Task> tasks;
+};
+
+static thread_local const ThreadPool* current_pool = nullptr;
+static thread_local size_t current_pool_thread_num = 0;
+
+ThreadPool::TaskGroup::TaskGroup(ThreadPool& pool)
+    : pool(pool),
+      pending_count(0) {}
+
+ThreadPool::TaskGroup::~TaskGroup() {
+  try {
+    this->wait();
+  } catch (...) {
+  }
+}
+
+void ThreadPool::TaskGroup::run(function<void()> fn) {
+  this->pending_count++;
+  this->pool.push(Task{std::move(fn), this});
+}
+
+void ThreadPool::TaskGroup::wait() {
+  size_t thread_num = this->pool.current_thread_num();
+  while (this->pending_count.load() > 0) {
+    // run other tasks while waiting, so that waiting from within a task (e.g. for nested parallelism) can't deadlock
+    // the pool
+    if (this->pool.run_one_task(thread_num)) {
+      continue;
+    }
+    unique_lock<mutex> g(this->pool.idle_lock);
+    this->pool.idle_cv.wait(g, [&]() -> bool {
+      return (this->pending_count.load() == 0) || (this->pool.queued_count.load() > 0);
+    });
+  }
+
+  exception_ptr exc;
+  {
+    lock_guard<mutex> g(this->exception_lock);
+    exc = std::move(this->exception);
+    this->exception = nullptr;
+  }
+  if (exc) {
+    rethrow_exception(exc);
+  }
+}
+
+ThreadPool::ThreadPool(size_t num_threads)
+    : queued_count(0),
+      next_external_worker(0),
+      should_exit(false) {
+  if (num_threads == 0) {
+    num_threads = thread::hardware_concurrency();
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  while (this->workers.size() < num_threads) {
+    this->workers.emplace_back(make_unique<Worker>());
+  }
+  while (this->threads.size() < num_threads) {
+    this->threads.emplace_back(&ThreadPool::worker_thread_fn, this, this->threads.size());
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> g(this->idle_lock);
+    this->should_exit = true;
+  }
+  this->idle_cv.notify_all();
+  for (auto& t : this->threads) {
+    t.join();
+  }
+}
+
+ThreadPool& ThreadPool::shared() {
+  static ThreadPool pool;
+  return pool;
+}
+
+size_t ThreadPool::size() const {
+  return this->workers.size();
+}
+
+size_t ThreadPool::current_thread_num() const {
+  return (current_pool == this) ? current_pool_thread_num : this->workers.size();
+}
+
+void ThreadPool::push(Task&& t) {
+  // tasks created by a worker go on that worker's own queue, since they're likely to use data that's already in that
+  // core's cache. tasks created by other threads are distributed round-robin
+  size_t thread_num = this->current_thread_num();
+  if (thread_num >= this->workers.size()) {
+    thread_num = this->next_external_worker.fetch_add(1, memory_order_relaxed) % this->workers.size();
+  }
+  {
+    auto& w = *this->workers[thread_num];
+    lock_guard<mutex> g(w.lock);
+    w.tasks.emplace_back(std::move(t));
+  }
+  this->queued_count++;
+
+  // the lock ensures that a thread that's about to go idle either sees the new value of queued_count or is already
+  // waiting on the condition variable
+  {
+    lock_guard<mutex> g(this->idle_lock);
+  }
+  this->idle_cv.notify_one();
+}
+
+bool ThreadPool::run_one_task(size_t thread_num) {
+  if (this->queued_count.load() == 0) {
+    return false;
+  }
+
+  // take the most recently-pushed task from our own queue if possible; otherwise, steal the oldest task from another
+  // worker's queue
+  Task t;
+  bool found = false;
+  if (thread_num < this->workers.size()) {
+    auto& w = *this->workers[thread_num];
+    lock_guard<mutex> g(w.lock);
+    if (!w.tasks.empty()) {
+      t = std::move(w.tasks.back());
+      w.tasks.pop_back();
+      found = true;
+    }
+  }
+  for (size_t z = 1; !found && (z <= this->workers.size()); z++) {
+    auto& w = *this->workers[(thread_num + z) % this->workers.size()];
+    lock_guard<mutex> g(w.lock);
+    if (!w.tasks.empty()) {
+      t = std::move(w.tasks.front());
+      w.tasks.pop_front();
+      found = true;
+    }
+  }
+  if (!found) {
+    return false;
+  }
+  this->queued_count--;
+
+  try {
+    t.fn();
+  } catch (...) {
+    lock_guard<mutex> g(t.group->exception_lock);
+    if (!t.group->exception) {
+      t.group->exception = current_exception();
+    }
+  }
+
+  // the group may be destroyed as soon as its pending count reaches zero, so we must not touch it after decrementing
+  if (t.group->pending_count.fetch_sub(1) == 1) {
+    {
+      lock_guard<mutex> g(this->idle_lock);
+    }
+    this->idle_cv.notify_all();
+  }
+  return true;
+}
+
+void ThreadPool::run_chunks(size_t num_chunks, const function<void(size_t)>& fn) {
+  TaskGroup g(*this);
+  size_t num_tasks = min<size_t>(num_chunks, this->workers.size());
+  for (size_t z = 1; z < num_tasks; z++) {
+    g.run([&fn, z]() -> void {
+      fn(z);
+    });
+  }
+  // the calling thread does some of the work too, instead of just waiting
+  try {
+    fn(0);
+  } catch (...) {
+    g.wait();
+    throw;
+  }
+  g.wait();
+}
+
+void ThreadPool::worker_thread_fn(size_t thread_num) {
+  current_pool = this;
+  current_pool_thread_num = thread_num;
+  for (;;) {
+    if (this->run_one_task(thread_num)) {
+      continue;
+    }
+    unique_lock<mutex> g(this->idle_lock);
+    this->idle_cv.wait(g, [&]() -> bool {
+      return this->should_exit || (this->queued_count.load() > 0);
+    });
+    if (this->should_exit) {
+      return;
+    }
+  }
+}
+
+ParallelWorkers::ParallelWorkers(ThreadPool* pool, size_t num_threads, function<void(size_t)> fn)
+    : fn(std::move(fn)),
+      num_workers(num_threads),
+      num_finished(0) {
+  if (pool) {
+    this->group = make_unique<ThreadPool::TaskGroup>(*pool);
+    for (size_t z = 0; z < num_threads; z++) {
+      this->group->run([this, z]() -> void {
+        this->run_worker(z);
+      });
+    }
+  } else {
+    while (this->threads.size() < num_threads) {
+      this->threads.emplace_back(&ParallelWorkers::run_worker, this, this->threads.size());
+    }
+  }
+}
+
+ParallelWorkers::~ParallelWorkers() {
+  this->join();
+}
+
+void ParallelWorkers::run_worker(size_t thread_num) {
+  auto mark_finished = on_close_scope([&]() -> void {
+    {
+      lock_guard<mutex> g(this->finished_lock);
+      this->num_finished++;
+    }
+    this->finished_cv.notify_all();
+  });
+  this->fn(thread_num);
+}
+
+bool ParallelWorkers::wait_for(uint64_t usecs) {
+  unique_lock<mutex> g(this->finished_lock);
+  return this->finished_cv.wait_for(g, chrono::microseconds(usecs), [&]() -> bool {
+    return this->num_finished == this->num_workers;
+  });
+}
+
+void ParallelWorkers::join() {
+  if (this->group) {
+    auto group = std::move(this->group);
+    group->wait();
+  }
+  for (auto& t : this->threads) {
+    t.join();
+  }
+  this->threads.clear();
+}
+
+ParallelProgressCounters::ParallelProgressCounters(size_t num_threads)
+    : counts(num_threads) {}
+
+uint64_t ParallelProgressCounters::total() const {
+  uint64_t ret = 0;
+  for (const auto& count : this->counts) {
+    ret += count.value.load(memory_order_relaxed);
+  }
+  return ret;
+}
+
 } // namespace phosg
@@ -2,9 +2,14 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <format>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <stdexcept>
 #include <string>
@@ -31,6 +36,203 @@ inline CallOnDestroy on_close_scope(std::function<void()> f) {
   return CallOnDestroy(std::move(f));
 }
 
+// A persistent pool of worker threads. Each worker has its own task queue; tasks submitted from a worker go to the end
+// of its own queue, and idle workers steal tasks from the front of other workers' queues. Threads that wait for tasks
+// (via TaskGroup::wait) also run queued tasks while waiting, so it's safe to use a pool recursively from within its own
+// tasks.
+//
+// Functions that take a thread_num argument pass a value in [0, size()]; the pool's workers use [0, size() - 1] and any
+// other thread (e.g. one that's running tasks during TaskGroup::wait) uses size().
+class ThreadPool {
+public:
+  // A set of tasks that can be waited on together. If any task throws an exception, the first such exception is
+  // rethrown by wait(). The destructor waits for all tasks to complete, but discards any exceptions.
+  class TaskGroup {
+  public:
+    explicit TaskGroup(ThreadPool& pool);
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup(TaskGroup&&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+    TaskGroup& operator=(TaskGroup&&) = delete;
+    ~TaskGroup();
+
+    void run(std::function<void()> fn);
+    void wait();
+
+  private:
+    ThreadPool& pool;
+    std::atomic<size_t> pending_count;
+    std::mutex exception_lock;
+    std::exception_ptr exception;
+
+    friend class ThreadPool;
+  };
+
+  // If num_threads is 0, uses the same number of threads as there are CPU cores in the system.
+  explicit ThreadPool(size_t num_threads = 0);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool(ThreadPool&&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ThreadPool& operator=(ThreadPool&&) = delete;
+  ~ThreadPool();
+
+  // Returns a pool shared by the entire process, which is created on first use and has one thread per CPU core.
+  static ThreadPool& shared();
+
+  size_t size() const;
+  // Returns the index of the calling thread within this pool, or size() if the calling thread doesn't belong to this
+  // pool.
+  size_t current_thread_num() const;
+
+  // Calls fn(v, slot_num) for each v in [start_value, end_value), splitting the range into chunks of grain_size
+  // values. If grain_size is 0, a chunk size is chosen so that there are several chunks per thread. The calling thread
+  // participates, and this returns when all calls have returned. slot_num is in [0, size()), and no two calls with the
+  // same slot_num run at the same time within one call to parallel_for, so it can be used to index per-thread scratch
+  // space that's allocated for the call. (This is not true of current_thread_num(), which returns the same value for
+  // all threads outside the pool.)
+  template <typename IntT = uint64_t, typename FnT>
+    requires(std::is_invocable_v<FnT&, IntT, size_t>)
+  void parallel_for(IntT start_value, IntT end_value, FnT&& fn, IntT grain_size = 0) {
+    if (end_value <= start_value) {
+      return;
+    }
+    grain_size = this->default_grain_size(start_value, end_value, grain_size);
+
+    // rather than creating a task for each chunk, create one task per thread, and have each task claim chunks until
+    // there are none left. this keeps the per-call overhead low for small loops
+    size_t num_chunks = (end_value - start_value + grain_size - 1) / grain_size;
+    std::atomic<size_t> next_chunk = 0;
+    this->run_chunks(num_chunks, [&](size_t slot_num) -> void {
+      size_t chunk_index;
+      while ((chunk_index = next_chunk.fetch_add(1, std::memory_order_relaxed)) < num_chunks) {
+        IntT chunk_start = start_value + chunk_index * grain_size;
+        IntT chunk_end = (end_value - chunk_start > grain_size) ? (chunk_start + grain_size) : end_value;
+        for (IntT v = chunk_start; v < chunk_end; v++) {
+          fn(v, slot_num);
+        }
+      }
+    });
+  }
+
+  // Computes combine_fn(... combine_fn(combine_fn(identity, fn(start_value)), fn(start_value + 1)) ..., fn(end_value -
+  // 1)) in parallel. combine_fn must be associative. The range is split into chunks as for parallel_for, and each
+  // chunk's result is combined in order, so the result doesn't depend on the number of threads or how the work was
+  // scheduled.
+  template <typename IntT = uint64_t, typename ResultT, typename FnT, typename CombineFnT>
+    requires(
+        std::is_invocable_r_v<ResultT, FnT&, IntT> &&
+        std::is_invocable_r_v<ResultT, CombineFnT&, ResultT, ResultT>)
+  ResultT parallel_reduce(
+      IntT start_value, IntT end_value, ResultT identity, FnT&& fn, CombineFnT&& combine_fn, IntT grain_size = 0) {
+    if (end_value <= start_value) {
+      return identity;
+    }
+    grain_size = this->default_grain_size(start_value, end_value, grain_size);
+
+    size_t num_chunks = (end_value - start_value + grain_size - 1) / grain_size;
+    std::vector<ResultT> chunk_results(num_chunks, identity);
+    std::atomic<size_t> next_chunk = 0;
+    this->run_chunks(num_chunks, [&](size_t) -> void {
+      size_t chunk_index;
+      while ((chunk_index = next_chunk.fetch_add(1, std::memory_order_relaxed)) < num_chunks) {
+        IntT chunk_start = start_value + chunk_index * grain_size;
+        IntT chunk_end = (end_value - chunk_start > grain_size) ? (chunk_start + grain_size) : end_value;
+        ResultT& result = chunk_results[chunk_index];
+        for (IntT v = chunk_start; v < chunk_end; v++) {
+          result = combine_fn(std::move(result), fn(v));
+        }
+      }
+    });
+
+    ResultT ret = std::move(identity);
+    for (auto& chunk_result : chunk_results) {
+      ret = combine_fn(std::move(ret), std::move(chunk_result));
+    }
+    return ret;
+  }
+
+private:
+  struct Task;
+  struct Worker;
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> queued_count;
+  std::atomic<size_t> next_external_worker;
+  std::mutex idle_lock;
+  std::condition_variable idle_cv;
+  bool should_exit;
+
+  void push(Task&& t);
+  bool run_one_task(size_t thread_num);
+  // Runs fn(slot_num) for each slot_num in [0, min(num_chunks, size())), on that many threads (including the calling
+  // thread, which runs slot 0), and waits for all calls to return
+  void run_chunks(size_t num_chunks, const std::function<void(size_t)>& fn);
+  void worker_thread_fn(size_t thread_num);
+
+  template <typename IntT>
+  IntT default_grain_size(IntT start_value, IntT end_value, IntT grain_size) const {
+    if (grain_size == 0) {
+      grain_size = (end_value - start_value) / (this->size() * 8);
+    }
+    return (grain_size == 0) ? 1 : grain_size;
+  }
+};
+
+// Wraps a value so that it occupies its own cache line(s). This is useful for per-thread values stored in an array,
+// which would otherwise cause false sharing between threads.
+template <typename T>
+struct alignas(64) CacheLinePadded {
+  T value;
+};
+
+// Runs fn(thread_num) for each thread_num in [0, num_threads), either on a new thread for each call (if pool is null)
+// or as tasks on the given pool. The constructor returns immediately; join() (or the destructor) waits for all calls to
+// return. This is used to implement the parallel functions below.
+class ParallelWorkers {
+public:
+  ParallelWorkers(ThreadPool* pool, size_t num_threads, std::function<void(size_t)> fn);
+  ParallelWorkers(const ParallelWorkers&) = delete;
+  ParallelWorkers(ParallelWorkers&&) = delete;
+  ParallelWorkers& operator=(const ParallelWorkers&) = delete;
+  ParallelWorkers& operator=(ParallelWorkers&&) = delete;
+  ~ParallelWorkers();
+
+  // Waits until all calls to fn have returned, or until the given time has passed. Returns true if all calls have
+  // returned. This does not rethrow exceptions from fn; join() must still be called afterward.
+  bool wait_for(uint64_t usecs);
+  void join();
+
+private:
+  std::function<void(size_t)> fn;
+  std::vector<std::thread> threads;
+  std::unique_ptr<ThreadPool::TaskGroup> group;
+
+  std::mutex finished_lock;
+  std::condition_variable finished_cv;
+  size_t num_workers;
+  size_t num_finished;
+
+  void run_worker(size_t thread_num);
+};
+
+// Per-thread counts of completed work, used for progress reporting. Each counter is only written by its own thread, so
+// updating them doesn't cause any contention between threads; the progress reporter reads all of them and adds them
+// together.
+class ParallelProgressCounters {
+public:
+  explicit ParallelProgressCounters(size_t num_threads);
+
+  inline void add(size_t thread_num, uint64_t count) {
+    auto& counter = this->counts[thread_num].value;
+    counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+  }
+  uint64_t total() const;
+
+private:
+  std::vector<CacheLinePadded<std::atomic<uint64_t>>> counts;
+};
+
 template <typename IntT>
 void parallel_noop_progress_fn(IntT, IntT, IntT, uint64_t) {
 }
@@ -40,10 +242,13 @@ void parallel_default_progress_fn(IntT start_value, IntT end_value, IntT current
   uint64_t elapsed_time = now() - start_time;
   std::string elapsed_str = format_duration(elapsed_time);
 
+  // current_value reflects only completed work, so the average throughput so far gives a good estimate of the remaining
+  // time. floating-point math is used to avoid overflow in the multiplication for large ranges
   std::string remaining_str;
-  if (current_value) {
-    uint64_t total_time = (elapsed_time * (end_value - start_value)) / (current_value - start_value);
-    uint64_t remaining_time = total_time - elapsed_time;
+  if (current_value > start_value) {
+    double done = static_cast<double>(current_value - start_value);
+    double remaining = static_cast<double>(end_value - current_value);
+    uint64_t remaining_time = static_cast<uint64_t>(static_cast<double>(elapsed_time) * (remaining / done));
     remaining_str = format_duration(remaining_time);
   } else {
     remaining_str = "...";
@@ -52,17 +257,52 @@ void parallel_default_progress_fn(IntT start_value, IntT end_value, IntT current
   fwritex(stderr, std::format("... {:08X} ({} / {})\r", current_value, elapsed_str, remaining_str));
 }
 
+// Calls progress_fn about once per second until all of the workers have finished. This returns as soon as the workers
+// finish (or one of them finds a result), rather than waiting for the next report time.
+template <typename IntT, typename ProgressFnT>
+void parallel_report_progress(
+    ParallelWorkers& workers,
+    const ParallelProgressCounters& counters,
+    IntT start_value,
+    IntT end_value,
+    ProgressFnT& progress_fn) {
+  uint64_t start_time = now();
+  while (!workers.wait_for(1000000)) {
+    progress_fn(start_value, end_value, static_cast<IntT>(start_value + counters.total()), start_time);
+  }
+}
+
 template <typename IntT, typename FnT>
   requires(std::is_invocable_r_v<bool, FnT, IntT, size_t>)
 void parallel_thread_fn(
-    FnT& fn, std::atomic<IntT>& current_value, std::atomic<IntT>& result_value, IntT end_value, size_t thread_num) {
+    FnT& fn,
+    std::atomic<IntT>& current_value,
+    std::atomic<IntT>& result_value,
+    ParallelProgressCounters& counters,
+    IntT end_value,
+    size_t thread_num) {
   IntT v;
   while ((v = current_value.fetch_add(1, std::memory_order_relaxed)) < end_value) {
     if (fn(v, thread_num)) {
       result_value = v;
       current_value = end_value;
     }
+    counters.add(thread_num, 1);
+  }
+}
+
+// Returns true if the progress function should be called while waiting for workers on the given pool. If the calling
+// thread is one of the pool's workers, it must not block the pool by sleeping in a progress loop, since the pool may
+// need it to run the workers' tasks.
+inline bool parallel_should_report_progress(ThreadPool* pool, bool use_progress_fn) {
+  return use_progress_fn && (!pool || (pool->current_thread_num() >= pool->size()));
+}
+
+inline size_t parallel_default_num_threads(ThreadPool* pool, size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = pool ? pool->size() : std::thread::hardware_concurrency();
   }
+  return num_threads;
 }
 
 // This function runs a function in parallel, using the specified number of threads. If the thread count is 0, the
@@ -71,50 +311,61 @@ void parallel_thread_fn(
 // parallel returns the value for which fn returned true, or it returns end_value if fn never returned true. If
 // multiple calls to fn return true, it is not guaranteed which of those values is returned (it is often, but not
 // always, the lowest one).
+//
+// If pool is not null, the work runs as tasks on the given thread pool instead of on newly-created threads, and a
+// thread count of 0 means to use the pool's size. The versions of these functions that don't take a pool argument
+// always create new threads.
 template <typename IntT = uint64_t, typename FnT, typename ProgressFnT = void (*)(IntT, IntT, IntT, uint64_t)>
   requires(
       std::is_invocable_r_v<bool, FnT, IntT, size_t> &&
       std::is_invocable_v<ProgressFnT, IntT, IntT, IntT, uint64_t>)
 IntT parallel(
+    ThreadPool* pool,
     FnT&& fn,
     IntT start_value,
     IntT end_value,
     size_t num_threads = 0,
     ProgressFnT&& progress_fn = parallel_default_progress_fn<IntT>,
     bool use_progress_fn = true) {
-  if (num_threads == 0) {
-    num_threads = std::thread::hardware_concurrency();
-  }
+  num_threads = parallel_default_num_threads(pool, num_threads);
 
   std::atomic<IntT> current_value(start_value);
   std::atomic<IntT> result_value(end_value);
-  std::vector<std::thread> threads;
-  while (threads.size() < num_threads) {
-    threads.emplace_back(
-        parallel_thread_fn<IntT, FnT>,
-        std::ref(fn),
-        std::ref(current_value),
-        std::ref(result_value),
-        end_value,
-        threads.size());
-  }
+  ParallelProgressCounters counters(num_threads);
+  ParallelWorkers workers(pool, num_threads, [&](size_t thread_num) -> void {
+    parallel_thread_fn<IntT, FnT>(fn, current_value, result_value, counters, end_value, thread_num);
+  });
 
-  if (use_progress_fn) {
-    uint64_t start_time = now();
-    IntT progress_current_value;
-    while ((progress_current_value = current_value.load()) < end_value) {
-      progress_fn(start_value, end_value, progress_current_value, start_time);
-      usleep(1000000);
-    }
+  if (parallel_should_report_progress(pool, use_progress_fn)) {
+    parallel_report_progress<IntT, ProgressFnT>(workers, counters, start_value, end_value, progress_fn);
   }
 
-  for (auto& t : threads) {
-    t.join();
-  }
+  workers.join();
 
   return result_value;
 }
 
+template <typename IntT = uint64_t, typename FnT, typename ProgressFnT = void (*)(IntT, IntT, IntT, uint64_t)>
+  requires(
+      std::is_invocable_r_v<bool, FnT, IntT, size_t> &&
+      std::is_invocable_v<ProgressFnT, IntT, IntT, IntT, uint64_t>)
+IntT parallel(
+    FnT&& fn,
+    IntT start_value,
+    IntT end_value,
+    size_t num_threads = 0,
+    ProgressFnT&& progress_fn = parallel_default_progress_fn<IntT>,
+    bool use_progress_fn = true) {
+  return parallel<IntT, FnT, ProgressFnT>(
+      nullptr,
+      std::forward<FnT>(fn),
+      start_value,
+      end_value,
+      num_threads,
+      std::forward<ProgressFnT>(progress_fn),
+      use_progress_fn);
+}
+
 // This is a bit of a hack, but it allows us to implement a shorthand for suppressing the default status reporting by
 // passing nullptr for the status function (even though it's not a callable according to the `requires` condition).
 template <typename IntT = uint64_t, typename FnT>
@@ -124,12 +375,20 @@ IntT parallel(FnT&& fn, IntT start_value, IntT end_value, size_t num_threads, st
       std::forward<FnT>(fn), start_value, end_value, num_threads, parallel_noop_progress_fn<IntT>, false);
 }
 
+template <typename IntT = uint64_t, typename FnT>
+  requires(std::is_invocable_r_v<bool, FnT, IntT, size_t>)
+IntT parallel(ThreadPool* pool, FnT&& fn, IntT start_value, IntT end_value, size_t num_threads, std::nullptr_t) {
+  return parallel<IntT, FnT>(
+      pool, std::forward<FnT>(fn), start_value, end_value, num_threads, parallel_noop_progress_fn<IntT>, false);
+}
+
 template <typename IntT, typename FnT>
   requires(std::is_invocable_r_v<bool, FnT, IntT, size_t>)
 void parallel_blocks_thread_fn(
     FnT& fn,
     std::atomic<IntT>& current_value,
     std::atomic<IntT>& result_value,
+    ParallelProgressCounters& counters,
     IntT end_value,
     IntT block_size,
     size_t thread_num) {
@@ -143,6 +402,7 @@ void parallel_blocks_thread_fn(
         break;
       }
     }
+    counters.add(thread_num, block_size);
   }
 }
 
@@ -158,6 +418,7 @@ template <typename IntT = uint64_t, typename FnT, typename ProgressFnT = void (*
       std::is_invocable_r_v<bool, FnT, IntT, size_t> &&
       std::is_invocable_v<ProgressFnT, IntT, IntT, IntT, uint64_t>)
 IntT parallel_blocks(
+    ThreadPool* pool,
     FnT&& fn,
     IntT start_value,
     IntT end_value,
@@ -169,43 +430,51 @@ IntT parallel_blocks(
     throw std::logic_error("block_size must evenly divide the entire range");
   }
 
-  if (num_threads == 0) {
-    num_threads = std::thread::hardware_concurrency();
-  }
+  num_threads = parallel_default_num_threads(pool, num_threads);
   if (num_threads < 1) {
     throw std::logic_error("thread count must be at least 1");
   }
 
   std::atomic<IntT> current_value(start_value);
   std::atomic<IntT> result_value(end_value);
-  std::vector<std::thread> threads;
-  while (threads.size() < num_threads) {
-    threads.emplace_back(
-        parallel_blocks_thread_fn<IntT, FnT>,
-        std::ref(fn),
-        std::ref(current_value),
-        std::ref(result_value),
-        end_value,
-        block_size,
-        threads.size());
+  ParallelProgressCounters counters(num_threads);
+  ParallelWorkers workers(pool, num_threads, [&](size_t thread_num) -> void {
+    parallel_blocks_thread_fn<IntT, FnT>(
+        fn, current_value, result_value, counters, end_value, block_size, thread_num);
+  });
+
+  if (parallel_should_report_progress(pool, use_progress_fn)) {
+    parallel_report_progress<IntT, ProgressFnT>(workers, counters, start_value, end_value, progress_fn);
   }
 
-  if (use_progress_fn) {
-    uint64_t start_time = now();
-    IntT progress_current_value;
-    while ((progress_current_value = current_value.load()) < end_value) {
-      progress_fn(start_value, end_value, progress_current_value, start_time);
-      usleep(1000000);
-    }
-  }
-
-  for (auto& t : threads) {
-    t.join();
-  }
+  workers.join();
 
   return result_value;
 }
 
+template <typename IntT = uint64_t, typename FnT, typename ProgressFnT = void (*)(IntT, IntT, IntT, uint64_t)>
+  requires(
+      std::is_invocable_r_v<bool, FnT, IntT, size_t> &&
+      std::is_invocable_v<ProgressFnT, IntT, IntT, IntT, uint64_t>)
+IntT parallel_blocks(
+    FnT&& fn,
+    IntT start_value,
+    IntT end_value,
+    IntT block_size,
+    size_t num_threads = 0,
+    ProgressFnT&& progress_fn = parallel_default_progress_fn<IntT>,
+    bool use_progress_fn = true) {
+  return parallel_blocks<IntT, FnT, ProgressFnT>(
+      nullptr,
+      std::forward<FnT>(fn),
+      start_value,
+      end_value,
+      block_size,
+      num_threads,
+      std::forward<ProgressFnT>(progress_fn),
+      use_progress_fn);
+}
+
 template <typename IntT = uint64_t, typename FnT>
   requires(std::is_invocable_r_v<bool, FnT, IntT, size_t>)
 IntT parallel_blocks(
@@ -214,6 +483,48 @@ IntT parallel_blocks(
       std::forward<FnT>(fn), start_value, end_value, block_size, num_threads, parallel_noop_progress_fn<IntT>, false);
 }
 
+template <typename IntT = uint64_t, typename FnT>
+  requires(std::is_invocable_r_v<bool, FnT, IntT, size_t>)
+IntT parallel_blocks(
+    ThreadPool* pool, FnT&& fn, IntT start_value, IntT end_value, IntT block_size, size_t num_threads, std::nullptr_t) {
+  return parallel_blocks<IntT, FnT>(
+      pool, std::forward<FnT>(fn), start_value, end_value, block_size, num_threads, parallel_noop_progress_fn<IntT>,
+      false);
+}
+
+// Combines all of the given values into values[0] by combining pairs of values in a binary tree shape: first values[0]
+// with values[1], values[2] with values[3], etc., then values[0] with values[2], and so on. The pairs at each level of
+// the tree are combined in parallel. The shape of the tree depends only on the number of values, so if combine_fn is
+// deterministic, the result is too (even if combine_fn is not associative, as for floating-point addition).
+// combine_fn is called as combine_fn(std::move(left), std::move(right)) and must return the combined value.
+template <typename T, typename CombineFnT>
+  requires(std::is_invocable_r_v<T, CombineFnT&, T&&, T&&>)
+void parallel_tree_merge(
+    ThreadPool* pool, std::vector<CacheLinePadded<T>>& values, CombineFnT&& combine_fn, size_t num_threads = 0) {
+  num_threads = parallel_default_num_threads(pool, num_threads);
+  for (size_t step = 1; step < values.size(); step *= 2) {
+    size_t num_pairs = (values.size() - step + (2 * step) - 1) / (2 * step);
+    auto combine_pair = [&](size_t pair_index) -> void {
+      size_t left = pair_index * 2 * step;
+      values[left].value = combine_fn(std::move(values[left].value), std::move(values[left + step].value));
+    };
+    if ((num_pairs == 1) || (num_threads == 1)) {
+      for (size_t z = 0; z < num_pairs; z++) {
+        combine_pair(z);
+      }
+    } else {
+      std::atomic<size_t> next_pair = 0;
+      ParallelWorkers workers(pool, std::min<size_t>(num_threads, num_pairs), [&](size_t) -> void {
+        size_t pair_index;
+        while ((pair_index = next_pair.fetch_add(1, std::memory_order_relaxed)) < num_pairs) {
+          combine_pair(pair_index);
+        }
+      });
+      workers.join();
+    }
+  }
+}
+
 // Like parallel_blocks, but returns all values for which fn returned true. (Unlike the other parallel functions, this
 // one does not return early.)
 template <typename IntT = uint64_t, typename RetT = std::unordered_set<IntT>, typename FnT, typename ProgressFnT = void (*)(IntT, IntT, IntT, uint64_t)>
@@ -221,6 +532,7 @@ template <typename IntT = uint64_t, typename RetT = std::unordered_set<IntT>, ty
       std::is_invocable_r_v<bool, FnT, IntT, size_t> &&
       std::is_invocable_v<ProgressFnT, IntT, IntT, IntT, uint64_t>)
 std::unordered_set<IntT> parallel_blocks_multi(
+    ThreadPool* pool,
     FnT&& fn,
     IntT start_value,
     IntT end_value,
@@ -229,26 +541,51 @@ std::unordered_set<IntT> parallel_blocks_multi(
     ProgressFnT&& progress_fn = parallel_default_progress_fn<IntT>,
     bool use_progress_fn = true) {
 
-  if (num_threads == 0) {
-    num_threads = std::thread::hardware_concurrency();
-  }
+  num_threads = parallel_default_num_threads(pool, num_threads);
 
-  std::vector<RetT> thread_rets(num_threads);
-  parallel_blocks<IntT>([&](IntT z, size_t thread_num) {
+  std::vector<CacheLinePadded<RetT>> thread_rets(num_threads);
+  parallel_blocks<IntT>(pool, [&](IntT z, size_t thread_num) {
     if (fn(z, thread_num)) {
-      thread_rets[thread_num].emplace(z);
+      thread_rets[thread_num].value.emplace(z);
     }
     return false;
   },
       start_value, end_value, block_size, num_threads, progress_fn, use_progress_fn);
 
-  RetT ret = std::move(thread_rets[0]);
-  for (size_t z = 1; z < thread_rets.size(); z++) {
-    auto& thread_ret = thread_rets[z];
-    ret.insert(std::make_move_iterator(thread_ret.begin()), std::make_move_iterator(thread_ret.end()));
-  }
+  // always insert the smaller set into the larger one
+  parallel_tree_merge<RetT>(pool, thread_rets, [](RetT&& a, RetT&& b) -> RetT {
+    if (a.size() < b.size()) {
+      a.swap(b);
+    }
+    a.insert(std::make_move_iterator(b.begin()), std::make_move_iterator(b.end()));
+    return std::move(a);
+  },
+      num_threads);
 
-  return ret;
+  return std::move(thread_rets[0].value);
+}
+
+template <typename IntT = uint64_t, typename RetT = std::unordered_set<IntT>, typename FnT, typename ProgressFnT = void (*)(IntT, IntT, IntT, uint64_t)>
+  requires(
+      std::is_invocable_r_v<bool, FnT, IntT, size_t> &&
+      std::is_invocable_v<ProgressFnT, IntT, IntT, IntT, uint64_t>)
+std::unordered_set<IntT> parallel_blocks_multi(
+    FnT&& fn,
+    IntT start_value,
+    IntT end_value,
+    IntT block_size,
+    size_t num_threads = 0,
+    ProgressFnT&& progress_fn = parallel_default_progress_fn<IntT>,
+    bool use_progress_fn = true) {
+  return parallel_blocks_multi<IntT, RetT, FnT, ProgressFnT>(
+      nullptr,
+      std::forward<FnT>(fn),
+      start_value,
+      end_value,
+      block_size,
+      num_threads,
+      std::forward<ProgressFnT>(progress_fn),
+      use_progress_fn);
 }
 
 template <typename IntT = uint64_t, typename RetT = std::unordered_set<IntT>, typename FnT>
@@ -259,57 +596,242 @@ std::unordered_set<IntT> parallel_blocks_multi(
       std::forward<FnT>(fn), start_value, end_value, block_size, num_threads, parallel_noop_progress_fn<IntT>, false);
 }
 
+template <typename IntT = uint64_t, typename RetT = std::unordered_set<IntT>, typename FnT>
+  requires(std::is_invocable_r_v<bool, FnT, IntT, size_t>)
+std::unordered_set<IntT> parallel_blocks_multi(
+    ThreadPool* pool, FnT&& fn, IntT start_value, IntT end_value, IntT block_size, size_t num_threads, std::nullptr_t) {
+  return parallel_blocks_multi<IntT, RetT, FnT>(
+      pool, std::forward<FnT>(fn), start_value, end_value, block_size, num_threads, parallel_noop_progress_fn<IntT>,
+      false);
+}
+
+// Computes a reduction over [start_value, end_value) in parallel. Each thread has its own accumulator, which starts as
+// a copy of identity; accumulate_fn(accumulator, value, thread_num) is called for each value in the range, then the
+// accumulators are combined with combine_fn (as for parallel_tree_merge). combine_fn must be associative, and identity
+// must be an identity value for it. If block_size is 0, a block size is chosen automatically. (This takes its arguments
+// in the same order as parallel and parallel_blocks; ThreadPool::parallel_reduce is the pool's chunked equivalent.)
+//
+// By default, which values are accumulated into which accumulator depends on the number of threads and on scheduling,
+// so if combine_fn is not exactly associative (as for floating-point addition), the result may vary slightly between
+// runs. If deterministic is true, the range is instead split into blocks whose boundaries depend only on the range and
+// block_size, each block is accumulated separately, and the blocks' results are combined in a fixed order, so the
+// result is bitwise-identical regardless of the number of threads. This uses more memory (one accumulator per block
+// instead of one per thread).
+template <typename IntT = uint64_t, typename ResultT, typename AccumulateFnT, typename CombineFnT>
+  requires(
+      std::is_invocable_v<AccumulateFnT&, ResultT&, IntT, size_t> &&
+      std::is_invocable_r_v<ResultT, CombineFnT&, ResultT&&, ResultT&&>)
+ResultT parallel_accumulate(
+    ThreadPool* pool,
+    AccumulateFnT&& accumulate_fn,
+    CombineFnT&& combine_fn,
+    IntT start_value,
+    IntT end_value,
+    const ResultT& identity,
+    size_t num_threads = 0,
+    IntT block_size = 0,
+    bool deterministic = false) {
+  num_threads = parallel_default_num_threads(pool, num_threads);
+  if (end_value <= start_value) {
+    return identity;
+  }
+  IntT range_size = end_value - start_value;
+  if (block_size == 0) {
+    // in deterministic mode, the block size must not depend on the thread count
+    block_size = deterministic ? (range_size / 0x400) : (range_size / (num_threads * 16));
+    if (block_size == 0) {
+      block_size = 1;
+    }
+  }
+  size_t num_blocks = (range_size / block_size) + ((range_size % block_size) ? 1 : 0);
+
+  std::vector<CacheLinePadded<ResultT>> accumulators(
+      deterministic ? num_blocks : num_threads, CacheLinePadded<ResultT>{identity});
+  std::atomic<size_t> next_block = 0;
+  ParallelWorkers workers(pool, std::min<size_t>(num_threads, num_blocks), [&](size_t thread_num) -> void {
+    size_t block_index;
+    while ((block_index = next_block.fetch_add(1, std::memory_order_relaxed)) < num_blocks) {
+      IntT block_start = start_value + block_index * block_size;
+      IntT block_end = (end_value - block_start > block_size) ? (block_start + block_size) : end_value;
+      ResultT& accumulator = accumulators[deterministic ? block_index : thread_num].value;
+      for (IntT v = block_start; v < block_end; v++) {
+        accumulate_fn(accumulator, v, thread_num);
+      }
+    }
+  });
+  workers.join();
+
+  parallel_tree_merge<ResultT>(pool, accumulators, std::forward<CombineFnT>(combine_fn), num_threads);
+  return std::move(accumulators[0].value);
+}
+
+template <typename IntT = uint64_t, typename ResultT, typename AccumulateFnT, typename CombineFnT>
+  requires(
+      std::is_invocable_v<AccumulateFnT&, ResultT&, IntT, size_t> &&
+      std::is_invocable_r_v<ResultT, CombineFnT&, ResultT&&, ResultT&&>)
+ResultT parallel_accumulate(
+    AccumulateFnT&& accumulate_fn,
+    CombineFnT&& combine_fn,
+    IntT start_value,
+    IntT end_value,
+    const ResultT& identity,
+    size_t num_threads = 0,
+    IntT block_size = 0,
+    bool deterministic = false) {
+  return parallel_accumulate<IntT, ResultT>(
+      nullptr,
+      std::forward<AccumulateFnT>(accumulate_fn),
+      std::forward<CombineFnT>(combine_fn),
+      start_value,
+      end_value,
+      identity,
+      num_threads,
+      block_size,
+      deterministic);
+}
+
+// Like parallel_accumulate, but computes reduce_fn(... reduce_fn(reduce_fn(identity, map_fn(start_value, thread_num)),
+// map_fn(start_value + 1, thread_num)) ..., map_fn(end_value - 1, thread_num)). reduce_fn is used both to accumulate
+// mapped values and to combine the accumulators, so it must be associative.
+template <typename IntT = uint64_t, typename ResultT, typename MapFnT, typename ReduceFnT>
+  requires(
+      std::is_invocable_r_v<ResultT, MapFnT&, IntT, size_t> &&
+      std::is_invocable_r_v<ResultT, ReduceFnT&, ResultT&&, ResultT&&>)
+ResultT parallel_map_reduce(
+    ThreadPool* pool,
+    MapFnT&& map_fn,
+    ReduceFnT&& reduce_fn,
+    IntT start_value,
+    IntT end_value,
+    const ResultT& identity,
+    size_t num_threads = 0,
+    IntT block_size = 0,
+    bool deterministic = false) {
+  return parallel_accumulate<IntT, ResultT>(
+      pool,
+      [&](ResultT& accumulator, IntT v, size_t thread_num) -> void {
+        accumulator = reduce_fn(std::move(accumulator), map_fn(v, thread_num));
+      },
+      reduce_fn,
+      start_value,
+      end_value,
+      identity,
+      num_threads,
+      block_size,
+      deterministic);
+}
+
+template <typename IntT = uint64_t, typename ResultT, typename MapFnT, typename ReduceFnT>
+  requires(
+      std::is_invocable_r_v<ResultT, MapFnT&, IntT, size_t> &&
+      std::is_invocable_r_v<ResultT, ReduceFnT&, ResultT&&, ResultT&&>)
+ResultT parallel_map_reduce(
+    MapFnT&& map_fn,
+    ReduceFnT&& reduce_fn,
+    IntT start_value,
+    IntT end_value,
+    const ResultT& identity,
+    size_t num_threads = 0,
+    IntT block_size = 0,
+    bool deterministic = false) {
+  return parallel_map_reduce<IntT, ResultT>(
+      nullptr,
+      std::forward<MapFnT>(map_fn),
+      std::forward<ReduceFnT>(reduce_fn),
+      start_value,
+      end_value,
+      identity,
+      num_threads,
+      block_size,
+      deterministic);
+}
+
 // The main parallel implementation uses integer indexes and blocks for efficiency; however, this means it can only
 // support random access ranges. To support those, we implement them separately here. This function returns a pointer
 // to the value for which fn first returns true (which is usually, but not always, the first one in the range) and
 // stops iterating early when that happens. If fn never returns true, this function returns null.
+//
+// The range is split into batches, which the threads claim without locking. For random-access ranges, the batches are
+// computed from indexes; for other ranges, the range is first walked once to find the start of each batch. If
+// batch_size is 0, a batch size is chosen so that there are several batches per thread.
 template <std::ranges::sized_range RangeT, typename FnT>
   requires(
-      std::ranges::input_range<RangeT> &&
+      std::ranges::forward_range<RangeT> &&
       std::ranges::sized_range<RangeT> &&
       (std::is_invocable_r_v<bool, FnT&, std::ranges::range_reference_t<RangeT>, size_t> ||
           std::is_invocable_r_v<void, FnT&, std::ranges::range_reference_t<RangeT>, size_t>))
-std::ranges::range_value_t<RangeT>* parallel_range(RangeT&& range, FnT&& fn, size_t num_threads = 0) {
-  if (num_threads == 0) {
-    num_threads = std::thread::hardware_concurrency();
+std::ranges::range_value_t<RangeT>* parallel_range(
+    ThreadPool* pool, RangeT&& range, FnT&& fn, size_t num_threads = 0, size_t batch_size = 0) {
+  num_threads = parallel_default_num_threads(pool, num_threads);
+
+  size_t size = std::ranges::size(range);
+  if (size == 0) {
+    return nullptr;
+  }
+  if (batch_size == 0) {
+    batch_size = std::max<size_t>(size / (num_threads * 16), 1);
+  }
+  size_t num_batches = (size + batch_size - 1) / batch_size;
+
+  using IteratorT = std::ranges::iterator_t<RangeT>;
+  std::vector<IteratorT> batch_starts;
+  if constexpr (!std::ranges::random_access_range<RangeT>) {
+    batch_starts.reserve(num_batches);
+    auto it = std::ranges::begin(range);
+    for (size_t z = 0; z < num_batches; z++) {
+      batch_starts.emplace_back(it);
+      if (z < num_batches - 1) {
+        std::ranges::advance(it, batch_size);
+      }
+    }
   }
 
-  std::mutex lock;
-  auto it = range.begin();
-  std::ranges::range_value_t<RangeT>* result_value = nullptr;
-
-  auto parallel_thread_fn = [&](size_t thread_num) -> void {
-    for (;;) {
-      std::ranges::range_value_t<RangeT>* v;
-      {
-        std::lock_guard<std::mutex> g(lock);
-        if (it == range.end()) {
-          return;
-        }
-        v = &(*(it++));
+  std::atomic<size_t> next_batch = 0;
+  std::atomic<std::ranges::range_value_t<RangeT>*> result_value = nullptr;
+  ParallelWorkers workers(pool, num_threads, [&](size_t thread_num) -> void {
+    size_t batch_index;
+    while ((batch_index = next_batch.fetch_add(1, std::memory_order_relaxed)) < num_batches) {
+      size_t batch_start = batch_index * batch_size;
+      size_t batch_end = std::min<size_t>(batch_start + batch_size, size);
+      IteratorT it;
+      if constexpr (std::ranges::random_access_range<RangeT>) {
+        it = std::ranges::begin(range) + batch_start;
+      } else {
+        it = batch_starts[batch_index];
       }
-      if constexpr (std::is_invocable_r_v<bool, FnT&, std::ranges::range_reference_t<RangeT>, size_t>) {
-        if (fn(*v, thread_num)) {
-          std::lock_guard g(lock);
-          result_value = v;
-          it = range.end();
-          return;
+      for (size_t z = batch_start; z < batch_end; z++, ++it) {
+        if constexpr (std::is_invocable_r_v<bool, FnT&, std::ranges::range_reference_t<RangeT>, size_t>) {
+          if (fn(*it, thread_num)) {
+            // only the first match is kept; this also stops all other threads after their current call to fn
+            std::ranges::range_value_t<RangeT>* expected = nullptr;
+            result_value.compare_exchange_strong(expected, &(*it));
+            next_batch = num_batches;
+            return;
+          }
+          if (result_value.load(std::memory_order_relaxed)) {
+            return;
+          }
+        } else {
+          fn(*it, thread_num);
         }
-      } else {
-        fn(*v, thread_num);
       }
     }
-  };
+  });
+  workers.join();
 
-  std::vector<std::thread> threads;
-  while (threads.size() < num_threads) {
-    threads.emplace_back(parallel_thread_fn, threads.size());
-  }
-  for (auto& t : threads) {
-    t.join();
-  }
+  return result_value.load();
+}
 
-  return result_value;
+template <std::ranges::sized_range RangeT, typename FnT>
+  requires(
+      std::ranges::forward_range<RangeT> &&
+      std::ranges::sized_range<RangeT> &&
+      (std::is_invocable_r_v<bool, FnT&, std::ranges::range_reference_t<RangeT>, size_t> ||
+          std::is_invocable_r_v<void, FnT&, std::ranges::range_reference_t<RangeT>, size_t>))
+std::ranges::range_value_t<RangeT>* parallel_range(
+    RangeT&& range, FnT&& fn, size_t num_threads = 0, size_t batch_size = 0) {
+  return parallel_range<RangeT, FnT>(
+      nullptr, std::forward<RangeT>(range), std::forward<FnT>(fn), num_threads, batch_size);
 }
 
 // Enables iteration over an enum using a range-based for loop. The enum must contain members named MIN_VALUE and
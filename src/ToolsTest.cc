@@ -1,3 +1,8 @@
+#include <math.h>
+#include <string.h>
+
+#include <list>
+#include <map>
 #include <stdexcept>
 
 #include "Strings.hh"
@@ -74,6 +79,40 @@ int main(int, char**) {
     expect_eq((parallel<uint64_t>(is_equal, 0, 0x10000, num_threads, nullptr)), 0x10000);
   }
 
+  {
+    fwrite_fmt(stderr, "-- parallel progress reporting\n");
+    size_t num_progress_calls = 0;
+    uint64_t last_progress_value = 0;
+    auto progress_fn = [&](uint64_t start_value, uint64_t end_value, uint64_t current_value, uint64_t) -> void {
+      expect_ge(current_value, start_value);
+      expect_le(current_value, end_value);
+      expect_ge(current_value, last_progress_value);
+      last_progress_value = current_value;
+      num_progress_calls++;
+    };
+
+    // Short calls should not wait for the progress interval before returning
+    auto nop = [&](uint64_t, size_t) -> bool {
+      return false;
+    };
+    uint64_t start_time = now();
+    parallel<uint64_t>(nop, 0x100, 0x200, num_threads, progress_fn);
+    uint64_t duration = now() - start_time;
+    fwrite_fmt(stderr, "---- time: {}\n", duration);
+    expect_lt(duration, 500000);
+    expect_eq(num_progress_calls, 0);
+
+    // Long calls should report progress periodically, based on completed work
+    auto slow = [&](uint64_t, size_t) -> bool {
+      usleep(10000);
+      return false;
+    };
+    last_progress_value = 0x100;
+    parallel<uint64_t>(slow, 0x100, 0x100 + 120 * num_threads, num_threads, progress_fn);
+    expect_ge(num_progress_calls, 1);
+    expect_gt(last_progress_value, 0x100);
+  }
+
   {
     fwrite_fmt(stderr, "-- parallel_blocks\n");
     vector<uint8_t> hits(0x1000000, 0);
@@ -215,6 +254,225 @@ int main(int, char**) {
     expect_eq(sum, hits.size());
   }
 
+  {
+    fwrite_fmt(stderr, "-- parallel_range return value\n");
+    std::list<uint64_t> l;
+    std::map<uint64_t, uint64_t> m;
+    for (uint64_t z = 0; z < 0x10000; z++) {
+      l.emplace_back(z);
+      m.emplace(z, z);
+    }
+    uint64_t target_value = 0xC349;
+    auto* found_l = parallel_range(l, [&](uint64_t v, size_t) -> bool {
+      return (v == target_value);
+    },
+        num_threads, 0x100);
+    expect_ne(found_l, nullptr);
+    expect_eq(*found_l, target_value);
+    auto* found_m = parallel_range(m, [&](const std::pair<const uint64_t, uint64_t>& it, size_t) -> bool {
+      return (it.second == target_value);
+    },
+        num_threads);
+    expect_ne(found_m, nullptr);
+    expect_eq(found_m->first, target_value);
+    target_value = 0xCC349; // > end_value; should not be found
+    expect_eq(nullptr, parallel_range(l, [&](uint64_t v, size_t) -> bool {
+      return (v == target_value);
+    },
+                           num_threads));
+
+    // batches that don't evenly divide the range
+    std::atomic<size_t> count = 0;
+    parallel_range(l, [&](uint64_t, size_t) -> void {
+      count++;
+    },
+        num_threads, 0x333);
+    expect_eq(count.load(), l.size());
+    std::list<uint64_t> empty_l;
+    expect_eq(nullptr, parallel_range(empty_l, [&](uint64_t, size_t) -> bool {
+      return true;
+    }));
+  }
+
+  {
+    fwrite_fmt(stderr, "-- parallel_accumulate\n");
+    auto add_value = [](uint64_t& sum, uint64_t v, size_t) -> void {
+      sum += v;
+    };
+    auto add = [](uint64_t a, uint64_t b) -> uint64_t {
+      return a + b;
+    };
+    expect_eq(0x7FFFFF800000ULL, (parallel_accumulate<uint64_t, uint64_t>(add_value, add, 0, 0x1000000, 0, 7)));
+    expect_eq(
+        0x7FFFFF800000ULL, (parallel_accumulate<uint64_t, uint64_t>(add_value, add, 0, 0x1000000, 0, 4, 0, true)));
+    expect_eq(0, (parallel_accumulate<uint64_t, uint64_t>(add_value, add, 10, 10, 0, 4)));
+
+    fwrite_fmt(stderr, "-- parallel_map_reduce (deterministic)\n");
+    // floating-point addition isn't associative, so these results would differ slightly if the values were summed in
+    // different orders for different thread counts
+    auto inverse_square = [](uint64_t v, size_t) -> double {
+      return 1.0 / (static_cast<double>(v) * static_cast<double>(v));
+    };
+    auto add_double = [](double a, double b) -> double {
+      return a + b;
+    };
+    double expected_sum = parallel_map_reduce<uint64_t, double>(
+        inverse_square, add_double, 1, 0x100001, 0.0, 1, 0, true);
+    for (size_t thread_count : {2, 3, 4, 7, 16}) {
+      double sum = parallel_map_reduce<uint64_t, double>(
+          inverse_square, add_double, 1, 0x100001, 0.0, thread_count, 0, true);
+      expect_eq(0, memcmp(&sum, &expected_sum, sizeof(double)));
+    }
+    expect_lt(fabs(expected_sum - (M_PI * M_PI / 6)), 0.00001);
+
+    fwrite_fmt(stderr, "-- parallel_tree_merge\n");
+    vector<CacheLinePadded<string>> strs;
+    for (size_t z = 0; z < 26; z++) {
+      strs.emplace_back(CacheLinePadded<string>{string(1, 'a' + z)});
+    }
+    parallel_tree_merge<string>(nullptr, strs, [](string&& a, string&& b) -> string {
+      return a + b;
+    },
+        4);
+    expect_eq(strs[0].value, "abcdefghijklmnopqrstuvwxyz");
+  }
+
+  {
+    fwrite_fmt(stderr, "-- ThreadPool::parallel_for\n");
+    ThreadPool pool(4);
+    vector<uint8_t> hits(0x100000, 0);
+    pool.parallel_for<size_t>(0, hits.size(), [&](size_t v, size_t slot_num) -> void {
+      expect_lt(slot_num, pool.size());
+      hits[v]++;
+    });
+    for (size_t x = 0; x < hits.size(); x++) {
+      expect_eq(hits[x], 1);
+    }
+
+    fwrite_fmt(stderr, "-- ThreadPool::parallel_for from multiple outside threads\n");
+    // Each caller has its own per-slot scratch space; if two calls for the same caller ever ran with the same slot_num
+    // at the same time, the in-use flag or the scratch contents would catch it
+    auto run_caller = [&](uint64_t seed) -> void {
+      vector<CacheLinePadded<atomic<bool>>> in_use(pool.size());
+      vector<vector<uint64_t>> scratch(pool.size(), vector<uint64_t>(0x40));
+      pool.parallel_for<uint64_t>(0, 0x4000, [&](uint64_t v, size_t slot_num) -> void {
+        expect(!in_use[slot_num].value.exchange(true));
+        auto& slot_scratch = scratch[slot_num];
+        for (auto& item : slot_scratch) {
+          item = seed ^ v;
+        }
+        for (const auto& item : slot_scratch) {
+          expect_eq(item, seed ^ v);
+        }
+        in_use[slot_num].value = false;
+      },
+          0x10);
+    };
+    for (size_t z = 0; z < 20; z++) {
+      thread t1(run_caller, 0x1111111111111111);
+      thread t2(run_caller, 0x2222222222222222);
+      t1.join();
+      t2.join();
+    }
+
+    fwrite_fmt(stderr, "-- ThreadPool::parallel_reduce\n");
+    auto identity = [](uint64_t v) -> uint64_t {
+      return v;
+    };
+    auto add = [](uint64_t a, uint64_t b) -> uint64_t {
+      return a + b;
+    };
+    uint64_t sum = pool.parallel_reduce<uint64_t>(0, 0x100000, static_cast<uint64_t>(0), identity, add);
+    expect_eq(sum, 0x7FFFF80000ULL);
+    auto letter = [](size_t v) -> string {
+      return string(1, 'a' + v);
+    };
+    auto concat = [](string a, string b) -> string {
+      return a + b;
+    };
+    string concatenated = pool.parallel_reduce<size_t>(0, 26, string(), letter, concat, 3);
+    expect_eq(concatenated, "abcdefghijklmnopqrstuvwxyz");
+
+    fwrite_fmt(stderr, "-- ThreadPool::TaskGroup (nested)\n");
+    atomic<size_t> count = 0;
+    {
+      ThreadPool::TaskGroup g(pool);
+      for (size_t z = 0; z < 64; z++) {
+        g.run([&]() -> void {
+          ThreadPool::TaskGroup inner_g(pool);
+          for (size_t y = 0; y < 64; y++) {
+            inner_g.run([&]() -> void {
+              count++;
+            });
+          }
+          inner_g.wait();
+        });
+      }
+      g.wait();
+    }
+    expect_eq(count.load(), 64 * 64);
+
+    fwrite_fmt(stderr, "-- ThreadPool::TaskGroup (exception)\n");
+    {
+      ThreadPool::TaskGroup g(pool);
+      for (size_t z = 0; z < 16; z++) {
+        g.run([z]() -> void {
+          if (z == 7) {
+            throw out_of_range("test exception");
+          }
+        });
+      }
+      expect_raises(out_of_range, [&]() {
+        g.wait();
+      });
+    }
+
+    fwrite_fmt(stderr, "-- parallel functions on ThreadPool\n");
+    uint64_t target_value = 0xC349;
+    auto is_equal = [&](uint64_t v, size_t) -> bool {
+      return (v == target_value);
+    };
+    expect_eq((parallel<uint64_t>(&pool, is_equal, 0, 0x10000, 0, nullptr)), target_value);
+    expect_eq((parallel_blocks<uint64_t>(&pool, is_equal, 0, 0x100000, 0x100, 0, nullptr)), target_value);
+    auto found = parallel_blocks_multi<uint64_t>(&pool, is_equal, 0, 0x100000, 0x1000, 0, nullptr);
+    expect_eq(1, found.size());
+    expect_eq(1, found.count(target_value));
+    vector<uint64_t> values(0x10000);
+    for (size_t z = 0; z < values.size(); z++) {
+      values[z] = z;
+    }
+    expect_eq(&values[target_value], parallel_range(&pool, values, [&](uint64_t v, size_t) -> bool {
+      return (v == target_value);
+    }));
+
+    fwrite_fmt(stderr, "-- call overhead (1000 calls of 0x100 values each)\n");
+    vector<uint64_t> small_hits(0x100, 0);
+    auto handle_small_value = [&](uint64_t v, size_t) -> bool {
+      small_hits[v]++;
+      return false;
+    };
+    uint64_t start_time = now();
+    for (size_t z = 0; z < 1000; z++) {
+      parallel_blocks<uint64_t>(handle_small_value, 0, small_hits.size(), 0x10, num_threads, nullptr);
+    }
+    uint64_t threads_duration = now() - start_time;
+    start_time = now();
+    for (size_t z = 0; z < 1000; z++) {
+      parallel_blocks<uint64_t>(&pool, handle_small_value, 0, small_hits.size(), 0x10, num_threads, nullptr);
+    }
+    uint64_t pool_duration = now() - start_time;
+    start_time = now();
+    for (size_t z = 0; z < 1000; z++) {
+      pool.parallel_for<uint64_t>(0, small_hits.size(), handle_small_value, 0x10);
+    }
+    uint64_t parallel_for_duration = now() - start_time;
+    fwrite_fmt(stderr, "---- new threads: {}; pool: {}; parallel_for: {}\n",
+        threads_duration, pool_duration, parallel_for_duration);
+    for (uint64_t v : small_hits) {
+      expect_eq(v, 3000);
+    }
+  }
+
   {
     fwrite_fmt(stderr, "-- EnumRange\n");
     std::vector<TestEnum> seen_values;
@@ -139,6 +139,11 @@ T Vector2<T>::at(size_t dim) const {
   return reinterpret_cast<const T*>(this)[dim];
 }
 
+template <typename T>
+T& Vector2<T>::at(size_t dim) {
+  return reinterpret_cast<T*>(this)[dim];
+}
+
 template <typename T>
 T Vector2<T>::norm1() const {
   return this->x + this->y;
@@ -320,6 +325,11 @@ T Vector3<T>::at(size_t dim) const {
   return reinterpret_cast<const T*>(this)[dim];
 }
 
+template <typename T>
+T& Vector3<T>::at(size_t dim) {
+  return reinterpret_cast<T*>(this)[dim];
+}
+
 template <typename T>
 T Vector3<T>::norm1() const {
   return this->x + this->y + this->z;
@@ -540,6 +550,11 @@ T Vector4<T>::at(size_t dim) const {
   return reinterpret_cast<const T*>(this)[dim];
 }
 
+template <typename T>
+T& Vector4<T>::at(size_t dim) {
+  return reinterpret_cast<T*>(this)[dim];
+}
+
 template <typename T>
 T Vector4<T>::norm1() const {
   return this->x + this->y + this->z + this->w;
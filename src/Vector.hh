@@ -43,6 +43,7 @@ struct Vector2 {
   bool operator<(const Vector2<T>& other) const;
 
   T at(size_t dim) const;
+  T& at(size_t dim);
 
   T norm1() const;
   double norm() const;
@@ -101,6 +102,7 @@ struct Vector3 {
   bool operator<(const Vector3<T>& other) const;
 
   T at(size_t dim) const;
+  T& at(size_t dim);
 
   T norm1() const;
   double norm() const;
@@ -162,6 +164,7 @@ struct Vector4 {
   bool operator<(const Vector4<T>& other) const;
 
   T at(size_t dim) const;
+  T& at(size_t dim);
 
   T norm1() const;
   double norm() const;